@@ -0,0 +1,260 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Alarm rules are small state machines updated as each sample arrives.
+// Nothing keeps or rescans history: a rule only remembers its state, the
+// time it entered it and, for flapping, a bounded ring of transition times.
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define MAX_ALARM_RULES 16
+#define FLAP_RING_SIZE 64          // Upper bound for a flapping rule's threshold
+
+typedef enum { RULE_IDLE = 0, RULE_PENDING, RULE_ACTIVE, RULE_CLEARING } rule_phase;
+
+typedef struct {
+    budc_alarm_rule rule;
+    rule_phase phase;
+    double since_ms;               // Entry time of the current phase
+    double last_value;
+    double flaps[FLAP_RING_SIZE];  // Lock transition times, oldest at flap_head
+    unsigned int flap_head, flap_count;
+} rule_state;
+
+struct budc_alarm_set {
+    budc_mutex lock;
+    rule_state rules[MAX_ALARM_RULES];
+    int count;
+    int last_locked;               // -1 until the first lock sample
+};
+
+// --- HELPER FUNCTIONS ---
+static struct budc_alarm_set* alarm_set(budc_device* dev) {
+    return dev->alarms;
+}
+
+static void emit(budc_device* dev, budc_event_type type, int rule_id, double value) {
+    BUDC_LOG(type == BUDC_EVENT_ALARM_RAISED ? BUDC_LOG_WARN : BUDC_LOG_INFO,
+             type == BUDC_EVENT_ALARM_RAISED ? "alarm_raised" : "alarm_cleared",
+             "port=%s rule=%d value=%.2f", dev->port_name, rule_id, value);
+    budc_push_event(dev, type, rule_id, value);
+}
+
+// Advances a rule given whether its raise and clear conditions hold now.
+// hold_ms / clear_ms make both edges require persistence; the separate raise
+// and clear thresholds give hysteresis on the value itself.
+static void step(budc_device* dev, int id, rule_state* st, bool raise, bool clear, double now) {
+    const budc_alarm_rule* r = &st->rule;
+    switch (st->phase) {
+    case RULE_IDLE:
+        if (!raise) return;
+        st->phase = RULE_PENDING;
+        st->since_ms = now;
+        /* fall through */
+    case RULE_PENDING:
+        if (!raise) { st->phase = RULE_IDLE; return; }
+        if (now - st->since_ms >= r->hold_ms) {
+            st->phase = RULE_ACTIVE;
+            st->since_ms = now;
+            emit(dev, BUDC_EVENT_ALARM_RAISED, id, st->last_value);
+        }
+        return;
+    case RULE_ACTIVE:
+        if (!clear) return;
+        st->phase = RULE_CLEARING;
+        st->since_ms = now;
+        /* fall through */
+    case RULE_CLEARING:
+        if (!clear) { st->phase = RULE_ACTIVE; return; }
+        if (now - st->since_ms >= r->clear_ms) {
+            st->phase = RULE_IDLE;
+            st->since_ms = now;
+            emit(dev, BUDC_EVENT_ALARM_CLEARED, id, st->last_value);
+        }
+        return;
+    }
+}
+
+static unsigned int flap_count(rule_state* st, double now) {
+    while (st->flap_count > 0 && now - st->flaps[st->flap_head] > st->rule.window_ms) {
+        st->flap_head = (st->flap_head + 1) % FLAP_RING_SIZE;
+        st->flap_count--;
+    }
+    return st->flap_count;
+}
+
+// Re-evaluates one rule against its last value. Used both for new samples
+// and for timer ticks, so hold and clear times expire on time even when
+// samples are sparse.
+static void evaluate(budc_device* dev, int id, rule_state* st, double now) {
+    const budc_alarm_rule* r = &st->rule;
+    double v = st->last_value;
+    switch (r->kind) {
+    case BUDC_ALARM_TEMP_ABOVE:
+    case BUDC_ALARM_LATENCY_ABOVE:
+        step(dev, id, st, v > r->threshold, v < r->clear_threshold, now);
+        break;
+    case BUDC_ALARM_LOCK_LOST:
+        step(dev, id, st, v < 0.5, v >= 0.5, now);
+        break;
+    case BUDC_ALARM_LOCK_FLAPPING:
+        st->last_value = flap_count(st, now);
+        step(dev, id, st, st->last_value > r->threshold, st->last_value <= r->clear_threshold, now);
+        break;
+    }
+}
+
+static bool rule_takes(budc_alarm_kind kind, budc_sample_kind sample) {
+    switch (kind) {
+    case BUDC_ALARM_TEMP_ABOVE:    return sample == BUDC_SAMPLE_TEMPERATURE;
+    case BUDC_ALARM_LATENCY_ABOVE: return sample == BUDC_SAMPLE_LATENCY;
+    case BUDC_ALARM_LOCK_LOST:
+    case BUDC_ALARM_LOCK_FLAPPING: return sample == BUDC_SAMPLE_LOCK;
+    }
+    return false;
+}
+
+// --- RULES ---
+static struct budc_alarm_set* ensure_set(budc_device* dev) {
+    if (dev->alarms) return dev->alarms;
+    struct budc_alarm_set* set = calloc(1, sizeof(struct budc_alarm_set));
+    if (!set) return NULL;
+    budc_mutex_init(&set->lock);
+    set->last_locked = -1;
+    dev->alarms = set;
+    return set;
+}
+
+int budc_alarm_add(budc_device* dev, const budc_alarm_rule* rule) {
+    if (!dev || !rule) return -1;
+    if (rule->kind == BUDC_ALARM_LOCK_FLAPPING && (rule->threshold >= FLAP_RING_SIZE || rule->window_ms == 0)) return -1;
+
+    budc_mutex_lock(&dev->io_lock);  // Guards creation of the set itself
+    struct budc_alarm_set* set = ensure_set(dev);
+    budc_mutex_unlock(&dev->io_lock);
+    if (!set) return -1;
+
+    budc_mutex_lock(&set->lock);
+    int id = -1;
+    if (set->count < MAX_ALARM_RULES) {
+        id = set->count++;
+        rule_state* st = &set->rules[id];
+        memset(st, 0, sizeof(*st));
+        st->rule = *rule;
+        if (st->rule.clear_threshold > st->rule.threshold) st->rule.clear_threshold = st->rule.threshold;
+        st->last_value = rule->kind == BUDC_ALARM_LOCK_LOST ? 1.0 : 0.0;
+    }
+    budc_mutex_unlock(&set->lock);
+    return id;
+}
+
+void budc_alarm_clear_rules(budc_device* dev) {
+    struct budc_alarm_set* set = dev ? alarm_set(dev) : NULL;
+    if (!set) return;
+    budc_mutex_lock(&set->lock);
+    set->count = 0;
+    budc_mutex_unlock(&set->lock);
+}
+
+bool budc_alarm_is_active(budc_device* dev, int rule_id) {
+    struct budc_alarm_set* set = dev ? alarm_set(dev) : NULL;
+    if (!set) return false;
+    budc_mutex_lock(&set->lock);
+    bool active = rule_id >= 0 && rule_id < set->count
+                  && (set->rules[rule_id].phase == RULE_ACTIVE || set->rules[rule_id].phase == RULE_CLEARING);
+    budc_mutex_unlock(&set->lock);
+    return active;
+}
+
+void budc_alarm_free(budc_device* dev) {
+    struct budc_alarm_set* set = alarm_set(dev);
+    if (!set) return;
+    dev->alarms = NULL;
+    budc_mutex_destroy(&set->lock);
+    free(set);
+}
+
+// --- SAMPLES ---
+void budc_alarm_on_sample(budc_device* dev, budc_sample_kind kind, double value) {
+    struct budc_alarm_set* set = alarm_set(dev);
+    if (!set) return;
+    double now = scpi_now_ms();
+
+    budc_mutex_lock(&set->lock);
+    bool lock_edge = false;
+    if (kind == BUDC_SAMPLE_LOCK) {
+        int locked = value >= 0.5;
+        lock_edge = set->last_locked >= 0 && set->last_locked != locked;
+        set->last_locked = locked;
+    }
+    for (int i = 0; i < set->count; i++) {
+        rule_state* st = &set->rules[i];
+        if (!rule_takes(st->rule.kind, kind)) continue;
+        if (st->rule.kind == BUDC_ALARM_LOCK_FLAPPING) {
+            if (lock_edge) {
+                if (st->flap_count == FLAP_RING_SIZE) {
+                    st->flap_head = (st->flap_head + 1) % FLAP_RING_SIZE;
+                    st->flap_count--;
+                }
+                st->flaps[(st->flap_head + st->flap_count) % FLAP_RING_SIZE] = now;
+                st->flap_count++;
+            }
+        } else {
+            st->last_value = value;
+        }
+        evaluate(dev, i, st, now);
+    }
+    budc_mutex_unlock(&set->lock);
+}
+
+// Earliest time a pending or clearing rule (or a flapping window) can change
+// state without a new sample; -1 when nothing is waiting.
+double budc_alarm_next_deadline(budc_device* dev) {
+    struct budc_alarm_set* set = alarm_set(dev);
+    if (!set) return -1.0;
+    double next = -1.0;
+    budc_mutex_lock(&set->lock);
+    for (int i = 0; i < set->count; i++) {
+        const rule_state* st = &set->rules[i];
+        double due = -1.0;
+        if (st->phase == RULE_PENDING) due = st->since_ms + st->rule.hold_ms;
+        else if (st->phase == RULE_CLEARING) due = st->since_ms + st->rule.clear_ms;
+        if (st->rule.kind == BUDC_ALARM_LOCK_FLAPPING && st->flap_count > 0) {
+            double expiry = st->flaps[st->flap_head] + st->rule.window_ms;
+            if (due < 0 || expiry < due) due = expiry;
+        }
+        if (due >= 0 && (next < 0 || due < next)) next = due;
+    }
+    budc_mutex_unlock(&set->lock);
+    return next;
+}
+
+void budc_alarm_tick(budc_device* dev) {
+    struct budc_alarm_set* set = alarm_set(dev);
+    if (!set) return;
+    double now = scpi_now_ms();
+    budc_mutex_lock(&set->lock);
+    for (int i = 0; i < set->count; i++) evaluate(dev, i, &set->rules[i], now);
+    budc_mutex_unlock(&set->lock);
+}
@@ -0,0 +1,283 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Power calibration. The output level of a unit drifts across its band, so
+// a table maps frequency to an offset in power-level steps. With a table
+// loaded, the power levels given to the setters are nominal: the device is
+// sent the nominal level plus the offset for the frequency, interpolated
+// linearly between points and held flat past either end. A retune then
+// re-sends the corrected power in the same write as the FREQ (see
+// set_settings in budc_scpi.c).
+//
+// A table may have several temperature bands. The band is picked from the
+// filtered temperature, so choosing it costs no I/O. Without a recent
+// reading the first band is used.
+//
+// Calibration file:
+//
+//   # comments
+//   serial 244003                  optional, the file is refused by other units
+//   band <min_c> <max_c>           optional, starts a band; points before any band line cover every temperature
+//   <freq_hz> <offset>             one point per line, in any order
+//
+// Each band is kept as two sorted arrays (frequencies, offsets) in one
+// allocation, so a lookup is a binary search over a few cache lines. The
+// table is never changed in place; loading or adding a band swaps in a new one.
+
+#include "budc_internal.h"
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define CAL_MAX_BANDS 8
+#define CAL_MAX_POINTS 4096            // Per band
+#define CAL_TEMP_MAX_AGE_MS 60000.0    // Older temperatures do not pick the band
+
+typedef struct {
+    double min_c, max_c;
+    int n;
+    const double* freqs_hz;            // Ascending
+    const float* offsets;
+} cal_band;
+
+struct budc_cal_table {
+    int band_count;
+    cal_band bands[CAL_MAX_BANDS];
+    // The arrays of every band follow
+};
+
+static int compare_point(const void* a, const void* b) {
+    double x = ((const budc_cal_point*)a)->freq_hz, y = ((const budc_cal_point*)b)->freq_hz;
+    return (x > y) - (x < y);
+}
+
+// --- BUILDING ---
+// A copy of old with one more band. points is sorted in place.
+static struct budc_cal_table* add_band(const struct budc_cal_table* old, double min_c, double max_c,
+                                       budc_cal_point* points, int n) {
+    int bands = old ? old->band_count : 0;
+    size_t total = (size_t)n;
+    for (int b = 0; b < bands; b++) total += (size_t)old->bands[b].n;
+    struct budc_cal_table* t = malloc(sizeof(*t) + total * (sizeof(double) + sizeof(float)));
+    if (!t) return NULL;
+    double* freqs = (double*)(t + 1);
+    float* offsets = (float*)(freqs + total);
+
+    qsort(points, (size_t)n, sizeof(*points), compare_point);
+    t->band_count = bands + 1;
+    for (int b = 0; b <= bands; b++) {
+        cal_band* dst = &t->bands[b];
+        if (b < bands) {
+            *dst = old->bands[b];
+            memcpy(freqs, dst->freqs_hz, (size_t)dst->n * sizeof(double));
+            memcpy(offsets, dst->offsets, (size_t)dst->n * sizeof(float));
+        } else {
+            dst->min_c = min_c;
+            dst->max_c = max_c;
+            dst->n = n;
+            for (int i = 0; i < n; i++) {
+                freqs[i] = points[i].freq_hz;
+                offsets[i] = (float)points[i].offset;
+            }
+        }
+        dst->freqs_hz = freqs;
+        dst->offsets = offsets;
+        freqs += dst->n;
+        offsets += dst->n;
+    }
+    return t;
+}
+
+static void swap_table(budc_device* dev, struct budc_cal_table* t) {
+    budc_mutex_lock(&dev->state_lock);
+    struct budc_cal_table* old = dev->cal;
+    dev->cal = t;
+    budc_mutex_unlock(&dev->state_lock);
+    free(old);
+}
+
+int budc_add_calibration_band(budc_device* dev, double min_c, double max_c, const budc_cal_point* points, int n) {
+    if (!dev || !points || n < 1 || n > CAL_MAX_POINTS || min_c >= max_c) return -1;
+    budc_cal_point* sorted = malloc((size_t)n * sizeof(*sorted));
+    if (!sorted) return -1;
+    memcpy(sorted, points, (size_t)n * sizeof(*sorted));
+
+    budc_mutex_lock(&dev->state_lock);
+    struct budc_cal_table* old = dev->cal;
+    struct budc_cal_table* t = NULL;
+    if (!old || old->band_count < CAL_MAX_BANDS) t = add_band(old, min_c, max_c, sorted, n);
+    if (t) dev->cal = t;
+    budc_mutex_unlock(&dev->state_lock);
+    free(sorted);
+    if (!t) return -1;
+    free(old);
+    return 0;
+}
+
+// --- LOADING ---
+static int unit_serial(budc_device* dev, char* serial, size_t len) {
+    char identity[256], format[32];
+    if (budc_get_identity(dev, identity, sizeof(identity)) != 0) return -1;
+    snprintf(format, sizeof(format), "%%*[^,],%%*[^,],%%%zu[^,]", len - 1);
+    return sscanf(identity, format, serial) == 1 ? 0 : -1;
+}
+
+// Returns 1 if the file names another unit
+static int read_table(FILE* f, const char* serial, struct budc_cal_table** out) {
+    char line[256];
+    budc_cal_point* points = malloc(CAL_MAX_POINTS * sizeof(*points));
+    struct budc_cal_table* t = NULL;
+    double min_c = -INFINITY, max_c = INFINITY;
+    int n = 0, result = points ? 0 : -1;
+
+    while (result == 0) {
+        bool more = fgets(line, sizeof(line), f) != NULL;
+        char name[64];
+        double a, b;
+        bool band = more && sscanf(line, "band %lf %lf", &a, &b) == 2;
+        // A band ends at the next band line or at the end of the file
+        if ((band || !more) && n > 0) {
+            struct budc_cal_table* next = t && t->band_count == CAL_MAX_BANDS ? NULL
+                                          : add_band(t, min_c, max_c, points, n);
+            free(t);
+            t = next;
+            n = 0;
+            if (!t) result = -1;
+        }
+        if (!more || result != 0) break;
+        if (band) {
+            if (a >= b) result = -1;
+            min_c = a;
+            max_c = b;
+        } else if (sscanf(line, "serial %63s", name) == 1) {
+            if (serial && strcmp(name, serial) != 0) result = 1;
+        } else if (sscanf(line, "%lf %lf", &a, &b) == 2) {
+            if (n == CAL_MAX_POINTS) result = -1;
+            else points[n++] = (budc_cal_point){ a, b };
+        }
+    }
+    free(points);
+    if (result == 0 && !t) result = -1;
+    if (result != 0) { free(t); t = NULL; }
+    *out = t;
+    return result;
+}
+
+// path.<serial> is preferred when it exists, so one path serves a rack
+int budc_load_calibration(budc_device* dev, const char* path) {
+    char serial[64], own[512];
+    if (!dev) return -1;
+    if (!path) {
+        swap_table(dev, NULL);
+        return 0;
+    }
+    bool have_serial = unit_serial(dev, serial, sizeof(serial)) == 0;
+    FILE* f = NULL;
+    if (have_serial) {
+        snprintf(own, sizeof(own), "%s.%s", path, serial);
+        f = fopen(own, "r");
+    }
+    if (!f) f = fopen(path, "r");
+    if (!f) return -1;
+    struct budc_cal_table* t;
+    int result = read_table(f, have_serial ? serial : NULL, &t);
+    fclose(f);
+    if (result == 1) BUDC_LOG(BUDC_LOG_INFO, "cal_mismatch", "path=\"%s\"", path);
+    if (result != 0) return result;
+
+    swap_table(dev, t);
+    BUDC_LOG(BUDC_LOG_DEBUG, "cal_load", "port=%s path=\"%s\" bands=%d", dev->port_name, path, t->band_count);
+    return 0;
+}
+
+// --- LOOKUP ---
+static const cal_band* pick_band(const struct budc_cal_table* t, double temp_c, bool have_temp) {
+    if (!have_temp || t->band_count == 1) return &t->bands[0];
+    const cal_band* best = &t->bands[0];
+    double best_gap = INFINITY;
+    for (int b = 0; b < t->band_count; b++) {
+        const cal_band* band = &t->bands[b];
+        double gap = temp_c < band->min_c ? band->min_c - temp_c : temp_c >= band->max_c ? temp_c - band->max_c : 0.0;
+        if (gap < best_gap) { best = band; best_gap = gap; }
+    }
+    return best;
+}
+
+static double interpolate(const cal_band* b, double freq_hz) {
+    const double* f = b->freqs_hz;
+    if (freq_hz <= f[0]) return b->offsets[0];
+    if (freq_hz >= f[b->n - 1]) return b->offsets[b->n - 1];
+    // f[lo] <= freq_hz < f[hi]
+    int lo = 0, hi = b->n - 1;
+    while (hi - lo > 1) {
+        int mid = (lo + hi) / 2;
+        if (f[mid] <= freq_hz) lo = mid; else hi = mid;
+    }
+    double x = (freq_hz - f[lo]) / (f[hi] - f[lo]);
+    return b->offsets[lo] + x * (b->offsets[hi] - b->offsets[lo]);
+}
+
+bool budc_cal_loaded(budc_device* dev) {
+    return dev->cal != NULL;
+}
+
+int budc_calibration_offset(budc_device* dev, double freq_hz, double* offset) {
+    float temp_c;
+    double age_ms;
+    if (!dev || !offset) return -1;
+    bool have_temp = budc_get_temperature_filtered(dev, &temp_c, &age_ms) == 0 && age_ms < CAL_TEMP_MAX_AGE_MS;
+    budc_mutex_lock(&dev->state_lock);
+    const struct budc_cal_table* t = dev->cal;
+    if (t) *offset = interpolate(pick_band(t, temp_c, have_temp), freq_hz);
+    budc_mutex_unlock(&dev->state_lock);
+    return t ? 0 : -1;
+}
+
+int budc_cal_power(budc_device* dev, double freq_hz, int nominal) {
+    double offset;
+    if (nominal < 0 || budc_calibration_offset(dev, freq_hz, &offset) != 0) return nominal;
+    long level = nominal + (long)(offset < 0 ? offset - 0.5 : offset + 0.5);
+    return level < 0 ? 0 : (int)level;
+}
+
+budc_cal_table* budc_cal_table_create(const budc_cal_point* points, int n) {
+    if (!points || n < 1 || n > CAL_MAX_POINTS) return NULL;
+    budc_cal_point* sorted = malloc((size_t)n * sizeof(*sorted));
+    if (!sorted) return NULL;
+    memcpy(sorted, points, (size_t)n * sizeof(*sorted));
+    budc_cal_table* t = add_band(NULL, -INFINITY, INFINITY, sorted, n);
+    free(sorted);
+    return t;
+}
+
+double budc_cal_table_offset(const budc_cal_table* table, double freq_hz) {
+    return interpolate(pick_band(table, 0.0, false), freq_hz);
+}
+
+void budc_cal_table_free(budc_cal_table* table) {
+    free(table);
+}
+
+void budc_cal_free(budc_device* dev) {
+    free(dev->cal);
+    dev->cal = NULL;
+}
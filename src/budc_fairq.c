@@ -0,0 +1,177 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Fair sharing of one port between the clients of a handle. Each exchange
+// gets a finish tag when it is queued: the later of the scheduler's virtual
+// time and the client's previous tag, plus its cost divided by the client's
+// weight. The port goes to the smallest tag (self-clocked fair queuing).
+// A client that floods the port therefore only delays its own calls, and a
+// client with weight 8 gets eight times the bytes of one with weight 1 while
+// both are busy. A client may bound how many of its calls wait at once;
+// beyond that a call fails at once instead of queueing.
+//
+// Threads pick their client with budc_client_attach. Calls from threads
+// that have none share the handle's default client, weight 1 and unbounded,
+// so single-threaded use behaves as before.
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define FQ_REPLY_COST 16               // Bytes charged for an expected reply, about one SCPI answer
+#define FQ_TERMINATOR_COST 2
+
+struct budc_client {
+    budc_device* dev;
+    unsigned int max_queued;       // 0: unbounded
+    double last_finish;            // Finish tag of its latest call
+    budc_client_stats stats;       // Guarded by dev->fq_lock, like the rest
+    struct budc_client* next;
+};
+
+static BUDC_THREAD_LOCAL budc_client* current_client;
+static BUDC_THREAD_LOCAL bool current_rejected;
+
+static budc_client* client_new(budc_device* dev, const char* name, unsigned int weight, unsigned int max_queued) {
+    budc_client* c = calloc(1, sizeof(*c));
+    if (!c) return NULL;
+    c->dev = dev;
+    c->max_queued = max_queued;
+    c->stats.weight = weight ? weight : 1;
+    snprintf(c->stats.name, sizeof(c->stats.name), "%s", name ? name : "");
+    return c;
+}
+
+budc_client* budc_client_create(budc_device* dev, const char* name, unsigned int weight, unsigned int max_queued) {
+    if (!dev) return NULL;
+    budc_client* c = client_new(dev, name, weight, max_queued);
+    if (!c) return NULL;
+    budc_mutex_lock(&dev->fq_lock);
+    c->last_finish = dev->fq_vtime;
+    c->next = dev->clients;
+    dev->clients = c;
+    budc_mutex_unlock(&dev->fq_lock);
+    return c;
+}
+
+void budc_client_destroy(budc_client* client) {
+    if (!client) return;
+    budc_device* dev = client->dev;
+    budc_mutex_lock(&dev->fq_lock);
+    for (budc_client** p = &dev->clients; *p; p = &(*p)->next) {
+        if (*p == client) { *p = client->next; break; }
+    }
+    budc_mutex_unlock(&dev->fq_lock);
+    if (current_client == client) current_client = NULL;
+    free(client);
+}
+
+budc_client* budc_client_attach(budc_client* client) {
+    budc_client* previous = current_client;
+    current_client = client;
+    current_rejected = false;
+    return previous;
+}
+
+bool budc_client_rejected(void) {
+    return current_rejected;
+}
+
+int budc_client_get_stats(budc_client* client, budc_client_stats* stats) {
+    if (!client || !stats) return -1;
+    budc_mutex_lock(&client->dev->fq_lock);
+    *stats = client->stats;
+    budc_mutex_unlock(&client->dev->fq_lock);
+    return 0;
+}
+
+double budc_client_wait_percentile(const budc_client_stats* stats, double percentile) {
+    return budc_hist_percentile(stats->wait_hist, stats->wait_max_ms, percentile);
+}
+
+// Waits for the port's turn. Returns -1 without queueing if the client
+// already has max_queued calls waiting.
+int budc_fairq_enter(budc_device* dev, const char* payload, bool expects_reply) {
+    budc_client* c = current_client && current_client->dev == dev ? current_client : NULL;
+    budc_fq_waiter self;
+    double cost = (double)strlen(payload) + FQ_TERMINATOR_COST + (expects_reply ? FQ_REPLY_COST : 0);
+
+    budc_mutex_lock(&dev->fq_lock);
+    if (!c) {
+        if (!dev->default_client) dev->default_client = client_new(dev, "default", 1, 0);
+        c = dev->default_client;
+    }
+    // Without a client (out of memory) calls are still serialised, just unaccounted
+    if (c && c->max_queued && c->stats.queued >= c->max_queued) {
+        c->stats.rejected++;
+        budc_mutex_unlock(&dev->fq_lock);
+        current_rejected = true;
+        BUDC_LOG(BUDC_LOG_DEBUG, "client_refused", "client=%s queued=%u", c->stats.name, c->max_queued);
+        return -1;
+    }
+
+    double start = dev->fq_vtime;
+    if (c && c->last_finish > start) start = c->last_finish;
+    self.finish = start + cost / (c ? c->stats.weight : 1);
+    if (c) {
+        c->last_finish = self.finish;
+        c->stats.queued++;
+    }
+    // Equal tags keep arrival order
+    budc_fq_waiter** p = &dev->fq_waiters;
+    while (*p && (*p)->finish <= self.finish) p = &(*p)->next;
+    self.next = *p;
+    *p = &self;
+
+    double queued_ms = scpi_now_ms();
+    while (dev->fq_busy || dev->fq_waiters != &self) budc_cond_wait(&dev->fq_cond, &dev->fq_lock);
+    dev->fq_waiters = self.next;
+    dev->fq_busy = true;
+    dev->fq_vtime = self.finish;
+    if (c) {
+        c->stats.queued--;
+        c->stats.transactions++;
+        c->stats.bytes += (unsigned long)cost;
+        budc_hist_add(c->stats.wait_hist, &c->stats.wait_max_ms, scpi_now_ms() - queued_ms);
+    }
+    budc_mutex_unlock(&dev->fq_lock);
+    return 0;
+}
+
+void budc_fairq_leave(budc_device* dev) {
+    budc_mutex_lock(&dev->fq_lock);
+    dev->fq_busy = false;
+    // The new head may be anywhere among the sleepers
+    budc_cond_broadcast(&dev->fq_cond);
+    budc_mutex_unlock(&dev->fq_lock);
+}
+
+void budc_fairq_free(budc_device* dev) {
+    while (dev->clients) {
+        budc_client* next = dev->clients->next;
+        if (current_client == dev->clients) current_client = NULL;
+        free(dev->clients);
+        dev->clients = next;
+    }
+    free(dev->default_client);
+    dev->default_client = NULL;
+}
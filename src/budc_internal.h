@@ -0,0 +1,210 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Library-internal definitions shared between the budc_*.c files.
+// Not installed and not part of the public API.
+
+#ifndef BUDC_INTERNAL_H
+#define BUDC_INTERNAL_H
+
+#include "budc_scpi.h"
+#include "budc_thread.h"
+
+// Logging, see budc_log.c. fmt adds logfmt fields after the event name:
+// BUDC_LOG(BUDC_LOG_DEBUG, "connect", "port=%s", name). Arguments are not
+// evaluated when the level is off.
+typedef struct {
+    budc_atomic second;            // Rate-limit window of the call site
+    budc_atomic count;
+    budc_atomic suppressed;
+} budc_log_site;
+
+extern volatile int budc_log_threshold;  // -1 until the first record reads BUDC_LOG
+void budc_log_emit(budc_log_site* site, budc_log_level level, const char* file, int line,
+                   const char* event, const char* fmt, ...);
+
+#define BUDC_LOG(level, event, ...) do { \
+        if ((int)(level) <= budc_log_threshold || budc_log_threshold < 0) { \
+            static budc_log_site budc_log_site_; \
+            budc_log_emit(&budc_log_site_, (level), __FILE__, __LINE__, (event), __VA_ARGS__); \
+        } \
+    } while (0)
+
+struct sp_port;
+struct budc_monitor;
+struct budc_alarm_set;
+struct budc_lock_profile;
+struct budc_saver;
+struct budc_cal_table;
+
+typedef struct budc_fq_waiter {
+    double finish;                 // Finish tag, see budc_fairq.c
+    struct budc_fq_waiter* next;
+} budc_fq_waiter;
+
+typedef enum {
+    BUDC_SAMPLE_LOCK = 0,          // 1.0 locked, 0.0 unlocked
+    BUDC_SAMPLE_TEMPERATURE,       // Degrees C
+    BUDC_SAMPLE_LATENCY            // Query round trip in ms
+} budc_sample_kind;
+
+#define BUDC_EVENT_QUEUE_SIZE 32
+#define BUDC_TEMP_MEDIAN_WINDOW 5
+#define BUDC_RX_BUFFER 512
+#define BUDC_LATE_SLOTS 4              // Timed-out queries remembered at once
+
+struct budc_device {
+    budc_mutex io_lock;            // Serialises whole transactions (write + reply)
+    struct sp_port* port;
+    char port_name[128];
+    budc_connect_options options;
+    char identity[256];            // Cached *IDN? reply, empty until read; guarded by state_lock
+    double connect_ms;             // Open to first reply, -1 if the probe did not answer
+    budc_sync_mode sync_mode;      // As requested by the caller
+    // What BUDC_SYNC_AUTO settled on, AUTO until known. Guarded by state_lock;
+    // one thread probes while sync_resolving, the others wait on sync_cond.
+    budc_sync_mode sync_resolved;
+    bool sync_resolving;
+    budc_cond sync_cond;
+    const char* sync_query;        // Fallback query for BUDC_SYNC_QUERY
+    bool pooled;                   // Owned by the connection pool, see budc_pool.c
+
+    // Watchdog, guarded by io_lock
+    budc_watchdog_config watchdog;
+    budc_atomic health;            // budc_health; written under io_lock, read anywhere through health_of
+    unsigned int consecutive_timeouts;
+    double next_recovery_ms;       // FAILED: earliest time for the next recovery attempt
+    double last_io_ms;             // Start of the last exchange, drives the heartbeat
+
+    // Reply framing, guarded by io_lock. SCPI replies carry no tag, so a
+    // query that timed out is remembered until its reply turns up or its
+    // window closes; see scpi_exchange_locked.
+    char rx_buf[BUDC_RX_BUFFER];   // Bytes read past the end of the last reply
+    size_t rx_len;
+    struct {
+        char query[16];            // Last query of the payload, for display and same-query checks
+        int shape;                 // What its reply looks like, a reply_shape
+        double expires_ms;         // Give up on it after this
+    } late[BUDC_LATE_SLOTS];
+    unsigned int late_count;
+
+    // Counters have their own lock so readers never wait behind serial I/O
+    budc_mutex stats_lock;
+    budc_stats stats;
+    unsigned int io_waiters;       // Callers blocked on io_lock in scpi_transact, guarded by stats_lock
+
+    // Fair queuing between clients, guarded by fq_lock; see budc_fairq.c.
+    // Taken before io_lock and never held with it.
+    budc_mutex fq_lock;
+    budc_cond fq_cond;
+    bool fq_busy;                  // A scheduled call owns the port
+    double fq_vtime;               // Finish tag of the call being served
+    budc_fq_waiter* fq_waiters;    // Sorted by finish tag
+    budc_client* clients;
+    budc_client* default_client;   // For threads with no client attached, created on first use
+
+    // Events, guarded by event_lock
+    budc_mutex event_lock;
+    budc_event_callback event_cb;
+    void* event_user;
+    budc_event events[BUDC_EVENT_QUEUE_SIZE];
+    unsigned int event_head, event_count;
+    bool event_dispatching;
+
+    // Shadow of the device state as last observed, guarded by state_lock
+    budc_mutex state_lock;
+    int last_locked;               // -1 until the first LOCK? reply
+    double lock_lost_ms;           // When the current loss of lock was first seen, 0 while locked
+    double lock_time_ema_ms;       // Typical unlock-to-lock time seen by budc_wait_for_lock
+    struct budc_lock_profile* lock_profile;  // Measured lock times per hop, NULL if none loaded
+    double cmd_freq_hz;            // Last frequency set successfully, 0 if none
+    double prev_freq_hz;           // The one before it, where the last hop started
+    int cmd_power;
+    bool have_cmd_power;
+    int nominal_power;             // Power asked for before calibration, -1 if none
+    struct budc_cal_table* cal;    // Power calibration, NULL if none loaded; see budc_cal.c
+    double last_command_ms;        // Time of the last FREQ/PWR/PRESET
+    bool locked_since_command;     // Seen locked after the last command
+    bool relock_enabled;
+    budc_relock_config relock;
+    double next_relock_ms;         // Earliest next relock after every stage failed
+
+    // Temperature filter, guarded by state_lock
+    int temp_support;              // -1 unknown, 0 unit has no usable TEMP?, 1 answers
+    unsigned int temp_failures;    // Consecutive failed reads while support is unknown
+    float temp_raw[BUDC_TEMP_MEDIAN_WINDOW];
+    unsigned int temp_raw_head, temp_raw_count;
+    double temp_filtered;
+    double temp_sample_ms;         // When temp_filtered last took a reading, 0 if never
+
+    struct budc_monitor* monitor;  // Background thread, see budc_monitor.c
+    struct budc_alarm_set* alarms; // Alarm rules, see budc_alarm.c
+    struct budc_saver* saver;      // Deferred SAVE, see budc_save.c; NULL until a policy is set
+};
+
+void scpi_delay(int milliseconds);
+double scpi_now_ms(void);
+
+static inline budc_health health_of(budc_device* dev) { return (budc_health)budc_atomic_load(&dev->health); }
+
+void budc_push_event(budc_device* dev, budc_event_type type, int code, double value);
+void budc_flush_events(budc_device* dev);
+void budc_hist_add(unsigned long* hist, double* max_ms, double ms);
+double budc_hist_percentile(const unsigned long* hist, double max_ms, double percentile);
+int budc_reopen(budc_device* dev, unsigned int probe_ms);
+void budc_sample_temperature(budc_device* dev);  // One TEMP? into the filter, no retries
+void budc_adopt_sync_mode(budc_device* dev, budc_sync_mode resolved);  // From an earlier session, no probe
+int budc_save_now(budc_device* dev);  // SAVE on the port, timed into the stats
+// FREQ and PWR as given, no calibration. nominal is recorded as the power
+// asked for; negative values leave that part alone.
+int budc_apply_exact(budc_device* dev, double freq_hz, int power, int nominal);
+
+// budc_monitor.c
+bool budc_monitor_running(budc_device* dev);
+bool budc_monitor_wake(budc_device* dev);  // Returns false when no monitor is running
+
+// budc_alarm.c
+void budc_alarm_on_sample(budc_device* dev, budc_sample_kind kind, double value);
+double budc_alarm_next_deadline(budc_device* dev);
+void budc_alarm_tick(budc_device* dev);
+void budc_alarm_free(budc_device* dev);
+
+// budc_cal.c
+bool budc_cal_loaded(budc_device* dev);
+int budc_cal_power(budc_device* dev, double freq_hz, int nominal);  // Level to send; nominal without a table
+void budc_cal_free(budc_device* dev);
+
+// budc_fairq.c
+int budc_fairq_enter(budc_device* dev, const char* payload, bool expects_reply);  // -1: client queue full
+void budc_fairq_leave(budc_device* dev);
+void budc_fairq_free(budc_device* dev);
+
+// budc_lockprof.c
+double budc_lock_profile_expect(budc_device* dev, double from_hz, double to_hz);  // state_lock held, -1 if unknown
+void budc_lock_profile_free(budc_device* dev);
+
+// budc_relock.c
+void budc_relock_check(budc_device* dev);
+
+// budc_save.c
+bool budc_save_defer(budc_device* dev);  // False: no policy, send the SAVE now
+void budc_save_free(budc_device* dev);
+
+#endif // BUDC_INTERNAL_H
@@ -0,0 +1,290 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Lock-time characterisation. budc_characterize_lock hops a device between
+// every ordered pair of a frequency grid. It times each hop from the set
+// command to the first LOCK? that reads 1, polling back to back. The result
+// is written as a plain-text profile:
+//
+//   # comments: identity, repeats, summary statistics
+//   freqs_hz <f0> <f1> ... <fn-1>
+//   median_ms                      n rows, row = from, column = to, "-" on the diagonal
+//   ...
+//   max_ms                         same layout
+//   ...
+//
+// budc_load_lock_profile reads the median matrix back. budc_wait_for_lock
+// then uses it, instead of the running average, to decide how long to sleep
+// before the first poll.
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// --- CONFIGURATION ---
+#define PROFILE_MAX_POINTS 32
+#define CHARZ_MAX_REPEATS 64
+#define CHARZ_LOCK_TIMEOUT_MS 5000  // A hop that has not locked by then counts as failed
+
+struct budc_lock_profile {
+    int n;
+    double freqs_hz[PROFILE_MAX_POINTS];
+    double median_ms[PROFILE_MAX_POINTS][PROFILE_MAX_POINTS];
+};
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+// Sorts in place
+static double percentile(double* values, int count, double p) {
+    if (count == 0) return -1.0;
+    qsort(values, count, sizeof(double), compare_double);
+    int i = (int)(p / 100.0 * (count - 1) + 0.5);
+    return values[i];
+}
+
+// Every directed edge of the complete graph on n nodes exactly once, as one
+// walk starting and ending at node 0 (Hierholzer). Each hop then starts from
+// where the previous one ended, so no settling hop is wasted between
+// measurements. walk needs n * (n - 1) + 1 entries.
+static int euler_walk(int n, int* walk) {
+    int next_out[PROFILE_MAX_POINTS];
+    int stack[PROFILE_MAX_POINTS * PROFILE_MAX_POINTS + 1];
+    int top = 0, len = 0;
+    for (int i = 0; i < n; i++) next_out[i] = 0;
+    stack[top++] = 0;
+    while (top > 0) {
+        int v = stack[top - 1];
+        if (next_out[v] == v) next_out[v]++;  // No self-loops
+        if (next_out[v] < n) {
+            stack[top++] = next_out[v]++;
+        } else {
+            walk[len++] = v;
+            top--;
+        }
+    }
+    // Popped in reverse order
+    for (int i = 0; i < len / 2; i++) {
+        int t = walk[i]; walk[i] = walk[len - 1 - i]; walk[len - 1 - i] = t;
+    }
+    return len;
+}
+
+static double time_hop(budc_device* dev, double freq_hz) {
+    bool locked = false;
+    double start = scpi_now_ms();
+    if (budc_set_frequency_hz(dev, freq_hz) != 0) return -1.0;
+    while (scpi_now_ms() - start < CHARZ_LOCK_TIMEOUT_MS) {
+        if (budc_get_lock_status(dev, &locked) == 0 && locked) return scpi_now_ms() - start;
+    }
+    return -1.0;
+}
+
+static void write_matrix(FILE* f, const char* name, int n, double (*m)[PROFILE_MAX_POINTS]) {
+    fprintf(f, "%s\n", name);
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            if (i == j) fprintf(f, "%10s", "-");
+            else if (m[i][j] < 0) fprintf(f, "%10s", "fail");
+            else fprintf(f, "%10.1f", m[i][j]);
+        }
+        fprintf(f, "\n");
+    }
+}
+
+int budc_characterize_lock(budc_device* dev, const double* freqs_hz, int n, int repeats, const char* path,
+                           budc_charz_fn on_hop, void* user_data) {
+    if (!dev || !freqs_hz || n < 2 || n > PROFILE_MAX_POINTS || repeats < 1 || repeats > CHARZ_MAX_REPEATS || !path) return -1;
+    int walk[PROFILE_MAX_POINTS * (PROFILE_MAX_POINTS - 1) + 1];
+    int hops = euler_walk(n, walk) - 1;
+
+    // samples[(i * n + j) * repeats + r]
+    double* samples = malloc((size_t)n * n * repeats * sizeof(double));
+    double* all = malloc((size_t)hops * repeats * sizeof(double));
+    double (*median)[PROFILE_MAX_POINTS] = calloc(PROFILE_MAX_POINTS, sizeof(*median));
+    double (*worst)[PROFILE_MAX_POINTS] = calloc(PROFILE_MAX_POINTS, sizeof(*worst));
+    if (!samples || !all || !median || !worst) {
+        free(samples); free(all); free(median); free(worst);
+        return -1;
+    }
+
+    // Settle on the first point without timing it
+    int result = 0, failures = 0, count = 0;
+    double start = scpi_now_ms();
+    if (budc_set_frequency_hz(dev, freqs_hz[walk[0]]) != 0 || budc_wait_for_lock(dev, CHARZ_LOCK_TIMEOUT_MS) != 0) {
+        result = -1;
+    }
+    for (int r = 0; r < repeats && result == 0; r++) {
+        for (int h = 0; h < hops; h++) {
+            int from = walk[h], to = walk[h + 1];
+            double ms = time_hop(dev, freqs_hz[to]);
+            samples[(from * n + to) * repeats + r] = ms;
+            if (ms >= 0) all[count++] = ms; else failures++;
+            if (on_hop) on_hop(freqs_hz[from], freqs_hz[to], ms, user_data);
+            // A failed hop leaves the unit unlocked; get it back before timing from here
+            if (ms < 0 && budc_wait_for_lock(dev, CHARZ_LOCK_TIMEOUT_MS) != 0) { result = -1; break; }
+        }
+    }
+    double elapsed = scpi_now_ms() - start;
+
+    double per_pair[CHARZ_MAX_REPEATS];
+    for (int i = 0; i < n && result == 0; i++) {
+        for (int j = 0; j < n; j++) {
+            if (i == j) continue;
+            int ok = 0;
+            worst[i][j] = -1.0;
+            for (int r = 0; r < repeats; r++) {
+                double ms = samples[(i * n + j) * repeats + r];
+                if (ms < 0) continue;
+                per_pair[ok++] = ms;
+                if (ms > worst[i][j]) worst[i][j] = ms;
+            }
+            median[i][j] = percentile(per_pair, ok, 50);
+        }
+    }
+
+    FILE* f = result == 0 ? fopen(path, "w") : NULL;
+    if (f) {
+        char identity[256] = "";
+        time_t now = time(NULL);
+        budc_get_identity(dev, identity, sizeof(identity));
+        fprintf(f, "# BUDC lock-time profile\n# device %s\n# taken %s", identity, ctime(&now));
+        fprintf(f, "# %d points, %d hops x %d repeats, %.1f s, set command to first LOCK? = 1\n",
+                n, hops, repeats, elapsed / 1000.0);
+        fprintf(f, "# lock ms: min %.1f, median %.1f, p95 %.1f, max %.1f, %d failed hop(s)\n",
+                percentile(all, count, 0), percentile(all, count, 50), percentile(all, count, 95),
+                percentile(all, count, 100), failures);
+        // The envelope against step size: is a small hop really faster?
+        fprintf(f, "# by step size (MHz: median ms / max ms):\n");
+        for (int d = 1; d < n; d++) {
+            double step_mhz = 0.0, by_step[2 * PROFILE_MAX_POINTS], step_max = 0.0;
+            int k = 0;
+            for (int i = 0; i + d < n; i++) {
+                step_mhz = (freqs_hz[i + d] - freqs_hz[i]) / 1e6;
+                if (median[i][i + d] >= 0) by_step[k++] = median[i][i + d];
+                if (median[i + d][i] >= 0) by_step[k++] = median[i + d][i];
+                if (worst[i][i + d] > step_max) step_max = worst[i][i + d];
+                if (worst[i + d][i] > step_max) step_max = worst[i + d][i];
+            }
+            fprintf(f, "#   %10.3f: %7.1f / %7.1f\n", step_mhz, percentile(by_step, k, 50), step_max);
+        }
+        fprintf(f, "freqs_hz");
+        for (int i = 0; i < n; i++) fprintf(f, " %.0f", freqs_hz[i]);
+        fprintf(f, "\n");
+        write_matrix(f, "median_ms", n, median);
+        write_matrix(f, "max_ms", n, worst);
+        if (fclose(f) != 0) result = -1;
+    } else {
+        result = -1;
+    }
+    if (result == 0 && failures > 0) result = 1;
+
+    free(samples); free(all); free(median); free(worst);
+    return result;
+}
+
+int budc_load_lock_profile(budc_device* dev, const char* path) {
+    if (!dev) return -1;
+    if (!path) {
+        budc_lock_profile_free(dev);
+        return 0;
+    }
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+    struct budc_lock_profile* p = calloc(1, sizeof(*p));
+    char line[1024];
+    int row = -1;
+    while (p && fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        if (strncmp(line, "freqs_hz", 8) == 0) {
+            char* s = line + 8;
+            char* end;
+            for (double v = strtod(s, &end); end != s && p->n < PROFILE_MAX_POINTS; v = strtod(s, &end)) {
+                p->freqs_hz[p->n++] = v;
+                s = end;
+            }
+        } else if (strncmp(line, "median_ms", 9) == 0) {
+            row = 0;
+        } else if (row >= 0 && row < p->n) {
+            char* s = line;
+            for (int j = 0; j < p->n; j++) {
+                char cell[16];
+                int used = 0;
+                if (sscanf(s, "%15s%n", cell, &used) != 1) break;
+                s += used;
+                p->median_ms[row][j] = (cell[0] == '-' || cell[0] == 'f') ? -1.0 : atof(cell);
+            }
+            if (++row == p->n) row = -1;  // max_ms follows, not needed here
+        }
+    }
+    fclose(f);
+    if (!p || p->n < 2) { free(p); return -1; }
+
+    budc_mutex_lock(&dev->state_lock);
+    free(dev->lock_profile);
+    dev->lock_profile = p;
+    budc_mutex_unlock(&dev->state_lock);
+    return 0;
+}
+
+static double distance(double a, double b) { return a > b ? a - b : b - a; }
+
+static int nearest_point(const struct budc_lock_profile* p, double freq_hz) {
+    int best = 0;
+    for (int i = 1; i < p->n; i++) {
+        if (distance(p->freqs_hz[i], freq_hz) < distance(p->freqs_hz[best], freq_hz)) best = i;
+    }
+    return best;
+}
+
+// Caller holds state_lock. Nearest grid points; a hop within one grid cell
+// takes the fastest measured hop out of that point, and a hop from an
+// unknown frequency (the first set after connecting) the average into the target.
+double budc_lock_profile_expect(budc_device* dev, double from_hz, double to_hz) {
+    const struct budc_lock_profile* p = dev->lock_profile;
+    if (!p || to_hz <= 0) return -1.0;
+    int j = nearest_point(p, to_hz);
+    if (from_hz <= 0) {
+        double sum = 0.0;
+        int count = 0;
+        for (int k = 0; k < p->n; k++) {
+            if (k != j && p->median_ms[k][j] >= 0) { sum += p->median_ms[k][j]; count++; }
+        }
+        return count ? sum / count : -1.0;
+    }
+    int i = nearest_point(p, from_hz);
+    if (i != j) return p->median_ms[i][j];
+    double best = -1.0;
+    for (int k = 0; k < p->n; k++) {
+        if (k != i && p->median_ms[i][k] >= 0 && (best < 0 || p->median_ms[i][k] < best)) best = p->median_ms[i][k];
+    }
+    return best;
+}
+
+void budc_lock_profile_free(budc_device* dev) {
+    budc_mutex_lock(&dev->state_lock);
+    free(dev->lock_profile);
+    dev->lock_profile = NULL;
+    budc_mutex_unlock(&dev->state_lock);
+}
@@ -0,0 +1,218 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Levelled logging that stays off the I/O path. BUDC_LOG checks the level
+// inline, so a disabled record costs one comparison. An enabled one is
+// formatted into a buffer of the calling thread and copied into a bounded
+// lock-free queue; a writer thread drains the queue every few
+// milliseconds and does the actual output. A thread that logs while holding
+// io_lock therefore never waits on stderr or on another logging thread.
+// When the writer falls behind, records are dropped and counted rather
+// than blocking the caller.
+//
+// Each call site may emit a limited number of records per second. The
+// rest are counted, and the next record that gets through reports how many
+// were suppressed.
+//
+// The queue is Vyukov's bounded queue: every slot carries a sequence number
+// that tells producers when it is free and the writer when it is filled.
+
+#include "budc_internal.h"
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define LOG_SLOTS 256                  // Records waiting for the writer
+#define LOG_LINE_MAX 384
+#define LOG_WRITER_MS 20
+#define LOG_SITE_PER_SECOND 50         // Records one call site may emit per second
+
+typedef struct {
+    budc_atomic seq;
+    int level;
+    char line[LOG_LINE_MAX];
+} log_slot;
+
+volatile int budc_log_threshold = -1;
+
+static const char* level_names[] = { "error", "warn", "info", "debug", "trace" };
+
+static log_slot slots[LOG_SLOTS];
+static budc_atomic enqueue_pos;
+static unsigned long dequeue_pos;      // Guarded by write_lock
+static budc_atomic ready;
+static budc_atomic written, dropped, suppressed;
+static budc_atomic thread_count;
+static budc_mutex start_lock = BUDC_MUTEX_INIT;
+static budc_mutex write_lock = BUDC_MUTEX_INIT;
+static budc_log_sink sink;             // Guarded by write_lock
+static void* sink_data;
+static budc_thread writer;
+
+// --- WRITER ---
+static void drain(void) {
+    budc_mutex_lock(&write_lock);
+    for (;;) {
+        log_slot* s = &slots[dequeue_pos % LOG_SLOTS];
+        if ((unsigned long)budc_atomic_load(&s->seq) != dequeue_pos + 1) break;
+        if (sink) sink((budc_log_level)s->level, s->line, sink_data);
+        else fprintf(stderr, "%s\n", s->line);
+        // Free again once the producers have gone round the queue
+        budc_atomic_store(&s->seq, (long)(dequeue_pos + LOG_SLOTS));
+        dequeue_pos++;
+        budc_atomic_add(&written, 1);
+    }
+    if (!sink) fflush(stderr);
+    budc_mutex_unlock(&write_lock);
+}
+
+static void* writer_main(void* arg) {
+    (void)arg;
+    for (;;) {
+        drain();
+        scpi_delay(LOG_WRITER_MS);
+    }
+    return NULL;
+}
+
+// Sets the queue up and starts the writer on first use
+static void log_init(void) {
+    if (budc_atomic_load(&ready)) return;
+    budc_mutex_lock(&start_lock);
+    if (!budc_atomic_load(&ready)) {
+        for (long i = 0; i < LOG_SLOTS; i++) budc_atomic_store(&slots[i].seq, i);
+        budc_log_level level = BUDC_LOG_WARN;
+        const char* env = getenv("BUDC_LOG");
+        if (env) budc_log_parse_level(env, &level);
+        budc_log_threshold = (int)level;
+        // Without a writer, records still go out through budc_log_flush and at exit
+        if (budc_thread_create(&writer, writer_main, NULL) == 0) budc_thread_detach(writer);
+        atexit(budc_log_flush);
+        budc_atomic_store(&ready, 1);
+    }
+    budc_mutex_unlock(&start_lock);
+}
+
+// --- PRODUCERS ---
+static void enqueue(budc_log_level level, const char* text) {
+    unsigned long pos = (unsigned long)budc_atomic_load(&enqueue_pos);
+    log_slot* s;
+    for (;;) {
+        s = &slots[pos % LOG_SLOTS];
+        long diff = (long)((unsigned long)budc_atomic_load(&s->seq) - pos);
+        if (diff == 0 && budc_atomic_cas(&enqueue_pos, (long)pos, (long)(pos + 1))) break;
+        if (diff < 0) {
+            budc_atomic_add(&dropped, 1);
+            return;
+        }
+        pos = (unsigned long)budc_atomic_load(&enqueue_pos);
+    }
+    s->level = (int)level;
+    memcpy(s->line, text, strlen(text) + 1);
+    budc_atomic_store(&s->seq, (long)(pos + 1));
+}
+
+// Returns how many records of the site were suppressed in its previous
+// second when this one opens a new second, -1 if this one is over the limit
+static long site_admit(budc_log_site* site) {
+    long second = (long)(scpi_now_ms() / 1000.0);
+    long seen = budc_atomic_load(&site->second);
+    long missed = 0;
+    if (seen != second && budc_atomic_cas(&site->second, seen, second)) {
+        budc_atomic_store(&site->count, 0);
+        missed = budc_atomic_exchange(&site->suppressed, 0);
+    }
+    if (budc_atomic_add(&site->count, 1) <= LOG_SITE_PER_SECOND) return missed;
+    budc_atomic_add(&site->suppressed, 1);
+    budc_atomic_add(&suppressed, 1);
+    return -1;
+}
+
+void budc_log_emit(budc_log_site* site, budc_log_level level, const char* file, int line,
+                   const char* event, const char* fmt, ...) {
+    static BUDC_THREAD_LOCAL char text[LOG_LINE_MAX];
+    static BUDC_THREAD_LOCAL long thread_id;
+    log_init();
+    if ((int)level > budc_log_threshold) return;
+    long missed = site_admit(site);
+    if (missed < 0) return;
+    if (!thread_id) thread_id = budc_atomic_add(&thread_count, 1);
+
+    const char* base = file;
+    for (const char* p = file; *p; p++) if (*p == '/' || *p == '\\') base = p + 1;
+    int n = snprintf(text, sizeof(text), "t_ms=%.3f level=%s thread=%ld src=%s:%d event=%s",
+                     scpi_now_ms(), level_names[level], thread_id, base, line, event);
+    if (fmt && *fmt && n > 0 && (size_t)n + 1 < sizeof(text)) {
+        va_list args;
+        va_start(args, fmt);
+        text[n++] = ' ';
+        int m = vsnprintf(text + n, sizeof(text) - (size_t)n, fmt, args);
+        va_end(args);
+        if (m > 0) n += m;
+    }
+    if (missed > 0 && n > 0 && (size_t)n < sizeof(text)) {
+        snprintf(text + n, sizeof(text) - (size_t)n, " suppressed=%ld", missed);
+    }
+    enqueue(level, text);
+}
+
+// --- PUBLIC ---
+int budc_log_parse_level(const char* name, budc_log_level* level) {
+    for (int i = 0; i <= BUDC_LOG_TRACE; i++) {
+        if (strcmp(name, level_names[i]) == 0) {
+            *level = (budc_log_level)i;
+            return 0;
+        }
+    }
+    return -1;
+}
+
+void budc_log_set_level(budc_log_level level) {
+    log_init();
+    if (level > BUDC_LOG_TRACE) level = BUDC_LOG_TRACE;
+    budc_log_threshold = (int)level;
+}
+
+budc_log_level budc_log_get_level(void) {
+    log_init();
+    return (budc_log_level)budc_log_threshold;
+}
+
+void budc_log_set_sink(budc_log_sink fn, void* user_data) {
+    log_init();
+    drain();  // What was logged before goes where it was meant to
+    budc_mutex_lock(&write_lock);
+    sink = fn;
+    sink_data = user_data;
+    budc_mutex_unlock(&write_lock);
+}
+
+void budc_log_flush(void) {
+    if (budc_atomic_load(&ready)) drain();
+}
+
+void budc_log_get_stats(budc_log_stats* stats) {
+    if (!stats) return;
+    stats->written = (unsigned long)budc_atomic_load(&written);
+    stats->dropped = (unsigned long)budc_atomic_load(&dropped);
+    stats->suppressed = (unsigned long)budc_atomic_load(&suppressed);
+}
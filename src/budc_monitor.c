@@ -0,0 +1,203 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define MONITOR_IDLE_WAKE_MS 1000  // Longest sleep when nothing is scheduled
+
+struct budc_monitor {
+    budc_device* dev;
+    budc_monitor_config cfg;
+    budc_thread thread;
+    budc_mutex lock;
+    budc_cond cond;
+    bool stop;
+    bool detached;                 // Stopped from its own thread, frees itself on the way out
+    bool wake;                     // Set by budc_monitor_wake, e.g. on a wedged port
+    double last_lock_poll_ms;
+    double last_temp_poll_ms;
+};
+
+void budc_default_monitor_config(budc_monitor_config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->heartbeat_ms = 1000;
+    cfg->lock_poll_ms = 500;
+    cfg->temp_poll_ms = 5000;
+}
+
+static double earliest(double a, double b) {
+    if (a < 0) return b;
+    if (b < 0) return a;
+    return a < b ? a : b;
+}
+
+// --- SCHEDULING ---
+// When the monitor next has something to do. Health fields are read without
+// io_lock (health atomically); a stale value only shifts the wake-up by one round.
+static double next_due_ms(struct budc_monitor* mon, double now) {
+    budc_device* dev = mon->dev;
+    double due = budc_alarm_next_deadline(dev);
+    switch (health_of(dev)) {
+    case BUDC_HEALTH_RECOVERING:
+        return now;
+    case BUDC_HEALTH_FAILED:
+        return earliest(due, dev->next_recovery_ms);
+    default:
+        if (mon->cfg.heartbeat_ms) due = earliest(due, dev->last_io_ms + mon->cfg.heartbeat_ms);
+        if (mon->cfg.lock_poll_ms) due = earliest(due, mon->last_lock_poll_ms + mon->cfg.lock_poll_ms);
+        if (mon->cfg.temp_poll_ms) due = earliest(due, mon->last_temp_poll_ms + mon->cfg.temp_poll_ms);
+        return due < 0 ? now + MONITOR_IDLE_WAKE_MS : due;
+    }
+}
+
+static void monitor_tick(struct budc_monitor* mon) {
+    budc_device* dev = mon->dev;
+    double now = scpi_now_ms();
+    switch (health_of(dev)) {
+    case BUDC_HEALTH_RECOVERING:
+        budc_recover(dev);
+        break;
+    case BUDC_HEALTH_FAILED:
+        if (now >= dev->next_recovery_ms) budc_recover(dev);
+        break;
+    default:
+        // Samples feed the shadow state, the temperature filter and the alarm rules
+        if (mon->cfg.lock_poll_ms && now - mon->last_lock_poll_ms >= mon->cfg.lock_poll_ms) {
+            bool locked;
+            mon->last_lock_poll_ms = now;
+            budc_get_lock_status(dev, &locked);
+            budc_relock_check(dev);
+        }
+        if (mon->cfg.temp_poll_ms && now - mon->last_temp_poll_ms >= mon->cfg.temp_poll_ms) {
+            mon->last_temp_poll_ms = now;
+            budc_sample_temperature(dev);
+        }
+        // Polls count as traffic, so this only fires on an otherwise idle link
+        if (mon->cfg.heartbeat_ms && scpi_now_ms() - dev->last_io_ms >= mon->cfg.heartbeat_ms) budc_heartbeat(dev);
+        break;
+    }
+    budc_alarm_tick(dev);
+    budc_flush_events(dev);
+}
+
+static void* monitor_main(void* arg) {
+    struct budc_monitor* mon = arg;
+    budc_mutex_lock(&mon->lock);
+    while (!mon->stop) {
+        double now = scpi_now_ms();
+        double due = next_due_ms(mon, now);
+        if (due > now && !mon->wake) {
+            double wait = due - now;
+            if (wait > MONITOR_IDLE_WAKE_MS) wait = MONITOR_IDLE_WAKE_MS;
+            budc_cond_timedwait(&mon->cond, &mon->lock, (unsigned int)wait + 1);
+            continue;
+        }
+        mon->wake = false;
+        budc_mutex_unlock(&mon->lock);
+        monitor_tick(mon);
+        budc_mutex_lock(&mon->lock);
+    }
+    bool detached = mon->detached;
+    budc_mutex_unlock(&mon->lock);
+    if (detached) {
+        budc_cond_destroy(&mon->cond);
+        budc_mutex_destroy(&mon->lock);
+        free(mon);
+    }
+    return NULL;
+}
+
+// --- START / STOP ---
+int budc_monitor_start(budc_device* dev, const budc_monitor_config* cfg) {
+    if (!budc_is_connected(dev)) return -1;
+    if (dev->monitor) return 0;
+
+    struct budc_monitor* mon = calloc(1, sizeof(struct budc_monitor));
+    if (!mon) return -1;
+    mon->dev = dev;
+    if (cfg) mon->cfg = *cfg; else budc_default_monitor_config(&mon->cfg);
+    budc_mutex_init(&mon->lock);
+    budc_cond_init(&mon->cond);
+
+    if (budc_thread_create(&mon->thread, monitor_main, mon) != 0) {
+        budc_cond_destroy(&mon->cond);
+        budc_mutex_destroy(&mon->lock);
+        free(mon);
+        return -1;
+    }
+    budc_mutex_lock(&dev->io_lock);
+    dev->monitor = mon;
+    budc_mutex_unlock(&dev->io_lock);
+    BUDC_LOG(BUDC_LOG_DEBUG, "monitor_start", "port=%s", dev->port_name);
+    return 0;
+}
+
+// From an event callback this runs on the monitor thread, which cannot join
+// itself: it is detached instead and exits once the callback returns.
+void budc_monitor_stop(budc_device* dev) {
+    if (!dev || !dev->monitor) return;
+
+    budc_mutex_lock(&dev->io_lock);
+    struct budc_monitor* mon = dev->monitor;
+    dev->monitor = NULL;
+    budc_mutex_unlock(&dev->io_lock);
+    if (!mon) return;
+
+    if (budc_thread_is_current(mon->thread)) {
+        budc_mutex_lock(&mon->lock);
+        mon->stop = true;
+        mon->detached = true;
+        budc_mutex_unlock(&mon->lock);
+        budc_thread_detach(mon->thread);
+        BUDC_LOG(BUDC_LOG_DEBUG, "monitor_stop", "port=%s detached=1", dev->port_name);
+        return;
+    }
+
+    budc_mutex_lock(&mon->lock);
+    mon->stop = true;
+    budc_cond_signal(&mon->cond);
+    budc_mutex_unlock(&mon->lock);
+    budc_thread_join(mon->thread);
+
+    budc_cond_destroy(&mon->cond);
+    budc_mutex_destroy(&mon->lock);
+    free(mon);
+    BUDC_LOG(BUDC_LOG_DEBUG, "monitor_stop", "port=%s", dev->port_name);
+}
+
+bool budc_monitor_running(budc_device* dev) {
+    return dev && dev->monitor != NULL;
+}
+
+// Called with io_lock held (from the transaction path); only takes the
+// monitor's own lock, which the monitor never holds while doing I/O.
+bool budc_monitor_wake(budc_device* dev) {
+    struct budc_monitor* mon = dev->monitor;
+    if (!mon) return false;
+    budc_mutex_lock(&mon->lock);
+    mon->wake = true;
+    budc_cond_signal(&mon->cond);
+    budc_mutex_unlock(&mon->lock);
+    return true;
+}
@@ -0,0 +1,271 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define POOL_DEFAULT_LINGER_MS 2000
+
+typedef struct pool_entry {
+    budc_device* dev;
+    char serial[64];
+    int refs;
+    double idle_since;             // When refs dropped to zero
+    struct pool_entry* next;
+} pool_entry;
+
+static budc_mutex pool_lock = BUDC_MUTEX_INIT;
+static budc_mutex acquire_lock = BUDC_MUTEX_INIT;  // Serialises the slow connect path
+static budc_cond pool_cond = BUDC_COND_INIT;
+static pool_entry* pool_head = NULL;
+static unsigned int pool_linger_ms = POOL_DEFAULT_LINGER_MS;
+static bool reaper_running = false;
+static bool probe_unknown = false;           // Open every port when looking up a serial
+
+// --- HELPER FUNCTIONS ---
+static void parse_serial(const char* identity, char* serial, size_t len) {
+    char field[64] = "";
+    serial[0] = '\0';
+    if (sscanf(identity, "%*[^,],%*[^,],%63[^,]", field) == 1) snprintf(serial, len, "%s", field);
+}
+
+static pool_entry* find_entry(const char* key) {
+    for (pool_entry* e = pool_head; e; e = e->next) {
+        if (strcmp(e->dev->port_name, key) == 0) return e;
+        if (e->serial[0] && strcmp(e->serial, key) == 0) return e;
+    }
+    return NULL;
+}
+
+static bool port_in_pool(const char* port_name) {
+    for (pool_entry* e = pool_head; e; e = e->next) {
+        if (strcmp(e->dev->port_name, port_name) == 0) return true;
+    }
+    return false;
+}
+
+static void close_entry(pool_entry* e) {
+    BUDC_LOG(BUDC_LOG_DEBUG, "pool_close", "port=%s", e->dev->port_name);
+    e->dev->pooled = false;
+    budc_disconnect(e->dev);
+    free(e);
+}
+
+// Unlinks every idle entry whose linger time has passed (or all idle entries
+// when force is set) and returns them as a list to close outside the lock.
+static pool_entry* unlink_expired(double now, bool force) {
+    pool_entry* expired = NULL;
+    pool_entry** link = &pool_head;
+    while (*link) {
+        pool_entry* e = *link;
+        if (e->refs == 0 && (force || now - e->idle_since >= pool_linger_ms)) {
+            *link = e->next;
+            e->next = expired;
+            expired = e;
+        } else {
+            link = &e->next;
+        }
+    }
+    return expired;
+}
+
+static void close_list(pool_entry* list) {
+    while (list) {
+        pool_entry* next = list->next;
+        close_entry(list);
+        list = next;
+    }
+}
+
+// --- LINGER ---
+// Sleeps until the earliest idle entry expires and closes it. Exits as soon
+// as nothing is idle; budc_release starts it again when needed.
+static void* reaper_main(void* arg) {
+    (void)arg;
+    budc_mutex_lock(&pool_lock);
+    for (;;) {
+        double now = scpi_now_ms();
+        pool_entry* expired = unlink_expired(now, false);
+        if (expired) {
+            budc_mutex_unlock(&pool_lock);
+            close_list(expired);
+            budc_mutex_lock(&pool_lock);
+            continue;
+        }
+
+        double next_expiry = -1.0;
+        for (pool_entry* e = pool_head; e; e = e->next) {
+            if (e->refs > 0) continue;
+            double expiry = e->idle_since + pool_linger_ms;
+            if (next_expiry < 0 || expiry < next_expiry) next_expiry = expiry;
+        }
+        if (next_expiry < 0) break;
+        budc_cond_timedwait(&pool_cond, &pool_lock, (unsigned int)(next_expiry - now) + 1);
+    }
+    reaper_running = false;
+    budc_mutex_unlock(&pool_lock);
+    return NULL;
+}
+
+// Called with pool_lock held
+static void wake_reaper(void) {
+    if (reaper_running) {
+        budc_cond_signal(&pool_cond);
+        return;
+    }
+    budc_thread thread;
+    if (budc_thread_create(&thread, reaper_main, NULL) == 0) {
+        reaper_running = true;
+        budc_thread_detach(thread);
+    }
+}
+
+// --- ACQUIRE / RELEASE ---
+static budc_device* pool_get(const char* key) {
+    budc_device* dev = NULL;
+    budc_mutex_lock(&pool_lock);
+    pool_entry* e = find_entry(key);
+    if (e) {
+        e->refs++;
+        dev = e->dev;
+    }
+    budc_mutex_unlock(&pool_lock);
+    return dev;
+}
+
+static budc_device* pool_insert(budc_device* dev) {
+    pool_entry* e = calloc(1, sizeof(pool_entry));
+    if (!e) { budc_disconnect(dev); return NULL; }
+    e->dev = dev;
+    e->refs = 1;
+    parse_serial(dev->identity, e->serial, sizeof(e->serial));
+    dev->pooled = true;
+
+    budc_mutex_lock(&pool_lock);
+    e->next = pool_head;
+    pool_head = e;
+    budc_mutex_unlock(&pool_lock);
+    BUDC_LOG(BUDC_LOG_DEBUG, "pool_add", "port=%s serial=\"%s\"", dev->port_name, e->serial);
+    return dev;
+}
+
+static budc_device* connect_matching(const char* port_name, const char* serial) {
+    budc_device* dev = budc_connect(port_name);
+    if (!dev) return NULL;
+    if (!serial) return dev;
+
+    char found[64];
+    if (dev->identity[0] == '\0') budc_get_identity(dev, dev->identity, sizeof(dev->identity));
+    parse_serial(dev->identity, found, sizeof(found));
+    if (strcmp(found, serial) == 0) return dev;
+    budc_disconnect(dev);
+    return NULL;
+}
+
+budc_device* budc_acquire(const char* serial_or_port) {
+    if (!serial_or_port || !*serial_or_port) return NULL;
+
+    budc_device* dev = pool_get(serial_or_port);
+    if (dev) return dev;
+
+    budc_mutex_lock(&acquire_lock);
+    dev = pool_get(serial_or_port);  // Another thread may have opened it meanwhile
+    if (dev) { budc_mutex_unlock(&acquire_lock); return dev; }
+
+    serial_port_info* ports = NULL;
+    int count = budc_find_ports(&ports);
+    bool is_port = strchr(serial_or_port, '/') || strchr(serial_or_port, '\\')
+                   || strncmp(serial_or_port, "COM", 3) == 0;
+    for (int i = 0; !is_port && i < count; i++) {
+        if (strcmp(ports[i].name, serial_or_port) == 0) is_port = true;
+    }
+
+    if (is_port) {
+        dev = connect_matching(serial_or_port, NULL);
+    } else {
+        // Look for the serial number on the ports the pool does not already
+        // own: those that look like a unit, then, if allowed, the rest
+        budc_mutex_lock(&pool_lock);
+        bool any = probe_unknown;
+        budc_mutex_unlock(&pool_lock);
+        for (int pass = 0; !dev && pass < (any ? 2 : 1); pass++) {
+            for (int i = 0; !dev && i < count; i++) {
+                if (budc_port_may_be_budc(&ports[i], serial_or_port) == (pass == 1)) continue;
+                budc_mutex_lock(&pool_lock);
+                bool owned = port_in_pool(ports[i].name);
+                budc_mutex_unlock(&pool_lock);
+                if (!owned) dev = connect_matching(ports[i].name, serial_or_port);
+            }
+        }
+    }
+    free(ports);
+
+    if (dev) dev = pool_insert(dev);
+    budc_mutex_unlock(&acquire_lock);
+    return dev;
+}
+
+void budc_release(budc_device* dev) {
+    if (!dev) return;
+    pool_entry* closing = NULL;
+
+    budc_mutex_lock(&pool_lock);
+    for (pool_entry** link = &pool_head; *link; link = &(*link)->next) {
+        pool_entry* e = *link;
+        if (e->dev != dev) continue;
+        if (e->refs > 0 && --e->refs == 0) {
+            e->idle_since = scpi_now_ms();
+            if (pool_linger_ms == 0) {
+                *link = e->next;
+                e->next = NULL;
+                closing = e;
+            } else {
+                wake_reaper();
+            }
+        }
+        break;
+    }
+    budc_mutex_unlock(&pool_lock);
+
+    if (closing) close_entry(closing);
+}
+
+void budc_pool_set_linger_ms(unsigned int linger_ms) {
+    budc_mutex_lock(&pool_lock);
+    pool_linger_ms = linger_ms;
+    if (reaper_running) budc_cond_signal(&pool_cond);
+    budc_mutex_unlock(&pool_lock);
+}
+
+void budc_pool_set_probe_unknown(bool probe) {
+    budc_mutex_lock(&pool_lock);
+    probe_unknown = probe;
+    budc_mutex_unlock(&pool_lock);
+}
+
+void budc_pool_flush(void) {
+    budc_mutex_lock(&pool_lock);
+    pool_entry* idle = unlink_expired(scpi_now_ms(), true);
+    budc_mutex_unlock(&pool_lock);
+    close_list(idle);
+}
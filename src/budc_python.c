@@ -0,0 +1,646 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Python extension module "budc" over budc_scpi (built with -DBUILD_PYTHON=ON).
+//
+// Every call that talks to the device releases the GIL for the whole
+// exchange, so Python threads driving different devices (or the same one;
+// handles are thread-safe) run their serial I/O in parallel. status(),
+// sweep() and sample() do all their work in one GIL-free stretch. Their
+// measurements come back as a Samples object, a block of doubles exposed
+// through the buffer protocol: memoryview() and numpy.asarray() use it in
+// place without copying.
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+#include <math.h>
+#include <string.h>
+#include "budc_scpi.h"
+
+static PyObject* BudcError;
+
+// --- CONFIGURATION ---
+#define SAMPLE_TEMP_MAX_AGE_MS 6000.0  // Just over the monitor's default temperature poll
+
+// --- SAMPLES ---
+// Row layout shared by sweep() and sample()
+enum { COL_TIME_MS = 0, COL_FREQ_GHZ, COL_LOCKED, COL_TEMP_C, COL_LOCK_MS, SAMPLE_COLS };
+static const char* sample_columns[SAMPLE_COLS] = { "t_ms", "freq_ghz", "locked", "temp_c", "lock_ms" };
+
+typedef struct {
+    PyObject_HEAD
+    double* data;
+    Py_ssize_t rows;
+    Py_ssize_t shape[2];
+    Py_ssize_t strides[2];
+    int exports;
+} SamplesObject;
+
+static PyTypeObject SamplesType;
+
+static SamplesObject* samples_new(Py_ssize_t rows) {
+    SamplesObject* s = PyObject_New(SamplesObject, &SamplesType);
+    if (!s) return NULL;
+    s->data = PyMem_RawCalloc(rows > 0 ? (size_t)rows * SAMPLE_COLS : 1, sizeof(double));
+    if (!s->data) { Py_DECREF(s); return (SamplesObject*)PyErr_NoMemory(); }
+    s->rows = rows;
+    s->shape[0] = rows;
+    s->shape[1] = SAMPLE_COLS;
+    s->strides[0] = SAMPLE_COLS * sizeof(double);
+    s->strides[1] = sizeof(double);
+    s->exports = 0;
+    return s;
+}
+
+static void samples_dealloc(SamplesObject* s) {
+    PyMem_RawFree(s->data);
+    PyObject_Free(s);
+}
+
+static int samples_getbuffer(SamplesObject* s, Py_buffer* view, int flags) {
+    if ((flags & PyBUF_WRITABLE) == PyBUF_WRITABLE) {
+        PyErr_SetString(PyExc_BufferError, "Samples is read-only");
+        view->obj = NULL;
+        return -1;
+    }
+    view->obj = (PyObject*)s;
+    Py_INCREF(s);
+    view->buf = s->data;
+    view->len = s->rows * SAMPLE_COLS * (Py_ssize_t)sizeof(double);
+    view->readonly = 1;
+    view->itemsize = sizeof(double);
+    view->format = (flags & PyBUF_FORMAT) ? "d" : NULL;
+    view->ndim = 2;
+    view->shape = (flags & PyBUF_ND) ? s->shape : NULL;
+    view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? s->strides : NULL;
+    view->suboffsets = NULL;
+    view->internal = NULL;
+    s->exports++;
+    return 0;
+}
+
+static void samples_releasebuffer(SamplesObject* s, Py_buffer* view) {
+    (void)view;
+    s->exports--;
+}
+
+static Py_ssize_t samples_len(SamplesObject* s) { return s->rows; }
+
+// s[i] is one row as a tuple, for use without numpy
+static PyObject* samples_item(SamplesObject* s, Py_ssize_t i) {
+    if (i < 0 || i >= s->rows) { PyErr_SetString(PyExc_IndexError, "row out of range"); return NULL; }
+    const double* row = s->data + i * SAMPLE_COLS;
+    return Py_BuildValue("(ddddd)", row[0], row[1], row[2], row[3], row[4]);
+}
+
+static PyObject* samples_get_columns(SamplesObject* s, void* closure) {
+    (void)s; (void)closure;
+    return Py_BuildValue("(sssss)", sample_columns[0], sample_columns[1], sample_columns[2],
+                         sample_columns[3], sample_columns[4]);
+}
+
+static PyBufferProcs samples_as_buffer = {
+    (getbufferproc)samples_getbuffer,
+    (releasebufferproc)samples_releasebuffer,
+};
+
+static PySequenceMethods samples_as_sequence = {
+    .sq_length = (lenfunc)samples_len,
+    .sq_item = (ssizeargfunc)samples_item,
+};
+
+static PyGetSetDef samples_getset[] = {
+    { "columns", (getter)samples_get_columns, NULL, "Column names, in order", NULL },
+    { NULL }
+};
+
+static PyTypeObject SamplesType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "budc.Samples",
+    .tp_basicsize = sizeof(SamplesObject),
+    .tp_dealloc = (destructor)samples_dealloc,
+    .tp_as_sequence = &samples_as_sequence,
+    .tp_as_buffer = &samples_as_buffer,
+    .tp_getset = samples_getset,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Measurements as rows of (t_ms, freq_ghz, locked, temp_c, lock_ms) doubles.\n"
+              "Supports the buffer protocol: numpy.asarray(samples) is a zero-copy (n, 5) view.",
+};
+
+// --- DEVICE ---
+typedef struct {
+    PyObject_HEAD
+    budc_device* dev;
+    int busy;                      // Calls in flight with the GIL released
+} DeviceObject;
+
+// Called with the GIL held; pairs with device_leave
+static budc_device* device_enter(DeviceObject* self) {
+    if (!self->dev) { PyErr_SetString(BudcError, "device is closed"); return NULL; }
+    self->busy++;
+    return self->dev;
+}
+
+static void device_leave(DeviceObject* self) { self->busy--; }
+
+static PyObject* device_failed(const char* what) {
+    PyErr_Format(BudcError, "%s failed", what);
+    return NULL;
+}
+
+static int device_init(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "port", "keep_lines", NULL };
+    const char* port;
+    int keep_lines = 0;
+    budc_connect_options opts;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "s|p", kwlist, &port, &keep_lines)) return -1;
+    if (self->dev) { PyErr_SetString(BudcError, "already connected"); return -1; }
+
+    budc_default_connect_options(&opts);
+    opts.keep_control_lines = keep_lines != 0;
+    budc_device* dev;
+    Py_BEGIN_ALLOW_THREADS
+    dev = budc_connect_ex(port, &opts);
+    Py_END_ALLOW_THREADS
+    if (!dev) { PyErr_Format(BudcError, "failed to connect to %s", port); return -1; }
+    self->dev = dev;
+    return 0;
+}
+
+static void device_dealloc(DeviceObject* self) {
+    if (self->dev) {
+        budc_device* dev = self->dev;
+        self->dev = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        budc_disconnect(dev);
+        Py_END_ALLOW_THREADS
+    }
+    Py_TYPE(self)->tp_free((PyObject*)self);
+}
+
+static PyObject* device_close(DeviceObject* self, PyObject* unused) {
+    (void)unused;
+    if (self->busy) { PyErr_SetString(BudcError, "device is in use by another thread"); return NULL; }
+    if (self->dev) {
+        budc_device* dev = self->dev;
+        self->dev = NULL;
+        Py_BEGIN_ALLOW_THREADS
+        budc_disconnect(dev);
+        Py_END_ALLOW_THREADS
+    }
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_enter_ctx(DeviceObject* self, PyObject* unused) {
+    (void)unused;
+    Py_INCREF(self);
+    return (PyObject*)self;
+}
+
+static PyObject* device_exit_ctx(DeviceObject* self, PyObject* args) {
+    (void)args;
+    return device_close(self, NULL);
+}
+
+static PyObject* device_identity(DeviceObject* self, PyObject* unused) {
+    char identity[256];
+    int rc;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_identity(dev, identity, sizeof(identity));
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("identity");
+    return PyUnicode_FromString(identity);
+}
+
+// All four readings in one GIL-free stretch
+static PyObject* device_status(DeviceObject* self, PyObject* unused) {
+    double freq_ghz = 0.0;
+    bool locked = false;
+    float temp_c = 0.0f;
+    int power = 0, rc;
+    bool temp_ok;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_frequency_ghz(dev, &freq_ghz) | budc_get_lock_status(dev, &locked)
+         | budc_get_power_level(dev, &power);
+    temp_ok = budc_get_temperature_filtered(dev, &temp_c, NULL) == 0 || budc_get_temperature_c(dev, &temp_c) == 0;
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("status");
+
+    PyObject* temp = temp_ok ? PyFloat_FromDouble(temp_c) : Py_NewRef(Py_None);
+    if (!temp) return NULL;
+    return Py_BuildValue("{s:d,s:O,s:N,s:i}", "freq_ghz", freq_ghz, "locked", locked ? Py_True : Py_False,
+                         "temp_c", temp, "power", power);
+}
+
+static PyObject* device_freq(DeviceObject* self, PyObject* unused) {
+    double freq_ghz;
+    int rc;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_frequency_ghz(dev, &freq_ghz);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("freq");
+    return PyFloat_FromDouble(freq_ghz);
+}
+
+static PyObject* device_locked(DeviceObject* self, PyObject* unused) {
+    bool locked;
+    int rc;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_lock_status(dev, &locked);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("locked");
+    return PyBool_FromLong(locked);
+}
+
+static PyObject* device_temp(DeviceObject* self, PyObject* unused) {
+    float temp_c;
+    int rc;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_temperature_c(dev, &temp_c);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) Py_RETURN_NONE;  // Not every model reports temperature
+    return PyFloat_FromDouble(temp_c);
+}
+
+static PyObject* device_power(DeviceObject* self, PyObject* unused) {
+    int power, rc;
+    (void)unused;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_get_power_level(dev, &power);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("power");
+    return PyLong_FromLong(power);
+}
+
+// Frequency in Hz from exactly one of ghz / mhz / hz, -1 when none is given
+static int parse_freq(PyObject* ghz, PyObject* mhz, PyObject* hz, double* freq_hz) {
+    int given = (ghz != Py_None) + (mhz != Py_None) + (hz != Py_None);
+    *freq_hz = -1.0;
+    if (given > 1) { PyErr_SetString(PyExc_TypeError, "give only one of ghz, mhz, hz"); return -1; }
+    if (ghz != Py_None) *freq_hz = PyFloat_AsDouble(ghz) * 1e9;
+    else if (mhz != Py_None) *freq_hz = PyFloat_AsDouble(mhz) * 1e6;
+    else if (hz != Py_None) *freq_hz = PyFloat_AsDouble(hz);
+    return PyErr_Occurred() ? -1 : 0;
+}
+
+// apply(ghz=|mhz=|hz=, power=): frequency and power in one exchange
+static PyObject* device_apply(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "ghz", "mhz", "hz", "power", NULL };
+    PyObject *ghz = Py_None, *mhz = Py_None, *hz = Py_None;
+    int power = -1, rc;
+    double freq_hz;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OOOi", kwlist, &ghz, &mhz, &hz, &power)) return NULL;
+    if (parse_freq(ghz, mhz, hz, &freq_hz) != 0) return NULL;
+    if (freq_hz < 0 && power < 0) { PyErr_SetString(PyExc_TypeError, "nothing to apply"); return NULL; }
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_apply_settings(dev, freq_hz, power);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("apply");
+    Py_RETURN_NONE;
+}
+
+// load_calibration(path): path.<serial> if it exists; None drops the table
+static PyObject* device_load_calibration(DeviceObject* self, PyObject* args) {
+    PyObject* path_obj;
+    const char* path = NULL;
+    int rc;
+    if (!PyArg_ParseTuple(args, "O", &path_obj)) return NULL;
+    if (path_obj != Py_None && !(path = PyUnicode_AsUTF8(path_obj))) return NULL;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_load_calibration(dev, path);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc == 1) { PyErr_SetString(BudcError, "calibration is for another unit"); return NULL; }
+    if (rc != 0) return device_failed("load_calibration");
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_calibration_offset(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "ghz", "mhz", "hz", NULL };
+    PyObject *ghz = Py_None, *mhz = Py_None, *hz = Py_None;
+    double freq_hz, offset;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|$OOO", kwlist, &ghz, &mhz, &hz)) return NULL;
+    if (parse_freq(ghz, mhz, hz, &freq_hz) != 0) return NULL;
+    if (freq_hz < 0) { PyErr_SetString(PyExc_TypeError, "give one of ghz, mhz, hz"); return NULL; }
+    if (!self->dev) { PyErr_SetString(BudcError, "device is closed"); return NULL; }
+    if (budc_calibration_offset(self->dev, freq_hz, &offset) != 0) Py_RETURN_NONE;
+    return PyFloat_FromDouble(offset);
+}
+
+static PyObject* device_wait_lock(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "timeout_ms", NULL };
+    unsigned int timeout_ms = 5000;
+    int rc;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|I", kwlist, &timeout_ms)) return NULL;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_wait_for_lock(dev, timeout_ms);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    return PyBool_FromLong(rc == 0);
+}
+
+static PyObject* device_simple(DeviceObject* self, int (*fn)(budc_device*), const char* what) {
+    int rc;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = fn(dev);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed(what);
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_preset(DeviceObject* self, PyObject* unused) { (void)unused; return device_simple(self, budc_preset, "preset"); }
+static PyObject* device_save(DeviceObject* self, PyObject* unused) { (void)unused; return device_simple(self, budc_save_settings, "save"); }
+static PyObject* device_flush_save(DeviceObject* self, PyObject* unused) { (void)unused; return device_simple(self, budc_flush_save, "flush_save"); }
+
+// defer_saves(quiet_ms=2000, max_defer_ms=30000), or quiet_ms=None to save at once again
+static PyObject* device_defer_saves(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "quiet_ms", "max_defer_ms", NULL };
+    PyObject* quiet = NULL;
+    budc_save_config cfg;
+    int rc;
+    budc_default_save_config(&cfg);
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|OI", kwlist, &quiet, &cfg.max_defer_ms)) return NULL;
+    if (quiet && quiet != Py_None) {
+        cfg.quiet_ms = (unsigned int)PyLong_AsUnsignedLong(quiet);
+        if (PyErr_Occurred()) return NULL;
+    }
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_set_save_policy(dev, quiet == Py_None ? NULL : &cfg);
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("defer_saves");
+    Py_RETURN_NONE;
+}
+
+static PyObject* device_raw(DeviceObject* self, PyObject* args) {
+    const char* command;
+    char reply[512] = "";
+    int rc;
+    if (!PyArg_ParseTuple(args, "s", &command)) return NULL;
+    budc_device* dev = device_enter(self);
+    if (!dev) return NULL;
+    Py_BEGIN_ALLOW_THREADS
+    rc = budc_send_raw_command(dev, command, reply, sizeof(reply));
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (rc != 0) return device_failed("raw");
+    return PyUnicode_FromString(reply);
+}
+
+static PyObject* device_stats(DeviceObject* self, PyObject* unused) {
+    budc_stats st;
+    (void)unused;
+    if (!self->dev) { PyErr_SetString(BudcError, "device is closed"); return NULL; }
+    if (budc_get_stats(self->dev, &st) != 0) return device_failed("stats");
+    return Py_BuildValue("{s:k,s:k,s:k,s:k,s:k,s:d,s:d,s:d,s:k,s:k,s:k,s:k,s:k,s:d,s:d}",
+                         "transactions", st.transactions, "timeouts", st.timeouts,
+                         "fast_failures", st.fast_failures, "recoveries", st.recoveries,
+                         "recovery_failures", st.recovery_failures,
+                         "latency_p50_ms", budc_stats_latency_percentile(&st, 50),
+                         "latency_p99_ms", budc_stats_latency_percentile(&st, 99),
+                         "latency_max_ms", st.latency_max_ms,
+                         "relocks", st.relocks, "relock_failures", st.relock_failures,
+                         "late_replies", st.late_replies, "saves", st.saves,
+                         "saves_coalesced", st.saves_coalesced, "save_busy_ms", st.save_busy_ms,
+                         "save_max_ms", st.save_max_ms);
+}
+
+// The monitor's filtered temperature when it is recent, otherwise a direct
+// read, which also refreshes the filter for the next few rows
+static void read_row(budc_device* dev, double* row, double start_ms) {
+    double freq_ghz, age_ms;
+    bool locked;
+    float temp_c;
+    row[COL_TIME_MS] = budc_now_ms() - start_ms;
+    row[COL_FREQ_GHZ] = budc_get_frequency_ghz(dev, &freq_ghz) == 0 ? freq_ghz : NAN;
+    row[COL_LOCKED] = budc_get_lock_status(dev, &locked) == 0 ? (locked ? 1.0 : 0.0) : NAN;
+    bool temp_ok = (budc_get_temperature_filtered(dev, &temp_c, &age_ms) == 0 && age_ms < SAMPLE_TEMP_MAX_AGE_MS)
+                   || budc_get_temperature_c(dev, &temp_c) == 0;
+    row[COL_TEMP_C] = temp_ok ? temp_c : NAN;
+}
+
+// sweep(freqs_ghz, power=None, timeout_ms=5000, dwell_ms=0): one row per
+// step; lock_ms is the time to lock after the retune, NaN on timeout
+static PyObject* device_sweep(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "freqs_ghz", "power", "timeout_ms", "dwell_ms", NULL };
+    PyObject* freqs_obj;
+    int power = -1;
+    unsigned int timeout_ms = 5000, dwell_ms = 0;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|iII", kwlist, &freqs_obj, &power, &timeout_ms, &dwell_ms))
+        return NULL;
+
+    PyObject* freqs = PySequence_Fast(freqs_obj, "freqs_ghz must be a sequence");
+    if (!freqs) return NULL;
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(freqs);
+    SamplesObject* out = samples_new(n);
+    if (!out) { Py_DECREF(freqs); return NULL; }
+    // Targets go into the freq column first, so no Python objects are touched without the GIL
+    for (Py_ssize_t i = 0; i < n; i++) {
+        out->data[i * SAMPLE_COLS + COL_FREQ_GHZ] = PyFloat_AsDouble(PySequence_Fast_GET_ITEM(freqs, i));
+    }
+    Py_DECREF(freqs);
+    if (PyErr_Occurred()) { Py_DECREF(out); return NULL; }
+
+    budc_device* dev = device_enter(self);
+    if (!dev) { Py_DECREF(out); return NULL; }
+    Py_ssize_t failed_at = -1;
+    Py_BEGIN_ALLOW_THREADS
+    double start = budc_now_ms();
+    for (Py_ssize_t i = 0; i < n; i++) {
+        double* row = out->data + i * SAMPLE_COLS;
+        // Power only goes out with the first step; later steps only retune
+        if (budc_apply_settings(dev, row[COL_FREQ_GHZ] * 1e9, i == 0 ? power : -1) != 0) { failed_at = i; break; }
+        double t0 = budc_now_ms();
+        row[COL_LOCK_MS] = budc_wait_for_lock(dev, timeout_ms) == 0 ? budc_now_ms() - t0 : NAN;
+        if (dwell_ms) budc_sleep_ms(dwell_ms);
+        read_row(dev, row, start);
+    }
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    if (failed_at >= 0) {
+        Py_DECREF(out);
+        PyErr_Format(BudcError, "sweep failed at step %zd", failed_at);
+        return NULL;
+    }
+    return (PyObject*)out;
+}
+
+// sample(count, interval_ms=100): readings at a fixed rate, lock_ms unused
+static PyObject* device_sample(DeviceObject* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = { "count", "interval_ms", NULL };
+    Py_ssize_t count;
+    unsigned int interval_ms = 100;
+    if (!PyArg_ParseTupleAndKeywords(args, kwargs, "n|I", kwlist, &count, &interval_ms)) return NULL;
+    if (count < 0) { PyErr_SetString(PyExc_ValueError, "count must be >= 0"); return NULL; }
+    SamplesObject* out = samples_new(count);
+    if (!out) return NULL;
+    budc_device* dev = device_enter(self);
+    if (!dev) { Py_DECREF(out); return NULL; }
+    Py_BEGIN_ALLOW_THREADS
+    double start = budc_now_ms();
+    for (Py_ssize_t i = 0; i < count; i++) {
+        // Anchored to the start so the rate does not drift with I/O time
+        double due = start + (double)i * interval_ms;
+        double now = budc_now_ms();
+        if (due > now) budc_sleep_ms((unsigned int)(due - now));
+        double* row = out->data + i * SAMPLE_COLS;
+        read_row(dev, row, start);
+        row[COL_LOCK_MS] = NAN;
+    }
+    Py_END_ALLOW_THREADS
+    device_leave(self);
+    return (PyObject*)out;
+}
+
+static PyMethodDef device_methods[] = {
+    { "close", (PyCFunction)device_close, METH_NOARGS, "Disconnect. Later calls raise budc.Error." },
+    { "__enter__", (PyCFunction)device_enter_ctx, METH_NOARGS, NULL },
+    { "__exit__", (PyCFunction)device_exit_ctx, METH_VARARGS, NULL },
+    { "identity", (PyCFunction)device_identity, METH_NOARGS, "*IDN? reply." },
+    { "status", (PyCFunction)device_status, METH_NOARGS,
+      "Dict of freq_ghz, locked, temp_c (None if unsupported) and power, read in one call." },
+    { "freq", (PyCFunction)device_freq, METH_NOARGS, "Current frequency in GHz." },
+    { "locked", (PyCFunction)device_locked, METH_NOARGS, "PLL lock state." },
+    { "temp", (PyCFunction)device_temp, METH_NOARGS, "Temperature in C, None if not supported." },
+    { "power", (PyCFunction)device_power, METH_NOARGS, "Current power level." },
+    { "apply", (PyCFunction)(void (*)(void))device_apply, METH_VARARGS | METH_KEYWORDS,
+      "apply(*, ghz=None, mhz=None, hz=None, power=-1): set frequency and/or power in one exchange." },
+    { "load_calibration", (PyCFunction)device_load_calibration, METH_VARARGS,
+      "load_calibration(path): correct power levels for frequency from now on; None turns it off." },
+    { "calibration_offset", (PyCFunction)(void (*)(void))device_calibration_offset, METH_VARARGS | METH_KEYWORDS,
+      "calibration_offset(*, ghz=None, mhz=None, hz=None) -> power offset, None without a table." },
+    { "wait_lock", (PyCFunction)(void (*)(void))device_wait_lock, METH_VARARGS | METH_KEYWORDS,
+      "wait_lock(timeout_ms=5000) -> bool" },
+    { "preset", (PyCFunction)device_preset, METH_NOARGS, "Reset to preset values." },
+    { "save", (PyCFunction)device_save, METH_NOARGS, "Save settings to flash, or mark them dirty after defer_saves()." },
+    { "defer_saves", (PyCFunction)(void (*)(void))device_defer_saves, METH_VARARGS | METH_KEYWORDS,
+      "defer_saves(quiet_ms=2000, max_defer_ms=30000): coalesce save() calls into one SAVE; quiet_ms=None turns it off." },
+    { "flush_save", (PyCFunction)device_flush_save, METH_NOARGS, "Send a deferred SAVE now." },
+    { "raw", (PyCFunction)device_raw, METH_VARARGS, "raw(command) -> reply string." },
+    { "stats", (PyCFunction)device_stats, METH_NOARGS, "Link counters and latency percentiles." },
+    { "sweep", (PyCFunction)(void (*)(void))device_sweep, METH_VARARGS | METH_KEYWORDS,
+      "sweep(freqs_ghz, power=-1, timeout_ms=5000, dwell_ms=0) -> Samples, one row per step." },
+    { "sample", (PyCFunction)(void (*)(void))device_sample, METH_VARARGS | METH_KEYWORDS,
+      "sample(count, interval_ms=100) -> Samples taken at a fixed rate." },
+    { NULL }
+};
+
+static PyTypeObject DeviceType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "budc.Device",
+    .tp_basicsize = sizeof(DeviceObject),
+    .tp_dealloc = (destructor)device_dealloc,
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_doc = "Device(port, keep_lines=False): a connection to one BUDC. Safe to share between threads.",
+    .tp_methods = device_methods,
+    .tp_init = (initproc)device_init,
+    .tp_new = PyType_GenericNew,
+};
+
+// --- MODULE ---
+static PyObject* module_find_ports(PyObject* module, PyObject* unused) {
+    serial_port_info* ports = NULL;
+    int count;
+    (void)module; (void)unused;
+    Py_BEGIN_ALLOW_THREADS
+    count = budc_find_ports(&ports);
+    Py_END_ALLOW_THREADS
+    if (count < 0) return device_failed("find_ports");
+    PyObject* list = PyList_New(count);
+    for (int i = 0; list && i < count; i++) {
+        PyObject* item = Py_BuildValue("(ss)", ports[i].name, ports[i].description);
+        if (!item) { Py_CLEAR(list); break; }
+        PyList_SET_ITEM(list, i, item);
+    }
+    free(ports);
+    return list;
+}
+
+static PyObject* module_set_log_level(PyObject* module, PyObject* args) {
+    const char* name;
+    budc_log_level level;
+    (void)module;
+    if (!PyArg_ParseTuple(args, "s", &name)) return NULL;
+    if (budc_log_parse_level(name, &level) != 0) {
+        PyErr_Format(PyExc_ValueError, "unknown log level '%s'", name);
+        return NULL;
+    }
+    budc_log_set_level(level);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef module_methods[] = {
+    { "find_ports", module_find_ports, METH_NOARGS, "List of (port, description) tuples." },
+    { "set_log_level", module_set_log_level, METH_VARARGS, "Library log level on stderr: error, warn, info, debug or trace." },
+    { NULL }
+};
+
+static struct PyModuleDef budc_module = {
+    PyModuleDef_HEAD_INIT, "budc", "Native bindings for the BUDC controller library.", -1, module_methods,
+};
+
+PyMODINIT_FUNC PyInit_budc(void) {
+    if (PyType_Ready(&SamplesType) < 0 || PyType_Ready(&DeviceType) < 0) return NULL;
+    PyObject* m = PyModule_Create(&budc_module);
+    if (!m) return NULL;
+    BudcError = PyErr_NewException("budc.Error", PyExc_OSError, NULL);
+    if (PyModule_AddObjectRef(m, "Error", BudcError) < 0
+        || PyModule_AddObjectRef(m, "Device", (PyObject*)&DeviceType) < 0
+        || PyModule_AddObjectRef(m, "Samples", (PyObject*)&SamplesType) < 0) {
+        Py_DECREF(m);
+        return NULL;
+    }
+    return m;
+}
@@ -0,0 +1,155 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Relock policy: re-applies the last commanded setting when the PLL drops
+// lock, escalating from a plain re-send to a port reopen and finally PRESET.
+// Runs on the monitor thread right after the lock poll that saw the loss.
+
+#include "budc_internal.h"
+#include <stdio.h>
+#include <string.h>
+
+typedef struct {
+    double freq_hz;
+    int power;
+    bool have_power;
+    int nominal;                   // Before calibration, -1 if unknown
+} relock_target;
+
+void budc_default_relock_config(budc_relock_config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->settle_ms = 1000;
+    cfg->reapply_timeout_ms = 2000;
+    cfg->reconnect_timeout_ms = 3000;
+    cfg->preset_timeout_ms = 5000;
+    cfg->retry_interval_ms = 30000;
+}
+
+// With nothing commanded through this handle yet, what the device is tuned
+// to now becomes the target, so attaching to a running unit needs no retune.
+void budc_set_relock_policy(budc_device* dev, const budc_relock_config* cfg) {
+    double freq_ghz = 0.0;
+    int power = 0;
+    bool have_power = false;
+    if (!dev) return;
+
+    budc_mutex_lock(&dev->state_lock);
+    bool adopt = cfg && dev->cmd_freq_hz <= 0;
+    budc_mutex_unlock(&dev->state_lock);
+    if (adopt) {
+        if (budc_get_frequency_ghz(dev, &freq_ghz) != 0) freq_ghz = 0.0;
+        have_power = budc_get_power_level(dev, &power) == 0;
+    }
+
+    budc_mutex_lock(&dev->state_lock);
+    dev->relock_enabled = cfg != NULL;
+    if (cfg) dev->relock = *cfg;
+    dev->next_relock_ms = 0.0;
+    if (adopt && dev->cmd_freq_hz <= 0 && freq_ghz > 0) {
+        dev->cmd_freq_hz = freq_ghz * 1e9;
+        dev->cmd_power = power;
+        dev->have_cmd_power = have_power;
+        dev->locked_since_command = dev->last_locked == 1;
+    }
+    budc_mutex_unlock(&dev->state_lock);
+}
+
+static double remaining_ms(double start, unsigned int budget_ms) {
+    return budget_ms - (scpi_now_ms() - start);
+}
+
+// Re-sends frequency and power as they were sent, already calibrated, and
+// waits for lock, all before deadline
+static int reapply(budc_device* dev, const relock_target* t, double start, unsigned int budget_ms) {
+    if (budc_apply_exact(dev, t->freq_hz, t->have_power ? t->power : -1, t->nominal) != 0) return -1;
+    double left = remaining_ms(start, budget_ms);
+    if (left <= 0) return -1;
+    return budc_wait_for_lock(dev, (unsigned int)left);
+}
+
+static budc_relock_stage run_stages(budc_device* dev, const budc_relock_config* cfg, const relock_target* t) {
+    double start = scpi_now_ms();
+    if (reapply(dev, t, start, cfg->reapply_timeout_ms) == 0) return BUDC_RELOCK_REAPPLY;
+
+    BUDC_LOG(BUDC_LOG_INFO, "relock_reopen", "port=%s", dev->port_name);
+    start = scpi_now_ms();
+    // This runs on the monitor thread, which is also the one that would
+    // recover a link the watchdog has given up on, so do it here
+    int reopened = budc_get_health(dev) >= BUDC_HEALTH_RECOVERING ? budc_recover(dev)
+                                                                  : budc_reopen(dev, cfg->reconnect_timeout_ms / 2);
+    if (reopened == 0 && reapply(dev, t, start, cfg->reconnect_timeout_ms) == 0) return BUDC_RELOCK_RECONNECT;
+
+    BUDC_LOG(BUDC_LOG_INFO, "relock_preset", "port=%s", dev->port_name);
+    start = scpi_now_ms();
+    if (budc_preset(dev) == 0 && reapply(dev, t, start, cfg->preset_timeout_ms) == 0) return BUDC_RELOCK_PRESET;
+    return BUDC_RELOCK_FAILED;
+}
+
+void budc_relock_check(budc_device* dev) {
+    double now = scpi_now_ms();
+    budc_relock_config cfg;
+    relock_target target;
+    double lost_ms;
+
+    // Only a loss after the device locked on the commanded setting counts;
+    // the unlock that follows a deliberate retune is not a fault.
+    budc_mutex_lock(&dev->state_lock);
+    bool due = dev->relock_enabled && dev->last_locked == 0 && dev->locked_since_command
+               && dev->cmd_freq_hz > 0 && now - dev->last_command_ms >= dev->relock.settle_ms
+               && now >= dev->next_relock_ms;
+    cfg = dev->relock;
+    target.freq_hz = dev->cmd_freq_hz;
+    target.power = dev->cmd_power;
+    target.have_power = dev->have_cmd_power;
+    target.nominal = dev->nominal_power;
+    lost_ms = dev->lock_lost_ms;
+    budc_mutex_unlock(&dev->state_lock);
+    if (!due) return;
+
+    BUDC_LOG(BUDC_LOG_INFO, "relock_start", "port=%s freq_hz=%.0f", dev->port_name, target.freq_hz);
+    budc_relock_stage stage = run_stages(dev, &cfg, &target);
+    double outage = scpi_now_ms() - (lost_ms > 0 ? lost_ms : now);
+
+    budc_mutex_lock(&dev->stats_lock);
+    if (stage != BUDC_RELOCK_FAILED) {
+        dev->stats.relocks++;
+        budc_hist_add(dev->stats.relock_hist, &dev->stats.relock_max_ms, outage);
+    } else {
+        dev->stats.relock_failures++;
+    }
+    budc_mutex_unlock(&dev->stats_lock);
+
+    if (stage == BUDC_RELOCK_FAILED) {
+        // The stages rewrote the shadow (PRESET clears it); keep the target
+        // armed so the next attempt goes for the same setting
+        budc_mutex_lock(&dev->state_lock);
+        dev->cmd_freq_hz = target.freq_hz;
+        dev->cmd_power = target.power;
+        dev->have_cmd_power = target.have_power;
+        dev->nominal_power = target.nominal;
+        dev->locked_since_command = true;
+        dev->next_relock_ms = scpi_now_ms() + cfg.retry_interval_ms;
+        budc_mutex_unlock(&dev->state_lock);
+    }
+    BUDC_LOG(stage == BUDC_RELOCK_FAILED ? BUDC_LOG_ERROR : BUDC_LOG_INFO, "relock_done",
+             "port=%s stage=%d outage_ms=%.1f", dev->port_name, stage, outage);
+    budc_push_event(dev, BUDC_EVENT_RELOCK, stage, outage);
+    budc_flush_events(dev);
+}
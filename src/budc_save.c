@@ -0,0 +1,216 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Deferred SAVE. SAVE writes the settings to flash, which holds the port
+// for tens of milliseconds and wears the part, and scripts tend to save
+// after every change. With a save policy set, budc_save_settings only marks
+// the settings dirty. A thread per handle sends one SAVE once neither a
+// save request nor a set command has come for quiet_ms, and in any case
+// no later than max_defer_ms after the first request it covers, so a
+// steady stream of changes cannot put the save off forever. budc_flush_save
+// and budc_disconnect send a pending SAVE at once.
+//
+// A deferred SAVE that fails stays pending and is tried again after another
+// quiet period. Its result only shows in the stats and the log, so callers
+// that need to know should use budc_flush_save.
+
+#include "budc_internal.h"
+#include <stdlib.h>
+#include <string.h>
+
+struct budc_saver {
+    budc_device* dev;
+    budc_save_config cfg;
+    bool enabled;                  // False once the policy is turned off again
+    budc_thread thread;
+    budc_mutex lock;
+    budc_cond cond;
+    bool stop;
+    bool dirty;                    // A SAVE was asked for and not yet sent
+    bool saving;                   // A SAVE is on the port
+    unsigned long requests;        // Requests the pending SAVE covers
+    double first_ms;               // First of them
+    double last_ms;                // Latest of them
+};
+
+void budc_default_save_config(budc_save_config* cfg) {
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->quiet_ms = 2000;
+    cfg->max_defer_ms = 30000;
+}
+
+// --- SCHEDULING ---
+// When the pending SAVE is due. A set command restarts the quiet period
+// too: the settings it changed will be covered by the same SAVE.
+static double due_ms(struct budc_saver* s) {
+    budc_device* dev = s->dev;
+    budc_mutex_lock(&dev->state_lock);
+    double last = dev->last_command_ms > s->last_ms ? dev->last_command_ms : s->last_ms;
+    budc_mutex_unlock(&dev->state_lock);
+    double quiet = last + s->cfg.quiet_ms;
+    double limit = s->first_ms + s->cfg.max_defer_ms;
+    return quiet < limit ? quiet : limit;
+}
+
+// Sends the pending SAVE. Called with s->lock held and no SAVE on the port;
+// the lock is dropped for the exchange.
+static int save_locked(struct budc_saver* s) {
+    budc_device* dev = s->dev;
+    unsigned long covered = s->requests;
+    double deferred = scpi_now_ms() - s->first_ms;
+    s->dirty = false;
+    s->requests = 0;
+    s->saving = true;
+    budc_mutex_unlock(&s->lock);
+
+    int result = budc_save_now(dev);
+    double now = scpi_now_ms();
+    if (result == 0) {
+        budc_mutex_lock(&dev->stats_lock);
+        dev->stats.saves_coalesced += covered - 1;
+        budc_mutex_unlock(&dev->stats_lock);
+        BUDC_LOG(BUDC_LOG_DEBUG, "save", "port=%s requests=%lu deferred_ms=%.0f", dev->port_name, covered, deferred);
+    } else {
+        BUDC_LOG(BUDC_LOG_WARN, "save_failed", "port=%s requests=%lu", dev->port_name, covered);
+    }
+
+    budc_mutex_lock(&s->lock);
+    s->saving = false;
+    if (result != 0) {
+        // Still pending, merged with whatever was asked for meanwhile
+        if (!s->dirty) s->first_ms = now;
+        s->dirty = true;
+        s->requests += covered;
+        s->last_ms = now;
+    }
+    budc_cond_broadcast(&s->cond);
+    return result;
+}
+
+static void* saver_main(void* arg) {
+    struct budc_saver* s = arg;
+    budc_mutex_lock(&s->lock);
+    while (!s->stop) {
+        if (!s->enabled || !s->dirty || s->saving) {
+            budc_cond_wait(&s->cond, &s->lock);
+            continue;
+        }
+        double now = scpi_now_ms();
+        double due = due_ms(s);
+        if (due > now) {
+            budc_cond_timedwait(&s->cond, &s->lock, (unsigned int)(due - now) + 1);
+            continue;
+        }
+        save_locked(s);
+    }
+    budc_mutex_unlock(&s->lock);
+    return NULL;
+}
+
+// --- PUBLIC ---
+int budc_set_save_policy(budc_device* dev, const budc_save_config* cfg) {
+    if (!dev) return -1;
+    struct budc_saver* s = dev->saver;
+    if (!cfg) {
+        if (!s) return 0;
+        budc_mutex_lock(&s->lock);
+        s->enabled = false;
+        budc_mutex_unlock(&s->lock);
+        return budc_flush_save(dev);
+    }
+
+    if (!s) {
+        s = calloc(1, sizeof(struct budc_saver));
+        if (!s) return -1;
+        s->dev = dev;
+        budc_mutex_init(&s->lock);
+        budc_cond_init(&s->cond);
+        if (budc_thread_create(&s->thread, saver_main, s) != 0) {
+            budc_cond_destroy(&s->cond);
+            budc_mutex_destroy(&s->lock);
+            free(s);
+            return -1;
+        }
+        dev->saver = s;
+    }
+    budc_mutex_lock(&s->lock);
+    s->cfg = *cfg;
+    if (s->cfg.max_defer_ms < s->cfg.quiet_ms) s->cfg.max_defer_ms = s->cfg.quiet_ms;
+    s->enabled = true;
+    budc_cond_signal(&s->cond);
+    budc_mutex_unlock(&s->lock);
+    BUDC_LOG(BUDC_LOG_DEBUG, "save_policy", "port=%s quiet_ms=%u max_defer_ms=%u",
+             dev->port_name, s->cfg.quiet_ms, s->cfg.max_defer_ms);
+    return 0;
+}
+
+// Marks the settings dirty when a policy is set. Returns false when the
+// SAVE has to be sent now.
+bool budc_save_defer(budc_device* dev) {
+    struct budc_saver* s = dev->saver;
+    if (!s || !budc_is_connected(dev)) return false;
+    budc_mutex_lock(&s->lock);
+    bool deferred = s->enabled;
+    if (deferred) {
+        double now = scpi_now_ms();
+        if (!s->dirty) s->first_ms = now;
+        s->dirty = true;
+        s->requests++;
+        s->last_ms = now;
+        budc_cond_signal(&s->cond);
+    }
+    budc_mutex_unlock(&s->lock);
+    return deferred;
+}
+
+int budc_flush_save(budc_device* dev) {
+    if (!dev || !dev->saver) return 0;
+    struct budc_saver* s = dev->saver;
+    budc_mutex_lock(&s->lock);
+    while (s->saving) budc_cond_wait(&s->cond, &s->lock);
+    int result = s->dirty ? save_locked(s) : 0;
+    budc_mutex_unlock(&s->lock);
+    return result;
+}
+
+bool budc_save_pending(budc_device* dev) {
+    if (!dev || !dev->saver) return false;
+    budc_mutex_lock(&dev->saver->lock);
+    bool pending = dev->saver->dirty || dev->saver->saving;
+    budc_mutex_unlock(&dev->saver->lock);
+    return pending;
+}
+
+// Sends what is still pending before the port closes
+void budc_save_free(budc_device* dev) {
+    struct budc_saver* s = dev->saver;
+    if (!s) return;
+    budc_mutex_lock(&s->lock);
+    s->stop = true;
+    budc_cond_signal(&s->cond);
+    budc_mutex_unlock(&s->lock);
+    budc_thread_join(s->thread);
+
+    if (budc_flush_save(dev) != 0) BUDC_LOG(BUDC_LOG_ERROR, "save_lost", "port=%s", dev->port_name);
+    dev->saver = NULL;
+    budc_cond_destroy(&s->cond);
+    budc_mutex_destroy(&s->lock);
+    free(s);
+}
@@ -18,7 +18,7 @@
  * along with this program.  If not, see <https://www.gnu.org/licenses/>.
  */
 
-#include "budc_scpi.h"
+#include "budc_internal.h"
 #include <libserialport.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -34,21 +34,25 @@
 #endif
 
 // --- CONFIGURATION ---
-// Debug can be controlled by CMake or disabled here
-#ifndef BUDC_DEBUG
-#define BUDC_DEBUG 0  // Changed from 1 to 0 to disable debug
-#endif
-
 #define READ_TIMEOUT_MS 800
+#define INTER_CHAR_TIMEOUT_MS 20   // Silence after the last byte that ends an unterminated reply
+#define LATE_REPLY_WINDOW_MS 2000  // How long a timed-out query's reply is still expected
+#define LATE_SETTLE_MS 50          // Wait for a second reply when a late one cannot be told apart
+#define SYNC_TIMEOUT_MS 3000       // Upper bound for a set command (SAVE writes flash)
+#define OPC_PROBE_TIMEOUT_MS 300   // Firmware without *OPC? simply never answers
+#define READY_PROBE_INTERVAL_MS 50 // First per-attempt timeout of the connect readiness probe
+#define LINE_TOGGLE_MS 20          // DTR/RTS low time when kicking a wedged adapter
 #define COMMAND_TERMINATOR "\r\n"
 #define MAX_RETRIES 3
+#define LOCK_POLL_MIN_MS 10        // budc_wait_for_lock starts polling this fast...
+#define LOCK_POLL_MAX_MS 200       // ...and backs off to this
+#define TEMP_EMA_ALPHA 0.3         // Smoothing applied after the median
+#define TEMP_UNSUPPORTED_AFTER 3   // Failed reads on a healthy link before TEMP? is written off
 
-struct budc_device {
-    struct sp_port* port;
-};
+#define DEFAULT_SYNC_QUERY "LOCK?"
 
 // --- HELPER FUNCTIONS ---
-static void scpi_delay(int milliseconds) {
+void scpi_delay(int milliseconds) {
     #ifdef _WIN32
         Sleep(milliseconds);
     #else
@@ -56,6 +60,22 @@ static void scpi_delay(int milliseconds) {
     #endif
 }
 
+double scpi_now_ms(void) {
+    #ifdef _WIN32
+        LARGE_INTEGER freq, now;
+        QueryPerformanceFrequency(&freq);
+        QueryPerformanceCounter(&now);
+        return (double)now.QuadPart * 1000.0 / (double)freq.QuadPart;
+    #else
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+    #endif
+}
+
+double budc_now_ms(void) { return scpi_now_ms(); }
+void budc_sleep_ms(unsigned int milliseconds) { scpi_delay((int)milliseconds); }
+
 static void trim_whitespace(char* str) {
     if (!str || *str == '\0') return;
     char* start = str;
@@ -67,97 +87,825 @@ static void trim_whitespace(char* str) {
 }
 
 // --- CONNECTION ---
-budc_device* budc_connect(const char* port_name) {
-    if (BUDC_DEBUG) printf("DEBUG: Connecting to %s...\n", port_name);
+static int scpi_exchange_locked(budc_device* dev, const char* payload, char* response, size_t response_len, unsigned int timeout_ms);
+static void reset_framing_locked(budc_device* dev);
+
+void budc_default_connect_options(budc_connect_options* opts) {
+    memset(opts, 0, sizeof(*opts));
+    opts->baudrate = 9600;
+    opts->keep_control_lines = false;
+    opts->ready_timeout_ms = 1000;
+}
+
+// Applies the whole line configuration with a single sp_set_config call.
+// Leaving DTR/RTS out of the config keeps whatever state the lines are in.
+static int configure_port(struct sp_port* port, const budc_connect_options* opts) {
+    struct sp_port_config* config;
+    if (sp_new_config(&config) != SP_OK) return -1;
+    sp_set_config_baudrate(config, opts->baudrate);
+    sp_set_config_bits(config, 8);
+    sp_set_config_parity(config, SP_PARITY_NONE);
+    sp_set_config_stopbits(config, 1);
+    sp_set_config_flowcontrol(config, SP_FLOWCONTROL_NONE);
+    if (!opts->keep_control_lines) {
+        sp_set_config_dtr(config, SP_DTR_ON);
+        sp_set_config_rts(config, SP_RTS_ON);
+    }
+    int result = (sp_set_config(port, config) == SP_OK) ? 0 : -1;
+    sp_free_config(config);
+    return result;
+}
+
+static struct sp_port* open_port(const char* port_name, const budc_connect_options* opts) {
     struct sp_port* port;
     if (sp_get_port_by_name(port_name, &port) != SP_OK) return NULL;
     if (sp_open(port, SP_MODE_READ_WRITE) != SP_OK) {
         sp_free_port(port);
         return NULL;
     }
+    if (configure_port(port, opts) != 0) {
+        sp_close(port);
+        sp_free_port(port);
+        return NULL;
+    }
+    return port;
+}
+
+// Polls *IDN? with short timeouts until the device answers, instead of
+// sleeping a fixed time. The reply is kept as the cached identity.
+static int probe_ready(budc_device* dev, unsigned int timeout_ms, double start_ms) {
+    char response[256];
+    unsigned int attempt_ms = READY_PROBE_INTERVAL_MS;
+    do {
+        double remaining = timeout_ms - (scpi_now_ms() - start_ms);
+        unsigned int wait_ms = remaining < attempt_ms ? (unsigned int)remaining + 1 : attempt_ms;
+        if (scpi_exchange_locked(dev, "*IDN?", response, sizeof(response), wait_ms) == 0
+            && strlen(response) > 5) {
+            snprintf(dev->identity, sizeof(dev->identity), "%s", response);
+            dev->connect_ms = scpi_now_ms() - start_ms;
+            BUDC_LOG(BUDC_LOG_DEBUG, "ready", "port=%s ms=%.1f", dev->port_name, dev->connect_ms);
+            return 0;
+        }
+        // Back off so firmware that is merely slow to answer is not flushed forever
+        if (attempt_ms < 400) attempt_ms *= 2;
+    } while (scpi_now_ms() - start_ms < timeout_ms);
+    return -1;
+}
 
-    if (BUDC_DEBUG) printf("DEBUG: Port opened. Configuring...\n");
-    sp_set_baudrate(port, 9600);
-    sp_set_bits(port, 8);
-    sp_set_parity(port, SP_PARITY_NONE);
-    sp_set_stopbits(port, 1);
-    sp_set_flowcontrol(port, SP_FLOWCONTROL_NONE);
+budc_device* budc_connect_ex(const char* port_name, const budc_connect_options* opts) {
+    budc_connect_options defaults;
+    if (!opts) { budc_default_connect_options(&defaults); opts = &defaults; }
 
-    if (BUDC_DEBUG) printf("DEBUG: Asserting DTR and RTS lines.\n");
-    sp_set_dtr(port, SP_DTR_ON);
-    sp_set_rts(port, SP_RTS_ON);
+    BUDC_LOG(BUDC_LOG_DEBUG, "connect", "port=%s dtr_rts=%s", port_name, opts->keep_control_lines ? "kept" : "on");
+    double start = scpi_now_ms();
+    struct sp_port* port = open_port(port_name, opts);
+    if (!port) {
+        BUDC_LOG(BUDC_LOG_WARN, "open_failed", "port=%s", port_name);
+        return NULL;
+    }
 
-    budc_device* dev = malloc(sizeof(budc_device));
+    budc_device* dev = calloc(1, sizeof(budc_device));
     if (!dev) { sp_close(port); sp_free_port(port); return NULL; }
+    budc_mutex_init(&dev->io_lock);
+    budc_mutex_init(&dev->event_lock);
+    budc_mutex_init(&dev->stats_lock);
+    budc_mutex_init(&dev->state_lock);
+    budc_mutex_init(&dev->fq_lock);
+    budc_cond_init(&dev->fq_cond);
+    budc_cond_init(&dev->sync_cond);
+    dev->last_locked = -1;
+    dev->temp_support = -1;
+    dev->nominal_power = -1;
+    budc_default_watchdog_config(&dev->watchdog);
+    budc_atomic_store(&dev->health, BUDC_HEALTH_OK);
     dev->port = port;
+    dev->options = *opts;
+    snprintf(dev->port_name, sizeof(dev->port_name), "%s", port_name);
+    dev->sync_mode = BUDC_SYNC_AUTO;
+    dev->sync_resolved = BUDC_SYNC_AUTO;
+    dev->sync_query = DEFAULT_SYNC_QUERY;
+    dev->connect_ms = -1.0;
 
-    if (BUDC_DEBUG) printf("DEBUG: Flushing buffers post-configuration.\n");
     sp_flush(port, SP_BUF_BOTH);
-    scpi_delay(50); // A small delay after setup is good practice.
+    if (opts->ready_timeout_ms > 0) probe_ready(dev, opts->ready_timeout_ms, start);
 
     return dev;
 }
 
+budc_device* budc_connect(const char* port_name) {
+    return budc_connect_ex(port_name, NULL);
+}
+
+static int reopen_locked(budc_device* dev, unsigned int probe_ms) {
+    double start = scpi_now_ms();
+    if (dev->port) {
+        sp_close(dev->port);
+        sp_free_port(dev->port);
+        dev->port = NULL;
+    }
+    dev->port = open_port(dev->port_name, &dev->options);
+    dev->connect_ms = -1.0;
+    if (!dev->port) return -1;
+    sp_flush(dev->port, SP_BUF_BOTH);
+    reset_framing_locked(dev);
+    return probe_ms > 0 ? probe_ready(dev, probe_ms, start) : 0;
+}
+
+int budc_reopen(budc_device* dev, unsigned int probe_ms) {
+    if (!dev) return -1;
+    budc_mutex_lock(&dev->io_lock);
+    int result = reopen_locked(dev, probe_ms);
+    budc_mutex_unlock(&dev->io_lock);
+    return result;
+}
+
+// Reopens the port behind an existing handle. Cached identity and sync mode
+// survive, so the device does not have to be re-identified or re-probed.
+int budc_reconnect(budc_device* dev) {
+    return budc_reopen(dev, dev ? dev->options.ready_timeout_ms : 0);
+}
+
+double budc_get_connect_time_ms(budc_device* dev) {
+    return dev ? dev->connect_ms : -1.0;
+}
+
 void budc_disconnect(budc_device* dev) {
+    if (dev && dev->pooled) {
+        budc_release(dev);
+        return;
+    }
     if (dev) {
+        budc_save_free(dev);
+        budc_monitor_stop(dev);
+        budc_alarm_free(dev);
+        budc_lock_profile_free(dev);
+        budc_cal_free(dev);
+        budc_fairq_free(dev);
         if (dev->port) {
-            if (BUDC_DEBUG) printf("DEBUG: Closing port.\n");
+            BUDC_LOG(BUDC_LOG_DEBUG, "close", "port=%s", dev->port_name);
             sp_close(dev->port);
             sp_free_port(dev->port);
         }
+        budc_mutex_destroy(&dev->event_lock);
+        budc_mutex_destroy(&dev->stats_lock);
+        budc_mutex_destroy(&dev->state_lock);
+        budc_mutex_destroy(&dev->io_lock);
+        budc_cond_destroy(&dev->sync_cond);
+        budc_cond_destroy(&dev->fq_cond);
+        budc_mutex_destroy(&dev->fq_lock);
         free(dev);
     }
 }
 
 bool budc_is_connected(budc_device* dev) { return dev != NULL && dev->port != NULL; }
 
-// --- REVISED RAW COMMAND WITH WINDOWS-SPECIFIC DELAY ---
-int budc_send_raw_command(budc_device* dev, const char* command, char* response, size_t response_len) {
+// --- TRANSACTIONS ---
+// SCPI replies carry no tag, so a reply that arrives after its query timed
+// out would be taken as the answer to the next one (a PWR? level parsed as a
+// frequency). Instead of flushing the input before every command, which also
+// throws away a reply that is merely late, each timed-out query is remembered
+// with the shape of its reply. A reply that fits the remembered query and not
+// the current one is discarded and counted. When both fit, a second reply
+// within LATE_SETTLE_MS shows that the first was the late one.
+
+typedef enum {
+    REPLY_ANY = 0,    // Unknown query, anything goes
+    REPLY_FLAG,       // "0" or "1": LOCK?, *OPC?
+    REPLY_HZ,         // Frequency in Hz: FREQ?
+    REPLY_LEVEL,      // Small integer: PWR?
+    REPLY_NUMBER,     // Any number: TEMP?
+    REPLY_IDENTITY    // Comma-separated fields: *IDN?
+} reply_shape;
+
+static const struct { const char* query; reply_shape shape; } reply_shapes[] = {
+    { "LOCK?", REPLY_FLAG }, { "*OPC?", REPLY_FLAG }, { "FREQ?", REPLY_HZ },
+    { "PWR?", REPLY_LEVEL }, { "TEMP?", REPLY_NUMBER }, { "*IDN?", REPLY_IDENTITY },
+};
+
+// The reply answers the last query of a payload such as "FREQ 2.4e9\n*OPC?"
+static const char* last_query(const char* payload) {
+    const char* line = payload;
+    for (const char* p = payload; *p; p++) {
+        if (*p == '\n' && p[1]) line = p + 1;
+    }
+    return line;
+}
+
+static reply_shape query_shape(const char* query) {
+    for (size_t i = 0; i < sizeof(reply_shapes) / sizeof(reply_shapes[0]); i++) {
+        size_t n = strlen(reply_shapes[i].query);
+        if (strncmp(query, reply_shapes[i].query, n) == 0 && (query[n] == '\0' || isspace((unsigned char)query[n]))) {
+            return reply_shapes[i].shape;
+        }
+    }
+    return REPLY_ANY;
+}
+
+static bool reply_fits(const char* reply, reply_shape shape) {
+    char* end;
+    double value;
+    switch (shape) {
+    case REPLY_FLAG:
+        return strcmp(reply, "0") == 0 || strcmp(reply, "1") == 0;
+    case REPLY_HZ:
+    case REPLY_LEVEL:
+    case REPLY_NUMBER:
+        value = strtod(reply, &end);
+        if (end == reply || *end != '\0') return false;
+        if (shape == REPLY_HZ) return value >= 1e6;
+        if (shape == REPLY_LEVEL) return value > -1000.0 && value < 1000.0 && value == (double)(int)value;
+        return true;
+    case REPLY_IDENTITY:
+        return strchr(reply, ',') != NULL;
+    default:
+        return true;
+    }
+}
+
+static void remember_late_locked(budc_device* dev, const char* query, double now) {
+    if (dev->late_count == BUDC_LATE_SLOTS) {
+        memmove(&dev->late[0], &dev->late[1], (BUDC_LATE_SLOTS - 1) * sizeof(dev->late[0]));
+        dev->late_count--;
+    }
+    unsigned int i = dev->late_count++;
+    snprintf(dev->late[i].query, sizeof(dev->late[i].query), "%s", query);
+    dev->late[i].shape = query_shape(query);
+    dev->late[i].expires_ms = now + LATE_REPLY_WINDOW_MS;
+}
+
+static void forget_late_locked(budc_device* dev, unsigned int i) {
+    memmove(&dev->late[i], &dev->late[i + 1], (dev->late_count - i - 1) * sizeof(dev->late[0]));
+    dev->late_count--;
+}
+
+static void expire_late_locked(budc_device* dev, double now) {
+    while (dev->late_count > 0 && dev->late[0].expires_ms <= now) forget_late_locked(dev, 0);
+}
+
+static void count_late_reply(budc_device* dev, const char* reply, const char* query) {
+    BUDC_LOG(BUDC_LOG_DEBUG, "late_reply", "port=%s reply=\"%s\" query=\"%s\"", dev->port_name, reply, query);
+    budc_mutex_lock(&dev->stats_lock);
+    dev->stats.late_replies++;
+    budc_mutex_unlock(&dev->stats_lock);
+}
+
+// Drops the receive buffer and the list of outstanding queries, for when the
+// port itself is flushed or reopened
+static void reset_framing_locked(budc_device* dev) {
+    dev->rx_len = 0;
+    dev->late_count = 0;
+}
+
+// Takes one line out of rx_buf, or the whole buffer when unterminated is set.
+// Empty lines (a bare terminator) are dropped.
+static bool take_line(budc_device* dev, char* line, size_t line_len, bool unterminated) {
+    while (dev->rx_len > 0) {
+        char* nl = memchr(dev->rx_buf, '\n', dev->rx_len);
+        if (!nl && !unterminated && dev->rx_len < sizeof(dev->rx_buf)) return false;
+        size_t used = nl ? (size_t)(nl - dev->rx_buf) + 1 : dev->rx_len;
+        size_t copy = used < line_len ? used : line_len - 1;
+        memcpy(line, dev->rx_buf, copy);
+        line[copy] = '\0';
+        dev->rx_len -= used;
+        memmove(dev->rx_buf, dev->rx_buf + used, dev->rx_len);
+        trim_whitespace(line);
+        if (line[0]) return true;
+    }
+    return false;
+}
+
+// Reads one reply line. Returns as soon as a line terminator arrives, or after
+// a short silence once data has started, so unterminated replies still work.
+// Bytes after the first line stay in rx_buf for the next call.
+static int scpi_read_line(budc_device* dev, char* line, size_t line_len, double deadline) {
+    size_t total = 0;
+    line[0] = '\0';
+    while (!take_line(dev, line, line_len, false)) {
+        unsigned int wait_ms = INTER_CHAR_TIMEOUT_MS;
+        if (dev->rx_len == 0) {
+            double remaining = deadline - scpi_now_ms();
+            if (remaining <= 0) break;
+            wait_ms = (unsigned int)remaining + 1;
+        }
+        int n = sp_blocking_read_next(dev->port, dev->rx_buf + dev->rx_len, sizeof(dev->rx_buf) - dev->rx_len, wait_ms);
+        if (n <= 0) {
+            take_line(dev, line, line_len, true);
+            break;
+        }
+        dev->rx_len += n;
+        total += n;
+    }
+    if (total > 0) {
+        budc_mutex_lock(&dev->stats_lock);
+        dev->stats.bytes_read += total;
+        budc_mutex_unlock(&dev->stats_lock);
+    }
+    return line[0] ? 0 : -1;
+}
+
+// Anything already waiting before a command is written cannot be its reply.
+// Lines matching an outstanding query are counted as late replies.
+static void drain_input_locked(budc_device* dev) {
+    char line[256];
+    int waiting = sp_input_waiting(dev->port);
+    while (waiting > 0 && dev->rx_len < sizeof(dev->rx_buf)) {
+        int n = sp_nonblocking_read(dev->port, dev->rx_buf + dev->rx_len, sizeof(dev->rx_buf) - dev->rx_len);
+        if (n <= 0) break;
+        dev->rx_len += n;
+        budc_mutex_lock(&dev->stats_lock);
+        dev->stats.bytes_read += n;
+        budc_mutex_unlock(&dev->stats_lock);
+        waiting = sp_input_waiting(dev->port);
+    }
+    while (take_line(dev, line, sizeof(line), true)) {
+        if (dev->late_count > 0) {
+            count_late_reply(dev, line, dev->late[0].query);
+            forget_late_locked(dev, 0);
+        } else {
+            BUDC_LOG(BUDC_LOG_DEBUG, "unsolicited", "port=%s line=\"%s\"", dev->port_name, line);
+        }
+    }
+    if (waiting > 0) sp_flush(dev->port, SP_BUF_INPUT);  // More than rx_buf holds: garbage, not replies
+}
+
+// Reads the reply to query, skipping replies that belong to earlier queries
+// which timed out
+static int scpi_read_reply(budc_device* dev, const char* query, char* response, size_t response_len, unsigned int timeout_ms) {
+    double deadline = scpi_now_ms() + timeout_ms;
+    reply_shape shape = query_shape(query);
+    while (scpi_read_line(dev, response, response_len, deadline) == 0) {
+        expire_late_locked(dev, scpi_now_ms());
+        if (dev->late_count == 0) return 0;
+
+        // Oldest outstanding query first, replies come back in order
+        const char* late_query = dev->late[0].query;
+        bool fits_late = reply_fits(response, (reply_shape)dev->late[0].shape);
+        if (fits_late && !reply_fits(response, shape)) {
+            count_late_reply(dev, response, late_query);
+            forget_late_locked(dev, 0);
+            continue;
+        }
+        if (!fits_late || strcmp(late_query, query) == 0) {
+            // Not the late reply, or as good as it; the other may still come
+            return 0;
+        }
+
+        // Either could have sent it: if another reply follows at once, the
+        // first was the late one
+        char next[256];
+        double settle = scpi_now_ms() + LATE_SETTLE_MS;
+        if (scpi_read_line(dev, next, sizeof(next), settle < deadline ? settle : deadline) == 0) {
+            count_late_reply(dev, response, late_query);
+            snprintf(response, response_len, "%s", next);
+        }
+        forget_late_locked(dev, 0);
+        return 0;
+    }
+    return -1;
+}
+
+// Writes a payload (one or more commands) and optionally reads one reply.
+// The caller holds dev->io_lock.
+static int scpi_exchange_locked(budc_device* dev, const char* payload, char* response, size_t response_len, unsigned int timeout_ms) {
     if (!budc_is_connected(dev)) return -1;
-    
-    sp_flush(dev->port, SP_BUF_BOTH);
-    
-    char full_command[256];
-    snprintf(full_command, sizeof(full_command), "%s%s", command, COMMAND_TERMINATOR);
+
+    dev->last_io_ms = scpi_now_ms();
+    drain_input_locked(dev);
+
+    char full_command[512];
+    snprintf(full_command, sizeof(full_command), "%s%s", payload, COMMAND_TERMINATOR);
     size_t command_len = strlen(full_command);
 
-    if (BUDC_DEBUG) printf("\nDEBUG: Writing command: '%s'\n", command);
     int write_result = sp_blocking_write(dev->port, full_command, command_len, READ_TIMEOUT_MS);
-    if (BUDC_DEBUG) printf("DEBUG: sp_blocking_write returned: %d (wrote %d of %zu bytes)\n", write_result, write_result, command_len);
+    BUDC_LOG(BUDC_LOG_TRACE, "write", "port=%s cmd=\"%s\" wrote=%d of=%zu", dev->port_name, payload, write_result, command_len);
+    if (write_result > 0) {
+        budc_mutex_lock(&dev->stats_lock);
+        dev->stats.bytes_written += write_result;
+        budc_mutex_unlock(&dev->stats_lock);
+    }
 
     if (write_result < (int)command_len) {
-        if (BUDC_DEBUG) fprintf(stderr, "DEBUG: Write failed or timed out.\n");
+        BUDC_LOG(BUDC_LOG_WARN, "write_failed", "port=%s cmd=\"%s\" result=%d", dev->port_name, payload, write_result);
         return -1;
     }
 
-    if (strchr(command, '?')) {
-        if (!response || response_len == 0) return -1;
-        response[0] = '\0';
-        
-        // --- THE FINAL FIX ---
-        // Add a small delay ONLY on Windows to allow the device to process
-        // slower commands like FREQ? or TEMP? before we try to read.
-        #ifdef _WIN32
-            if (BUDC_DEBUG) printf("DEBUG: Applying Windows-specific pre-read delay (100ms).\n");
-            scpi_delay(100);
-        #endif
-
-        if (BUDC_DEBUG) printf("DEBUG: Attempting to read response...\n");
-        int bytes_read = sp_blocking_read_next(dev->port, response, response_len - 1, READ_TIMEOUT_MS);
-        if (BUDC_DEBUG) printf("DEBUG: sp_blocking_read_next returned %d bytes.\n", bytes_read);
-
-        if (bytes_read > 0) {
-            response[bytes_read] = '\0';
-            trim_whitespace(response);
-            if (BUDC_DEBUG) printf("DEBUG: Response after trim: '%s'\n", response);
-            if (strlen(response) == 0) return -1;
-        } else {
-            return -1;
+    if (!response) return 0;
+    if (response_len == 0) return -1;
+
+    // Add a small delay ONLY on Windows to allow the device to process
+    // slower commands like FREQ? or TEMP? before we try to read.
+    #ifdef _WIN32
+        scpi_delay(100);
+    #endif
+
+    const char* query = last_query(payload);
+    int result = scpi_read_reply(dev, query, response, response_len, timeout_ms);
+    if (result != 0) remember_late_locked(dev, query, scpi_now_ms());
+    BUDC_LOG(BUDC_LOG_TRACE, result == 0 ? "reply" : "no_reply", "port=%s query=\"%s\" reply=\"%s\"", dev->port_name, query, response);
+    return result;
+}
+
+// --- WATCHDOG ---
+void budc_default_watchdog_config(budc_watchdog_config* cfg) {
+    cfg->wedge_threshold = 3;
+    cfg->recovery_timeout_ms = 1500;
+    cfg->retry_interval_ms = 5000;
+}
+
+void budc_set_watchdog_config(budc_device* dev, const budc_watchdog_config* cfg) {
+    if (!dev || !cfg) return;
+    budc_mutex_lock(&dev->io_lock);
+    dev->watchdog = *cfg;
+    if (dev->watchdog.wedge_threshold == 0) dev->watchdog.wedge_threshold = 1;
+    budc_mutex_unlock(&dev->io_lock);
+}
+
+budc_health budc_get_health(budc_device* dev) {
+    if (!budc_is_connected(dev)) return BUDC_HEALTH_FAILED;
+    return health_of(dev);
+}
+
+static void set_health_locked(budc_device* dev, budc_health health) {
+    budc_health from = health_of(dev);
+    if (from == health) return;
+    BUDC_LOG(health == BUDC_HEALTH_OK ? BUDC_LOG_INFO : BUDC_LOG_WARN, "health", "port=%s from=%d to=%d",
+             dev->port_name, from, health);
+    budc_atomic_store(&dev->health, health);
+    budc_push_event(dev, BUDC_EVENT_HEALTH_CHANGED, health, 0.0);
+}
+
+// Kicks the adapter (DTR/RTS toggle and flush), then reopens the port if the
+// device still does not answer. The whole attempt stays within
+// recovery_timeout_ms.
+static int recover_locked(budc_device* dev) {
+    double start = scpi_now_ms();
+    double budget = dev->watchdog.recovery_timeout_ms;
+    set_health_locked(dev, BUDC_HEALTH_RECOVERING);
+
+    int result = -1;
+    if (dev->port) {
+        if (!dev->options.keep_control_lines) {
+            sp_set_dtr(dev->port, SP_DTR_OFF);
+            sp_set_rts(dev->port, SP_RTS_OFF);
+            scpi_delay(LINE_TOGGLE_MS);
+            sp_set_dtr(dev->port, SP_DTR_ON);
+            sp_set_rts(dev->port, SP_RTS_ON);
         }
+        sp_flush(dev->port, SP_BUF_BOTH);
+        reset_framing_locked(dev);
+        result = probe_ready(dev, (unsigned int)(budget / 3), scpi_now_ms());
+    }
+    double remaining = budget - (scpi_now_ms() - start);
+    if (result != 0 && remaining > 0) result = reopen_locked(dev, (unsigned int)remaining);
+
+    double elapsed = scpi_now_ms() - start;
+    budc_mutex_lock(&dev->stats_lock);
+    dev->stats.last_recovery_ms = elapsed;
+    if (result == 0) dev->stats.recoveries++; else dev->stats.recovery_failures++;
+    budc_mutex_unlock(&dev->stats_lock);
+    if (result == 0) {
+        dev->consecutive_timeouts = 0;
+        set_health_locked(dev, BUDC_HEALTH_OK);
+    } else {
+        dev->next_recovery_ms = scpi_now_ms() + dev->watchdog.retry_interval_ms;
+        set_health_locked(dev, BUDC_HEALTH_FAILED);
+    }
+    BUDC_LOG(result == 0 ? BUDC_LOG_INFO : BUDC_LOG_ERROR, "recovery", "port=%s result=%s ms=%.1f",
+             dev->port_name, result == 0 ? "ok" : "failed", elapsed);
+    return result;
+}
+
+int budc_recover(budc_device* dev) {
+    if (!dev) return -1;
+    budc_mutex_lock(&dev->io_lock);
+    int result = recover_locked(dev);
+    budc_mutex_unlock(&dev->io_lock);
+    budc_flush_events(dev);
+    return result;
+}
+
+// Refuses the call while the link is known to be bad, so callers are not
+// dragged through the full timeout-and-retry cycle. Without a monitor the
+// caller that finds a retry due runs the recovery itself.
+static bool fail_fast_locked(budc_device* dev) {
+    budc_health health = health_of(dev);
+    if (health == BUDC_HEALTH_RECOVERING) return true;
+    if (health != BUDC_HEALTH_FAILED) return false;
+    if (scpi_now_ms() < dev->next_recovery_ms || budc_monitor_running(dev)) return true;
+    return recover_locked(dev) != 0;
+}
+
+static void note_exchange_locked(budc_device* dev, bool answered) {
+    if (answered) {
+        dev->consecutive_timeouts = 0;
+        if (health_of(dev) == BUDC_HEALTH_DEGRADED) set_health_locked(dev, BUDC_HEALTH_OK);
+        return;
+    }
+    budc_mutex_lock(&dev->stats_lock);
+    dev->stats.timeouts++;
+    budc_mutex_unlock(&dev->stats_lock);
+    if (++dev->consecutive_timeouts < dev->watchdog.wedge_threshold) {
+        set_health_locked(dev, BUDC_HEALTH_DEGRADED);
+        return;
     }
+    BUDC_LOG(BUDC_LOG_WARN, "wedged", "port=%s timeouts=%u", dev->port_name, dev->consecutive_timeouts);
+    set_health_locked(dev, BUDC_HEALTH_RECOVERING);
+    if (!budc_monitor_wake(dev)) recover_locked(dev);
+}
+
+void budc_hist_add(unsigned long* hist, double* max_ms, double ms) {
+    int bucket = 0;
+    for (double edge = 1.0; ms >= edge && bucket < BUDC_LATENCY_BUCKETS - 1; edge *= 2.0) bucket++;
+    hist[bucket]++;
+    if (ms > *max_ms) *max_ms = ms;
+}
+
+// Port time of this thread's last exchange, for callers that account it
+// separately (SAVE)
+static BUDC_THREAD_LOCAL double last_exchange_ms;
+
+static void count_fast_failure(budc_device* dev) {
+    budc_mutex_lock(&dev->stats_lock);
+    dev->stats.fast_failures++;
+    budc_mutex_unlock(&dev->stats_lock);
+}
+
+static int scpi_transact_locked(budc_device* dev, const char* payload, char* response, size_t response_len, unsigned int timeout_ms) {
+    if (fail_fast_locked(dev)) {
+        count_fast_failure(dev);
+        return -1;
+    }
+    double start = scpi_now_ms();
+    int result = scpi_exchange_locked(dev, payload, response, response_len, timeout_ms);
+    double latency = scpi_now_ms() - start;
+    last_exchange_ms = latency;
+
+    budc_mutex_lock(&dev->stats_lock);
+    dev->stats.transactions++;
+    dev->stats.io_busy_ms += latency;
+    if (response && result == 0) budc_hist_add(dev->stats.latency_hist, &dev->stats.latency_max_ms, latency);
+    budc_mutex_unlock(&dev->stats_lock);
+
+    // A write alone proves nothing about a wedged adapter, only replies count
+    if (response || result != 0) note_exchange_locked(dev, result == 0);
+    // An unanswered query took at least its timeout, and must not leave a
+    // latency alarm looking healthy on a link that has stopped answering
+    if (response) budc_alarm_on_sample(dev, BUDC_SAMPLE_LATENCY,
+                                       result == 0 || latency >= timeout_ms ? latency : (double)timeout_ms);
+    return result;
+}
+
+// Every exchange with the device goes through here, so several threads can
+// share one handle without interleaving a command with another's reply.
+static int scpi_transact(budc_device* dev, const char* payload, char* response, size_t response_len, unsigned int timeout_ms) {
+    if (!dev) return -1;
+    // The monitor holds io_lock while it recovers; do not queue up behind it
+    if (health_of(dev) == BUDC_HEALTH_RECOVERING && budc_monitor_running(dev)) {
+        count_fast_failure(dev);
+        return -1;
+    }
+    budc_mutex_lock(&dev->stats_lock);
+    dev->io_waiters++;
+    budc_mutex_unlock(&dev->stats_lock);
+    // Callers take turns by client first (budc_fairq.c); io_lock then only
+    // waits for the monitor and other direct holders
+    bool admitted = budc_fairq_enter(dev, payload, response != NULL) == 0;
+    if (admitted) budc_mutex_lock(&dev->io_lock);
+    budc_mutex_lock(&dev->stats_lock);
+    dev->io_waiters--;
+    budc_mutex_unlock(&dev->stats_lock);
+    if (!admitted) return -1;
+    int result = scpi_transact_locked(dev, payload, response, response_len, timeout_ms);
+    budc_mutex_unlock(&dev->io_lock);
+    budc_fairq_leave(dev);
+    budc_flush_events(dev);
+    return result;
+}
+
+int budc_heartbeat(budc_device* dev) {
+    char response[64];
+    return scpi_transact(dev, dev && dev->sync_query ? dev->sync_query : DEFAULT_SYNC_QUERY,
+                         response, sizeof(response), READ_TIMEOUT_MS);
+}
+
+// --- STATS ---
+int budc_get_stats(budc_device* dev, budc_stats* stats) {
+    if (!dev || !stats) return -1;
+    budc_mutex_lock(&dev->stats_lock);
+    *stats = dev->stats;
+    stats->io_waiters = dev->io_waiters;
+    budc_mutex_unlock(&dev->stats_lock);
     return 0;
 }
 
+// Estimated from the histogram, interpolating linearly inside the bucket
+double budc_hist_percentile(const unsigned long* hist, double max_ms, double percentile) {
+    unsigned long total = 0;
+    for (int i = 0; i < BUDC_LATENCY_BUCKETS; i++) total += hist[i];
+    if (total == 0) return 0.0;
+
+    double rank = percentile / 100.0 * total;
+    unsigned long seen = 0;
+    for (int i = 0; i < BUDC_LATENCY_BUCKETS; i++) {
+        unsigned long n = hist[i];
+        if (n == 0 || seen + n < rank) { seen += n; continue; }
+        double lo = i == 0 ? 0.0 : (double)(1UL << (i - 1));
+        double hi = i == BUDC_LATENCY_BUCKETS - 1 ? max_ms : (double)(1UL << i);
+        if (hi > max_ms) hi = max_ms;
+        if (hi < lo) hi = lo;
+        return lo + (hi - lo) * (rank - seen) / n;
+    }
+    return max_ms;
+}
+
+double budc_stats_latency_percentile(const budc_stats* stats, double percentile) {
+    return budc_hist_percentile(stats->latency_hist, stats->latency_max_ms, percentile);
+}
+
+double budc_stats_relock_percentile(const budc_stats* stats, double percentile) {
+    return budc_hist_percentile(stats->relock_hist, stats->relock_max_ms, percentile);
+}
+
+void budc_reset_stats(budc_device* dev) {
+    if (!dev) return;
+    budc_mutex_lock(&dev->stats_lock);
+    memset(&dev->stats, 0, sizeof(dev->stats));
+    budc_mutex_unlock(&dev->stats_lock);
+}
+
+// --- EVENTS ---
+void budc_set_event_callback(budc_device* dev, budc_event_callback callback, void* user_data) {
+    if (!dev) return;
+    budc_mutex_lock(&dev->event_lock);
+    dev->event_cb = callback;
+    dev->event_user = user_data;
+    dev->event_count = 0;
+    budc_mutex_unlock(&dev->event_lock);
+}
+
+// Events are queued where they happen (often with io_lock held) and handed
+// to the callback later by budc_flush_events, so a callback may call back
+// into the library.
+void budc_push_event(budc_device* dev, budc_event_type type, int code, double value) {
+    budc_mutex_lock(&dev->event_lock);
+    if (dev->event_cb) {
+        if (dev->event_count == BUDC_EVENT_QUEUE_SIZE) {
+            dev->event_head = (dev->event_head + 1) % BUDC_EVENT_QUEUE_SIZE;  // Drop the oldest
+            dev->event_count--;
+            budc_mutex_lock(&dev->stats_lock);
+            dev->stats.events_dropped++;
+            budc_mutex_unlock(&dev->stats_lock);
+        }
+        budc_event* ev = &dev->events[(dev->event_head + dev->event_count) % BUDC_EVENT_QUEUE_SIZE];
+        ev->type = type;
+        ev->timestamp_ms = scpi_now_ms();
+        ev->code = code;
+        ev->value = value;
+        dev->event_count++;
+    }
+    budc_mutex_unlock(&dev->event_lock);
+}
+
+void budc_flush_events(budc_device* dev) {
+    if (!dev) return;
+    budc_mutex_lock(&dev->event_lock);
+    if (dev->event_dispatching) {  // Another thread is draining, it will pick these up
+        budc_mutex_unlock(&dev->event_lock);
+        return;
+    }
+    dev->event_dispatching = true;
+    while (dev->event_count > 0 && dev->event_cb) {
+        budc_event ev = dev->events[dev->event_head];
+        budc_event_callback cb = dev->event_cb;
+        void* user = dev->event_user;
+        dev->event_head = (dev->event_head + 1) % BUDC_EVENT_QUEUE_SIZE;
+        dev->event_count--;
+        budc_mutex_unlock(&dev->event_lock);
+        cb(dev, &ev, user);
+        budc_mutex_lock(&dev->event_lock);
+    }
+    dev->event_dispatching = false;
+    budc_mutex_unlock(&dev->event_lock);
+}
+
+int budc_send_raw_command(budc_device* dev, const char* command, char* response, size_t response_len) {
+    if (!budc_is_connected(dev)) return -1;
+    if (strchr(command, '?')) {
+        if (!response || response_len == 0) return -1;
+        return scpi_transact(dev, command, response, response_len, READ_TIMEOUT_MS);
+    }
+    return scpi_transact(dev, command, NULL, 0, 0);
+}
+
+// --- OPERATION COMPLETE ---
+// No model is known to answer *OPC? or to lack it, so every unit is probed
+// once. Units that stay silent are synchronised with DEFAULT_SYNC_QUERY.
+static budc_sync_mode probe_sync_mode(budc_device* dev) {
+    char identity[256], product[64] = "", response[16];
+    budc_mutex_lock(&dev->state_lock);
+    snprintf(identity, sizeof(identity), "%s", dev->identity);
+    budc_mutex_unlock(&dev->state_lock);
+    if (identity[0] == '\0' && budc_get_identity(dev, identity, sizeof(identity)) != 0) identity[0] = '\0';
+    sscanf(identity, "%*[^,],%63[^,]", product);
+    // Raw exchange: silence is the expected answer here, not a sign of a wedged port
+    budc_mutex_lock(&dev->io_lock);
+    bool opc_supported = scpi_exchange_locked(dev, "*OPC?", response, sizeof(response), OPC_PROBE_TIMEOUT_MS) == 0
+                         && atoi(response) == 1;
+    budc_mutex_unlock(&dev->io_lock);
+    BUDC_LOG(BUDC_LOG_DEBUG, "sync_mode", "port=%s model=\"%s\" sync=\"%s\"", dev->port_name, product,
+             opc_supported ? "*OPC?" : dev->sync_query);
+    return opc_supported ? BUDC_SYNC_OPC : BUDC_SYNC_QUERY;
+}
+
+// A mode resolved in an earlier session, see budc_warm.c. Skips the *OPC? probe.
+void budc_adopt_sync_mode(budc_device* dev, budc_sync_mode resolved) {
+    if (dev->sync_mode != BUDC_SYNC_AUTO || resolved == BUDC_SYNC_AUTO) return;
+    budc_mutex_lock(&dev->state_lock);
+    dev->sync_resolved = resolved;
+    budc_mutex_unlock(&dev->state_lock);
+}
+
+void budc_set_sync_mode(budc_device* dev, budc_sync_mode mode) {
+    if (!dev) return;
+    budc_mutex_lock(&dev->state_lock);
+    dev->sync_mode = mode;
+    dev->sync_resolved = mode;
+    budc_mutex_unlock(&dev->state_lock);
+}
+
+// The first caller to find the mode unresolved probes; callers arriving
+// meanwhile wait for its result instead of probing again
+budc_sync_mode budc_get_sync_mode(budc_device* dev) {
+    if (!budc_is_connected(dev)) return BUDC_SYNC_AUTO;
+    budc_mutex_lock(&dev->state_lock);
+    while (dev->sync_resolved == BUDC_SYNC_AUTO && dev->sync_resolving) {
+        budc_cond_wait(&dev->sync_cond, &dev->state_lock);
+    }
+    if (dev->sync_resolved == BUDC_SYNC_AUTO) {
+        dev->sync_resolving = true;
+        budc_mutex_unlock(&dev->state_lock);
+        budc_sync_mode probed = probe_sync_mode(dev);
+        budc_mutex_lock(&dev->state_lock);
+        if (dev->sync_resolved == BUDC_SYNC_AUTO) dev->sync_resolved = probed;
+        dev->sync_resolving = false;
+        budc_cond_broadcast(&dev->sync_cond);
+    }
+    budc_sync_mode mode = dev->sync_resolved;
+    budc_mutex_unlock(&dev->state_lock);
+    return mode;
+}
+
+// Sends a set command with the operation-complete query appended in the same
+// write, and returns once the device has answered it.
+static int scpi_set_command(budc_device* dev, const char* command) {
+    if (!budc_is_connected(dev)) return -1;
+
+    budc_sync_mode mode = budc_get_sync_mode(dev);
+    if (mode == BUDC_SYNC_NONE) return scpi_transact(dev, command, NULL, 0, 0);
+
+    const char* query = (mode == BUDC_SYNC_OPC) ? "*OPC?" : dev->sync_query;
+    char payload[320], response[64];
+    snprintf(payload, sizeof(payload), "%s%s%s", command, COMMAND_TERMINATOR, query);
+    return scpi_transact(dev, payload, response, sizeof(response), SYNC_TIMEOUT_MS);
+}
+
+int budc_wait_operation_complete(budc_device* dev) {
+    if (!budc_is_connected(dev)) return -1;
+
+    budc_sync_mode mode = budc_get_sync_mode(dev);
+    if (mode == BUDC_SYNC_NONE) return 0;
+
+    char response[64];
+    return scpi_transact(dev, mode == BUDC_SYNC_OPC ? "*OPC?" : dev->sync_query,
+                         response, sizeof(response), SYNC_TIMEOUT_MS);
+}
+
+// Feeds a lock reading into the shadow state and the alarm rules, and
+// reports edges as LOCK_CHANGED events.
+static void record_lock_sample(budc_device* dev, bool locked) {
+    budc_mutex_lock(&dev->state_lock);
+    bool changed = dev->last_locked >= 0 && dev->last_locked != (int)locked;
+    dev->last_locked = locked;
+    if (locked) {
+        dev->lock_lost_ms = 0.0;
+        dev->locked_since_command = true;
+    } else if (dev->lock_lost_ms == 0.0) {
+        dev->lock_lost_ms = scpi_now_ms();
+    }
+    budc_mutex_unlock(&dev->state_lock);
+    if (changed) budc_push_event(dev, BUDC_EVENT_LOCK_CHANGED, locked, 0.0);
+    budc_alarm_on_sample(dev, BUDC_SAMPLE_LOCK, locked ? 1.0 : 0.0);
+    budc_flush_events(dev);
+}
+
+// Pause between getter retries. Returns false when the link is being
+// recovered, so the retry loop gives up at once instead of sleeping.
+static bool retry_pause(budc_device* dev, int milliseconds) {
+    if (budc_get_health(dev) >= BUDC_HEALTH_RECOVERING) return false;
+    scpi_delay(milliseconds);
+    return true;
+}
+
 // --- ALL GETTER, SETTER, AND HIGH-LEVEL FUNCTIONS REMAIN THE SAME ---
 int budc_find_ports(serial_port_info** port_list) {
     struct sp_port** ports;
@@ -171,15 +919,39 @@ int budc_find_ports(serial_port_info** port_list) {
         strncpy((*port_list)[i].name, sp_get_port_name(ports[i]), sizeof((*port_list)[i].name) - 1);
         char* desc = sp_get_port_description(ports[i]);
         if (desc) strncpy((*port_list)[i].description, desc, sizeof((*port_list)[i].description) - 1);
+        (*port_list)[i].usb = sp_get_port_transport(ports[i]) == SP_TRANSPORT_USB;
+        char* usb_serial = (*port_list)[i].usb ? sp_get_port_usb_serial(ports[i]) : NULL;
+        if (usb_serial) strncpy((*port_list)[i].usb_serial, usb_serial, sizeof((*port_list)[i].usb_serial) - 1);
     }
     sp_free_port_list(ports);
     return count;
 }
 
+bool budc_port_may_be_budc(const serial_port_info* port, const char* serial) {
+    static const char* const markers[] = { "budc", "buc", "bdc", "lotus" };
+    char desc[sizeof(port->description)];
+    if (!port || !port->usb) return false;  // Native UARTs are consoles and modems, units are on USB
+    if (serial && port->usb_serial[0] && strcmp(port->usb_serial, serial) == 0) return true;
+    size_t n = 0;
+    for (; port->description[n] && n < sizeof(desc) - 1; n++) desc[n] = (char)tolower((unsigned char)port->description[n]);
+    desc[n] = '\0';
+    for (size_t i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+        if (strstr(desc, markers[i])) return true;
+    }
+    return false;
+}
+
 int budc_get_identity(budc_device* dev, char* buffer, size_t len) {
     for (int i = 0; i < MAX_RETRIES; i++) {
-        if (budc_send_raw_command(dev, "*IDN?", buffer, len) == 0 && strlen(buffer) > 5) return 0;
-        scpi_delay(100);
+        if (budc_send_raw_command(dev, "*IDN?", buffer, len) == 0 && strlen(buffer) > 5) {
+            if (buffer != dev->identity) {
+                budc_mutex_lock(&dev->state_lock);
+                snprintf(dev->identity, sizeof(dev->identity), "%s", buffer);
+                budc_mutex_unlock(&dev->state_lock);
+            }
+            return 0;
+        }
+        if (!retry_pause(dev, 100)) break;
     }
     return -1;
 }
@@ -191,7 +963,7 @@ int budc_get_frequency_ghz(budc_device* dev, double* freq_ghz) {
             *freq_ghz = atof(response) / 1e9;
             return 0;
         }
-        scpi_delay(100);
+        if (!retry_pause(dev, 100)) break;
     }
     return -1;
 }
@@ -201,33 +973,108 @@ int budc_get_lock_status(budc_device* dev, bool* is_locked) {
     for (int i = 0; i < MAX_RETRIES; i++) {
         if (budc_send_raw_command(dev, "LOCK?", response, sizeof(response)) == 0) {
             *is_locked = (atoi(response) == 1);
+            record_lock_sample(dev, *is_locked);
             return 0;
         }
-        scpi_delay(100);
+        if (!retry_pause(dev, 100)) break;
     }
     return -1;
 }
 
-int budc_get_temperature_c(budc_device* dev, float* temp_c) {
+// --- TEMPERATURE ---
+// One TEMP? query. Returns 0 with a plausible reading.
+static int read_temperature_once(budc_device* dev, float* temp_c) {
     char response[64];
-    float temp_value;
-    for (int i = 0; i < 5; i++) {
-        if (budc_send_raw_command(dev, "TEMP?", response, sizeof(response)) == 0) {
-            char* num_start = response;
-            while (*num_start && !isdigit((unsigned char)*num_start) && *num_start != '-' && *num_start != '.') {
-                num_start++;
-            }
-            if (*num_start) {
-                temp_value = atof(num_start);
-                if (temp_value >= -50.0f && temp_value <= 150.0f) {
-                    if (temp_value != 0.0f || i == 4) {
-                        *temp_c = temp_value;
-                        return 0;
-                    }
-                }
-            }
+    if (budc_send_raw_command(dev, "TEMP?", response, sizeof(response)) != 0) return -1;
+    char* num_start = response;
+    while (*num_start && !isdigit((unsigned char)*num_start) && *num_start != '-' && *num_start != '.') {
+        num_start++;
+    }
+    if (!*num_start) return -1;
+    float temp_value = atof(num_start);
+    if (temp_value < -50.0f || temp_value > 150.0f) return -1;
+    *temp_c = temp_value;
+    return 0;
+}
+
+static int compare_float(const void* a, const void* b) {
+    float x = *(const float*)a, y = *(const float*)b;
+    return (x > y) - (x < y);
+}
+
+// Median of the last few readings, then an EMA. The median throws away the
+// occasional bogus reading (firmware sometimes reports 0.0) without the
+// extra queries the old retry loop spent on it.
+static void filter_temperature(budc_device* dev, bool ok, float raw) {
+    budc_mutex_lock(&dev->state_lock);
+    if (!ok) {
+        if (dev->temp_support < 0 && budc_get_health(dev) == BUDC_HEALTH_OK
+            && ++dev->temp_failures >= TEMP_UNSUPPORTED_AFTER) {
+            dev->temp_support = 0;
+            BUDC_LOG(BUDC_LOG_INFO, "temp_unsupported", "port=%s", dev->port_name);
+        }
+        budc_mutex_unlock(&dev->state_lock);
+        return;
+    }
+    dev->temp_support = 1;
+    dev->temp_raw[dev->temp_raw_head] = raw;
+    dev->temp_raw_head = (dev->temp_raw_head + 1) % BUDC_TEMP_MEDIAN_WINDOW;
+    if (dev->temp_raw_count < BUDC_TEMP_MEDIAN_WINDOW) dev->temp_raw_count++;
+
+    float sorted[BUDC_TEMP_MEDIAN_WINDOW];
+    memcpy(sorted, dev->temp_raw, dev->temp_raw_count * sizeof(float));
+    qsort(sorted, dev->temp_raw_count, sizeof(float), compare_float);
+    double median = sorted[dev->temp_raw_count / 2];
+    if (dev->temp_sample_ms == 0.0) dev->temp_filtered = median;
+    else dev->temp_filtered += TEMP_EMA_ALPHA * (median - dev->temp_filtered);
+    dev->temp_sample_ms = scpi_now_ms();
+    double filtered = dev->temp_filtered;
+    budc_mutex_unlock(&dev->state_lock);
+
+    budc_alarm_on_sample(dev, BUDC_SAMPLE_TEMPERATURE, filtered);
+    budc_flush_events(dev);
+}
+
+void budc_sample_temperature(budc_device* dev) {
+    float raw = 0.0f;
+    if (!budc_temperature_supported(dev)) return;
+    bool ok = read_temperature_once(dev, &raw) == 0;
+    filter_temperature(dev, ok, raw);
+}
+
+bool budc_temperature_supported(budc_device* dev) {
+    if (!dev) return false;
+    budc_mutex_lock(&dev->state_lock);
+    bool supported = dev->temp_support != 0;
+    budc_mutex_unlock(&dev->state_lock);
+    return supported;
+}
+
+int budc_get_temperature_filtered(budc_device* dev, float* temp_c, double* age_ms) {
+    if (!dev || !temp_c) return -1;
+    budc_mutex_lock(&dev->state_lock);
+    bool have = dev->temp_support == 1 && dev->temp_sample_ms > 0.0;
+    if (have) {
+        *temp_c = (float)dev->temp_filtered;
+        if (age_ms) *age_ms = scpi_now_ms() - dev->temp_sample_ms;
+    }
+    budc_mutex_unlock(&dev->state_lock);
+    return have ? 0 : -1;
+}
+
+// Direct read. A 0.0 reading is still re-read once or twice, since callers
+// of this function get the raw value rather than the filtered one.
+int budc_get_temperature_c(budc_device* dev, float* temp_c) {
+    float temp_value = 0.0f;
+    if (!budc_temperature_supported(dev)) return -1;
+    for (int i = 0; i < MAX_RETRIES; i++) {
+        bool ok = read_temperature_once(dev, &temp_value) == 0;
+        filter_temperature(dev, ok, temp_value);
+        if (ok && (temp_value != 0.0f || i == MAX_RETRIES - 1)) {
+            *temp_c = temp_value;
+            return 0;
         }
-        scpi_delay(250);
+        if (!budc_temperature_supported(dev) || !retry_pause(dev, 100)) break;
     }
     return -1;
 }
@@ -239,48 +1086,157 @@ int budc_get_power_level(budc_device* dev, int* power_level) {
             *power_level = atoi(response);
             return 0;
         }
-        scpi_delay(100);
+        if (!retry_pause(dev, 100)) break;
     }
     return -1;
 }
 
+// Remembers what was last commanded, for the relock policy. freq_hz < 0
+// leaves the frequency alone, nominal < 0 the power asked for; PRESET
+// forgets everything.
+static int note_command(budc_device* dev, int result, double freq_hz, const int* power, int nominal, bool preset) {
+    if (result != 0) return result;
+    budc_mutex_lock(&dev->state_lock);
+    if (freq_hz >= 0) {
+        dev->prev_freq_hz = dev->cmd_freq_hz;
+        dev->cmd_freq_hz = freq_hz;
+    }
+    if (power) { dev->cmd_power = *power; dev->have_cmd_power = true; }
+    if (nominal >= 0) dev->nominal_power = nominal;
+    if (preset) { dev->cmd_freq_hz = 0.0; dev->have_cmd_power = false; dev->nominal_power = -1; }
+    dev->last_command_ms = scpi_now_ms();
+    dev->locked_since_command = false;
+    budc_mutex_unlock(&dev->state_lock);
+    return result;
+}
+
+// FREQ and PWR in a single write with one operation-complete query, so the
+// pair costs one round trip. freq_command is the FREQ command or NULL, and
+// a negative power leaves power alone.
+static int send_settings(budc_device* dev, const char* freq_command, double freq_hz, int power, int nominal) {
+    char command[96] = "";
+    if (freq_command) snprintf(command, sizeof(command), "%s", freq_command);
+    if (power >= 0) {
+        size_t used = strlen(command);
+        snprintf(command + used, sizeof(command) - used, "%sPWR %d", used ? COMMAND_TERMINATOR : "", power);
+    }
+    if (!command[0]) return 0;
+    return note_command(dev, scpi_set_command(dev, command), freq_command ? freq_hz : -1.0,
+                        power >= 0 ? &power : NULL, nominal, false);
+}
+
+// Without a calibration table the nominal power is sent as it is. With one,
+// it is corrected for the frequency being set, or for the current one. A
+// retune without a power re-sends the last nominal power corrected for the
+// new frequency, unless that leaves the level unchanged.
+static int set_settings(budc_device* dev, const char* freq_command, double freq_hz, int nominal) {
+    if (!dev) return -1;
+    if (!budc_cal_loaded(dev)) return send_settings(dev, freq_command, freq_hz, nominal, nominal);
+
+    budc_mutex_lock(&dev->state_lock);
+    double target_hz = freq_command ? freq_hz : dev->cmd_freq_hz;
+    bool retune = nominal < 0;
+    if (retune) nominal = dev->nominal_power;
+    int sent = dev->have_cmd_power ? dev->cmd_power : -1;
+    budc_mutex_unlock(&dev->state_lock);
+
+    double freq_ghz;
+    if (target_hz <= 0 && nominal >= 0 && budc_get_frequency_ghz(dev, &freq_ghz) == 0) target_hz = freq_ghz * 1e9;
+    int power = target_hz > 0 ? budc_cal_power(dev, target_hz, nominal) : nominal;
+    if (retune && power == sent) power = -1;
+    return send_settings(dev, freq_command, freq_hz, power, nominal);
+}
+
 int budc_set_frequency_ghz(budc_device* dev, double freq_ghz) {
     char command[64]; snprintf(command, sizeof(command), "FREQ %.10gGHZ", freq_ghz);
-    return budc_send_raw_command(dev, command, NULL, 0);
+    return set_settings(dev, command, freq_ghz * 1e9, -1);
 }
 int budc_set_frequency_mhz(budc_device* dev, double freq_mhz) {
     char command[64]; snprintf(command, sizeof(command), "FREQ %.10gMHZ", freq_mhz);
-    return budc_send_raw_command(dev, command, NULL, 0);
+    return set_settings(dev, command, freq_mhz * 1e6, -1);
 }
 int budc_set_frequency_hz(budc_device* dev, double freq_hz) {
     char command[64]; snprintf(command, sizeof(command), "FREQ %.10g", freq_hz);
-    return budc_send_raw_command(dev, command, NULL, 0);
+    return set_settings(dev, command, freq_hz, -1);
 }
 int budc_set_power_level(budc_device* dev, int power_level) {
-    char command[32]; snprintf(command, sizeof(command), "PWR %d", power_level);
-    return budc_send_raw_command(dev, command, NULL, 0);
+    if (power_level < 0) return -1;
+    return set_settings(dev, NULL, -1.0, power_level);
+}
+// A negative value leaves that setting alone
+int budc_apply_settings(budc_device* dev, double freq_hz, int power_level) {
+    char command[64];
+    if (freq_hz >= 0) snprintf(command, sizeof(command), "FREQ %.10g", freq_hz);
+    return set_settings(dev, freq_hz >= 0 ? command : NULL, freq_hz, power_level);
+}
+int budc_apply_exact(budc_device* dev, double freq_hz, int power, int nominal) {
+    char command[64];
+    if (!dev) return -1;
+    if (freq_hz >= 0) snprintf(command, sizeof(command), "FREQ %.10g", freq_hz);
+    return send_settings(dev, freq_hz >= 0 ? command : NULL, freq_hz, power, nominal);
+}
+int budc_save_now(budc_device* dev) {
+    int result = scpi_set_command(dev, "SAVE");
+    if (!dev) return result;
+    budc_mutex_lock(&dev->stats_lock);
+    if (result == 0) {
+        dev->stats.saves++;
+        dev->stats.save_busy_ms += last_exchange_ms;
+        if (last_exchange_ms > dev->stats.save_max_ms) dev->stats.save_max_ms = last_exchange_ms;
+    } else {
+        dev->stats.save_failures++;
+    }
+    budc_mutex_unlock(&dev->stats_lock);
+    return result;
 }
 int budc_save_settings(budc_device* dev) {
-    return budc_send_raw_command(dev, "SAVE", NULL, 0);
+    if (dev && budc_save_defer(dev)) return 0;
+    return budc_save_now(dev);
 }
 int budc_preset(budc_device* dev) {
-    return budc_send_raw_command(dev, "PRESET", NULL, 0);
+    return note_command(dev, scpi_set_command(dev, "PRESET"), -1.0, NULL, -1, true);
 }
 
+// Polls fast at first and backs off. The first pause after an unlocked
+// reading is sized from the lock profile for this hop if one is loaded, or
+// else from the typical lock time seen so far, so a slow PLL is not polled
+// needlessly and a fast one is not kept waiting a full poll interval.
 int budc_wait_for_lock(budc_device* dev, unsigned int timeout_ms) {
+    if (!dev) return -1;
     bool locked = false;
-    clock_t start = clock();
-    while (!locked) {
-        if (budc_get_lock_status(dev, &locked) == 0 && locked) return 0;
-        clock_t current = clock();
-        if (((double)(current - start) / CLOCKS_PER_SEC * 1000.0) > timeout_ms) return -1;
-        scpi_delay(200);
+    double start = scpi_now_ms();
+    unsigned int interval = LOCK_POLL_MIN_MS;
+    bool first = true;
+    for (;;) {
+        if (budc_get_lock_status(dev, &locked) == 0 && locked) break;
+        double elapsed = scpi_now_ms() - start;
+        if (elapsed > timeout_ms) return -1;
+
+        unsigned int pause = interval;
+        if (first) {
+            budc_mutex_lock(&dev->state_lock);
+            double typical = budc_lock_profile_expect(dev, dev->prev_freq_hz, dev->cmd_freq_hz);
+            if (typical < 0) typical = dev->lock_time_ema_ms;
+            double expected = typical * 0.8 - elapsed;
+            budc_mutex_unlock(&dev->state_lock);
+            if (expected > pause) pause = (unsigned int)expected;
+            first = false;
+        }
+        if (pause > timeout_ms - elapsed) pause = (unsigned int)(timeout_ms - elapsed) + 1;
+        if (!retry_pause(dev, (int)pause)) return -1;
+        if (interval < LOCK_POLL_MAX_MS) interval = interval * 2 > LOCK_POLL_MAX_MS ? LOCK_POLL_MAX_MS : interval * 2;
+    }
+    // Only a wait that actually saw the device unlocked says anything about lock time
+    if (!first) {
+        double lock_ms = scpi_now_ms() - start;
+        budc_mutex_lock(&dev->state_lock);
+        dev->lock_time_ema_ms = dev->lock_time_ema_ms > 0 ? 0.75 * dev->lock_time_ema_ms + 0.25 * lock_ms : lock_ms;
+        budc_mutex_unlock(&dev->state_lock);
     }
     return 0;
 }
 
 int budc_set_frequency_and_wait(budc_device* dev, double freq_ghz, unsigned int timeout_ms) {
     if (budc_set_frequency_ghz(dev, freq_ghz) != 0) return -1;
-    scpi_delay(200);
     return budc_wait_for_lock(dev, timeout_ms);
 }
\ No newline at end of file
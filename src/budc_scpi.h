@@ -25,22 +25,362 @@
 #include <stdbool.h>
 
 typedef struct budc_device budc_device;
-typedef struct { char name[128]; char description[256]; } serial_port_info;
+typedef struct budc_client budc_client;
+typedef struct {
+    char name[128];
+    char description[256];
+    char usb_serial[64];       // USB serial number of the adapter, empty if none or not USB
+    bool usb;
+} serial_port_info;
+
+// How set commands wait for the device to finish processing them
+typedef enum {
+    BUDC_SYNC_AUTO = 0,  // Probe *OPC? once, fall back to BUDC_SYNC_QUERY if unanswered
+    BUDC_SYNC_OPC,       // Append *OPC? and wait for its reply
+    BUDC_SYNC_QUERY,     // Append a cheap query (e.g. LOCK?) for firmware without *OPC?
+    BUDC_SYNC_NONE       // Do not wait, return once the command is written
+} budc_sync_mode;
+
+// Link health as seen by the watchdog
+typedef enum {
+    BUDC_HEALTH_OK = 0,
+    BUDC_HEALTH_DEGRADED,    // Recent timeouts, below the wedge threshold
+    BUDC_HEALTH_RECOVERING,  // Port considered wedged, recovery under way; calls fail fast
+    BUDC_HEALTH_FAILED       // Recovery failed; calls fail fast until the next attempt
+} budc_health;
+
+typedef struct {
+    unsigned int wedge_threshold;      // Consecutive timeouts that mark the port wedged (default 3)
+    unsigned int recovery_timeout_ms;  // Upper bound for one recovery attempt (default 1500)
+    unsigned int retry_interval_ms;    // Pause between failed recovery attempts (default 5000)
+} budc_watchdog_config;
+
+#define BUDC_LATENCY_BUCKETS 16  // Bucket 0: < 1 ms, bucket i: [2^(i-1), 2^i) ms, last is open-ended
+
+typedef struct {
+    unsigned long transactions;        // Exchanges that reached the port
+    unsigned long timeouts;            // Exchanges that got no reply
+    unsigned long fast_failures;       // Calls refused while the link was recovering or failed
+    unsigned long recoveries;
+    unsigned long recovery_failures;
+    double last_recovery_ms;           // Duration of the last recovery attempt
+    unsigned long events_dropped;      // Event queue overflows
+    unsigned long latency_hist[BUDC_LATENCY_BUCKETS];  // Command-to-reply time of answered queries
+    double latency_max_ms;
+    unsigned long relocks;             // Lock losses repaired by the relock policy
+    unsigned long relock_failures;     // Lock losses where every relock stage failed
+    unsigned long relock_hist[BUDC_LATENCY_BUCKETS];  // Outage from loss seen to lock restored, same buckets
+    double relock_max_ms;
+    unsigned long bytes_written;       // Bytes sent to the port, terminators included
+    unsigned long bytes_read;          // Reply bytes received
+    double io_busy_ms;                 // Total time spent in exchanges; its rate is the link utilisation
+    unsigned int io_waiters;           // Callers queued for the port when the snapshot was taken
+    unsigned long late_replies;        // Replies to timed-out queries that arrived later and were discarded
+    unsigned long saves;               // SAVE commands sent
+    unsigned long saves_coalesced;     // Save requests covered by a later SAVE instead of their own
+    unsigned long save_failures;
+    double save_busy_ms;               // Time SAVE exchanges held the port, flash write included
+    double save_max_ms;
+} budc_stats;
+
+typedef struct {
+    char name[32];
+    unsigned int weight;
+    unsigned long transactions;        // Calls that got the port
+    unsigned long rejected;            // Calls refused because the client's queue was full
+    unsigned int queued;               // Calls waiting when the snapshot was taken
+    unsigned long bytes;               // Cost charged: command bytes plus an allowance per reply
+    unsigned long wait_hist[BUDC_LATENCY_BUCKETS];  // Time queued before the port was granted
+    double wait_max_ms;
+} budc_client_stats;
+
+typedef enum {
+    BUDC_EVENT_HEALTH_CHANGED = 0,     // code = new budc_health
+    BUDC_EVENT_LOCK_CHANGED,           // code = 1 locked, 0 unlocked
+    BUDC_EVENT_ALARM_RAISED,           // code = rule id, value = triggering measurement
+    BUDC_EVENT_ALARM_CLEARED,          // code = rule id, value = last measurement
+    BUDC_EVENT_RELOCK                  // code = budc_relock_stage that restored lock, value = outage in ms
+} budc_event_type;
+
+typedef struct {
+    budc_event_type type;
+    double timestamp_ms;               // budc_now_ms() clock
+    int code;
+    double value;
+} budc_event;
+
+// Called from whichever thread observed the event (a caller or the monitor),
+// never with library locks held. The callback may stop the monitor but must
+// not disconnect dev: the thread that raised the event still uses it.
+typedef void (*budc_event_callback)(budc_device* dev, const budc_event* event, void* user_data);
+
+typedef struct {
+    unsigned int heartbeat_ms;         // Query an idle link this often, 0 to disable (default 1000)
+    unsigned int lock_poll_ms;         // Sample LOCK? this often, 0 to disable (default 500)
+    unsigned int temp_poll_ms;         // Sample TEMP? into the filter this often, 0 to disable (default 5000)
+} budc_monitor_config;
+
+// Alarm rules, evaluated as each sample arrives (from the monitor or from
+// any getter call). Edges are reported as ALARM_RAISED / ALARM_CLEARED events.
+typedef enum {
+    BUDC_ALARM_TEMP_ABOVE = 0,         // Temperature (C) above threshold
+    BUDC_ALARM_LOCK_LOST,              // PLL unlocked (thresholds unused)
+    BUDC_ALARM_LOCK_FLAPPING,          // More than threshold lock transitions within window_ms
+    BUDC_ALARM_LATENCY_ABOVE           // Query round trip (ms) above threshold, a timeout counts as its full wait
+} budc_alarm_kind;
+
+typedef struct {
+    budc_alarm_kind kind;
+    double threshold;                  // Raise above this
+    double clear_threshold;            // Clear below this (hysteresis), clamped to threshold
+    unsigned int hold_ms;              // Condition must hold this long before raising
+    unsigned int clear_ms;             // Clear condition must hold this long before clearing
+    unsigned int window_ms;            // LOCK_FLAPPING counting window
+} budc_alarm_rule;
+
+// Automatic relock. When the monitor sees the PLL lose lock after it had
+// locked on the last commanded setting, the library re-sends that setting
+// and escalates if the device does not lock again. Each stage is bounded.
+typedef struct {
+    unsigned int settle_ms;            // Ignore lock loss this soon after a set command (default 1000)
+    unsigned int reapply_timeout_ms;   // Stage 1: re-send FREQ/PWR and wait for lock (default 2000)
+    unsigned int reconnect_timeout_ms; // Stage 2: reopen the port, re-send and wait (default 3000)
+    unsigned int preset_timeout_ms;    // Stage 3: PRESET, re-send and wait (default 5000)
+    unsigned int retry_interval_ms;    // After every stage failed, wait before trying again (default 30000)
+} budc_relock_config;
+
+typedef enum {
+    BUDC_RELOCK_FAILED = 0,
+    BUDC_RELOCK_REAPPLY,
+    BUDC_RELOCK_RECONNECT,
+    BUDC_RELOCK_PRESET
+} budc_relock_stage;
+
+// Connection options for budc_connect_ex
+typedef struct {
+    int baudrate;
+    bool keep_control_lines;        // Leave DTR/RTS as they are (some adapters reset on toggle)
+    unsigned int ready_timeout_ms;  // Poll *IDN? until the device answers, 0 to skip
+} budc_connect_options;
 
 // Connection
 int budc_find_ports(serial_port_info** port_list);
+// Whether a port is worth opening to look for a unit, without touching it:
+// a USB port that reports serial as its USB serial number, or whose
+// description names a BUDC, BUC or BDC. serial may be NULL.
+bool budc_port_may_be_budc(const serial_port_info* port, const char* serial);
+void budc_default_connect_options(budc_connect_options* opts);
 budc_device* budc_connect(const char* port_name);
+budc_device* budc_connect_ex(const char* port_name, const budc_connect_options* opts);
+int budc_reconnect(budc_device* dev);
+double budc_get_connect_time_ms(budc_device* dev);
+
+// Connection pool: one shared, reference-counted handle per device in the
+// process. Handles are safe to use from several threads. budc_disconnect on
+// a pooled handle is the same as budc_release.
+budc_device* budc_acquire(const char* serial_or_port);
+void budc_release(budc_device* dev);
+void budc_pool_set_linger_ms(unsigned int linger_ms);  // Keep idle handles open this long (default 2000)
+// By serial, only ports passing budc_port_may_be_budc are opened unless this
+// is set. Opening a port raises DTR/RTS and writes *IDN? to whatever is there.
+void budc_pool_set_probe_unknown(bool probe_unknown);
+void budc_pool_flush(void);                            // Close idle handles now
 void budc_disconnect(budc_device* dev);
 bool budc_is_connected(budc_device* dev);
 
 // Raw command
 int budc_send_raw_command(budc_device* dev, const char* command, char* response, size_t response_len);
 
+// Watchdog, stats and events
+void budc_default_watchdog_config(budc_watchdog_config* cfg);
+void budc_set_watchdog_config(budc_device* dev, const budc_watchdog_config* cfg);
+budc_health budc_get_health(budc_device* dev);
+int budc_recover(budc_device* dev);
+int budc_heartbeat(budc_device* dev);
+int budc_get_stats(budc_device* dev, budc_stats* stats);
+void budc_reset_stats(budc_device* dev);
+void budc_set_event_callback(budc_device* dev, budc_event_callback callback, void* user_data);
+
+double budc_stats_latency_percentile(const budc_stats* stats, double percentile);
+double budc_stats_relock_percentile(const budc_stats* stats, double percentile);
+
+// Clients (budc_fairq.c): callers sharing a handle get the port in proportion
+// to their weight. A thread acts for the client it attached, or for the
+// handle's default client (weight 1, unbounded). With max_queued > 0, a call
+// made while that many of the client's calls are waiting fails at once, and
+// budc_client_rejected tells it apart from a device error. Destroy clients
+// before budc_disconnect; any left are freed with the handle.
+budc_client* budc_client_create(budc_device* dev, const char* name, unsigned int weight, unsigned int max_queued);
+void budc_client_destroy(budc_client* client);
+budc_client* budc_client_attach(budc_client* client);  // For this thread; NULL detaches. Returns the previous one
+bool budc_client_rejected(void);  // A call on this thread was refused since the last attach
+int budc_client_get_stats(budc_client* client, budc_client_stats* stats);
+double budc_client_wait_percentile(const budc_client_stats* stats, double percentile);
+
+// Alarms
+int budc_alarm_add(budc_device* dev, const budc_alarm_rule* rule);  // Returns the rule id, -1 on error
+void budc_alarm_clear_rules(budc_device* dev);
+bool budc_alarm_is_active(budc_device* dev, int rule_id);
+
+// Monitor: background thread per device for heartbeat, sampling and recovery
+void budc_default_monitor_config(budc_monitor_config* cfg);
+int budc_monitor_start(budc_device* dev, const budc_monitor_config* cfg);
+void budc_monitor_stop(budc_device* dev);
+
+// Save policy, off by default: budc_save_settings sends SAVE at once. With
+// a policy it only marks the settings dirty, and one SAVE goes out once
+// there has been no save request or set command for quiet_ms, or at the
+// latest max_defer_ms after the first request. See budc_save.c.
+typedef struct {
+    unsigned int quiet_ms;             // Idle time before the SAVE (default 2000)
+    unsigned int max_defer_ms;         // Longest a request waits, at least quiet_ms (default 30000)
+} budc_save_config;
+
+void budc_default_save_config(budc_save_config* cfg);
+int budc_set_save_policy(budc_device* dev, const budc_save_config* cfg);  // NULL: off, sends what is pending
+int budc_flush_save(budc_device* dev);  // Sends a pending SAVE now; 0 if none was pending
+bool budc_save_pending(budc_device* dev);
+
+// Relock policy, off by default. Runs on the monitor thread, so it needs
+// budc_monitor_start. Pass NULL to turn it off. If nothing has been set
+// through this handle, the device's current frequency and power are the target.
+void budc_default_relock_config(budc_relock_config* cfg);
+void budc_set_relock_policy(budc_device* dev, const budc_relock_config* cfg);
+
+// Sequencer: test programs (loops, conditions, timed waits) compiled once
+// and run in-process against an open handle. The language is described at
+// the top of budc_seq.c.
+typedef struct budc_seq budc_seq;
+
+typedef struct {
+    double time_ms;                    // Step start, relative to the start of the run
+    double duration_ms;
+    int line;                          // Source line
+    const char* text;                  // Source statement(s)
+    bool ok;                           // Step result; for a condition, whether it held
+    bool condition;                    // An if statement rather than an action
+    bool has_value;
+    double value;                      // Readback, condition value, or wait overshoot in ms
+    const char* detail;                // Query reply, log or fail text, NULL otherwise
+} budc_seq_entry;
+
+typedef void (*budc_seq_log_fn)(const budc_seq_entry* entry, void* user_data);
+
+budc_seq* budc_seq_compile(const char* source, char* error, size_t error_len);  // NULL on error
+int budc_seq_run(budc_device* dev, budc_seq* seq, budc_seq_log_fn log, void* user_data);  // -1 on fail or cancel
+void budc_seq_cancel(budc_seq* seq);   // Safe from another thread or a signal handler
+void budc_seq_free(budc_seq* seq);
+
+// Band sweep split across several converters, each on its own thread. The
+// steps are shared out by model range and measured retune speed, and rebalanced
+// while running. See budc_sweep.c.
+typedef struct {
+    double start_hz, stop_hz, step_hz;  // Inclusive range
+    int power_level;                    // Negative leaves power alone
+    unsigned int lock_timeout_ms;       // Per step, 0 for the default (5000)
+    unsigned int dwell_ms;              // Hold after lock, e.g. for the receiver to capture
+} budc_sweep_plan;
+
+typedef struct {
+    double freq_hz;
+    int device;                         // Index into the device array, -1 if no model covers it
+    bool locked;
+    bool stolen;                        // Taken over from another device's share
+    double retune_ms;                   // Set command to lock, or to the timeout
+    double time_ms;                     // Step start, relative to the start of the sweep
+} budc_sweep_point;
+
+typedef void (*budc_sweep_fn)(const budc_sweep_point* point, void* user_data);  // Serialised across devices
+
+size_t budc_sweep_step_count(const budc_sweep_plan* plan);
+// points is indexed by step and needs budc_sweep_step_count entries. Returns
+// -1 if any step did not lock or no device could tune it.
+int budc_sweep_run(budc_device** devs, int count, const budc_sweep_plan* plan,
+                   budc_sweep_point* points, size_t max_points, budc_sweep_fn on_point, void* user_data);
+
+// Lock-time characterisation (budc_lockprof.c): hop between every ordered
+// pair of freqs_hz, repeats times, timing set command to lock, and write the
+// matrix with summary statistics to path. Returns 0, 1 if some hops did not
+// lock, -1 on error. on_hop gets lock_ms < 0 for a failed hop.
+typedef void (*budc_charz_fn)(double from_hz, double to_hz, double lock_ms, void* user_data);
+int budc_characterize_lock(budc_device* dev, const double* freqs_hz, int n, int repeats, const char* path,
+                           budc_charz_fn on_hop, void* user_data);
+// Use a profile written by budc_characterize_lock as the prior for lock waits
+// and sweep planning on this handle. NULL path drops it.
+int budc_load_lock_profile(budc_device* dev, const char* path);
+
+// Warm start (budc_warm.c): what the handle has learnt about its unit (sync
+// mode, temperature support, lock time, last commanded frequency and power)
+// and its counters, saved to path and restored after the next connect.
+// Restore returns 1 and changes nothing if the file is for another unit.
+int budc_save_state(budc_device* dev, const char* path);
+int budc_restore_state(budc_device* dev, const char* path);
+
+// Power calibration (budc_cal.c): frequency to power-level offset, with
+// optional temperature bands, read from a file or added in code. With a
+// table loaded, power levels given to the setters are nominal and the
+// device gets them corrected for the frequency. A retune re-sends the last
+// nominal level, corrected for the new frequency, in the same write.
+typedef struct {
+    double freq_hz;
+    double offset;                     // Added to the nominal power level
+} budc_cal_point;
+
+// path.<serial> is read instead of path when it exists. Returns 1 and
+// changes nothing if the file names another unit. NULL path drops the table.
+int budc_load_calibration(budc_device* dev, const char* path);
+// Band for filtered temperatures in [min_c, max_c); the first band added is
+// used while no temperature is known
+int budc_add_calibration_band(budc_device* dev, double min_c, double max_c, const budc_cal_point* points, int n);
+int budc_calibration_offset(budc_device* dev, double freq_hz, double* offset);  // No I/O; -1 without a table
+// A one-band table of its own, looked up as a unit's would be, for tools
+// that need no unit (budc_cli --bench-cal)
+typedef struct budc_cal_table budc_cal_table;
+budc_cal_table* budc_cal_table_create(const budc_cal_point* points, int n);
+double budc_cal_table_offset(const budc_cal_table* table, double freq_hz);
+void budc_cal_table_free(budc_cal_table* table);
+
+// Logging (budc_log.c). Records are logfmt lines (t_ms=... level=...
+// event=... and fields), written by a background thread to stderr or to a
+// sink. The level starts from the BUDC_LOG environment variable (error,
+// warn, info, debug or trace; default warn) and can be changed at any time.
+typedef enum {
+    BUDC_LOG_ERROR = 0,
+    BUDC_LOG_WARN,
+    BUDC_LOG_INFO,
+    BUDC_LOG_DEBUG,                // Connections, state changes, recoveries
+    BUDC_LOG_TRACE                 // Every exchange on the port
+} budc_log_level;
+
+typedef void (*budc_log_sink)(budc_log_level level, const char* line, void* user_data);
+
+typedef struct {
+    unsigned long written;
+    unsigned long dropped;         // The writer fell behind and the queue was full
+    unsigned long suppressed;      // Over a call site's rate limit
+} budc_log_stats;
+
+void budc_log_set_level(budc_log_level level);
+budc_log_level budc_log_get_level(void);
+int budc_log_parse_level(const char* name, budc_log_level* level);  // -1 if unknown
+void budc_log_set_sink(budc_log_sink sink, void* user_data);  // Runs on the writer thread; NULL: stderr
+void budc_log_flush(void);  // Writes out everything logged so far
+void budc_log_get_stats(budc_log_stats* stats);
+
+// Operation complete
+void budc_set_sync_mode(budc_device* dev, budc_sync_mode mode);
+budc_sync_mode budc_get_sync_mode(budc_device* dev);
+int budc_wait_operation_complete(budc_device* dev);
+
 // Getters
 int budc_get_identity(budc_device* dev, char* buffer, size_t len);
 int budc_get_frequency_ghz(budc_device* dev, double* freq_ghz);
 int budc_get_lock_status(budc_device* dev, bool* is_locked);
 int budc_get_temperature_c(budc_device* dev, float* temp_c);
+// Instant: last background-filtered temperature and its age, no I/O.
+// Returns -1 until a sample exists (needs budc_monitor_start or a getter call).
+int budc_get_temperature_filtered(budc_device* dev, float* temp_c, double* age_ms);
+bool budc_temperature_supported(budc_device* dev);  // False once the unit is known to lack TEMP?
 int budc_get_power_level(budc_device* dev, int* power_level);
 
 // Setters
@@ -48,12 +388,16 @@ int budc_set_frequency_ghz(budc_device* dev, double freq_ghz);
 int budc_set_frequency_mhz(budc_device* dev, double freq_mhz);
 int budc_set_frequency_hz(budc_device* dev, double freq_hz);
 int budc_set_power_level(budc_device* dev, int power_level);
-int budc_save_settings(budc_device* dev);
+int budc_apply_settings(budc_device* dev, double freq_hz, int power_level);  // Negative skips that setting
+int budc_save_settings(budc_device* dev);  // Only marks the settings dirty under a save policy
 int budc_preset(budc_device* dev);
 
 // Robust High-Level Functions
 int budc_wait_for_lock(budc_device* dev, unsigned int timeout_ms);
 int budc_set_frequency_and_wait(budc_device* dev, double freq_ghz, unsigned int timeout_ms);
 
+// Utilities
+double budc_now_ms(void);  // Monotonic clock in milliseconds
+void budc_sleep_ms(unsigned int milliseconds);
 
 #endif // BUDC_SCPI_H
\ No newline at end of file
@@ -0,0 +1,625 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Sequencer: a line-oriented test language compiled to a flat instruction
+// array with resolved jumps, then run against an open handle.
+//
+//   freq <f>[GHz|MHz|kHz|Hz]      Set frequency (bare number is GHz)
+//   power <level>                 Set power level
+//   preset | save                 PRESET / SAVE
+//   wait <ms>                     Sleep, relative to the end of the last step
+//   at <ms>                       Sleep until <ms> after the start of the run
+//   period <ms>                   Drift-free pacing: each pass waits for the next slot
+//   waitlock [timeout_ms]         Wait for PLL lock (default 5000)
+//   read temp|dtemp|freq|power|lock   Read and log a value
+//   until <cond> [timeout <ms>] [every <ms>]   Poll until the condition holds
+//   cmd "<scpi>"                  Raw command, queries log their reply
+//   log "<text>" | fail "<text>" | stop
+//   repeat [n] ... end            Loop n times, or until break without n
+//   break
+//   if <cond> ... [else ...] end
+//
+// Conditions are "<var> <op> <number>" with op one of < <= > >= == !=, or
+// one of the words locked, unlocked, ok, failed. Device variables (temp,
+// dtemp, freq, power, lock) are read when the condition is evaluated; dtemp
+// is the absolute change since the previous temperature reading. ok is the
+// result of the previous step, latency its duration, elapsed the run time.
+//
+// Consecutive freq and power lines compile to one instruction, sent as a
+// single write with one operation-complete query.
+
+#include "budc_internal.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define SEQ_MAX_DEPTH 16           // Nested repeat / if blocks
+#define SEQ_MAX_BREAKS 16          // break statements per loop
+#define SEQ_SPIN_MS 2.0            // Final stretch of a wait done in short naps
+#define SEQ_SLEEP_SLICE_MS 100     // Longest single sleep, bounds cancel latency
+
+typedef enum {
+    OP_APPLY = 0, OP_PRESET, OP_SAVE, OP_WAIT, OP_AT, OP_PERIOD, OP_WAITLOCK, OP_READ, OP_UNTIL,
+    OP_CMD, OP_LOG, OP_FAIL, OP_STOP, OP_BRANCH, OP_JUMP, OP_LOOP_INIT, OP_LOOP
+} seq_opcode;
+
+typedef enum { VAR_TEMP = 0, VAR_DTEMP, VAR_FREQ, VAR_POWER, VAR_LOCK, VAR_OK, VAR_LATENCY, VAR_ELAPSED } seq_var;
+typedef enum { CMP_LT = 0, CMP_LE, CMP_GT, CMP_GE, CMP_EQ, CMP_NE } seq_cmp;
+
+typedef struct {
+    seq_var var;
+    seq_cmp cmp;
+    double value;
+} seq_cond;
+
+typedef struct {
+    seq_opcode op;
+    int line;
+    char text[64];
+    double a, b;                   // Operands: freq/power, ms, count, timeout/every
+    seq_cond cond;
+    int target;                    // Jump target, or loop counter slot for OP_LOOP
+    char str[128];                 // cmd / log / fail text
+} seq_instr;
+
+struct budc_seq {
+    seq_instr* code;
+    int count, capacity;
+    volatile int cancel;
+};
+
+static const char* var_names[] = { "temp", "dtemp", "freq", "power", "lock", "ok", "latency", "elapsed" };
+
+// --- COMPILER ---
+typedef enum { BLOCK_REPEAT, BLOCK_IF } block_kind;
+
+typedef struct {
+    block_kind kind;
+    int start;                     // REPEAT: LOOP_INIT index; IF: BRANCH index
+    int else_jump;                 // IF: JUMP over the else part, -1 without else
+    int breaks[SEQ_MAX_BREAKS];
+    int break_count;
+} seq_block;
+
+typedef struct {
+    budc_seq* seq;
+    int line;
+    int barrier;                   // Latest index some jump lands on; no merging across it
+    seq_block blocks[SEQ_MAX_DEPTH];
+    int depth;
+    char* error;
+    size_t error_len;
+} seq_compiler;
+
+static int compile_error(seq_compiler* c, const char* message) {
+    if (c->error && c->error_len) snprintf(c->error, c->error_len, "line %d: %s", c->line, message);
+    return -1;
+}
+
+static seq_instr* emit(seq_compiler* c, seq_opcode op, const char* text) {
+    budc_seq* seq = c->seq;
+    if (seq->count == seq->capacity) {
+        int capacity = seq->capacity ? seq->capacity * 2 : 32;
+        seq_instr* code = realloc(seq->code, capacity * sizeof(seq_instr));
+        if (!code) return NULL;
+        seq->code = code;
+        seq->capacity = capacity;
+    }
+    seq_instr* in = &seq->code[seq->count++];
+    memset(in, 0, sizeof(*in));
+    in->op = op;
+    in->line = c->line;
+    snprintf(in->text, sizeof(in->text), "%s", text);
+    return in;
+}
+
+// Marks the next instruction as a jump destination
+static int here(seq_compiler* c) {
+    c->barrier = c->seq->count;
+    return c->seq->count;
+}
+
+static char* skip_space(char* p) {
+    while (*p && isspace((unsigned char)*p)) p++;
+    return p;
+}
+
+static char* next_word(char** p) {
+    char* start = skip_space(*p);
+    char* end = start;
+    while (*end && !isspace((unsigned char)*end)) end++;
+    if (*end) *end++ = '\0';
+    *p = end;
+    return start;
+}
+
+static int parse_number(const char* word, double* out) {
+    char* end;
+    if (!*word) return -1;
+    *out = strtod(word, &end);
+    return *end ? -1 : 0;
+}
+
+static int parse_frequency_hz(const char* word, double* hz) {
+    static const struct { const char* suffix; double scale; } units[] = {
+        { "GHZ", 1e9 }, { "MHZ", 1e6 }, { "KHZ", 1e3 }, { "HZ", 1.0 }
+    };
+    char* end;
+    double value = strtod(word, &end);
+    if (end == word) return -1;
+    if (!*end) { *hz = value * 1e9; return 0; }
+    for (size_t i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+        if (strlen(end) == strlen(units[i].suffix)) {
+            bool same = true;
+            for (size_t k = 0; end[k]; k++) same = same && toupper((unsigned char)end[k]) == units[i].suffix[k];
+            if (same) { *hz = value * units[i].scale; return 0; }
+        }
+    }
+    return -1;
+}
+
+// Text between double quotes, or the rest of the line
+static int parse_string(char* p, char* out, size_t len) {
+    p = skip_space(p);
+    if (*p == '"') {
+        char* close = strrchr(p + 1, '"');
+        if (!close) return -1;
+        *close = '\0';
+        p++;
+    }
+    if (!*p) return -1;
+    snprintf(out, len, "%s", p);
+    return 0;
+}
+
+static int parse_var(const char* word, seq_var* var) {
+    for (size_t i = 0; i < sizeof(var_names) / sizeof(var_names[0]); i++) {
+        if (strcmp(word, var_names[i]) == 0) { *var = (seq_var)i; return 0; }
+    }
+    return -1;
+}
+
+static int parse_cond(seq_compiler* c, char** p, seq_cond* cond) {
+    static const char* ops[] = { "<", "<=", ">", ">=", "==", "!=" };
+    char* word = next_word(p);
+
+    if (strcmp(word, "locked") == 0) { *cond = (seq_cond){ VAR_LOCK, CMP_EQ, 1.0 }; return 0; }
+    if (strcmp(word, "unlocked") == 0) { *cond = (seq_cond){ VAR_LOCK, CMP_EQ, 0.0 }; return 0; }
+    if (strcmp(word, "ok") == 0) { *cond = (seq_cond){ VAR_OK, CMP_EQ, 1.0 }; return 0; }
+    if (strcmp(word, "failed") == 0) { *cond = (seq_cond){ VAR_OK, CMP_EQ, 0.0 }; return 0; }
+    if (parse_var(word, &cond->var) != 0) return compile_error(c, "unknown variable in condition");
+
+    char* op = next_word(p);
+    int found = -1;
+    for (int i = 0; i < 6; i++) {
+        if (strcmp(op, ops[i]) == 0) found = i;
+    }
+    if (found < 0) return compile_error(c, "expected a comparison (< <= > >= == !=)");
+    cond->cmp = (seq_cmp)found;
+    if (parse_number(next_word(p), &cond->value) != 0) return compile_error(c, "expected a number after the comparison");
+    return 0;
+}
+
+static seq_block* innermost_loop(seq_compiler* c) {
+    for (int i = c->depth - 1; i >= 0; i--) {
+        if (c->blocks[i].kind == BLOCK_REPEAT) return &c->blocks[i];
+    }
+    return NULL;
+}
+
+// Folds a freq or power line into the previous apply when nothing jumps
+// between them, so the pair goes out as one transaction.
+static int compile_apply(seq_compiler* c, const char* text, double freq_hz, double power) {
+    budc_seq* seq = c->seq;
+    seq_instr* prev = seq->count > 0 ? &seq->code[seq->count - 1] : NULL;
+    if (prev && prev->op == OP_APPLY && c->barrier != seq->count
+        && (freq_hz < 0 || prev->a < 0) && (power < 0 || prev->b < 0)) {
+        if (freq_hz >= 0) prev->a = freq_hz;
+        if (power >= 0) prev->b = power;
+        size_t used = strlen(prev->text);
+        snprintf(prev->text + used, sizeof(prev->text) - used, "; %s", text);
+        return 0;
+    }
+    seq_instr* in = emit(c, OP_APPLY, text);
+    if (!in) return compile_error(c, "out of memory");
+    in->a = freq_hz;
+    in->b = power;
+    return 0;
+}
+
+static int compile_line(seq_compiler* c, char* line) {
+    char text[64];
+    char* p = line;
+    snprintf(text, sizeof(text), "%s", skip_space(line));
+    char* word = next_word(&p);
+    for (char* k = word; *k; k++) *k = (char)tolower((unsigned char)*k);
+    seq_instr* in = NULL;
+    double number;
+
+    if (strcmp(word, "freq") == 0) {
+        double hz;
+        if (parse_frequency_hz(next_word(&p), &hz) != 0 || hz < 0) return compile_error(c, "bad frequency");
+        return compile_apply(c, text, hz, -1.0);
+    }
+    if (strcmp(word, "power") == 0) {
+        if (parse_number(next_word(&p), &number) != 0 || number < 0) return compile_error(c, "bad power level");
+        return compile_apply(c, text, -1.0, number);
+    }
+    if (strcmp(word, "preset") == 0) in = emit(c, OP_PRESET, text);
+    else if (strcmp(word, "save") == 0) in = emit(c, OP_SAVE, text);
+    else if (strcmp(word, "stop") == 0) in = emit(c, OP_STOP, text);
+    else if (strcmp(word, "wait") == 0 || strcmp(word, "at") == 0 || strcmp(word, "period") == 0) {
+        if (parse_number(next_word(&p), &number) != 0 || number < 0) return compile_error(c, "expected milliseconds");
+        in = emit(c, word[0] == 'w' ? OP_WAIT : word[0] == 'a' ? OP_AT : OP_PERIOD, text);
+        if (in) in->a = number;
+    } else if (strcmp(word, "waitlock") == 0) {
+        char* arg = next_word(&p);
+        number = 5000;
+        if (*arg && parse_number(arg, &number) != 0) return compile_error(c, "expected a timeout in milliseconds");
+        in = emit(c, OP_WAITLOCK, text);
+        if (in) in->a = number;
+    } else if (strcmp(word, "read") == 0) {
+        seq_var var;
+        if (parse_var(next_word(&p), &var) != 0 || var > VAR_LOCK) return compile_error(c, "read takes temp, dtemp, freq, power or lock");
+        in = emit(c, OP_READ, text);
+        if (in) in->cond.var = var;
+    } else if (strcmp(word, "until") == 0) {
+        seq_cond cond;
+        if (parse_cond(c, &p, &cond) != 0) return -1;
+        double timeout = 10000, every = 100;
+        for (char* opt = next_word(&p); *opt; opt = next_word(&p)) {
+            double* dst = strcmp(opt, "timeout") == 0 ? &timeout : strcmp(opt, "every") == 0 ? &every : NULL;
+            if (!dst || parse_number(next_word(&p), dst) != 0) return compile_error(c, "expected timeout <ms> or every <ms>");
+        }
+        in = emit(c, OP_UNTIL, text);
+        if (in) { in->cond = cond; in->a = timeout; in->b = every; }
+    } else if (strcmp(word, "cmd") == 0 || strcmp(word, "log") == 0 || strcmp(word, "fail") == 0) {
+        char str[128];
+        if (parse_string(p, str, sizeof(str)) != 0) {
+            if (word[0] != 'f') return compile_error(c, "expected text");
+            snprintf(str, sizeof(str), "failed");
+        }
+        in = emit(c, word[0] == 'c' ? OP_CMD : word[0] == 'l' ? OP_LOG : OP_FAIL, text);
+        if (in) snprintf(in->str, sizeof(in->str), "%s", str);
+    } else if (strcmp(word, "repeat") == 0) {
+        char* arg = next_word(&p);
+        number = -1;
+        if (*arg && (parse_number(arg, &number) != 0 || number < 1)) return compile_error(c, "repeat count must be at least 1");
+        if (c->depth == SEQ_MAX_DEPTH) return compile_error(c, "blocks nested too deep");
+        in = emit(c, OP_LOOP_INIT, text);
+        if (!in) return compile_error(c, "out of memory");
+        in->a = number;
+        seq_block* b = &c->blocks[c->depth++];
+        memset(b, 0, sizeof(*b));
+        b->kind = BLOCK_REPEAT;
+        b->start = c->seq->count - 1;
+        here(c);
+        return 0;
+    } else if (strcmp(word, "if") == 0) {
+        seq_cond cond;
+        if (parse_cond(c, &p, &cond) != 0) return -1;
+        if (c->depth == SEQ_MAX_DEPTH) return compile_error(c, "blocks nested too deep");
+        in = emit(c, OP_BRANCH, text);
+        if (!in) return compile_error(c, "out of memory");
+        in->cond = cond;
+        seq_block* b = &c->blocks[c->depth++];
+        memset(b, 0, sizeof(*b));
+        b->kind = BLOCK_IF;
+        b->start = c->seq->count - 1;
+        b->else_jump = -1;
+        return 0;
+    } else if (strcmp(word, "else") == 0) {
+        seq_block* b = c->depth ? &c->blocks[c->depth - 1] : NULL;
+        if (!b || b->kind != BLOCK_IF || b->else_jump >= 0) return compile_error(c, "else without if");
+        in = emit(c, OP_JUMP, text);
+        if (!in) return compile_error(c, "out of memory");
+        b->else_jump = c->seq->count - 1;
+        c->seq->code[b->start].target = here(c);
+        return 0;
+    } else if (strcmp(word, "end") == 0) {
+        if (c->depth == 0) return compile_error(c, "end without repeat or if");
+        seq_block* b = &c->blocks[--c->depth];
+        if (b->kind == BLOCK_IF) {
+            int end = here(c);
+            if (b->else_jump >= 0) c->seq->code[b->else_jump].target = end;
+            else c->seq->code[b->start].target = end;
+            return 0;
+        }
+        in = emit(c, OP_LOOP, text);
+        if (!in) return compile_error(c, "out of memory");
+        in->target = b->start;
+        int end = here(c);
+        for (int i = 0; i < b->break_count; i++) c->seq->code[b->breaks[i]].target = end;
+        return 0;
+    } else if (strcmp(word, "break") == 0) {
+        seq_block* loop = innermost_loop(c);
+        if (!loop) return compile_error(c, "break outside repeat");
+        if (loop->break_count == SEQ_MAX_BREAKS) return compile_error(c, "too many breaks in one loop");
+        in = emit(c, OP_JUMP, text);
+        if (in) loop->breaks[loop->break_count++] = c->seq->count - 1;
+    } else {
+        return compile_error(c, "unknown statement");
+    }
+    if (!in) return compile_error(c, "out of memory");
+    if (*skip_space(p) && in->op != OP_CMD && in->op != OP_LOG && in->op != OP_FAIL) {
+        return compile_error(c, "unexpected text after statement");
+    }
+    return 0;
+}
+
+budc_seq* budc_seq_compile(const char* source, char* error, size_t error_len) {
+    if (!source) return NULL;
+    budc_seq* seq = calloc(1, sizeof(budc_seq));
+    if (!seq) return NULL;
+    seq_compiler c;
+    memset(&c, 0, sizeof(c));
+    c.seq = seq;
+    c.barrier = -1;
+    c.error = error;
+    c.error_len = error_len;
+
+    const char* p = source;
+    int result = 0;
+    while (*p && result == 0) {
+        char line[256];
+        size_t len = strcspn(p, "\n");
+        c.line++;
+        snprintf(line, sizeof(line), "%.*s", (int)(len < sizeof(line) - 1 ? len : sizeof(line) - 1), p);
+        p += len + (p[len] == '\n');
+
+        bool quoted = false;
+        for (char* k = line; *k; k++) {
+            if (*k == '"') quoted = !quoted;
+            else if (*k == '#' && !quoted) { *k = '\0'; break; }
+        }
+        char* end = line + strlen(line);
+        while (end > line && isspace((unsigned char)end[-1])) *--end = '\0';
+        if (*skip_space(line)) result = compile_line(&c, line);
+    }
+    if (result == 0 && c.depth > 0) result = compile_error(&c, "missing end");
+    if (result != 0) { budc_seq_free(seq); return NULL; }
+    BUDC_LOG(BUDC_LOG_DEBUG, "seq_compiled", "instructions=%d", seq->count);
+    return seq;
+}
+
+void budc_seq_free(budc_seq* seq) {
+    if (!seq) return;
+    free(seq->code);
+    free(seq);
+}
+
+void budc_seq_cancel(budc_seq* seq) {
+    if (seq) seq->cancel = 1;
+}
+
+// --- RUNNER ---
+typedef struct {
+    budc_device* dev;
+    budc_seq* seq;
+    double start_ms;
+    double* slots;                 // Per instruction: loop counters, period anchors
+    bool ok;
+    double latency_ms;
+    bool have_temp;
+    double last_temp;
+    char reply[128];
+} seq_run;
+
+// Coarse sleeps in slices (so cancel is noticed), then short naps for the
+// last couple of milliseconds to land close to the deadline.
+static void sleep_until(seq_run* run, double deadline) {
+    for (;;) {
+        double left = deadline - scpi_now_ms();
+        if (left <= 0 || run->seq->cancel) return;
+        if (left > SEQ_SPIN_MS) {
+            double chunk = left - SEQ_SPIN_MS;
+            scpi_delay(chunk > SEQ_SLEEP_SLICE_MS ? SEQ_SLEEP_SLICE_MS : (int)chunk);
+        } else {
+            scpi_delay(0);
+        }
+    }
+}
+
+static int read_var(seq_run* run, seq_var var, double* out) {
+    double freq_ghz;
+    float temp_c;
+    int power;
+    bool locked;
+
+    switch (var) {
+    case VAR_TEMP:
+    case VAR_DTEMP:
+        if (budc_get_temperature_c(run->dev, &temp_c) != 0) return -1;
+        *out = var == VAR_TEMP ? temp_c : run->have_temp ? temp_c - run->last_temp : 0.0;
+        if (*out < 0 && var == VAR_DTEMP) *out = -*out;
+        {
+            bool had = run->have_temp;
+            run->have_temp = true;
+            run->last_temp = temp_c;
+            if (var == VAR_DTEMP && !had) return -1;  // No change to report from a single reading
+        }
+        return 0;
+    case VAR_FREQ:
+        if (budc_get_frequency_ghz(run->dev, &freq_ghz) != 0) return -1;
+        *out = freq_ghz;
+        return 0;
+    case VAR_POWER:
+        if (budc_get_power_level(run->dev, &power) != 0) return -1;
+        *out = power;
+        return 0;
+    case VAR_LOCK:
+        if (budc_get_lock_status(run->dev, &locked) != 0) return -1;
+        *out = locked;
+        return 0;
+    case VAR_OK:      *out = run->ok; return 0;
+    case VAR_LATENCY: *out = run->latency_ms; return 0;
+    case VAR_ELAPSED: *out = scpi_now_ms() - run->start_ms; return 0;
+    }
+    return -1;
+}
+
+static bool eval_cond(seq_run* run, const seq_cond* cond, double* value) {
+    if (read_var(run, cond->var, value) != 0) return false;
+    switch (cond->cmp) {
+    case CMP_LT: return *value < cond->value;
+    case CMP_LE: return *value <= cond->value;
+    case CMP_GT: return *value > cond->value;
+    case CMP_GE: return *value >= cond->value;
+    case CMP_EQ: return *value == cond->value;
+    case CMP_NE: return *value != cond->value;
+    }
+    return false;
+}
+
+int budc_seq_run(budc_device* dev, budc_seq* seq, budc_seq_log_fn log, void* user_data) {
+    if (!budc_is_connected(dev) || !seq) return -1;
+    seq_run run;
+    memset(&run, 0, sizeof(run));
+    run.dev = dev;
+    run.seq = seq;
+    run.ok = true;
+    run.slots = calloc(seq->count ? seq->count : 1, sizeof(double));
+    if (!run.slots) return -1;
+    seq->cancel = 0;
+    run.start_ms = scpi_now_ms();
+
+    int result = 0, pc = 0;
+    while (pc < seq->count) {
+        if (seq->cancel) { result = -1; break; }
+        int index = pc++;
+        const seq_instr* in = &seq->code[index];
+        budc_seq_entry entry;
+        double t0 = scpi_now_ms();
+        bool step_ok = true, logged = true;
+        memset(&entry, 0, sizeof(entry));
+
+        switch (in->op) {
+        case OP_APPLY:
+            step_ok = budc_apply_settings(dev, in->a, in->b >= 0 ? (int)in->b : -1) == 0;
+            break;
+        case OP_PRESET:
+            step_ok = budc_preset(dev) == 0;
+            break;
+        case OP_SAVE:
+            step_ok = budc_save_settings(dev) == 0;
+            break;
+        case OP_WAIT:
+        case OP_AT:
+        case OP_PERIOD: {
+            double deadline = t0 + in->a;
+            if (in->op == OP_AT) deadline = run.start_ms + in->a;
+            if (in->op == OP_PERIOD) {
+                // Anchored to the previous slot rather than to now, so the
+                // time spent in the loop body does not accumulate as drift
+                double* anchor = &run.slots[index];
+                if (*anchor == 0.0 || t0 - *anchor > in->a) *anchor = t0;
+                else *anchor += in->a;
+                deadline = *anchor;
+            }
+            sleep_until(&run, deadline);
+            entry.has_value = true;
+            entry.value = scpi_now_ms() - deadline;  // Overshoot
+            break;
+        }
+        case OP_WAITLOCK:
+            step_ok = budc_wait_for_lock(dev, (unsigned int)in->a) == 0;
+            break;
+        case OP_READ:
+            step_ok = read_var(&run, in->cond.var, &entry.value) == 0;
+            entry.has_value = step_ok;
+            break;
+        case OP_UNTIL: {
+            double deadline = t0 + in->a;
+            for (;;) {
+                step_ok = eval_cond(&run, &in->cond, &entry.value);
+                if (step_ok || seq->cancel || scpi_now_ms() >= deadline) break;
+                double next = scpi_now_ms() + in->b;
+                sleep_until(&run, next < deadline ? next : deadline);
+            }
+            entry.has_value = true;
+            break;
+        }
+        case OP_CMD:
+            run.reply[0] = '\0';
+            step_ok = budc_send_raw_command(dev, in->str, run.reply, sizeof(run.reply)) == 0;
+            if (strchr(in->str, '?')) {
+                char* end;
+                entry.detail = run.reply;
+                entry.value = strtod(run.reply, &end);
+                entry.has_value = step_ok && end != run.reply;
+            }
+            break;
+        case OP_LOG:
+            entry.detail = in->str;
+            break;
+        case OP_FAIL:
+            entry.detail = in->str;
+            step_ok = false;
+            result = -1;
+            pc = seq->count;
+            break;
+        case OP_STOP:
+            pc = seq->count;
+            break;
+        case OP_BRANCH: {
+            bool taken = eval_cond(&run, &in->cond, &entry.value);
+            entry.has_value = true;
+            entry.condition = true;
+            entry.ok = taken;
+            if (!taken) pc = in->target;
+            break;
+        }
+        case OP_JUMP:
+            pc = in->target;
+            logged = false;
+            break;
+        case OP_LOOP_INIT:
+            run.slots[index] = in->a;
+            logged = false;
+            break;
+        case OP_LOOP: {
+            double* remaining = &run.slots[in->target];
+            if (*remaining < 0 || --*remaining > 0) pc = in->target + 1;
+            logged = false;
+            break;
+        }
+        }
+
+        double t1 = scpi_now_ms();
+        // Conditions and pure control flow do not overwrite the step result
+        if (in->op != OP_BRANCH && logged && in->op != OP_LOG && in->op != OP_WAIT
+            && in->op != OP_AT && in->op != OP_PERIOD) {
+            run.ok = step_ok;
+            run.latency_ms = t1 - t0;
+        }
+        if (logged && log) {
+            entry.time_ms = t0 - run.start_ms;
+            entry.duration_ms = t1 - t0;
+            entry.line = in->line;
+            entry.text = in->text;
+            if (in->op != OP_BRANCH) entry.ok = step_ok;
+            log(&entry, user_data);
+        }
+    }
+    free(run.slots);
+    return result;
+}
@@ -0,0 +1,281 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Band sweep split across several converters. The steps are cut into
+// contiguous shares, one per device. A share is sized by the device's
+// measured retune time, and only contains frequencies the model can tune.
+// Every device runs its share on its own thread. A device that runs out of
+// work takes the far end of the share that would otherwise finish last. The
+// amount taken is sized so that both finish together. A slow unit therefore
+// ends up with less of the band, and a unit that stops answering hands back
+// everything it has left.
+
+#include "budc_internal.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define SWEEP_MAX_DEVICES 64
+#define SWEEP_DEFAULT_RETUNE_MS 200.0   // Prior for a unit that has not locked through this handle yet
+#define SWEEP_DEFAULT_LOCK_MS 5000
+#define SWEEP_RETUNE_ALPHA 0.3          // Weight of the newest step in a device's retune average
+#define SWEEP_MAX_FAILURES 3            // Consecutive failed sets before a device is given up on
+
+typedef struct sweep_state sweep_state;
+
+typedef struct {
+    sweep_state* run;
+    budc_device* dev;
+    int index;
+    double min_hz, max_hz;         // Tunable range, 0 and 0 when the model is unknown
+    int* steps;                    // Step indices owned by this device; [head, tail) are left
+    int head, tail;
+    double retune_ms;              // Average set-to-lock time, guarded by run->lock
+    bool stolen;                   // The current share was taken from another device
+    bool gave_up;                  // Stopped answering; its steps are free for the taking
+    budc_thread thread;
+    bool started;
+} sweep_worker;
+
+struct sweep_state {
+    budc_mutex lock;               // Guards the queues, the points and the callback
+    const budc_sweep_plan* plan;
+    sweep_worker workers[SWEEP_MAX_DEVICES];
+    int count;
+    budc_sweep_point* points;
+    size_t point_count;
+    budc_sweep_fn on_point;
+    void* user_data;
+    double start_ms;
+};
+
+size_t budc_sweep_step_count(const budc_sweep_plan* plan) {
+    if (!plan || plan->step_hz <= 0 || plan->stop_hz < plan->start_hz) return 0;
+    return (size_t)((plan->stop_hz - plan->start_hz) / plan->step_hz + 1e-6) + 1;
+}
+
+static double step_freq(const budc_sweep_plan* plan, size_t i) {
+    return plan->start_hz + (double)i * plan->step_hz;
+}
+
+// Lotus model names carry their band, e.g. BUDC3G20GE covers 3 to 20 GHz.
+// Anything else is not restricted.
+static void model_range(budc_device* dev, double* min_hz, double* max_hz) {
+    char identity[256], product[64] = "";
+    *min_hz = *max_hz = 0.0;
+    if (budc_get_identity(dev, identity, sizeof(identity)) != 0) return;
+    if (sscanf(identity, "%*[^,],%63[^,]", product) != 1) return;
+    for (const char* p = product; *p; p++) {
+        double lo, hi;
+        char g1, g2;
+        if (isdigit((unsigned char)*p) && (p == product || !isdigit((unsigned char)p[-1]))
+            && sscanf(p, "%lf%c%lf%c", &lo, &g1, &hi, &g2) == 4
+            && toupper((unsigned char)g1) == 'G' && toupper((unsigned char)g2) == 'G' && hi > lo) {
+            *min_hz = lo * 1e9;
+            *max_hz = hi * 1e9;
+            return;
+        }
+    }
+}
+
+static bool can_tune(const sweep_worker* w, double freq_hz) {
+    if (w->max_hz <= 0) return true;
+    return freq_hz >= w->min_hz && freq_hz <= w->max_hz;
+}
+
+// Cuts the steps into runs tunable by the same set of devices, then splits
+// each run into contiguous shares in proportion to retune speed
+static void partition(sweep_state* run) {
+    size_t i = 0;
+    while (i < run->point_count) {
+        unsigned long long mask = 0;
+        for (int d = 0; d < run->count; d++) {
+            if (can_tune(&run->workers[d], step_freq(run->plan, i))) mask |= 1ULL << d;
+        }
+        size_t end = i + 1;
+        while (end < run->point_count) {
+            unsigned long long next = 0;
+            for (int d = 0; d < run->count; d++) {
+                if (can_tune(&run->workers[d], step_freq(run->plan, end))) next |= 1ULL << d;
+            }
+            if (next != mask) break;
+            end++;
+        }
+        if (mask == 0) { i = end; continue; }  // Nobody covers these, they stay device -1
+
+        double total = 0.0;
+        for (int d = 0; d < run->count; d++) {
+            if (mask & (1ULL << d)) total += 1.0 / run->workers[d].retune_ms;
+        }
+        double share = 0.0;
+        size_t from = i;
+        for (int d = 0; d < run->count; d++) {
+            if (!(mask & (1ULL << d))) continue;
+            sweep_worker* w = &run->workers[d];
+            share += 1.0 / w->retune_ms;
+            size_t to = (mask >> d) == 1 ? end : i + (size_t)((double)(end - i) * share / total + 0.5);
+            for (size_t s = from; s < to; s++) w->steps[w->tail++] = (int)s;
+            from = to;
+        }
+        i = end;
+    }
+}
+
+// Called with run->lock held and the thief's queue empty. Picks the share
+// that would finish last and moves its far end over.
+static bool steal(sweep_state* run, sweep_worker* thief) {
+    sweep_worker* victim = NULL;
+    double worst = 0.0;
+    for (int d = 0; d < run->count; d++) {
+        sweep_worker* w = &run->workers[d];
+        int left = w->tail - w->head;
+        if (w == thief || left == 0 || !can_tune(thief, step_freq(run->plan, w->steps[w->tail - 1]))) continue;
+        if (!w->gave_up && left < 2) continue;  // Its owner is about to do it
+        double finish = w->gave_up ? 1e300 : left * w->retune_ms;
+        if (finish > worst) { worst = finish; victim = w; }
+    }
+    if (!victim) return false;
+
+    // Both finish together when thief_steps * thief_ms == victim_steps * victim_ms
+    int left = victim->tail - victim->head;
+    int take = left;
+    if (!victim->gave_up) {
+        take = (int)(left * victim->retune_ms / (victim->retune_ms + thief->retune_ms) + 0.5);
+        if (take < 1) take = 1;
+        if (take >= left) take = left - 1;
+    }
+    int first = victim->tail;
+    while (take > 0 && first > victim->head && can_tune(thief, step_freq(run->plan, victim->steps[first - 1]))) {
+        first--;
+        take--;
+    }
+    int moved = victim->tail - first;
+    memcpy(thief->steps, victim->steps + first, moved * sizeof(int));
+    thief->head = 0;
+    thief->tail = moved;
+    victim->tail = first;
+    thief->stolen = true;
+    BUDC_LOG(BUDC_LOG_DEBUG, "sweep_steal", "device=%d steps=%d from=%d", thief->index, moved, victim->index);
+    return moved > 0;
+}
+
+static void* sweep_worker_main(void* arg) {
+    sweep_worker* w = arg;
+    sweep_state* run = w->run;
+    const budc_sweep_plan* plan = run->plan;
+    unsigned int lock_ms = plan->lock_timeout_ms ? plan->lock_timeout_ms : SWEEP_DEFAULT_LOCK_MS;
+    int failures = 0;
+    bool power_set = plan->power_level < 0;
+
+    for (;;) {
+        budc_mutex_lock(&run->lock);
+        if (w->head == w->tail && !steal(run, w)) {
+            budc_mutex_unlock(&run->lock);
+            break;
+        }
+        int step = w->steps[w->head++];
+        bool stolen = w->stolen;
+        budc_mutex_unlock(&run->lock);
+
+        // Power goes with the first frequency, as one exchange
+        budc_sweep_point point;
+        point.freq_hz = step_freq(plan, step);
+        point.device = w->index;
+        point.stolen = stolen;
+        point.time_ms = budc_now_ms() - run->start_ms;
+        double t0 = budc_now_ms();
+        bool set = budc_apply_settings(w->dev, point.freq_hz, power_set ? -1 : plan->power_level) == 0;
+        if (set) power_set = true;
+        point.locked = set && budc_wait_for_lock(w->dev, lock_ms) == 0;
+        point.retune_ms = budc_now_ms() - t0;
+        if (point.locked && plan->dwell_ms) budc_sleep_ms(plan->dwell_ms);
+        failures = set ? 0 : failures + 1;
+
+        budc_mutex_lock(&run->lock);
+        run->points[step] = point;
+        if (set) w->retune_ms += SWEEP_RETUNE_ALPHA * (point.retune_ms + plan->dwell_ms - w->retune_ms);
+        if (failures >= SWEEP_MAX_FAILURES) w->gave_up = true;
+        if (run->on_point) run->on_point(&point, run->user_data);
+        budc_mutex_unlock(&run->lock);
+        if (w->gave_up) break;
+    }
+    return NULL;
+}
+
+int budc_sweep_run(budc_device** devs, int count, const budc_sweep_plan* plan,
+                   budc_sweep_point* points, size_t max_points, budc_sweep_fn on_point, void* user_data) {
+    size_t steps = budc_sweep_step_count(plan);
+    if (!devs || count <= 0 || count > SWEEP_MAX_DEVICES || !points || steps == 0 || steps > max_points) return -1;
+
+    sweep_state* run = calloc(1, sizeof(*run));
+    if (!run) return -1;
+    budc_mutex_init(&run->lock);
+    run->plan = plan;
+    run->count = count;
+    run->points = points;
+    run->point_count = steps;
+    run->on_point = on_point;
+    run->user_data = user_data;
+
+    int result = 0;
+    for (int d = 0; d < count; d++) {
+        sweep_worker* w = &run->workers[d];
+        w->run = run;
+        w->dev = devs[d];
+        w->index = d;
+        w->steps = malloc(steps * sizeof(int));
+        if (!w->steps) result = -1;
+        model_range(w->dev, &w->min_hz, &w->max_hz);
+        budc_mutex_lock(&w->dev->state_lock);
+        // A measured profile for this step size beats the running average
+        double mid = step_freq(plan, steps / 2);
+        double profiled = budc_lock_profile_expect(w->dev, mid, mid + plan->step_hz);
+        w->retune_ms = profiled > 0 ? profiled : w->dev->lock_time_ema_ms > 0 ? w->dev->lock_time_ema_ms : SWEEP_DEFAULT_RETUNE_MS;
+        budc_mutex_unlock(&w->dev->state_lock);
+    }
+
+    if (result == 0) {
+        for (size_t i = 0; i < steps; i++) {
+            memset(&points[i], 0, sizeof(points[i]));
+            points[i].freq_hz = step_freq(plan, i);
+            points[i].device = -1;
+        }
+        partition(run);
+        run->start_ms = budc_now_ms();
+        for (int d = 0; d < count; d++) {
+            sweep_worker* w = &run->workers[d];
+            w->started = budc_thread_create(&w->thread, sweep_worker_main, w) == 0;
+            if (!w->started) sweep_worker_main(w);  // Could not spawn, run it here instead
+        }
+        for (int d = 0; d < count; d++) {
+            if (run->workers[d].started) budc_thread_join(run->workers[d].thread);
+        }
+        for (size_t i = 0; i < steps; i++) {
+            if (!points[i].locked) result = -1;
+        }
+    }
+
+    for (int d = 0; d < count; d++) free(run->workers[d].steps);
+    budc_mutex_destroy(&run->lock);
+    free(run);
+    return result;
+}
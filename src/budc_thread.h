@@ -0,0 +1,150 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Minimal threading primitives: Win32 SRW locks and condition variables on
+// Windows (MSVC has no pthreads), pthreads everywhere else.
+
+#ifndef BUDC_THREAD_H
+#define BUDC_THREAD_H
+
+#include <stdlib.h>
+
+#ifdef _WIN32
+    #include <windows.h>
+    #include <process.h>
+#else
+    #include <pthread.h>
+    #include <sys/time.h>
+    #include <time.h>
+    #include <errno.h>
+#endif
+
+typedef void* (*budc_thread_fn)(void* arg);
+
+#if defined(_MSC_VER)
+#define BUDC_THREAD_LOCAL __declspec(thread)
+#else
+#define BUDC_THREAD_LOCAL _Thread_local
+#endif
+
+#ifdef _WIN32
+
+typedef SRWLOCK budc_mutex;
+typedef CONDITION_VARIABLE budc_cond;
+typedef HANDLE budc_thread;
+#define BUDC_MUTEX_INIT SRWLOCK_INIT
+#define BUDC_COND_INIT CONDITION_VARIABLE_INIT
+
+static inline void budc_mutex_init(budc_mutex* m) { InitializeSRWLock(m); }
+static inline void budc_mutex_destroy(budc_mutex* m) { (void)m; }
+static inline void budc_mutex_lock(budc_mutex* m) { AcquireSRWLockExclusive(m); }
+static inline void budc_mutex_unlock(budc_mutex* m) { ReleaseSRWLockExclusive(m); }
+
+static inline void budc_cond_init(budc_cond* c) { InitializeConditionVariable(c); }
+static inline void budc_cond_destroy(budc_cond* c) { (void)c; }
+static inline void budc_cond_wait(budc_cond* c, budc_mutex* m) { SleepConditionVariableSRW(c, m, INFINITE, 0); }
+// Returns 0 when signalled, 1 on timeout
+static inline int budc_cond_timedwait(budc_cond* c, budc_mutex* m, unsigned int timeout_ms) {
+    return SleepConditionVariableSRW(c, m, timeout_ms, 0) ? 0 : 1;
+}
+static inline void budc_cond_signal(budc_cond* c) { WakeConditionVariable(c); }
+static inline void budc_cond_broadcast(budc_cond* c) { WakeAllConditionVariable(c); }
+
+typedef struct { budc_thread_fn fn; void* arg; } budc_thread_start;
+
+static inline unsigned __stdcall budc_thread_trampoline(void* p) {
+    budc_thread_start start = *(budc_thread_start*)p;
+    free(p);
+    start.fn(start.arg);
+    return 0;
+}
+
+static inline int budc_thread_create(budc_thread* t, budc_thread_fn fn, void* arg) {
+    budc_thread_start* start = (budc_thread_start*)malloc(sizeof(*start));
+    if (!start) return -1;
+    start->fn = fn;
+    start->arg = arg;
+    *t = (HANDLE)_beginthreadex(NULL, 0, budc_thread_trampoline, start, 0, NULL);
+    if (!*t) { free(start); return -1; }
+    return 0;
+}
+static inline void budc_thread_join(budc_thread t) { WaitForSingleObject(t, INFINITE); CloseHandle(t); }
+static inline void budc_thread_detach(budc_thread t) { CloseHandle(t); }
+static inline int budc_thread_is_current(budc_thread t) { return GetThreadId(t) == GetCurrentThreadId(); }
+
+// Word-sized atomics for the few lock-free paths; every operation is a full barrier
+typedef volatile LONG budc_atomic;
+static inline long budc_atomic_load(budc_atomic* a) { return InterlockedCompareExchange(a, 0, 0); }
+static inline void budc_atomic_store(budc_atomic* a, long v) { InterlockedExchange(a, v); }
+static inline long budc_atomic_exchange(budc_atomic* a, long v) { return InterlockedExchange(a, v); }
+static inline long budc_atomic_add(budc_atomic* a, long v) { return InterlockedExchangeAdd(a, v) + v; }
+static inline int budc_atomic_cas(budc_atomic* a, long expected, long desired) {
+    return InterlockedCompareExchange(a, desired, expected) == expected;
+}
+
+#else
+
+typedef pthread_mutex_t budc_mutex;
+typedef pthread_cond_t budc_cond;
+typedef pthread_t budc_thread;
+#define BUDC_MUTEX_INIT PTHREAD_MUTEX_INITIALIZER
+#define BUDC_COND_INIT PTHREAD_COND_INITIALIZER
+
+static inline void budc_mutex_init(budc_mutex* m) { pthread_mutex_init(m, NULL); }
+static inline void budc_mutex_destroy(budc_mutex* m) { pthread_mutex_destroy(m); }
+static inline void budc_mutex_lock(budc_mutex* m) { pthread_mutex_lock(m); }
+static inline void budc_mutex_unlock(budc_mutex* m) { pthread_mutex_unlock(m); }
+
+static inline void budc_cond_init(budc_cond* c) { pthread_cond_init(c, NULL); }
+static inline void budc_cond_destroy(budc_cond* c) { pthread_cond_destroy(c); }
+static inline void budc_cond_wait(budc_cond* c, budc_mutex* m) { pthread_cond_wait(c, m); }
+// Returns 0 when signalled, 1 on timeout
+static inline int budc_cond_timedwait(budc_cond* c, budc_mutex* m, unsigned int timeout_ms) {
+    struct timeval now;
+    struct timespec deadline;
+    gettimeofday(&now, NULL);
+    long long nsec = (long long)now.tv_usec * 1000 + (long long)(timeout_ms % 1000) * 1000000;
+    deadline.tv_sec = now.tv_sec + timeout_ms / 1000 + (time_t)(nsec / 1000000000);
+    deadline.tv_nsec = (long)(nsec % 1000000000);
+    return pthread_cond_timedwait(c, m, &deadline) == ETIMEDOUT ? 1 : 0;
+}
+static inline void budc_cond_signal(budc_cond* c) { pthread_cond_signal(c); }
+static inline void budc_cond_broadcast(budc_cond* c) { pthread_cond_broadcast(c); }
+
+static inline int budc_thread_create(budc_thread* t, budc_thread_fn fn, void* arg) {
+    return pthread_create(t, NULL, fn, arg) == 0 ? 0 : -1;
+}
+static inline void budc_thread_join(budc_thread t) { pthread_join(t, NULL); }
+static inline void budc_thread_detach(budc_thread t) { pthread_detach(t); }
+static inline int budc_thread_is_current(budc_thread t) { return pthread_equal(t, pthread_self()); }
+
+// Word-sized atomics for the few lock-free paths; loads acquire, stores release
+typedef volatile long budc_atomic;
+static inline long budc_atomic_load(budc_atomic* a) { return __atomic_load_n(a, __ATOMIC_ACQUIRE); }
+static inline void budc_atomic_store(budc_atomic* a, long v) { __atomic_store_n(a, v, __ATOMIC_RELEASE); }
+static inline long budc_atomic_exchange(budc_atomic* a, long v) { return __atomic_exchange_n(a, v, __ATOMIC_ACQ_REL); }
+static inline long budc_atomic_add(budc_atomic* a, long v) { return __atomic_add_fetch(a, v, __ATOMIC_ACQ_REL); }
+static inline int budc_atomic_cas(budc_atomic* a, long expected, long desired) {
+    return __atomic_compare_exchange_n(a, &expected, desired, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+}
+
+#endif
+
+#endif // BUDC_THREAD_H
@@ -0,0 +1,211 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Warm start. A handle learns a few things about its unit as it goes: how
+// set commands synchronise, whether TEMP? works and how long the PLL takes
+// to lock. It also keeps what was last commanded, which the relock policy
+// puts back, and its counters. A fresh process has to learn all of that
+// again. That costs the *OPC? probe, and on units without a sensor several
+// timed-out TEMP? reads. Until then the relock policy has no target.
+//
+// budc_save_state writes it to a small text file and budc_restore_state
+// puts it back after connecting. The file is tied to the unit's *IDN?
+// reply, so another unit on the same port is not mistaken for the saved
+// one. The commanded frequency and power are only taken back if the unit
+// still reports them; counters are added to the new handle's.
+
+#include "budc_internal.h"
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// --- CONFIGURATION ---
+#define WARM_FREQ_TOLERANCE_HZ 1000.0  // FREQ? reports GHz to a few decimals
+
+static const struct { const char* name; size_t offset; } counters[] = {
+    { "transactions", offsetof(budc_stats, transactions) },
+    { "timeouts", offsetof(budc_stats, timeouts) },
+    { "fast_failures", offsetof(budc_stats, fast_failures) },
+    { "recoveries", offsetof(budc_stats, recoveries) },
+    { "recovery_failures", offsetof(budc_stats, recovery_failures) },
+    { "events_dropped", offsetof(budc_stats, events_dropped) },
+    { "relocks", offsetof(budc_stats, relocks) },
+    { "relock_failures", offsetof(budc_stats, relock_failures) },
+    { "bytes_written", offsetof(budc_stats, bytes_written) },
+    { "bytes_read", offsetof(budc_stats, bytes_read) },
+    { "late_replies", offsetof(budc_stats, late_replies) },
+    { "saves", offsetof(budc_stats, saves) },
+    { "saves_coalesced", offsetof(budc_stats, saves_coalesced) },
+    { "save_failures", offsetof(budc_stats, save_failures) },
+};
+
+static unsigned long* counter(budc_stats* st, size_t i) {
+    return (unsigned long*)((char*)st + counters[i].offset);
+}
+
+static void write_hist(FILE* f, const char* name, const unsigned long* hist, double max_ms) {
+    fprintf(f, "hist %s %.3f", name, max_ms);
+    for (int i = 0; i < BUDC_LATENCY_BUCKETS; i++) fprintf(f, " %lu", hist[i]);
+    fprintf(f, "\n");
+}
+
+// Adds a saved histogram line to hist
+static void merge_hist(const char* s, unsigned long* hist, double* max_ms) {
+    char* end;
+    double max = strtod(s, &end);
+    if (end == s) return;
+    if (max > *max_ms) *max_ms = max;
+    for (int i = 0; i < BUDC_LATENCY_BUCKETS; i++) {
+        s = end;
+        unsigned long n = strtoul(s, &end, 10);
+        if (end == s) break;
+        hist[i] += n;
+    }
+}
+
+int budc_save_state(budc_device* dev, const char* path) {
+    char identity[256], tmp[1024];
+    if (!dev || !path || budc_get_identity(dev, identity, sizeof(identity)) != 0) return -1;
+
+    budc_stats st;
+    budc_get_stats(dev, &st);
+    budc_mutex_lock(&dev->state_lock);
+    int temp_support = dev->temp_support;
+    double lock_ms = dev->lock_time_ema_ms;
+    double freq_hz = dev->cmd_freq_hz, prev_hz = dev->prev_freq_hz;
+    int power = dev->have_cmd_power ? dev->cmd_power : -1, nominal = dev->nominal_power;
+    int sync = dev->sync_mode == BUDC_SYNC_AUTO ? (int)dev->sync_resolved : BUDC_SYNC_AUTO;
+    budc_mutex_unlock(&dev->state_lock);
+
+    // Written aside and renamed, so a crash mid-write leaves the old file
+    snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+    FILE* f = fopen(tmp, "w");
+    if (!f) return -1;
+    fprintf(f, "# BUDC warm state\n");
+    fprintf(f, "identity %s\n", identity);
+    if (sync != BUDC_SYNC_AUTO) fprintf(f, "sync %d\n", sync);
+    if (temp_support >= 0) fprintf(f, "temp_support %d\n", temp_support);
+    if (lock_ms > 0) fprintf(f, "lock_ms %.1f\n", lock_ms);
+    if (freq_hz > 0) fprintf(f, "freq_hz %.0f %.0f\n", freq_hz, prev_hz);
+    if (power >= 0) fprintf(f, "power %d %d\n", power, nominal);  // Sent, and asked for before calibration
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        fprintf(f, "count %s %lu\n", counters[i].name, *counter(&st, i));
+    }
+    fprintf(f, "busy_ms %.1f\n", st.io_busy_ms);
+    fprintf(f, "save_ms %.1f %.1f\n", st.save_busy_ms, st.save_max_ms);
+    write_hist(f, "latency", st.latency_hist, st.latency_max_ms);
+    write_hist(f, "relock", st.relock_hist, st.relock_max_ms);
+    if (fclose(f) != 0) { remove(tmp); return -1; }
+#ifdef _WIN32
+    remove(path);  // rename does not replace on Windows
+#endif
+    if (rename(tmp, path) != 0) { remove(tmp); return -1; }
+    return 0;
+}
+
+int budc_restore_state(budc_device* dev, const char* path) {
+    char identity[256], line[512];
+    if (!dev || !path || budc_get_identity(dev, identity, sizeof(identity)) != 0) return -1;
+    FILE* f = fopen(path, "r");
+    if (!f) return -1;
+
+    // The identity comes first; anything else is for a different unit
+    bool same = false;
+    while (fgets(line, sizeof(line), f)) {
+        if (line[0] == '#') continue;
+        line[strcspn(line, "\r\n")] = '\0';
+        same = strncmp(line, "identity ", 9) == 0 && strcmp(line + 9, identity) == 0;
+        break;
+    }
+    if (!same) {
+        fclose(f);
+        BUDC_LOG(BUDC_LOG_INFO, "warm_mismatch", "path=\"%s\"", path);
+        return 1;
+    }
+
+    budc_stats saved;
+    memset(&saved, 0, sizeof(saved));
+    int sync = -1, temp_support = -1, power = -1, nominal = -1;
+    double lock_ms = 0.0, freq_hz = 0.0, prev_hz = 0.0;
+    while (fgets(line, sizeof(line), f)) {
+        char name[32];
+        unsigned long n;
+        if (sscanf(line, "sync %d", &sync) == 1) continue;
+        if (sscanf(line, "temp_support %d", &temp_support) == 1) continue;
+        if (sscanf(line, "lock_ms %lf", &lock_ms) == 1) continue;
+        if (sscanf(line, "freq_hz %lf %lf", &freq_hz, &prev_hz) >= 1) continue;
+        if (sscanf(line, "power %d %d", &power, &nominal) >= 1) continue;
+        if (sscanf(line, "busy_ms %lf", &saved.io_busy_ms) == 1) continue;
+        if (sscanf(line, "save_ms %lf %lf", &saved.save_busy_ms, &saved.save_max_ms) >= 1) continue;
+        if (strncmp(line, "hist latency ", 13) == 0) merge_hist(line + 13, saved.latency_hist, &saved.latency_max_ms);
+        else if (strncmp(line, "hist relock ", 12) == 0) merge_hist(line + 12, saved.relock_hist, &saved.relock_max_ms);
+        else if (sscanf(line, "count %31s %lu", name, &n) == 2) {
+            for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+                if (strcmp(counters[i].name, name) == 0) *counter(&saved, i) = n;
+            }
+        }
+    }
+    fclose(f);
+
+    if (sync > BUDC_SYNC_AUTO && sync <= BUDC_SYNC_NONE) budc_adopt_sync_mode(dev, (budc_sync_mode)sync);
+
+    // Taken back only while the unit still agrees, so a relock does not
+    // undo a change made while nothing was watching
+    double now_ghz = 0.0;
+    int now_power = -1;
+    bool freq_holds = freq_hz > 0 && budc_get_frequency_ghz(dev, &now_ghz) == 0
+                      && now_ghz * 1e9 - freq_hz < WARM_FREQ_TOLERANCE_HZ
+                      && freq_hz - now_ghz * 1e9 < WARM_FREQ_TOLERANCE_HZ;
+    bool power_holds = power >= 0 && budc_get_power_level(dev, &now_power) == 0 && now_power == power;
+
+    budc_mutex_lock(&dev->state_lock);
+    if (dev->temp_support < 0 && temp_support >= 0) dev->temp_support = temp_support;
+    if (dev->lock_time_ema_ms <= 0 && lock_ms > 0) dev->lock_time_ema_ms = lock_ms;
+    if (dev->cmd_freq_hz <= 0 && freq_holds) {
+        dev->cmd_freq_hz = freq_hz;
+        dev->prev_freq_hz = prev_hz;
+    }
+    if (!dev->have_cmd_power && power_holds) {
+        dev->cmd_power = power;
+        dev->have_cmd_power = true;
+        if (nominal >= 0) dev->nominal_power = nominal;
+    }
+    budc_mutex_unlock(&dev->state_lock);
+
+    budc_mutex_lock(&dev->stats_lock);
+    for (size_t i = 0; i < sizeof(counters) / sizeof(counters[0]); i++) {
+        *counter(&dev->stats, i) += *counter(&saved, i);
+    }
+    dev->stats.io_busy_ms += saved.io_busy_ms;
+    dev->stats.save_busy_ms += saved.save_busy_ms;
+    for (int i = 0; i < BUDC_LATENCY_BUCKETS; i++) {
+        dev->stats.latency_hist[i] += saved.latency_hist[i];
+        dev->stats.relock_hist[i] += saved.relock_hist[i];
+    }
+    if (saved.latency_max_ms > dev->stats.latency_max_ms) dev->stats.latency_max_ms = saved.latency_max_ms;
+    if (saved.relock_max_ms > dev->stats.relock_max_ms) dev->stats.relock_max_ms = saved.relock_max_ms;
+    if (saved.save_max_ms > dev->stats.save_max_ms) dev->stats.save_max_ms = saved.save_max_ms;
+    budc_mutex_unlock(&dev->stats_lock);
+
+    BUDC_LOG(BUDC_LOG_INFO, "warm_restore", "path=\"%s\" sync=%d temp_support=%d freq=%s power=%s", path,
+             sync, temp_support, freq_holds ? "kept" : "dropped", power_holds ? "kept" : "dropped");
+    return 0;
+}
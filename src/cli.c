@@ -19,15 +19,21 @@
  */
 
 #include "budc_scpi.h"
+#include "budc_thread.h"
+#include "cli_serve.h"
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <signal.h>
+#include <time.h>
 
 void print_usage() {
     printf("BUDC Command Line Interface by Penthertz\n");
     printf("Usage:\n");
     printf("  budc_cli --list                           List available serial ports\n");
-    printf("  budc_cli --port <name> [COMMANDS]\n\n");
+    printf("  budc_cli --port <name> [COMMANDS]\n");
+    printf("  budc_cli --port <a> --port <b> ... [COMMANDS]   Run on several devices in parallel\n");
+    printf("  budc_cli --all [--serial <sn> ...] [COMMANDS]   Run on every device found (or those serials)\n\n");
     printf("Commands:\n");
     printf("  --status              Get a full status report\n");
     printf("  --cmd \"<cmd>\"           Send raw SCPI command\n");
@@ -42,25 +48,581 @@ void print_usage() {
     printf("  --preset              Reset to preset values\n");
     printf("  --save                Save settings to flash\n");
     printf("  --wait-lock           Wait for PLL to lock (5s timeout) after a set command\n");
+    printf("  --keep-lines          Do not assert DTR/RTS on connect\n");
+    printf("  --log <level>         Log to stderr: error, warn (default), info, debug or trace\n");
+    printf("  --watch               Monitor the device and print lock, health and alarm events\n");
+    printf("  --temp-max <c>        --watch: alarm when temperature stays above <c> for 10s\n");
+    printf("  --latency-max <ms>    --watch: alarm when query latency stays above <ms> for 5s\n");
+    printf("  --flap-max <n>        --watch: alarm on more than <n> lock changes per minute\n");
+    printf("  --relock              --watch: re-apply frequency and power when lock is lost\n");
+    printf("  --seq <file>          Run a command sequence file and print its timed log\n");
+    printf("  --serve-stdio         Serve JSON-RPC requests on stdin/stdout, one per line\n");
+    printf("  --peer \"<cmd>\"        --serve-stdio: also serve the units of the server <cmd> runs\n");
+    printf("  --web [host:]<port>   Serve a live dashboard over HTTP (loopback unless host is given)\n");
+    printf("  --save-defer <ms>     --serve-stdio / --web: coalesce saves into one SAVE after <ms> without changes\n");
+    printf("  --sweep <start> <stop> <step_mhz>  Sweep start..stop GHz, shared across every --port / --all\n");
+    printf("  --dwell <ms>          --sweep: hold each step this long after lock\n");
+    printf("  --characterize <start> <stop> <n>  Time every hop between n points of start..stop GHz\n");
+    printf("  --out <file>          --characterize: profile to write (default lock_profile.txt)\n");
+    printf("  --lock-profile <file> Use a --characterize profile to pace lock waits and sweeps\n");
+    printf("  --cal <file>          Correct power levels for frequency (<file>.<serial> if present)\n");
+    printf("  --state <file>        Restore what was learnt about the unit from <file> and save it on exit\n");
+    printf("  --bench               Measure connect and query latency\n");
+    printf("  --bench-cal           Measure calibration lookups on a built-in table; needs no device\n");
+    printf("  --iterations <n>      Rounds for --bench and --bench-cal (default 10) or --characterize (default 3)\n");
     printf("\nExamples:\n");
     printf("  budc_cli --port /dev/ttyACM0 --status\n");
     printf("  budc_cli --port COM3 --freq 5.5\n");
     printf("  budc_cli --port COM3 --freq 2.4 --wait-lock\n");
+    printf("  budc_cli --port COM3 --bench --iterations 20\n");
+    printf("  budc_cli --port /dev/ttyACM0 --watch --temp-max 70\n");
+    printf("  budc_cli --all --freq 10.0 --wait-lock --status\n");
+    printf("  budc_cli --port /dev/ttyACM0 --port /dev/ttyACM1 --sweep 3.0 6.0 10\n");
+    printf("  budc_cli --port /dev/ttyACM0 --seq retune.seq\n");
+    printf("  budc_cli --port /dev/ttyACM0 --characterize 3.0 6.0 5 --out budc1.prof\n");
+    printf("  budc_cli --port /dev/ttyACM0 --serve-stdio\n");
+    printf("  budc_cli --all --web 8080\n");
+}
+
+static volatile sig_atomic_t watch_stop = 0;
+static void on_watch_signal(int sig) { (void)sig; watch_stop = 1; }
+
+static const char* alarm_names[] = { "temperature", "lock-lost", "lock-flapping", "latency" };
+static const char* health_names[] = { "OK", "DEGRADED", "RECOVERING", "FAILED" };
+static const char* relock_names[] = { "FAILED", "re-send", "reconnect", "preset" };
+
+static void print_event(budc_device* dev, const budc_event* ev, void* user_data) {
+    (void)dev;
+    const budc_alarm_kind* kinds = user_data;
+    char stamp[32];
+    time_t now = time(NULL);
+    strftime(stamp, sizeof(stamp), "%Y-%m-%d %H:%M:%S", localtime(&now));
+    switch (ev->type) {
+    case BUDC_EVENT_HEALTH_CHANGED:
+        printf("%s HEALTH %s\n", stamp, health_names[ev->code]);
+        break;
+    case BUDC_EVENT_LOCK_CHANGED:
+        printf("%s LOCK %s\n", stamp, ev->code ? "LOCKED" : "UNLOCKED");
+        break;
+    case BUDC_EVENT_ALARM_RAISED:
+    case BUDC_EVENT_ALARM_CLEARED:
+        printf("%s ALARM %s %s (%.1f)\n", stamp, alarm_names[kinds[ev->code]],
+               ev->type == BUDC_EVENT_ALARM_RAISED ? "RAISED" : "CLEARED", ev->value);
+        break;
+    case BUDC_EVENT_RELOCK:
+        if (ev->code) printf("%s RELOCK by %s, outage %.0f ms\n", stamp, relock_names[ev->code], ev->value);
+        else printf("%s RELOCK FAILED after %.0f ms\n", stamp, ev->value);
+        break;
+    default:
+        break;
+    }
+    fflush(stdout);
+}
+
+// Runs until interrupted; events are printed as the monitor produces them.
+static int run_watch(budc_device* dev, double temp_max, double latency_max, int flap_max, bool relock) {
+    static budc_alarm_kind kinds[8];
+    budc_alarm_rule rule;
+    int id;
+
+    memset(&rule, 0, sizeof(rule));
+    rule.kind = BUDC_ALARM_LOCK_LOST;
+    rule.hold_ms = 1000;
+    rule.clear_ms = 1000;
+    if ((id = budc_alarm_add(dev, &rule)) >= 0) kinds[id] = rule.kind;
+    if (temp_max > -900.0) {
+        memset(&rule, 0, sizeof(rule));
+        rule.kind = BUDC_ALARM_TEMP_ABOVE;
+        rule.threshold = temp_max;
+        rule.clear_threshold = temp_max - 2.0;
+        rule.hold_ms = 10000;
+        if ((id = budc_alarm_add(dev, &rule)) >= 0) kinds[id] = rule.kind;
+    }
+    if (latency_max > 0.0) {
+        memset(&rule, 0, sizeof(rule));
+        rule.kind = BUDC_ALARM_LATENCY_ABOVE;
+        rule.threshold = latency_max;
+        rule.clear_threshold = latency_max * 0.8;
+        rule.hold_ms = 5000;
+        rule.clear_ms = 5000;
+        if ((id = budc_alarm_add(dev, &rule)) >= 0) kinds[id] = rule.kind;
+    }
+    if (flap_max > 0) {
+        memset(&rule, 0, sizeof(rule));
+        rule.kind = BUDC_ALARM_LOCK_FLAPPING;
+        rule.threshold = flap_max;
+        rule.clear_threshold = flap_max / 2;
+        rule.window_ms = 60000;
+        if ((id = budc_alarm_add(dev, &rule)) >= 0) kinds[id] = rule.kind;
+        else fprintf(stderr, "Flapping threshold too large, rule not added.\n");
+    }
+
+    if (relock) {
+        budc_relock_config cfg;
+        budc_default_relock_config(&cfg);
+        budc_set_relock_policy(dev, &cfg);
+    }
+
+    budc_set_event_callback(dev, print_event, kinds);
+    if (budc_monitor_start(dev, NULL) != 0) { fprintf(stderr, "Failed to start monitor.\n"); return 1; }
+
+    signal(SIGINT, on_watch_signal);
+    signal(SIGTERM, on_watch_signal);
+    printf("Watching, press Ctrl+C to stop.\n");
+    fflush(stdout);
+    while (!watch_stop) budc_sleep_ms(100);
+
+    budc_monitor_stop(dev);
+    budc_set_event_callback(dev, NULL, NULL);
+
+    budc_stats stats;
+    if (relock && budc_get_stats(dev, &stats) == 0 && stats.relocks) {
+        printf("Relocks: %lu ok, %lu failed, outage p50 %.0f ms, p95 %.0f ms, max %.0f ms\n",
+               stats.relocks, stats.relock_failures, budc_stats_relock_percentile(&stats, 50),
+               budc_stats_relock_percentile(&stats, 95), stats.relock_max_ms);
+    }
+    return 0;
+}
+
+// --- SEQUENCES ---
+static budc_seq* running_seq = NULL;
+static void on_seq_signal(int sig) { (void)sig; budc_seq_cancel(running_seq); }
+
+static void print_seq_entry(const budc_seq_entry* e, void* user_data) {
+    (void)user_data;
+    char value[160] = "";
+    if (e->detail) snprintf(value, sizeof(value), "%s", e->detail);
+    else if (e->has_value) snprintf(value, sizeof(value), "%g", e->value);
+    const char* status = e->condition ? (e->ok ? "yes" : "no") : (e->ok ? "ok" : "FAIL");
+    printf("%10.1f ms %9.1f ms  L%-4d %-36s %-4s %s\n", e->time_ms, e->duration_ms, e->line, e->text, status, value);
+    fflush(stdout);
+}
+
+static int run_sequence(budc_device* dev, const char* path) {
+    FILE* f = fopen(path, "rb");
+    if (!f) { fprintf(stderr, "Cannot open %s\n", path); return 1; }
+    fseek(f, 0, SEEK_END);
+    long size = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    char* source = malloc(size > 0 ? size + 1 : 1);
+    size_t got = source ? fread(source, 1, size > 0 ? size : 0, f) : 0;
+    fclose(f);
+    if (!source) return 1;
+    source[got] = '\0';
+
+    char error[128];
+    budc_seq* seq = budc_seq_compile(source, error, sizeof(error));
+    free(source);
+    if (!seq) { fprintf(stderr, "%s: %s\n", path, error); return 1; }
+
+    running_seq = seq;
+    signal(SIGINT, on_seq_signal);
+    printf("%13s %12s  %-5s %-36s %-4s %s\n", "T", "DURATION", "LINE", "STEP", "", "VALUE");
+    double start = budc_now_ms();
+    int result = budc_seq_run(dev, seq, print_seq_entry, NULL);
+    printf("Sequence %s after %.1f ms\n", result == 0 ? "completed" : "failed", budc_now_ms() - start);
+    signal(SIGINT, SIG_DFL);
+    running_seq = NULL;
+    budc_seq_free(seq);
+    return result == 0 ? 0 : 1;
+}
+
+typedef struct { double min, max, sum; int count, failed; } bench_stat;
+
+static void bench_add(bench_stat* st, double ms) {
+    if (ms < 0) { st->failed++; return; }
+    if (st->count == 0 || ms < st->min) st->min = ms;
+    if (st->count == 0 || ms > st->max) st->max = ms;
+    st->sum += ms;
+    st->count++;
+}
+
+static void bench_print(const char* name, const bench_stat* st, const char* unit) {
+    if (st->count == 0) { printf("  %-28s no successful rounds (%d failed)\n", name, st->failed); return; }
+    printf("  %-28s min %8.2f  avg %8.2f  max %8.2f %s  (%d ok, %d failed)\n",
+           name, st->min, st->sum / st->count, st->max, unit, st->count, st->failed);
+}
+
+static double bench_query_ms(budc_device* dev, const char* query) {
+    char response[256];
+    double start = budc_now_ms();
+    if (budc_send_raw_command(dev, query, response, sizeof(response)) != 0) return -1.0;
+    return budc_now_ms() - start;
+}
+
+static int run_bench(const char* port_name, const budc_connect_options* opts, int iterations) {
+    bench_stat cold = {0}, warm = {0}, idn = {0}, lock = {0};
+
+    printf("Benchmarking %s (%d rounds)...\n", port_name, iterations);
+    for (int i = 0; i < iterations; i++) {
+        budc_device* dev = budc_connect_ex(port_name, opts);
+        if (!dev) { fprintf(stderr, "Failed to connect to %s\n", port_name); return 1; }
+        bench_add(&cold, budc_get_connect_time_ms(dev));
+        budc_disconnect(dev);
+    }
+
+    budc_device* dev = budc_connect_ex(port_name, opts);
+    if (!dev) { fprintf(stderr, "Failed to connect to %s\n", port_name); return 1; }
+    for (int i = 0; i < iterations; i++) {
+        bench_add(&warm, budc_reconnect(dev) == 0 ? budc_get_connect_time_ms(dev) : -1.0);
+    }
+    for (int i = 0; i < iterations; i++) {
+        bench_add(&idn, bench_query_ms(dev, "*IDN?"));
+        bench_add(&lock, bench_query_ms(dev, "LOCK?"));
+    }
+    budc_disconnect(dev);
+
+    printf("\n--- BUDC Benchmark ---\n");
+    bench_print("Connect to first reply", &cold, "ms");
+    bench_print("Warm reconnect", &warm, "ms");
+    bench_print("*IDN? round trip", &idn, "ms");
+    bench_print("LOCK? round trip", &lock, "ms");
+    printf("----------------------\n");
+    return (cold.failed || warm.failed || idn.failed || lock.failed) ? 1 : 0;
+}
+
+#define BENCH_CAL_POINTS 256
+#define BENCH_CAL_LOOKUPS 100000
+
+// Nanoseconds per calibration lookup, over a table built here so no unit is
+// needed. Frequencies are taken across the band in a scattered order, so no
+// search starts where the last one ended. The offsets are summed and the
+// sum printed, which keeps the lookups from being optimised away.
+static int run_bench_cal(int iterations) {
+    budc_cal_point points[BENCH_CAL_POINTS];
+    bench_stat lookup = {0};
+    double checksum = 0.0;
+    for (int i = 0; i < BENCH_CAL_POINTS; i++) {
+        points[i].freq_hz = 2e9 + i * (18e9 / (BENCH_CAL_POINTS - 1));
+        points[i].offset = (i % 7) - 3;
+    }
+    budc_cal_table* table = budc_cal_table_create(points, BENCH_CAL_POINTS);
+    if (!table) { fprintf(stderr, "Could not build a calibration table.\n"); return 1; }
+
+    printf("Benchmarking calibration lookups, %d points (%d rounds)...\n", BENCH_CAL_POINTS, iterations);
+    for (int r = 0; r < iterations; r++) {
+        double start = budc_now_ms();
+        for (int i = 0; i < BENCH_CAL_LOOKUPS; i++) {
+            checksum += budc_cal_table_offset(table, 2e9 + (i * 7919 % BENCH_CAL_LOOKUPS) * (18e9 / BENCH_CAL_LOOKUPS));
+        }
+        bench_add(&lookup, (budc_now_ms() - start) * 1e6 / BENCH_CAL_LOOKUPS);
+    }
+    budc_cal_table_free(table);
+
+    printf("\n--- BUDC Benchmark ---\n");
+    bench_print("Calibration lookup", &lookup, "ns");
+    printf("  %-28s %.1f\n", "Offset checksum", checksum);
+    printf("----------------------\n");
+    return 0;
+}
+
+// --- FLEET MODE ---
+// Each device gets its own thread and its own handle, so a rack of units
+// takes about as long as the slowest one instead of the sum of all of them.
+#define FLEET_MAX_PORTS 64
+#define FLEET_MAX_SERIALS 64
+
+typedef struct {
+    double freq_ghz, freq_mhz, freq_hz;
+    int power;
+    bool wait_lock, preset, save, status, get_freq, get_power, get_temp, get_lock;
+    const char* raw_command;
+    const char** serials;
+    int serial_count;
+    const char* cal_path;      // Power calibration, see budc_load_calibration; NULL for none
+    const budc_connect_options* opts;
+} fleet_ops;
+
+typedef struct {
+    char port[128];
+    bool explicit_port;        // Named with --port, reported even if it does not answer
+    const fleet_ops* ops;
+    budc_thread thread;
+    bool started;
+    bool matched;              // Answered and passed the serial filter
+    bool failed;
+    char error[32];
+    char serial[64];
+    double freq_ghz;
+    bool have_freq, have_temp, have_power;
+    int lock;                  // -1 not read
+    float temp_c;
+    int power;
+    char reply[64];
+    double elapsed_ms;
+} fleet_job;
+
+static void fleet_fail(fleet_job* job, const char* what) {
+    if (!job->failed) snprintf(job->error, sizeof(job->error), "%s", what);
+    job->failed = true;
+}
+
+static bool fleet_serial_selected(const fleet_ops* ops, const char* serial) {
+    if (ops->serial_count == 0) return true;
+    for (int i = 0; i < ops->serial_count; i++) {
+        if (strcmp(ops->serials[i], serial) == 0) return true;
+    }
+    return false;
+}
+
+// Same operations, in the same order, as the single-device path in main()
+static void* fleet_worker(void* arg) {
+    fleet_job* job = arg;
+    const fleet_ops* ops = job->ops;
+    char identity[256] = "";
+    double start = budc_now_ms();
+    job->lock = -1;
+
+    budc_device* dev = budc_connect_ex(job->port, ops->opts);
+    if (!dev || budc_get_connect_time_ms(dev) < 0 || budc_get_identity(dev, identity, sizeof(identity)) != 0) {
+        job->matched = job->explicit_port && ops->serial_count == 0;
+        fleet_fail(job, dev ? "no reply" : "connect failed");
+        if (dev) budc_disconnect(dev);
+        job->elapsed_ms = budc_now_ms() - start;
+        return NULL;
+    }
+    sscanf(identity, "%*[^,],%*[^,],%63[^,]", job->serial);
+    job->matched = fleet_serial_selected(ops, job->serial);
+    if (!job->matched) { budc_disconnect(dev); return NULL; }
+
+    if (ops->cal_path && budc_load_calibration(dev, ops->cal_path) < 0) fleet_fail(job, "calibration");
+    double both_hz = ops->freq_ghz >= 0 ? ops->freq_ghz * 1e9 : ops->freq_mhz >= 0 ? ops->freq_mhz * 1e6 : ops->freq_hz;
+    if (both_hz >= 0 && ops->power >= 0) {
+        if (budc_apply_settings(dev, both_hz, ops->power) != 0) fleet_fail(job, "set freq+power");
+    } else if (ops->freq_ghz >= 0) {
+        if (budc_set_frequency_ghz(dev, ops->freq_ghz) != 0) fleet_fail(job, "set freq");
+    } else if (ops->freq_mhz >= 0) {
+        if (budc_set_frequency_mhz(dev, ops->freq_mhz) != 0) fleet_fail(job, "set freq");
+    } else if (ops->freq_hz >= 0) {
+        if (budc_set_frequency_hz(dev, ops->freq_hz) != 0) fleet_fail(job, "set freq");
+    } else if (ops->power >= 0 && budc_set_power_level(dev, ops->power) != 0) {
+        fleet_fail(job, "set power");
+    }
+    if (ops->wait_lock && budc_wait_for_lock(dev, 5000) != 0) fleet_fail(job, "lock timeout");
+    if (ops->preset && budc_preset(dev) != 0) fleet_fail(job, "preset");
+    if (ops->save && budc_save_settings(dev) != 0) fleet_fail(job, "save");
+    if (ops->status || ops->get_freq) {
+        job->have_freq = budc_get_frequency_ghz(dev, &job->freq_ghz) == 0;
+        if (!job->have_freq) fleet_fail(job, "read freq");
+    }
+    if (ops->status || ops->get_power) {
+        job->have_power = budc_get_power_level(dev, &job->power) == 0;
+        if (!job->have_power) fleet_fail(job, "read power");
+    }
+    if (ops->status || ops->get_temp) job->have_temp = budc_get_temperature_c(dev, &job->temp_c) == 0;
+    if (ops->status || ops->get_lock) {
+        bool locked;
+        if (budc_get_lock_status(dev, &locked) == 0) job->lock = locked;
+        else fleet_fail(job, "read lock");
+    }
+    if (ops->raw_command && budc_send_raw_command(dev, ops->raw_command, job->reply, sizeof(job->reply)) != 0) {
+        fleet_fail(job, "raw command");
+    }
+
+    budc_disconnect(dev);
+    job->elapsed_ms = budc_now_ms() - start;
+    return NULL;
+}
+
+static void fleet_add(fleet_job* jobs, int* count, const char* port, bool explicit_port, const fleet_ops* ops) {
+    for (int i = 0; i < *count; i++) {
+        if (strcmp(jobs[i].port, port) == 0) return;
+    }
+    if (*count >= FLEET_MAX_PORTS) return;
+    fleet_job* job = &jobs[(*count)++];
+    memset(job, 0, sizeof(*job));
+    snprintf(job->port, sizeof(job->port), "%s", port);
+    job->explicit_port = explicit_port;
+    job->ops = ops;
+}
+
+static int run_fleet(const char** ports, int port_count, bool scan_all, const fleet_ops* ops) {
+    static fleet_job jobs[FLEET_MAX_PORTS];
+    int count = 0, shown = 0, failed = 0;
+    double slowest = 0.0, start = budc_now_ms();
+
+    for (int i = 0; i < port_count; i++) fleet_add(jobs, &count, ports[i], true, ops);
+    if (scan_all) {
+        serial_port_info* port_list = NULL;
+        int found = budc_find_ports(&port_list);
+        for (int i = 0; i < found; i++) fleet_add(jobs, &count, port_list[i].name, false, ops);
+        free(port_list);
+    }
+    if (count == 0) { fprintf(stderr, "No serial ports found.\n"); return 1; }
+
+    printf("Running on %d port(s)...\n", count);
+    for (int i = 0; i < count; i++) {
+        jobs[i].started = budc_thread_create(&jobs[i].thread, fleet_worker, &jobs[i]) == 0;
+        if (!jobs[i].started) fleet_worker(&jobs[i]);  // Could not spawn, run it here instead
+    }
+    for (int i = 0; i < count; i++) {
+        if (jobs[i].started) budc_thread_join(jobs[i].thread);
+    }
+    double wall = budc_now_ms() - start;
+
+    printf("\n%-24s %-12s %-10s %-9s %-7s %-6s %8s  %s\n",
+           "PORT", "SERIAL", "FREQ GHz", "LOCK", "TEMP C", "POWER", "TIME ms", "RESULT");
+    for (int i = 0; i < count; i++) {
+        const fleet_job* job = &jobs[i];
+        char freq[16] = "-", temp[16] = "-", power[16] = "-";
+        if (!job->matched) continue;
+        if (job->have_freq) snprintf(freq, sizeof(freq), "%.4f", job->freq_ghz);
+        if (job->have_temp) snprintf(temp, sizeof(temp), "%.1f", job->temp_c);
+        if (job->have_power) snprintf(power, sizeof(power), "%d", job->power);
+        printf("%-24s %-12s %-10s %-9s %-7s %-6s %8.0f  %s%s\n", job->port,
+               job->serial[0] ? job->serial : "-", freq,
+               job->lock < 0 ? "-" : job->lock ? "LOCKED" : "UNLOCKED", temp, power, job->elapsed_ms,
+               job->failed ? "FAILED: " : "ok", job->failed ? job->error : "");
+        if (job->reply[0]) printf("%-24s reply: %s\n", "", job->reply);
+        shown++;
+        if (job->failed) failed++;
+        if (job->elapsed_ms > slowest) slowest = job->elapsed_ms;
+    }
+    for (int s = 0; s < ops->serial_count; s++) {
+        bool seen = false;
+        for (int i = 0; i < count && !seen; i++) seen = jobs[i].matched && strcmp(jobs[i].serial, ops->serials[s]) == 0;
+        if (!seen) { printf("%-24s %-12s not found\n", "-", ops->serials[s]); failed++; }
+    }
+    printf("\n%d device(s), %d failed, wall time %.0f ms (slowest device %.0f ms)\n", shown, failed, wall, slowest);
+    return (failed || shown == 0) ? 1 : 0;
+}
+
+// --- SWEEP ---
+// One band, shared between all the given converters (see budc_sweep.c)
+static void print_sweep_point(const budc_sweep_point* point, void* user_data) {
+    budc_device** devs = user_data;
+    (void)devs;
+    printf("%10.6f GHz  dev %-2d %-8s %7.0f ms%s\n", point->freq_hz / 1e9, point->device,
+           point->locked ? "LOCKED" : "FAILED", point->retune_ms, point->stolen ? "  (rebalanced)" : "");
+    fflush(stdout);
+}
+
+static int run_sweep(const char** ports, int port_count, bool scan_all, const budc_connect_options* opts,
+                     const budc_sweep_plan* plan, const char* lock_profile, const char* cal_path) {
+    budc_device* devs[FLEET_MAX_PORTS];
+    const char* names[FLEET_MAX_PORTS];
+    serial_port_info* port_list = NULL;
+    int count = 0, found = scan_all ? budc_find_ports(&port_list) : 0;
+    size_t steps = budc_sweep_step_count(plan);
+    if (steps == 0) { fprintf(stderr, "Empty sweep range.\n"); free(port_list); return 1; }
+
+    for (int i = 0; i < port_count + found && count < FLEET_MAX_PORTS; i++) {
+        const char* name = i < port_count ? ports[i] : port_list[i - port_count].name;
+        budc_device* dev = budc_connect_ex(name, opts);
+        if (dev && budc_get_connect_time_ms(dev) < 0) { budc_disconnect(dev); dev = NULL; }
+        if (!dev) { if (i < port_count) fprintf(stderr, "Failed to connect to %s\n", name); continue; }
+        if (lock_profile && budc_load_lock_profile(dev, lock_profile) != 0) {
+            fprintf(stderr, "Could not read lock profile %s\n", lock_profile);
+        }
+        if (cal_path && budc_load_calibration(dev, cal_path) != 0) {
+            fprintf(stderr, "No calibration for %s in %s\n", name, cal_path);
+        }
+        names[count] = name;
+        devs[count++] = dev;
+    }
+    if (count == 0) { fprintf(stderr, "No devices to sweep with.\n"); free(port_list); return 1; }
+
+    budc_sweep_point* points = calloc(steps, sizeof(*points));
+    if (!points) { free(port_list); return 1; }
+    printf("Sweeping %.6f..%.6f GHz in %zu steps on %d device(s)...\n",
+           plan->start_hz / 1e9, plan->stop_hz / 1e9, steps, count);
+    double start = budc_now_ms();
+    int result = budc_sweep_run(devs, count, plan, points, steps, print_sweep_point, devs);
+    double wall = budc_now_ms() - start;
+
+    // Busy time summed over devices against wall time is the speedup over one unit
+    double busy = 0.0;
+    size_t uncovered = 0;
+    printf("\n%-4s %-24s %6s %6s %6s %10s\n", "DEV", "PORT", "STEPS", "TAKEN", "FAILED", "AVG ms");
+    for (int d = 0; d < count; d++) {
+        int done = 0, taken = 0, failed = 0;
+        double sum = 0.0;
+        for (size_t i = 0; i < steps; i++) {
+            if (points[i].device != d) continue;
+            done++;
+            sum += points[i].retune_ms + plan->dwell_ms;
+            if (points[i].stolen) taken++;
+            if (!points[i].locked) failed++;
+        }
+        busy += sum;
+        printf("%-4d %-24s %6d %6d %6d %10.1f\n", d, names[d], done, taken, failed, done ? sum / done : 0.0);
+    }
+    for (size_t i = 0; i < steps; i++) {
+        if (points[i].device < 0) uncovered++;
+    }
+    if (uncovered) printf("%zu step(s) outside every device's range\n", uncovered);
+    printf("\nSurvey time %.0f ms, %.0f ms of device work (%.2fx one unit)\n", wall, busy, wall > 0 ? busy / wall : 0.0);
+
+    for (int d = 0; d < count; d++) budc_disconnect(devs[d]);
+    free(points);
+    free(port_list);
+    return result == 0 ? 0 : 1;
+}
+
+// --- CHARACTERIZE ---
+static void print_hop(double from_hz, double to_hz, double lock_ms, void* user_data) {
+    int* hops = user_data;
+    if (lock_ms < 0) printf("  %4d  %10.6f -> %10.6f GHz  no lock\n", ++*hops, from_hz / 1e9, to_hz / 1e9);
+    else printf("  %4d  %10.6f -> %10.6f GHz  %7.1f ms\n", ++*hops, from_hz / 1e9, to_hz / 1e9, lock_ms);
+    fflush(stdout);
+}
+
+static int run_characterize(budc_device* dev, double start_ghz, double stop_ghz, int points, int repeats, const char* path) {
+    double freqs_hz[32];
+    int hops = 0;
+    if (points < 2 || points > 32 || stop_ghz <= start_ghz) {
+        fprintf(stderr, "--characterize needs start < stop and 2 to 32 points.\n");
+        return 1;
+    }
+    for (int i = 0; i < points; i++) freqs_hz[i] = (start_ghz + (stop_ghz - start_ghz) * i / (points - 1)) * 1e9;
+    printf("Characterizing lock time: %d points, %d hops x %d repeats...\n", points, points * (points - 1), repeats);
+    int result = budc_characterize_lock(dev, freqs_hz, points, repeats, path, print_hop, &hops);
+    if (result < 0) { fprintf(stderr, "Characterization failed.\n"); return 1; }
+    printf("Profile written to %s%s\n", path, result > 0 ? " (some hops did not lock)" : "");
+    return result;
 }
 
 int main(int argc, char* argv[]) {
     const char* port_name = NULL;
+    const char* ports[FLEET_MAX_PORTS];
+    const char* serials[FLEET_MAX_SERIALS];
+    int port_count = 0, serial_count = 0;
+    bool scan_all = false;
     const char* raw_command = NULL;
+    const char* seq_path = NULL;
     bool list_ports = false, get_status = false, get_freq = false;
     bool get_power = false, get_temp = false, get_lock = false;
     bool do_preset = false, do_save = false, wait_for_lock_after_set = false;
+    bool keep_lines = false, do_bench = false, do_bench_cal = false, do_watch = false, watch_relock = false, do_serve = false;
+    double watch_temp_max = -999.0, watch_latency_max = 0.0;
+    int watch_flap_max = 0;
+    int bench_iterations = 0;    // 0: the mode's own default
+    double charz_start = -1.0, charz_stop = -1.0;
+    int charz_points = 0;
+    const char* charz_out = "lock_profile.txt";
+    const char* lock_profile = NULL;
+    const char* cal_path = NULL;
+    const char* state_path = NULL;
+    const char* web = NULL;
+    int save_defer = -1;
+    const char* peers[FLEET_MAX_PORTS];
+    int peer_count = 0;
+    double sweep_start = -1.0, sweep_stop = -1.0, sweep_step_mhz = 0.0;
+    int sweep_dwell = 0;
     
     double set_freq_ghz = -1.0, set_freq_hz = -1.0, set_freq_mhz = -1.0;
     int set_power_level = -1;
 
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--list") == 0) list_ports = true;
-        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) port_name = argv[++i];
+        else if (strcmp(argv[i], "--port") == 0 && i + 1 < argc) {
+            port_name = argv[++i];
+            if (port_count < FLEET_MAX_PORTS) ports[port_count++] = port_name;
+        }
+        else if (strcmp(argv[i], "--all") == 0) scan_all = true;
+        else if (strcmp(argv[i], "--serial") == 0 && i + 1 < argc) {
+            if (serial_count < FLEET_MAX_SERIALS) serials[serial_count++] = argv[++i]; else i++;
+        }
         else if (strcmp(argv[i], "--cmd") == 0 && i + 1 < argc) raw_command = argv[++i];
         else if (strcmp(argv[i], "--status") == 0) get_status = true;
         else if (strcmp(argv[i], "--freq") == 0 && i + 1 < argc) set_freq_ghz = atof(argv[++i]);
@@ -74,6 +636,45 @@ int main(int argc, char* argv[]) {
         else if (strcmp(argv[i], "--preset") == 0) do_preset = true;
         else if (strcmp(argv[i], "--save") == 0) do_save = true;
         else if (strcmp(argv[i], "--wait-lock") == 0) wait_for_lock_after_set = true;
+        else if (strcmp(argv[i], "--keep-lines") == 0) keep_lines = true;
+        else if (strcmp(argv[i], "--log") == 0 && i + 1 < argc) {
+            budc_log_level level;
+            if (budc_log_parse_level(argv[++i], &level) != 0) {
+                fprintf(stderr, "Unknown log level '%s'\n", argv[i]);
+                return 1;
+            }
+            budc_log_set_level(level);
+        }
+        else if (strcmp(argv[i], "--bench") == 0) do_bench = true;
+        else if (strcmp(argv[i], "--bench-cal") == 0) do_bench_cal = true;
+        else if (strcmp(argv[i], "--serve-stdio") == 0) do_serve = true;
+        else if (strcmp(argv[i], "--web") == 0 && i + 1 < argc) web = argv[++i];
+        else if (strcmp(argv[i], "--save-defer") == 0 && i + 1 < argc) save_defer = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--seq") == 0 && i + 1 < argc) seq_path = argv[++i];
+        else if (strcmp(argv[i], "--sweep") == 0 && i + 3 < argc) {
+            sweep_start = atof(argv[++i]);
+            sweep_stop = atof(argv[++i]);
+            sweep_step_mhz = atof(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--dwell") == 0 && i + 1 < argc) sweep_dwell = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--characterize") == 0 && i + 3 < argc) {
+            charz_start = atof(argv[++i]);
+            charz_stop = atof(argv[++i]);
+            charz_points = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--out") == 0 && i + 1 < argc) charz_out = argv[++i];
+        else if (strcmp(argv[i], "--lock-profile") == 0 && i + 1 < argc) lock_profile = argv[++i];
+        else if (strcmp(argv[i], "--cal") == 0 && i + 1 < argc) cal_path = argv[++i];
+        else if (strcmp(argv[i], "--state") == 0 && i + 1 < argc) state_path = argv[++i];
+        else if (strcmp(argv[i], "--peer") == 0 && i + 1 < argc) {
+            if (peer_count < FLEET_MAX_PORTS) peers[peer_count++] = argv[++i]; else i++;
+        }
+        else if (strcmp(argv[i], "--watch") == 0) do_watch = true;
+        else if (strcmp(argv[i], "--temp-max") == 0 && i + 1 < argc) watch_temp_max = atof(argv[++i]);
+        else if (strcmp(argv[i], "--latency-max") == 0 && i + 1 < argc) watch_latency_max = atof(argv[++i]);
+        else if (strcmp(argv[i], "--flap-max") == 0 && i + 1 < argc) watch_flap_max = atoi(argv[++i]);
+        else if (strcmp(argv[i], "--relock") == 0) watch_relock = true;
+        else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc) bench_iterations = atoi(argv[++i]);
         else if (strcmp(argv[i], "--help") == 0) { print_usage(); return 0; }
     }
 
@@ -90,13 +691,76 @@ int main(int argc, char* argv[]) {
         return 0;
     }
 
+    if (do_bench_cal) return run_bench_cal(bench_iterations > 0 ? bench_iterations : 10);
+
+    budc_connect_options opts;
+    budc_default_connect_options(&opts);
+    opts.keep_control_lines = keep_lines;
+
+    if (sweep_start >= 0) {
+        budc_sweep_plan plan = { sweep_start * 1e9, sweep_stop * 1e9, sweep_step_mhz * 1e6, set_power_level,
+                                 0, sweep_dwell > 0 ? (unsigned int)sweep_dwell : 0 };
+        if (port_count == 0 && !scan_all) { print_usage(); return 0; }
+        return run_sweep(ports, port_count, scan_all, &opts, &plan, lock_profile, cal_path);
+    }
+
+    if (do_serve || web) {
+        if (port_count == 0 && !scan_all && peer_count == 0) { print_usage(); return 0; }
+        budc_save_config save;
+        budc_default_save_config(&save);
+        if (save_defer >= 0) save.quiet_ms = (unsigned int)save_defer;
+        serve_options serve = { ports, port_count, scan_all, peers, peer_count, state_path, &opts, do_serve, web,
+                                save_defer >= 0 ? &save : NULL, cal_path };
+        return run_serve_stdio(&serve);
+    }
+
+    if (port_count > 1 || scan_all || serial_count > 0) {
+        if (do_watch || do_bench || seq_path || charz_points) {
+            fprintf(stderr, "--watch, --bench, --seq and --characterize work on a single --port only.\n");
+            return 1;
+        }
+        fleet_ops ops = {
+            set_freq_ghz, set_freq_mhz, set_freq_hz, set_power_level,
+            wait_for_lock_after_set, do_preset, do_save, get_status, get_freq, get_power, get_temp, get_lock,
+            raw_command, serials, serial_count, cal_path, &opts
+        };
+        // --serial without ports searches every port; with ports it filters those
+        return run_fleet(ports, port_count, scan_all || port_count == 0, &ops);
+    }
+
     if (!port_name) { print_usage(); return 0; }
 
-    budc_device* dev = budc_connect(port_name);
+    if (do_bench) return run_bench(port_name, &opts, bench_iterations > 0 ? bench_iterations : 10);
+
+    budc_device* dev = budc_connect_ex(port_name, &opts);
     if (!dev) { fprintf(stderr, "Failed to connect to %s\n", port_name); return 1; }
     int result = 0;
+    if (lock_profile && budc_load_lock_profile(dev, lock_profile) != 0) {
+        fprintf(stderr, "Could not read lock profile %s\n", lock_profile);
+    }
+    // A missing file is the normal first run
+    if (state_path && budc_restore_state(dev, state_path) == 1) {
+        fprintf(stderr, "%s was saved for another unit, starting cold.\n", state_path);
+    }
+    if (charz_points) {
+        result = run_characterize(dev, charz_start, charz_stop, charz_points,
+                                  bench_iterations > 0 ? bench_iterations : 3, charz_out);
+        budc_disconnect(dev);
+        return result;
+    }
 
-    if (set_freq_ghz >= 0) {
+    if (cal_path) {
+        int loaded = budc_load_calibration(dev, cal_path);
+        if (loaded == 1) fprintf(stderr, "%s is for another unit, power is not calibrated.\n", cal_path);
+        else if (loaded != 0) fprintf(stderr, "Could not read calibration %s\n", cal_path);
+    }
+
+    // Frequency and power together go out in one write
+    double both_hz = set_freq_ghz >= 0 ? set_freq_ghz * 1e9 : set_freq_mhz >= 0 ? set_freq_mhz * 1e6 : set_freq_hz;
+    if (both_hz >= 0 && set_power_level >= 0) {
+        printf("Setting frequency to %.0f Hz and power to %d...\n", both_hz, set_power_level);
+        if (budc_apply_settings(dev, both_hz, set_power_level) != 0) { fprintf(stderr, "Failed to set frequency and power.\n"); result = 1; }
+    } else if (set_freq_ghz >= 0) {
         printf("Setting frequency to %.4f GHz...\n", set_freq_ghz);
         if (budc_set_frequency_ghz(dev, set_freq_ghz) != 0) { fprintf(stderr, "Failed to set frequency.\n"); result = 1; }
     } else if (set_freq_mhz >= 0) {
@@ -105,9 +769,7 @@ int main(int argc, char* argv[]) {
     } else if (set_freq_hz >= 0) {
         printf("Setting frequency to %.0f Hz...\n", set_freq_hz);
         if (budc_set_frequency_hz(dev, set_freq_hz) != 0) { fprintf(stderr, "Failed to set frequency.\n"); result = 1; }
-    }
-
-    if (set_power_level >= 0) {
+    } else if (set_power_level >= 0) {
         printf("Setting power to %d...\n", set_power_level);
         if (budc_set_power_level(dev, set_power_level) != 0) { fprintf(stderr, "Failed to set power.\n"); result = 1; }
     }
@@ -175,7 +837,10 @@ int main(int argc, char* argv[]) {
         printf("  Power Level:   %d\n", power);
         printf("--------------------------\n");
     }
+    if (seq_path && run_sequence(dev, seq_path) != 0) result = 1;
+    if (do_watch && run_watch(dev, watch_temp_max, watch_latency_max, watch_flap_max, watch_relock) != 0) result = 1;
 
+    if (state_path && budc_save_state(dev, state_path) != 0) fprintf(stderr, "Could not save state to %s\n", state_path);
     budc_disconnect(dev);
     return result;
 }
\ No newline at end of file
@@ -0,0 +1,1358 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// budc_cli --serve-stdio: JSON-RPC 2.0, one object per line on stdin and
+// stdout. The main thread reads requests into a fixed queue and a small
+// pool of workers runs them, so a slow request (wait_lock) does not hold up
+// quick ones and responses may come back out of order; match them by id.
+// Device events are pushed as "event" notifications on the same stream.
+//
+// Requests that change the device are "control", all others "observe".
+// Each class has its own queue and workers take control requests first.
+// On the port they run as separate clients (budc_fairq.c), so control gets
+// most of it while both are busy. Observe requests beyond a few pending
+// ones are answered with a busy error instead of being queued, so a poller
+// cannot push set commands back behind its backlog.
+//
+// One server can front several units: every local port given, and the
+// units of peers. A peer is another budc_cli --serve-stdio reached through
+// any command whose stdin and stdout carry the protocol, e.g. over ssh. A
+// request picks its unit with a "device" param (serial or port, default
+// the first unit). Requests for a peer's unit are passed on with a
+// local id and the reply is mapped back; the peer's events are relayed.
+// The status of every peer unit is refreshed in the background, and
+// "status" is answered from that copy while it is fresh.
+//
+// With --web the same units are shown on a dashboard (cli_web.c). A page
+// gets a view of each unit built from what the server already knows: the
+// status copies, the monitor's events and the filtered temperature. Views
+// are pushed when they change, so an open page costs the units nothing.
+// Local units get a status copy too, refreshed every few seconds and after
+// each control request. Controls posted by a page join the control queue
+// behind those from stdin and a worker answers them through cli_web.c.
+//
+// Only the handful of JSON shapes the protocol needs are parsed, in place,
+// without allocating.
+
+#include "cli_serve.h"
+#include "cli_web.h"
+#include "budc_thread.h"
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+#include <io.h>
+#define dup _dup
+#define dup2 _dup2
+#define fdopen _fdopen
+#define fileno _fileno
+#else
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#endif
+
+// --- CONFIGURATION ---
+#define SERVE_WORKERS 4
+#define SERVE_QUEUE_SIZE 64
+#define SERVE_LINE_MAX 1024
+#define SERVE_RESULT_MAX 4096          // A devices list of a few dozen units
+#define SERVE_WAIT_LOCK_MS 5000
+#define SERVE_CONTROL_WEIGHT 8
+#define SERVE_CONTROL_QUEUE 0          // Unbounded: set commands are never refused
+#define SERVE_OBSERVE_WEIGHT 1
+#define SERVE_OBSERVE_QUEUE 2          // Waiting for the port
+#define SERVE_OBSERVE_PENDING 8        // Waiting for a worker
+#define SERVE_MAX_UNITS 64
+#define SERVE_MAX_PEERS 8
+#define SERVE_PEER_PENDING 64          // Requests passed to one peer and not answered yet
+#define SERVE_PEER_START_MS 10000      // For a peer to list its units
+#define SERVE_PEER_REFRESH_MS 1000     // Status copy refresh for peer units
+#define SERVE_PEER_STALE_MS 3000       // Older copies are not served
+#define SERVE_PEER_CALL_MS 30000       // Dashboard controls passed to a peer
+#define SERVE_LOCAL_REFRESH_MS 5000    // --web: status copy of local units; lock and temperature come from the monitor
+#define SERVE_VIEW_MAX 768
+
+#define RPC_PARSE_ERROR -32700
+#define RPC_INVALID_REQUEST -32600
+#define RPC_METHOD_NOT_FOUND -32601
+#define RPC_INVALID_PARAMS -32602
+#define RPC_DEVICE_ERROR -32000
+#define RPC_BUSY -32001                 // Too many observe requests waiting for the port; retry later
+
+// NODE methods are answered by this process without touching a unit
+typedef enum { SERVE_CONTROL = 0, SERVE_OBSERVE = 1, SERVE_NODE = 2 } serve_class;
+
+typedef struct {
+    budc_device* dev;              // NULL for a peer's unit
+    budc_client* control;
+    budc_client* observe;
+    char serial[64];
+    char port[128];
+    int peer;                      // Index into srv.peers, -1 for a local unit
+    char status[256];              // Last status result, guarded by the peer's lock or srv.view_lock for local units
+    double status_ms;              // When it arrived, 0 if none or dropped
+    bool refreshing;               // A status refresh is on its way to the peer
+    int locked;                    // From lock events, -1 before the first; guarded by srv.view_lock, like below
+    int health;                    // budc_health, from health events
+    unsigned long long alarms;     // Active alarm rules, by id below 64
+    char view[SERVE_VIEW_MAX];     // Last view pushed to the dashboard, refresher thread only
+} serve_unit;
+
+// A dashboard control passed to a peer, waited for by the worker running it
+typedef struct {
+    char* reply;
+    size_t len;
+    bool done;
+    budc_cond cond;
+} serve_wait;
+
+#define PEER_SLOT_LIST -2          // pending[].unit: the startup "devices" request
+#define PEER_SLOT_CLIENT -1        // pending[].unit: a client's request, answered under its own id
+#define PEER_SLOT_WAIT -3          // pending[].unit: a dashboard control, answered into pending[].wait
+
+typedef struct {
+    const char* command;
+    FILE* to;                      // The peer's stdin
+    FILE* from;
+    long pid;
+    budc_thread reader;
+    bool reading;
+    budc_mutex lock;               // Guards everything below, and writes to the peer
+    budc_cond listed;
+    bool gone;
+    char list[SERVE_RESULT_MAX];   // Result of the startup "devices" request
+    bool have_list;
+    struct { bool used; int unit; char id[72]; serve_wait* wait; } pending[SERVE_PEER_PENDING];
+} serve_peer;
+
+static struct {
+    serve_unit units[SERVE_MAX_UNITS];
+    int unit_count;
+    serve_peer peers[SERVE_MAX_PEERS];
+    int peer_count;
+    budc_thread refresher;
+    bool refreshing;
+    budc_cond refresh_wake;
+    bool stopping;                 // Refresher exit, guarded by queue_lock
+    bool stdio;
+    bool web;
+    budc_mutex view_lock;
+    FILE* out;                     // The protocol stream; stdout itself goes to stderr
+    budc_mutex out_lock;           // Keeps each output line whole
+    budc_mutex queue_lock;
+    budc_cond not_empty, not_full;
+    char queue[2][SERVE_QUEUE_SIZE][SERVE_LINE_MAX];  // Indexed by serve_class
+    unsigned long call[2][SERVE_QUEUE_SIZE];          // The web call a request came from, 0 for stdin
+    unsigned int head[2], count[2];
+    unsigned long busy_replies;    // Observe requests refused at intake
+    bool closing;                  // No more requests are taken
+} srv;
+
+static const char* health_names[] = { "ok", "degraded", "recovering", "failed" };
+
+// Set while a worker runs a web call: its response goes here instead
+static BUDC_THREAD_LOCAL char* capture;
+static BUDC_THREAD_LOCAL size_t capture_len;
+static volatile sig_atomic_t interrupted;
+
+// --- OUTPUT ---
+static void write_line(const char* line) {
+    budc_mutex_lock(&srv.out_lock);
+    fputs(line, srv.out);
+    fputc('\n', srv.out);
+    fflush(srv.out);
+    budc_mutex_unlock(&srv.out_lock);
+}
+
+static void json_escape(const char* in, char* out, size_t len) {
+    size_t n = 0;
+    for (; *in && n + 7 < len; in++) {
+        unsigned char ch = (unsigned char)*in;
+        if (ch == '"' || ch == '\\') { out[n++] = '\\'; out[n++] = ch; }
+        else if (ch == '\n') { out[n++] = '\\'; out[n++] = 'n'; }
+        else if (ch == '\r') { out[n++] = '\\'; out[n++] = 'r'; }
+        else if (ch == '\t') { out[n++] = '\\'; out[n++] = 't'; }
+        else if (ch < 0x20) n += snprintf(out + n, len - n, "\\u%04x", ch);
+        else out[n++] = ch;
+    }
+    out[n] = '\0';
+}
+
+static void reply_result(const char* id, const char* result) {
+    char line[SERVE_RESULT_MAX + 256];
+    snprintf(capture ? capture : line, capture ? capture_len : sizeof(line),
+             "{\"jsonrpc\":\"2.0\",\"id\":%s,\"result\":%s}", id, result);
+    if (!capture) write_line(line);
+}
+
+static void reply_error(const char* id, int code, const char* message) {
+    char line[512];
+    snprintf(capture ? capture : line, capture ? capture_len : sizeof(line),
+             "{\"jsonrpc\":\"2.0\",\"id\":%s,\"error\":{\"code\":%d,\"message\":\"%s\"}}", id, code, message);
+    if (!capture) write_line(line);
+}
+
+// --- JSON SCANNING ---
+static const char* skip_ws(const char* p) {
+    while (*p == ' ' || *p == '\t' || *p == '\r' || *p == '\n') p++;
+    return p;
+}
+
+static const char* skip_string(const char* p) {
+    for (p++; *p && *p != '"'; p++) {
+        if (*p == '\\' && p[1]) p++;
+    }
+    return *p ? p + 1 : NULL;
+}
+
+// Returns the first character after the value starting at p, NULL if malformed
+static const char* skip_value(const char* p) {
+    if (*p == '"') return skip_string(p);
+    if (*p == '{' || *p == '[') {
+        int depth = 0;
+        while (*p) {
+            if (*p == '"') { p = skip_string(p); if (!p) return NULL; continue; }
+            if (*p == '{' || *p == '[') depth++;
+            else if (*p == '}' || *p == ']') { if (--depth == 0) return p + 1; }
+            p++;
+        }
+        return NULL;
+    }
+    while (*p && *p != ',' && *p != '}' && *p != ']' && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+    return p;
+}
+
+// Value of a top-level key of the object at obj, NULL if absent
+static const char* json_get(const char* obj, const char* key) {
+    if (!obj) return NULL;
+    const char* p = skip_ws(obj);
+    if (*p != '{') return NULL;
+    p = skip_ws(p + 1);
+    size_t key_len = strlen(key);
+    while (*p == '"') {
+        const char* name = p + 1;
+        const char* end = skip_string(p);
+        if (!end) return NULL;
+        bool match = (size_t)(end - 1 - name) == key_len && strncmp(name, key, key_len) == 0;
+        p = skip_ws(end);
+        if (*p != ':') return NULL;
+        p = skip_ws(p + 1);
+        if (match) return p;
+        p = skip_value(p);
+        if (!p) return NULL;
+        p = skip_ws(p);
+        if (*p != ',') return NULL;
+        p = skip_ws(p + 1);
+    }
+    return NULL;
+}
+
+static int json_string(const char* v, char* out, size_t len) {
+    if (!v || *v != '"' || len == 0) return -1;
+    size_t n = 0;
+    for (v++; *v && *v != '"'; v++) {
+        char ch = *v;
+        if (ch == '\\') {
+            v++;
+            switch (*v) {
+            case 'n': ch = '\n'; break;
+            case 'r': ch = '\r'; break;
+            case 't': ch = '\t'; break;
+            case 'u': ch = '?'; for (int i = 0; i < 4 && v[1]; i++) v++; break;
+            case '\0': return -1;
+            default: ch = *v; break;
+            }
+        }
+        if (n + 1 < len) out[n++] = ch;
+    }
+    out[n] = '\0';
+    return *v == '"' ? 0 : -1;
+}
+
+static int json_number(const char* v, double* out) {
+    char* end;
+    if (!v) return -1;
+    *out = strtod(v, &end);
+    return end == v ? -1 : 0;
+}
+
+static int json_bool(const char* v, bool* out) {
+    if (!v) return -1;
+    if (strncmp(v, "true", 4) == 0) { *out = true; return 0; }
+    if (strncmp(v, "false", 5) == 0) { *out = false; return 0; }
+    return -1;
+}
+
+// --- METHODS ---
+// Each fills result with a JSON value, or returns an RPC error code and
+// points *error at a message.
+typedef int (*serve_method)(serve_unit* u, const char* params, char* result, size_t len, const char** error);
+
+static int device_error(const char** error) {
+    *error = "device did not respond";
+    return RPC_DEVICE_ERROR;
+}
+
+static int m_ping(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    (void)u; (void)params; (void)error;
+    snprintf(result, len, "\"pong\"");
+    return 0;
+}
+
+static int m_identity(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    char identity[256], escaped[512];
+    (void)params;
+    if (budc_get_identity(u->dev, identity, sizeof(identity)) != 0) return device_error(error);
+    json_escape(identity, escaped, sizeof(escaped));
+    snprintf(result, len, "{\"identity\":\"%s\"}", escaped);
+    return 0;
+}
+
+static int format_temp(serve_unit* u, char* out, size_t len) {
+    float temp_c;
+    double age_ms = 0.0;
+    if (budc_get_temperature_filtered(u->dev, &temp_c, &age_ms) == 0
+        || budc_get_temperature_c(u->dev, &temp_c) == 0) {
+        snprintf(out, len, "%.2f", temp_c);
+        return 0;
+    }
+    snprintf(out, len, "null");
+    return -1;
+}
+
+static int m_status(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double freq_ghz;
+    bool locked;
+    int power;
+    char temp[32];
+    (void)params;
+    if (budc_get_frequency_ghz(u->dev, &freq_ghz) != 0 || budc_get_lock_status(u->dev, &locked) != 0
+        || budc_get_power_level(u->dev, &power) != 0) return device_error(error);
+    format_temp(u, temp, sizeof(temp));
+    snprintf(result, len, "{\"freq_ghz\":%.10g,\"locked\":%s,\"temp_c\":%s,\"power\":%d}",
+             freq_ghz, locked ? "true" : "false", temp, power);
+    return 0;
+}
+
+static int m_get_freq(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double freq_ghz;
+    (void)params;
+    if (budc_get_frequency_ghz(u->dev, &freq_ghz) != 0) return device_error(error);
+    snprintf(result, len, "{\"freq_ghz\":%.10g}", freq_ghz);
+    return 0;
+}
+
+static int m_get_lock(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    bool locked;
+    (void)params;
+    if (budc_get_lock_status(u->dev, &locked) != 0) return device_error(error);
+    snprintf(result, len, "{\"locked\":%s}", locked ? "true" : "false");
+    return 0;
+}
+
+static int m_get_temp(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    char temp[32];
+    (void)params;
+    if (!budc_temperature_supported(u->dev)) { *error = "temperature not supported"; return RPC_DEVICE_ERROR; }
+    if (format_temp(u, temp, sizeof(temp)) != 0) return device_error(error);
+    snprintf(result, len, "{\"temp_c\":%s}", temp);
+    return 0;
+}
+
+static int m_get_power(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    int power;
+    (void)params;
+    if (budc_get_power_level(u->dev, &power) != 0) return device_error(error);
+    snprintf(result, len, "{\"power\":%d}", power);
+    return 0;
+}
+
+// Frequency from any of ghz / mhz / hz, in Hz; -1 if none given
+static double param_freq_hz(const char* params) {
+    double value;
+    if (json_number(json_get(params, "ghz"), &value) == 0) return value * 1e9;
+    if (json_number(json_get(params, "mhz"), &value) == 0) return value * 1e6;
+    if (json_number(json_get(params, "hz"), &value) == 0) return value;
+    return -1.0;
+}
+
+// Optional "wait": true on set methods waits for lock before replying
+static int finish_set(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    bool wait = false;
+    double timeout = SERVE_WAIT_LOCK_MS;
+    json_bool(json_get(params, "wait"), &wait);
+    json_number(json_get(params, "timeout_ms"), &timeout);
+    if (wait && budc_wait_for_lock(u->dev, (unsigned int)timeout) != 0) {
+        *error = "no lock within timeout";
+        return RPC_DEVICE_ERROR;
+    }
+    snprintf(result, len, "true");
+    return 0;
+}
+
+static int m_set_freq(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double hz = param_freq_hz(params);
+    if (hz < 0) { *error = "expected ghz, mhz or hz"; return RPC_INVALID_PARAMS; }
+    if (budc_set_frequency_hz(u->dev, hz) != 0) return device_error(error);
+    return finish_set(u, params, result, len, error);
+}
+
+static int m_set_power(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double level;
+    if (json_number(json_get(params, "level"), &level) != 0 || level < 0) {
+        *error = "expected level";
+        return RPC_INVALID_PARAMS;
+    }
+    if (budc_set_power_level(u->dev, (int)level) != 0) return device_error(error);
+    snprintf(result, len, "true");
+    return 0;
+}
+
+static int m_apply(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double level = -1.0;
+    double hz = param_freq_hz(params);
+    json_number(json_get(params, "power"), &level);
+    if (hz < 0 && level < 0) { *error = "expected a frequency and/or power"; return RPC_INVALID_PARAMS; }
+    if (budc_apply_settings(u->dev, hz, level >= 0 ? (int)level : -1) != 0) return device_error(error);
+    return finish_set(u, params, result, len, error);
+}
+
+static int m_preset(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    (void)params;
+    if (budc_preset(u->dev) != 0) return device_error(error);
+    snprintf(result, len, "true");
+    return 0;
+}
+
+static int m_save(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    bool now = false;
+    json_bool(json_get(params, "now"), &now);
+    if ((now ? budc_flush_save(u->dev) : budc_save_settings(u->dev)) != 0) return device_error(error);
+    snprintf(result, len, "true");
+    return 0;
+}
+
+static int m_wait_lock(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    double timeout = SERVE_WAIT_LOCK_MS;
+    (void)error;
+    json_number(json_get(params, "timeout_ms"), &timeout);
+    double start = budc_now_ms();
+    bool locked = budc_wait_for_lock(u->dev, (unsigned int)timeout) == 0;
+    snprintf(result, len, "{\"locked\":%s,\"elapsed_ms\":%.1f}", locked ? "true" : "false", budc_now_ms() - start);
+    return 0;
+}
+
+static int m_raw(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    char command[256], reply[512], escaped[1024];
+    if (json_string(json_get(params, "command"), command, sizeof(command)) != 0) {
+        *error = "expected command";
+        return RPC_INVALID_PARAMS;
+    }
+    reply[0] = '\0';
+    if (budc_send_raw_command(u->dev, command, reply, sizeof(reply)) != 0) return device_error(error);
+    json_escape(reply, escaped, sizeof(escaped));
+    snprintf(result, len, "{\"reply\":\"%s\"}", escaped);
+    return 0;
+}
+
+static int m_stats(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    budc_stats st;
+    (void)params;
+    if (budc_get_stats(u->dev, &st) != 0) return device_error(error);
+    snprintf(result, len,
+             "{\"transactions\":%lu,\"timeouts\":%lu,\"fast_failures\":%lu,\"recoveries\":%lu,"
+             "\"latency_p50_ms\":%.2f,\"latency_p99_ms\":%.2f,\"latency_max_ms\":%.2f,\"relocks\":%lu,\"late_replies\":%lu,"
+             "\"saves\":%lu,\"saves_coalesced\":%lu,\"save_busy_ms\":%.1f,\"save_max_ms\":%.1f,\"save_pending\":%s}",
+             st.transactions, st.timeouts, st.fast_failures, st.recoveries,
+             budc_stats_latency_percentile(&st, 50), budc_stats_latency_percentile(&st, 99),
+             st.latency_max_ms, st.relocks, st.late_replies, st.saves, st.saves_coalesced,
+             st.save_busy_ms, st.save_max_ms, budc_save_pending(u->dev) ? "true" : "false");
+
+    // Per-client shares go in before the closing brace
+    budc_client* clients[] = { u->control, u->observe };
+    size_t n = strlen(result) - 1;
+    n += snprintf(result + n, len - n, ",\"clients\":[");
+    for (int i = 0; i < 2 && n < len; i++) {
+        budc_client_stats cs;
+        if (budc_client_get_stats(clients[i], &cs) != 0) continue;
+        n += snprintf(result + n, len - n,
+                      "%s{\"name\":\"%s\",\"weight\":%u,\"transactions\":%lu,\"rejected\":%lu,\"bytes\":%lu,"
+                      "\"wait_p50_ms\":%.2f,\"wait_p99_ms\":%.2f,\"wait_max_ms\":%.2f}",
+                      i ? "," : "", cs.name, cs.weight, cs.transactions, cs.rejected, cs.bytes,
+                      budc_client_wait_percentile(&cs, 50), budc_client_wait_percentile(&cs, 99), cs.wait_max_ms);
+    }
+    budc_mutex_lock(&srv.queue_lock);
+    unsigned long busy = srv.busy_replies;
+    budc_mutex_unlock(&srv.queue_lock);
+    if (n < len) snprintf(result + n, len - n, "],\"busy_replies\":%lu}", busy);
+    return 0;
+}
+
+// Every unit this server can reach, local ones first
+static int m_devices(serve_unit* u, const char* params, char* result, size_t len, const char** error) {
+    (void)u; (void)params; (void)error;
+    size_t n = (size_t)snprintf(result, len, "[");
+    for (int i = 0; i < srv.unit_count; i++) {
+        const serve_unit* d = &srv.units[i];
+        char serial[128], port[256], node[512], entry[1024];
+        json_escape(d->serial, serial, sizeof(serial));
+        json_escape(d->port, port, sizeof(port));
+        json_escape(d->peer < 0 ? "local" : srv.peers[d->peer].command, node, sizeof(node));
+        int w = snprintf(entry, sizeof(entry), "%s{\"device\":\"%s\",\"port\":\"%s\",\"node\":\"%s\"}",
+                         i ? "," : "", serial, port, node);
+        if (n + (size_t)w + 2 > len) break;  // Keep the JSON whole
+        memcpy(result + n, entry, (size_t)w + 1);
+        n += (size_t)w;
+    }
+    snprintf(result + n, len - n, "]");
+    return 0;
+}
+
+// cls: which client runs it on the unit's port, see the top of this file
+static const struct { const char* name; serve_method fn; serve_class cls; } methods[] = {
+    { "ping", m_ping, SERVE_NODE },             { "devices", m_devices, SERVE_NODE },
+    { "identity", m_identity, SERVE_OBSERVE },  { "status", m_status, SERVE_OBSERVE },
+    { "get_freq", m_get_freq, SERVE_OBSERVE },  { "get_lock", m_get_lock, SERVE_OBSERVE },
+    { "get_temp", m_get_temp, SERVE_OBSERVE },  { "get_power", m_get_power, SERVE_OBSERVE },
+    { "stats", m_stats, SERVE_OBSERVE },        { "set_freq", m_set_freq, SERVE_CONTROL },
+    { "set_power", m_set_power, SERVE_CONTROL }, { "apply", m_apply, SERVE_CONTROL },
+    { "preset", m_preset, SERVE_CONTROL },      { "save", m_save, SERVE_CONTROL },
+    { "wait_lock", m_wait_lock, SERVE_CONTROL }, { "raw", m_raw, SERVE_CONTROL },
+};
+
+// --- DASHBOARD ---
+static void wake_refresher(void) {
+    budc_mutex_lock(&srv.queue_lock);
+    budc_cond_broadcast(&srv.refresh_wake);
+    budc_mutex_unlock(&srv.queue_lock);
+}
+
+// Keeps what the view needs from an event's params and shows the event
+static void show_event(serve_unit* u, const char* params) {
+    char type[16], state[16];
+    bool locked;
+    double rule;
+    if (json_string(json_get(params, "type"), type, sizeof(type)) != 0) return;
+    budc_mutex_lock(&srv.view_lock);
+    if (strcmp(type, "lock") == 0 && json_bool(json_get(params, "locked"), &locked) == 0) {
+        u->locked = locked;
+    } else if (strcmp(type, "health") == 0 && json_string(json_get(params, "state"), state, sizeof(state)) == 0) {
+        for (int i = 0; i < 4; i++) if (strcmp(health_names[i], state) == 0) u->health = i;
+    } else if (strncmp(type, "alarm_", 6) == 0 && json_number(json_get(params, "rule"), &rule) == 0
+               && rule >= 0 && rule < 64) {
+        if (strcmp(type, "alarm_raised") == 0) u->alarms |= 1ULL << (int)rule;
+        else u->alarms &= ~(1ULL << (int)rule);
+    }
+    budc_mutex_unlock(&srv.view_lock);
+    web_publish("event", NULL, params);
+    wake_refresher();  // Its view has likely changed too
+}
+
+// params points into a relayed event line
+static void show_peer_event(int peer, const char* params) {
+    char device[64], object[512];
+    const char* end = params ? skip_value(params) : NULL;
+    if (!end || (size_t)(end - params) >= sizeof(object)) return;
+    if (json_string(json_get(params, "device"), device, sizeof(device)) != 0) return;
+    snprintf(object, sizeof(object), "%.*s", (int)(end - params), params);
+    for (int i = 0; i < srv.unit_count; i++) {
+        if (srv.units[i].peer == peer && strcmp(srv.units[i].serial, device) == 0) show_event(&srv.units[i], object);
+    }
+}
+
+// After a control request: the next view reads the unit again
+static void view_stale(serve_unit* u) {
+    budc_mutex_lock(&srv.view_lock);
+    u->status_ms = 0;
+    budc_mutex_unlock(&srv.view_lock);
+    wake_refresher();
+}
+
+// Status copy of a local unit, read as its observe client like any poller
+static void refresh_local(serve_unit* u) {
+    char result[sizeof(u->status)];
+    const char* error;
+    budc_client_attach(u->observe);
+    int code = m_status(u, NULL, result, sizeof(result), &error);
+    budc_mutex_lock(&srv.view_lock);
+    if (code == 0) memcpy(u->status, result, sizeof(result));
+    u->status_ms = budc_now_ms();  // A failed read is retried on the same schedule
+    budc_mutex_unlock(&srv.view_lock);
+}
+
+// Raw JSON value of key in obj, "null" if absent
+static void copy_value(const char* obj, const char* key, char* out, size_t len) {
+    const char* v = json_get(obj, key);
+    const char* end = v ? skip_value(v) : NULL;
+    if (!end || end == v || (size_t)(end - v) >= len) snprintf(out, len, "null");
+    else snprintf(out, len, "%.*s", (int)(end - v), v);
+}
+
+// What the page shows for a unit. Nothing here touches a port: events are
+// newer than the status copy where both have a value.
+static void build_view(serve_unit* u, char* out, size_t len) {
+    char status[sizeof(u->status)], freq[32], power[32], locked[8], temp[32], alarms[256] = "";
+    char serial[128], port[256], node[512];
+    float temp_c;
+    double age_ms;
+    budc_mutex* lock = u->peer >= 0 ? &srv.peers[u->peer].lock : &srv.view_lock;
+    budc_mutex_lock(lock);
+    memcpy(status, u->status, sizeof(status));
+    budc_mutex_unlock(lock);
+    copy_value(status, "freq_ghz", freq, sizeof(freq));
+    copy_value(status, "power", power, sizeof(power));
+    copy_value(status, "locked", locked, sizeof(locked));
+    // A tenth of a degree, so sensor noise does not push a new view every sample
+    if (u->dev && budc_get_temperature_filtered(u->dev, &temp_c, &age_ms) == 0) snprintf(temp, sizeof(temp), "%.1f", temp_c);
+    else copy_value(status, "temp_c", temp, sizeof(temp));
+
+    budc_mutex_lock(&srv.view_lock);
+    if (u->locked >= 0) snprintf(locked, sizeof(locked), "%s", u->locked ? "true" : "false");
+    int health = u->health;
+    unsigned long long active = u->alarms;
+    budc_mutex_unlock(&srv.view_lock);
+    size_t n = 0;
+    for (int i = 0; i < 64 && n + 8 < sizeof(alarms); i++) {
+        if (active & (1ULL << i)) n += (size_t)snprintf(alarms + n, sizeof(alarms) - n, "%s%d", n ? "," : "", i);
+    }
+    json_escape(u->serial, serial, sizeof(serial));
+    json_escape(u->port, port, sizeof(port));
+    json_escape(u->peer < 0 ? "local" : srv.peers[u->peer].command, node, sizeof(node));
+    snprintf(out, len,
+             "{\"device\":\"%s\",\"port\":\"%s\",\"node\":\"%s\",\"freq_ghz\":%s,\"power\":%s,\"locked\":%s,"
+             "\"temp_c\":%s,\"health\":\"%s\",\"alarms\":[%s]}",
+             serial, port, node, freq, power, locked, temp, health_names[health], alarms);
+}
+
+// Refresher thread only: pushes the views that changed
+static void publish_views(void) {
+    char view[SERVE_VIEW_MAX];
+    for (int i = 0; i < srv.unit_count; i++) {
+        serve_unit* u = &srv.units[i];
+        build_view(u, view, sizeof(view));
+        if (strcmp(view, u->view) == 0) continue;
+        memcpy(u->view, view, sizeof(view));
+        web_publish("status", u->serial, view);
+    }
+}
+
+// --- PEERS ---
+// Peer lock held. Returns -1 when every slot is taken.
+static int claim_slot(serve_peer* p, int unit, const char* id) {
+    for (int i = 0; i < SERVE_PEER_PENDING; i++) {
+        if (p->pending[i].used) continue;
+        p->pending[i].used = true;
+        p->pending[i].unit = unit;
+        p->pending[i].wait = NULL;
+        snprintf(p->pending[i].id, sizeof(p->pending[i].id), "%s", id ? id : "null");
+        return i;
+    }
+    return -1;
+}
+
+// Peer lock held
+static int send_to_peer(serve_peer* p, const char* line) {
+    if (p->gone || !p->to) return -1;
+    if (fputs(line, p->to) < 0 || fputc('\n', p->to) == EOF || fflush(p->to) != 0) return -1;
+    return 0;
+}
+
+// The request as the peer sees it: our slot as the id (none for a
+// notification), and the unit named even if the client left it to default
+static void build_forward(char* out, size_t len, int slot, const char* method, const char* params, const serve_unit* u) {
+    char id[24] = "", name[96], serial[128];
+    json_escape(method, name, sizeof(name));
+    json_escape(u->serial, serial, sizeof(serial));
+    if (slot >= 0) snprintf(id, sizeof(id), "\"id\":%d,", slot);
+    const char* end = params && *params == '{' ? skip_value(params) : NULL;
+    if (end && json_get(params, "device")) {
+        snprintf(out, len, "{\"jsonrpc\":\"2.0\",%s\"method\":\"%s\",\"params\":%.*s}",
+                 id, name, (int)(end - params), params);
+    } else if (end && *skip_ws(params + 1) != '}') {
+        snprintf(out, len, "{\"jsonrpc\":\"2.0\",%s\"method\":\"%s\",\"params\":{\"device\":\"%s\",%.*s}",
+                 id, name, serial, (int)(end - params - 1), params + 1);
+    } else {
+        snprintf(out, len, "{\"jsonrpc\":\"2.0\",%s\"method\":\"%s\",\"params\":{\"device\":\"%s\"}}",
+                 id, name, serial);
+    }
+}
+
+// Peer lock held. Hands a web call its response and wakes it.
+static void finish_wait(serve_peer* p, int slot, const char* line) {
+    serve_wait* w = p->pending[slot].wait;
+    snprintf(w->reply, w->len, "%s", line);
+    w->done = true;
+    budc_cond_signal(&w->cond);
+}
+
+// Peer lock held. A web call (see capture) waits here for the peer's answer.
+static void wait_for_peer(serve_peer* p, int slot) {
+    serve_wait w;
+    w.reply = capture;
+    w.len = capture_len;
+    w.done = false;
+    budc_cond_init(&w.cond);
+    p->pending[slot].wait = &w;
+    double deadline = budc_now_ms() + SERVE_PEER_CALL_MS;
+    while (!w.done && !p->gone) {
+        double left = deadline - budc_now_ms();
+        if (left <= 0) break;
+        budc_cond_timedwait(&w.cond, &p->lock, (unsigned int)left + 1);
+    }
+    if (!w.done) {
+        // Nothing may write to w once this returns
+        p->pending[slot].used = false;
+        snprintf(w.reply, w.len, "{\"jsonrpc\":\"2.0\",\"id\":%s,\"error\":{\"code\":%d,\"message\":\"%s\"}}",
+                 p->pending[slot].id, RPC_DEVICE_ERROR, p->gone ? "peer gone" : "peer did not answer");
+    }
+    budc_cond_destroy(&w.cond);
+}
+
+// id is NULL for a notification
+static void forward_request(serve_unit* u, const char* method, const char* params, const char* id) {
+    serve_peer* p = &srv.peers[u->peer];
+    char line[SERVE_LINE_MAX + 256], copy[sizeof(u->status)];
+
+    budc_mutex_lock(&p->lock);
+    if (strcmp(method, "status") == 0 && u->status_ms > 0 && budc_now_ms() - u->status_ms < SERVE_PEER_STALE_MS) {
+        memcpy(copy, u->status, sizeof(copy));
+        budc_mutex_unlock(&p->lock);
+        if (id) reply_result(id, copy);
+        return;
+    }
+    int slot = -1;
+    if (id && (slot = claim_slot(p, capture ? PEER_SLOT_WAIT : PEER_SLOT_CLIENT, id)) < 0) {
+        budc_mutex_unlock(&p->lock);
+        reply_error(id, RPC_BUSY, "busy");
+        return;
+    }
+    build_forward(line, sizeof(line), slot, method, params, u);
+    int sent = send_to_peer(p, line);
+    if (sent != 0 && slot >= 0) p->pending[slot].used = false;
+    if (sent == 0 && slot >= 0 && capture) wait_for_peer(p, slot);
+    budc_mutex_unlock(&p->lock);
+    if (sent != 0 && id) reply_error(id, RPC_DEVICE_ERROR, "peer gone");
+}
+
+static void on_peer_reply(serve_peer* p, int slot, const char* line, const char* id_value) {
+    char id[72], out[SERVE_RESULT_MAX + 256];
+    const char* result = json_get(line, "result");
+    const char* end = result ? skip_value(result) : NULL;
+    size_t result_len = end ? (size_t)(end - result) : 0;
+
+    budc_mutex_lock(&p->lock);
+    if (!p->pending[slot].used) { budc_mutex_unlock(&p->lock); return; }
+    int unit = p->pending[slot].unit;
+    memcpy(id, p->pending[slot].id, sizeof(id));
+    // The client's id in place of our slot number
+    snprintf(out, sizeof(out), "%.*s%s%s", (int)(id_value - line), line, id, skip_value(id_value));
+    if (unit == PEER_SLOT_WAIT) finish_wait(p, slot, out);
+    p->pending[slot].used = false;
+    if (unit == PEER_SLOT_LIST) {
+        p->list[0] = '\0';
+        if (end && result_len < sizeof(p->list)) snprintf(p->list, sizeof(p->list), "%.*s", (int)result_len, result);
+        p->have_list = true;
+        budc_cond_broadcast(&p->listed);
+    } else if (unit >= 0) {
+        serve_unit* u = &srv.units[unit];
+        u->refreshing = false;
+        if (end && result_len < sizeof(u->status)) {
+            snprintf(u->status, sizeof(u->status), "%.*s", (int)result_len, result);
+            u->status_ms = budc_now_ms();
+        }
+    }
+    budc_mutex_unlock(&p->lock);
+
+    if (unit == PEER_SLOT_CLIENT) write_line(out);
+}
+
+// A lock change makes the copied status wrong; the next status goes through
+static void drop_status_copy(int peer, const char* params) {
+    char type[16], device[64];
+    if (json_string(json_get(params, "type"), type, sizeof(type)) != 0 || strcmp(type, "lock") != 0) return;
+    if (json_string(json_get(params, "device"), device, sizeof(device)) != 0) return;
+    budc_mutex_lock(&srv.peers[peer].lock);
+    for (int i = 0; i < srv.unit_count; i++) {
+        if (srv.units[i].peer == peer && strcmp(srv.units[i].serial, device) == 0) srv.units[i].status_ms = 0;
+    }
+    budc_mutex_unlock(&srv.peers[peer].lock);
+}
+
+static void* peer_reader(void* arg) {
+    serve_peer* p = arg;
+    int index = (int)(p - srv.peers);
+    char line[SERVE_RESULT_MAX + 256];
+    while (fgets(line, sizeof(line), p->from)) {
+        line[strcspn(line, "\r\n")] = '\0';
+        const char* id = json_get(line, "id");
+        double slot;
+        if (id && json_number(id, &slot) == 0) {
+            if (slot >= 0 && slot < SERVE_PEER_PENDING) on_peer_reply(p, (int)slot, line, id);
+            continue;
+        }
+        char method[16];
+        if (json_string(json_get(line, "method"), method, sizeof(method)) == 0 && strcmp(method, "event") == 0) {
+            const char* params = json_get(line, "params");
+            drop_status_copy(index, params);
+            if (srv.stdio) write_line(line);
+            if (srv.web) show_peer_event(index, params);
+        }
+    }
+
+    // The peer is gone; nothing it owed will arrive now
+    budc_mutex_lock(&p->lock);
+    p->gone = true;
+    for (int i = 0; i < SERVE_PEER_PENDING; i++) {
+        if (!p->pending[i].used) continue;
+        if (p->pending[i].unit == PEER_SLOT_CLIENT) reply_error(p->pending[i].id, RPC_DEVICE_ERROR, "peer gone");
+        else if (p->pending[i].unit == PEER_SLOT_WAIT) budc_cond_signal(&p->pending[i].wait->cond);
+        else if (p->pending[i].unit >= 0) srv.units[p->pending[i].unit].refreshing = false;
+        p->pending[i].used = false;
+    }
+    budc_cond_broadcast(&p->listed);
+    budc_mutex_unlock(&p->lock);
+    fprintf(stderr, "Peer '%s' closed its stream.\n", p->command);
+    return NULL;
+}
+
+// Keeps a fresh status of every peer unit here, one request in flight per
+// unit. With --web it also keeps the local units' copies and the views.
+static void* refresher(void* arg) {
+    double peers_ms = 0.0;
+    (void)arg;
+    budc_mutex_lock(&srv.queue_lock);
+    while (!srv.stopping) {
+        budc_mutex_unlock(&srv.queue_lock);
+        // Events and controls wake this early; peers are still asked once a period
+        bool peers_due = budc_now_ms() - peers_ms >= SERVE_PEER_REFRESH_MS;
+        if (peers_due) peers_ms = budc_now_ms();
+        for (int i = 0; i < srv.unit_count; i++) {
+            serve_unit* u = &srv.units[i];
+            if (u->peer < 0) {
+                if (!srv.web) continue;
+                budc_mutex_lock(&srv.view_lock);
+                bool due = budc_now_ms() - u->status_ms >= SERVE_LOCAL_REFRESH_MS;
+                budc_mutex_unlock(&srv.view_lock);
+                if (due) refresh_local(u);
+                continue;
+            }
+            if (!peers_due) continue;
+            serve_peer* p = &srv.peers[u->peer];
+            char line[512];
+            budc_mutex_lock(&p->lock);
+            int slot = u->refreshing ? -1 : claim_slot(p, i, NULL);
+            if (slot >= 0) {
+                build_forward(line, sizeof(line), slot, "status", NULL, u);
+                if (send_to_peer(p, line) == 0) u->refreshing = true;
+                else p->pending[slot].used = false;
+            }
+            budc_mutex_unlock(&p->lock);
+        }
+        if (srv.web) publish_views();
+        budc_mutex_lock(&srv.queue_lock);
+        if (!srv.stopping) budc_cond_timedwait(&srv.refresh_wake, &srv.queue_lock, SERVE_PEER_REFRESH_MS);
+    }
+    budc_mutex_unlock(&srv.queue_lock);
+    return NULL;
+}
+
+#ifdef _WIN32
+static int spawn_peer(serve_peer* p) {
+    (void)p;
+    fprintf(stderr, "--peer is not supported on Windows.\n");
+    return -1;
+}
+
+static void reap_peer(serve_peer* p) { (void)p; }
+#else
+// Runs the command through the shell with its stdin and stdout on pipes
+static int spawn_peer(serve_peer* p) {
+    int in[2], out[2];
+    if (pipe(in) != 0) return -1;
+    if (pipe(out) != 0) { close(in[0]); close(in[1]); return -1; }
+    // Our ends must not leak into later peers, or this one never sees EOF
+    fcntl(in[1], F_SETFD, FD_CLOEXEC);
+    fcntl(out[0], F_SETFD, FD_CLOEXEC);
+    pid_t pid = fork();
+    if (pid == 0) {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[0]); close(in[1]); close(out[0]); close(out[1]);
+        execl("/bin/sh", "sh", "-c", p->command, (char*)NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+    if (pid < 0) { close(in[1]); close(out[0]); return -1; }
+    p->pid = (long)pid;
+    p->to = fdopen(in[1], "w");
+    p->from = fdopen(out[0], "r");
+    if (!p->to || !p->from) {
+        if (p->to) fclose(p->to); else close(in[1]);
+        if (p->from) fclose(p->from); else close(out[0]);
+        p->to = p->from = NULL;
+        waitpid(pid, NULL, 0);
+        return -1;
+    }
+    return 0;
+}
+
+static void reap_peer(serve_peer* p) {
+    if (p->pid > 0) waitpid((pid_t)p->pid, NULL, 0);
+}
+#endif
+
+// Starts the peer and asks for its units; they are added by add_peer_units
+static int start_peer(const char* command) {
+    serve_peer* p = &srv.peers[srv.peer_count];
+    memset(p, 0, sizeof(*p));
+    p->command = command;
+    budc_mutex_init(&p->lock);
+    budc_cond_init(&p->listed);
+    if (spawn_peer(p) != 0) {
+        fprintf(stderr, "Failed to start peer '%s'\n", command);
+        budc_cond_destroy(&p->listed);
+        budc_mutex_destroy(&p->lock);
+        return -1;
+    }
+    srv.peer_count++;
+    p->reading = budc_thread_create(&p->reader, peer_reader, p) == 0;
+    budc_mutex_lock(&p->lock);
+    int slot = claim_slot(p, PEER_SLOT_LIST, NULL);
+    char line[96];
+    snprintf(line, sizeof(line), "{\"jsonrpc\":\"2.0\",\"id\":%d,\"method\":\"devices\"}", slot);
+    send_to_peer(p, line);
+    budc_mutex_unlock(&p->lock);
+    return 0;
+}
+
+static void add_peer_units(int index) {
+    serve_peer* p = &srv.peers[index];
+    double deadline = budc_now_ms() + SERVE_PEER_START_MS;
+    budc_mutex_lock(&p->lock);
+    while (!p->have_list && !p->gone && p->reading) {
+        double left = deadline - budc_now_ms();
+        if (left <= 0) break;
+        budc_cond_timedwait(&p->listed, &p->lock, (unsigned int)left + 1);
+    }
+    const char* v = p->have_list ? skip_ws(p->list) : "";
+    if (*v == '[') v = skip_ws(v + 1);
+    int added = 0;
+    while (v && *v == '{' && srv.unit_count < SERVE_MAX_UNITS) {
+        serve_unit* u = &srv.units[srv.unit_count];
+        memset(u, 0, sizeof(*u));
+        if (json_string(json_get(v, "device"), u->serial, sizeof(u->serial)) == 0) {
+            json_string(json_get(v, "port"), u->port, sizeof(u->port));
+            u->peer = index;
+            u->locked = -1;
+            srv.unit_count++;
+            added++;
+        }
+        v = skip_value(v);
+        if (v) v = skip_ws(v);
+        if (!v || *v != ',') break;
+        v = skip_ws(v + 1);
+    }
+    budc_mutex_unlock(&p->lock);
+    if (added == 0) fprintf(stderr, "Peer '%s' offers no devices.\n", p->command);
+}
+
+static void stop_peer(serve_peer* p) {
+    // EOF on its stdin: it answers what it has and exits
+    budc_mutex_lock(&p->lock);
+    if (p->to) fclose(p->to);
+    p->to = NULL;
+    budc_mutex_unlock(&p->lock);
+    if (p->reading) budc_thread_join(p->reader);
+    if (p->from) fclose(p->from);
+    reap_peer(p);
+    budc_cond_destroy(&p->listed);
+    budc_mutex_destroy(&p->lock);
+}
+
+// --- DISPATCH ---
+// The id is echoed back verbatim, so strings and numbers both work
+static bool read_id(const char* request, char* id, size_t len) {
+    const char* v = json_get(request, "id");
+    const char* end = v ? skip_value(v) : NULL;
+    if (!v || !end || (size_t)(end - v) >= len || strncmp(v, "null", 4) == 0) {
+        snprintf(id, len, "null");
+        return false;
+    }
+    snprintf(id, len, "%.*s", (int)(end - v), v);
+    return true;
+}
+
+// The unit named by the "device" param, a serial or a port; the first if absent
+static serve_unit* find_unit(const char* params) {
+    char name[128];
+    if (json_string(json_get(params, "device"), name, sizeof(name)) != 0) {
+        return srv.unit_count > 0 ? &srv.units[0] : NULL;
+    }
+    for (int i = 0; i < srv.unit_count; i++) {
+        if (strcmp(srv.units[i].serial, name) == 0 || strcmp(srv.units[i].port, name) == 0) return &srv.units[i];
+    }
+    return NULL;
+}
+
+static void handle_request(const char* request) {
+    char id[72], method[48], result[SERVE_RESULT_MAX];
+    const char* error = "";
+    bool has_id = read_id(request, id, sizeof(id));
+
+    if (*skip_ws(request) != '{') { reply_error("null", RPC_PARSE_ERROR, "parse error"); return; }
+    if (json_string(json_get(request, "method"), method, sizeof(method)) != 0) {
+        reply_error(id, RPC_INVALID_REQUEST, "missing method");
+        return;
+    }
+    const char* params = json_get(request, "params");
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strcmp(methods[i].name, method) != 0) continue;
+        serve_unit* u = NULL;
+        if (methods[i].cls != SERVE_NODE) {
+            u = find_unit(params);
+            if (!u) {
+                if (has_id) reply_error(id, RPC_INVALID_PARAMS, "unknown device");
+                return;
+            }
+            if (u->peer >= 0) {
+                forward_request(u, method, params, has_id ? id : NULL);
+                return;
+            }
+            budc_client_attach(methods[i].cls == SERVE_CONTROL ? u->control : u->observe);
+        }
+        int code = methods[i].fn(u, params, result, sizeof(result), &error);
+        if (code != 0 && budc_client_rejected()) {
+            code = RPC_BUSY;
+            error = "busy";
+        }
+        if (srv.web && methods[i].cls == SERVE_CONTROL) view_stale(u);
+        if (!has_id) return;  // Notification: no response wanted
+        if (code == 0) reply_result(id, result);
+        else reply_error(id, code, error);
+        return;
+    }
+    if (has_id) reply_error(id, RPC_METHOD_NOT_FOUND, "method not found");
+}
+
+// What a dashboard page may post: the page's own controls, never raw,
+// preset or save
+static const char* const web_methods[] = { "apply", "set_freq", "set_power" };
+
+// A control posted by a dashboard page, on the web thread. Queued as a
+// control unless it is refused outright; never waits for room.
+static int web_call(const char* request, unsigned long call, char* reply, size_t len) {
+    char id[72], method[48];
+    bool allowed = false;
+    if (json_string(json_get(request, "method"), method, sizeof(method)) == 0) {
+        for (size_t i = 0; i < sizeof(web_methods) / sizeof(web_methods[0]); i++) {
+            if (strcmp(web_methods[i], method) == 0) allowed = true;
+        }
+    }
+    capture = reply;
+    capture_len = len;
+    if (!allowed) reply_error(read_id(request, id, sizeof(id)) ? id : "null", RPC_METHOD_NOT_FOUND, "method not available over the web");
+    else if (strlen(request) >= SERVE_LINE_MAX) reply_error("null", RPC_INVALID_REQUEST, "request too long");
+    capture = NULL;
+    if (reply[0]) return 0;
+
+    budc_mutex_lock(&srv.queue_lock);
+    if (srv.closing || srv.count[SERVE_CONTROL] == SERVE_QUEUE_SIZE) {
+        budc_mutex_unlock(&srv.queue_lock);
+        return -1;
+    }
+    unsigned int slot = (srv.head[SERVE_CONTROL] + srv.count[SERVE_CONTROL]) % SERVE_QUEUE_SIZE;
+    snprintf(srv.queue[SERVE_CONTROL][slot], SERVE_LINE_MAX, "%s", request);
+    srv.call[SERVE_CONTROL][slot] = call;
+    srv.count[SERVE_CONTROL]++;
+    budc_cond_signal(&srv.not_empty);
+    budc_mutex_unlock(&srv.queue_lock);
+    return 1;
+}
+
+static void* worker_main(void* arg) {
+    char request[SERVE_LINE_MAX], reply[SERVE_RESULT_MAX + 256];
+    (void)arg;
+    for (;;) {
+        budc_mutex_lock(&srv.queue_lock);
+        while (srv.count[SERVE_CONTROL] + srv.count[SERVE_OBSERVE] == 0 && !srv.closing) {
+            budc_cond_wait(&srv.not_empty, &srv.queue_lock);
+        }
+        serve_class c = srv.count[SERVE_CONTROL] ? SERVE_CONTROL : SERVE_OBSERVE;
+        if (srv.count[c] == 0) { budc_mutex_unlock(&srv.queue_lock); break; }
+        memcpy(request, srv.queue[c][srv.head[c]], SERVE_LINE_MAX);
+        unsigned long call = srv.call[c][srv.head[c]];
+        srv.head[c] = (srv.head[c] + 1) % SERVE_QUEUE_SIZE;
+        srv.count[c]--;
+        budc_cond_signal(&srv.not_full);
+        budc_mutex_unlock(&srv.queue_lock);
+        if (!call) { handle_request(request); continue; }
+        capture = reply;
+        capture_len = sizeof(reply);
+        reply[0] = '\0';
+        handle_request(request);
+        capture = NULL;
+        web_rpc_done(call, reply[0] ? reply : "null");  // A notification has no response
+    }
+    return NULL;
+}
+
+// --- EVENTS ---
+static void push_event(budc_device* dev, const budc_event* ev, void* user_data) {
+    static const char* relock[] = { "failed", "reapply", "reconnect", "preset" };
+    serve_unit* u = user_data;
+    char params[160], serial[128], object[320], line[384];
+    (void)dev;
+    switch (ev->type) {
+    case BUDC_EVENT_HEALTH_CHANGED:
+        snprintf(params, sizeof(params), "\"type\":\"health\",\"state\":\"%s\"", health_names[ev->code]);
+        break;
+    case BUDC_EVENT_LOCK_CHANGED:
+        snprintf(params, sizeof(params), "\"type\":\"lock\",\"locked\":%s", ev->code ? "true" : "false");
+        break;
+    case BUDC_EVENT_ALARM_RAISED:
+    case BUDC_EVENT_ALARM_CLEARED:
+        snprintf(params, sizeof(params), "\"type\":\"%s\",\"rule\":%d,\"value\":%.3f",
+                 ev->type == BUDC_EVENT_ALARM_RAISED ? "alarm_raised" : "alarm_cleared", ev->code, ev->value);
+        break;
+    case BUDC_EVENT_RELOCK:
+        snprintf(params, sizeof(params), "\"type\":\"relock\",\"stage\":\"%s\",\"outage_ms\":%.1f",
+                 relock[ev->code], ev->value);
+        break;
+    default:
+        return;
+    }
+    json_escape(u->serial, serial, sizeof(serial));
+    snprintf(object, sizeof(object), "{%s,\"device\":\"%s\",\"t_ms\":%.1f}", params, serial, ev->timestamp_ms);
+    if (srv.stdio) {
+        snprintf(line, sizeof(line), "{\"jsonrpc\":\"2.0\",\"method\":\"event\",\"params\":%s}", object);
+        write_line(line);
+    }
+    if (srv.web) show_event(u, object);
+}
+
+// --- SERVER ---
+static serve_class classify(const char* request) {
+    char method[48];
+    if (json_string(json_get(request, "method"), method, sizeof(method)) != 0) return SERVE_OBSERVE;
+    for (size_t i = 0; i < sizeof(methods) / sizeof(methods[0]); i++) {
+        if (strcmp(methods[i].name, method) == 0) return methods[i].cls == SERVE_CONTROL ? SERVE_CONTROL : SERVE_OBSERVE;
+    }
+    return SERVE_OBSERVE;
+}
+
+static bool is_shutdown(const char* request) {
+    char method[16];
+    return json_string(json_get(request, "method"), method, sizeof(method)) == 0 && strcmp(method, "shutdown") == 0;
+}
+
+// Anything else printed to stdout (a stray printf, a log sink pointed there)
+// would corrupt the stream, so the protocol gets its own handle on the
+// original stdout and stdout is pointed at stderr.
+static FILE* claim_stdout(void) {
+    fflush(stdout);
+    int fd = dup(fileno(stdout));
+    FILE* out = fd >= 0 ? fdopen(fd, "w") : NULL;
+    if (!out) return NULL;
+    dup2(fileno(stderr), fileno(stdout));
+    return out;
+}
+
+// Adds a unit for port_name. Ports found by scanning are skipped quietly
+// when nothing answers on them.
+static int add_local_unit(const char* port_name, const budc_connect_options* opts, bool scanned) {
+    if (srv.unit_count == SERVE_MAX_UNITS) return -1;
+    budc_device* dev = budc_connect_ex(port_name, opts);
+    if (dev && scanned && budc_get_connect_time_ms(dev) < 0) { budc_disconnect(dev); dev = NULL; }
+    if (!dev) {
+        if (!scanned) fprintf(stderr, "Failed to connect to %s\n", port_name);
+        return -1;
+    }
+    serve_unit* u = &srv.units[srv.unit_count++];
+    char identity[256];
+    memset(u, 0, sizeof(*u));
+    u->dev = dev;
+    u->peer = -1;
+    u->locked = -1;
+    snprintf(u->port, sizeof(u->port), "%s", port_name);
+    if (budc_get_identity(dev, identity, sizeof(identity)) != 0
+        || sscanf(identity, "%*[^,],%*[^,],%63[^,]", u->serial) != 1) {
+        snprintf(u->serial, sizeof(u->serial), "%s", port_name);
+    }
+    u->control = budc_client_create(dev, "control", SERVE_CONTROL_WEIGHT, SERVE_CONTROL_QUEUE);
+    u->observe = budc_client_create(dev, "observe", SERVE_OBSERVE_WEIGHT, SERVE_OBSERVE_QUEUE);
+    return 0;
+}
+
+static void on_interrupt(int sig) {
+    (void)sig;
+    interrupted = 1;
+}
+
+// One local unit uses the path as given, several get their serial appended
+static void state_file(const serve_options* opts, int locals, const serve_unit* u, char* path, size_t len) {
+    if (locals == 1) snprintf(path, len, "%s", opts->state_path);
+    else snprintf(path, len, "%s.%s", opts->state_path, u->serial);
+}
+
+int run_serve_stdio(const serve_options* opts) {
+    budc_thread workers[SERVE_WORKERS];
+    int started = 0, locals = 0;
+    char line[SERVE_LINE_MAX];
+    char shutdown_id[72] = "";
+    serial_port_info* port_list = NULL;
+
+    memset(&srv, 0, sizeof(srv));
+    srv.stdio = opts->stdio;
+    srv.out = claim_stdout();
+    if (!srv.out) { fprintf(stderr, "Cannot open the output stream.\n"); return 1; }
+    budc_mutex_init(&srv.out_lock);
+    budc_mutex_init(&srv.view_lock);
+    budc_mutex_init(&srv.queue_lock);
+    budc_cond_init(&srv.not_empty);
+    budc_cond_init(&srv.not_full);
+    budc_cond_init(&srv.refresh_wake);
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN);  // A peer that died must not take us with it
+#endif
+
+    // Peers first, so they do not inherit the serial ports
+    int result = 0;
+    for (int i = 0; i < opts->peer_count && srv.peer_count < SERVE_MAX_PEERS; i++) {
+        if (start_peer(opts->peers[i]) != 0) result = 1;
+    }
+    int found = opts->scan_all ? budc_find_ports(&port_list) : 0;
+    for (int i = 0; i < opts->port_count && result == 0; i++) {
+        if (add_local_unit(opts->ports[i], opts->connect, false) != 0) result = 1;
+    }
+    for (int i = 0; i < found && result == 0; i++) add_local_unit(port_list[i].name, opts->connect, true);
+    free(port_list);
+    locals = srv.unit_count;
+    for (int i = 0; i < srv.peer_count; i++) add_peer_units(i);
+    if (result == 0 && srv.unit_count == 0) { fprintf(stderr, "No devices to serve.\n"); result = 1; }
+
+    for (int i = 0; i < locals && result == 0; i++) {
+        serve_unit* u = &srv.units[i];
+        char path[512];
+        if (!opts->state_path) continue;
+        state_file(opts, locals, u, path, sizeof(path));
+        if (budc_restore_state(u->dev, path) == 1) fprintf(stderr, "%s was saved for another unit, starting cold.\n", path);
+    }
+    for (int i = 0; i < locals && result == 0 && opts->save; i++) budc_set_save_policy(srv.units[i].dev, opts->save);
+    for (int i = 0; i < locals && result == 0 && opts->cal_path; i++) {
+        if (budc_load_calibration(srv.units[i].dev, opts->cal_path) != 0) {
+            fprintf(stderr, "No calibration for %s in %s, power is not corrected.\n", srv.units[i].serial, opts->cal_path);
+        }
+    }
+    for (int i = 0; i < SERVE_WORKERS && result == 0; i++) {
+        if (budc_thread_create(&workers[started], worker_main, NULL) == 0) started++;
+    }
+    if (result == 0 && started == 0) { fprintf(stderr, "Failed to start workers.\n"); result = 1; }
+    if (result == 0 && opts->web) {
+        if (web_start(opts->web, web_call) != 0) result = 1;
+        else fprintf(stderr, "Dashboard on http://%s%s/\n", strchr(opts->web, ':') ? "" : "127.0.0.1:", opts->web);
+        srv.web = result == 0;
+    }
+    if (result == 0) {
+        for (int i = 0; i < locals; i++) {
+            budc_set_event_callback(srv.units[i].dev, push_event, &srv.units[i]);
+            budc_monitor_start(srv.units[i].dev, NULL);
+        }
+        srv.refreshing = (srv.peer_count > 0 || srv.web) && budc_thread_create(&srv.refresher, refresher, NULL) == 0;
+        if (srv.stdio) write_line("{\"jsonrpc\":\"2.0\",\"method\":\"ready\",\"params\":{}}");
+    }
+
+    // Without stdin the dashboard runs until the process is told to stop
+    if (result == 0 && !srv.stdio) {
+        signal(SIGINT, on_interrupt);
+        signal(SIGTERM, on_interrupt);
+        while (!interrupted) budc_sleep_ms(200);
+    }
+    while (result == 0 && srv.stdio && fgets(line, sizeof(line), stdin)) {
+        size_t n = strlen(line);
+        if (n == sizeof(line) - 1 && line[n - 1] != '\n') {
+            int ch;
+            while ((ch = getchar()) != EOF && ch != '\n') {}
+            reply_error("null", RPC_INVALID_REQUEST, "request too long");
+            continue;
+        }
+        while (n > 0 && (line[n - 1] == '\n' || line[n - 1] == '\r')) line[--n] = '\0';
+        if (n == 0) continue;
+        // Handled here rather than by a worker: nothing more is read after it
+        if (is_shutdown(line)) { read_id(line, shutdown_id, sizeof(shutdown_id)); break; }
+
+        serve_class c = classify(line);
+        budc_mutex_lock(&srv.queue_lock);
+        if (c == SERVE_OBSERVE && srv.count[c] >= SERVE_OBSERVE_PENDING) {
+            srv.busy_replies++;
+            budc_mutex_unlock(&srv.queue_lock);
+            char id[72];
+            if (read_id(line, id, sizeof(id))) reply_error(id, RPC_BUSY, "busy");
+            continue;
+        }
+        while (srv.count[c] == SERVE_QUEUE_SIZE) budc_cond_wait(&srv.not_full, &srv.queue_lock);
+        unsigned int slot = (srv.head[c] + srv.count[c]) % SERVE_QUEUE_SIZE;
+        memcpy(srv.queue[c][slot], line, n + 1);
+        srv.call[c][slot] = 0;
+        srv.count[c]++;
+        budc_cond_signal(&srv.not_empty);
+        budc_mutex_unlock(&srv.queue_lock);
+    }
+
+    // Requests already queued still get their responses, peers' and the
+    // dashboard's included; from here on the dashboard's controls are
+    // refused, so none can reach a unit once it is being shut down
+    budc_mutex_lock(&srv.queue_lock);
+    srv.closing = true;
+    srv.stopping = true;
+    budc_cond_broadcast(&srv.not_empty);
+    budc_cond_broadcast(&srv.refresh_wake);
+    budc_mutex_unlock(&srv.queue_lock);
+    for (int i = 0; i < started; i++) budc_thread_join(workers[i]);
+    if (srv.refreshing) budc_thread_join(srv.refresher);
+    for (int i = 0; i < srv.peer_count; i++) stop_peer(&srv.peers[i]);
+
+    for (int i = 0; i < locals; i++) {
+        serve_unit* u = &srv.units[i];
+        char path[512];
+        budc_monitor_stop(u->dev);
+        budc_set_event_callback(u->dev, NULL, NULL);
+        if (budc_flush_save(u->dev) != 0) fprintf(stderr, "Pending SAVE on %s failed.\n", u->port);
+        if (result == 0 && opts->state_path) {
+            state_file(opts, locals, u, path, sizeof(path));
+            if (budc_save_state(u->dev, path) != 0) fprintf(stderr, "Could not save state to %s\n", path);
+        }
+    }
+    if (shutdown_id[0] && strcmp(shutdown_id, "null") != 0) reply_result(shutdown_id, "true");
+
+    web_stop();  // Nothing publishes any more
+    for (int i = 0; i < locals; i++) budc_disconnect(srv.units[i].dev);
+    budc_cond_destroy(&srv.refresh_wake);
+    budc_cond_destroy(&srv.not_full);
+    budc_cond_destroy(&srv.not_empty);
+    budc_mutex_destroy(&srv.queue_lock);
+    budc_mutex_destroy(&srv.view_lock);
+    budc_mutex_destroy(&srv.out_lock);
+    fclose(srv.out);
+    return result;
+}
@@ -0,0 +1,47 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// JSON-RPC over stdin/stdout for budc_cli --serve-stdio, see cli_serve.c
+
+#ifndef CLI_SERVE_H
+#define CLI_SERVE_H
+
+#include "budc_scpi.h"
+
+typedef struct {
+    const char** ports;            // Each must answer
+    int port_count;
+    bool scan_all;                 // Also every other port where a unit answers
+    const char** peers;            // Commands running another server, see cli_serve.c
+    int peer_count;
+    const char* state_path;        // Warm state, see budc_save_state; NULL for none
+    const budc_connect_options* connect;
+    bool stdio;                    // Serve JSON-RPC on stdin/stdout
+    const char* web;               // Dashboard address, see cli_web.c; NULL for none
+    const budc_save_config* save;  // Deferred SAVE for local units; NULL saves at once
+    const char* cal_path;          // Power calibration, see budc_load_calibration; NULL for none
+} serve_options;
+
+// Connects to the ports, starts the peers and serves requests until stdin
+// closes or a "shutdown" request arrives; without stdio, until interrupted.
+// Returns the process exit code.
+int run_serve_stdio(const serve_options* opts);
+
+#endif // CLI_SERVE_H
@@ -0,0 +1,523 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// A small HTTP server for budc_cli --web. It serves one page, pushes what
+// the server publishes to every open page as Server-Sent Events on
+// /events, and runs controls posted to /rpc through the server's own
+// JSON-RPC dispatch. Viewers only ever see published messages, so however
+// many are open, none of them causes a single exchange with a unit.
+//
+// One thread runs every connection with select(). Events are queued per
+// viewer and sent as the socket takes them; a viewer that falls too far
+// behind is dropped and its browser reconnects. A posted control is handed
+// to the server, which queues it with its other controls; its connection
+// waits in the table, costing the loop nothing, until the answer comes back
+// through web_rpc_done. Only a few may wait at once, beyond that a post is
+// answered 503.
+//
+// /rpc only accepts Content-Type: application/json. A page on another
+// origin cannot send that without a CORS preflight, which is never
+// granted, so it cannot drive the units through a viewer's browser. A page
+// can still point a name of its own at this address (DNS rebinding) and
+// become same-origin, so every request must name this server in Host, and
+// in Origin when there is one, by IP address or as localhost. The methods
+// /rpc runs are limited to the page's controls, see web_call in cli_serve.c.
+
+#ifdef _WIN32
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#endif
+#include "cli_web.h"
+#include "budc_scpi.h"
+#include "budc_thread.h"
+#include <ctype.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#ifdef _WIN32
+typedef SOCKET web_socket;
+#define WEB_INVALID INVALID_SOCKET
+#define web_close closesocket
+#else
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <sys/select.h>
+#include <sys/socket.h>
+#include <unistd.h>
+typedef int web_socket;
+#define WEB_INVALID (-1)
+#define web_close close
+#endif
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+// --- CONFIGURATION ---
+#define WEB_MAX_CONNS 32
+#define WEB_REQUEST_MAX 4096
+#define WEB_OUT_MAX 32768              // Unsent bytes per viewer before it is dropped
+#define WEB_MESSAGE_MAX 1024
+#define WEB_RETAINED 64                // Keyed messages kept for new viewers
+#define WEB_HISTORY 32                 // Unkeyed ones
+#define WEB_POLL_MS 250
+#define WEB_KEEPALIVE_MS 15000
+#define WEB_RPC_REPLY_MAX 8192
+#define WEB_MAX_CALLS 8                // Posted controls waiting for their answer
+
+typedef struct {
+    web_socket sock;
+    bool stream;                   // Sent /events; receives published messages
+    bool closing;                  // Close once out is flushed
+    unsigned long call;            // Waiting for the answer to this control, 0 if none
+    char in[WEB_REQUEST_MAX];
+    size_t in_len;
+    char out[WEB_OUT_MAX];
+    size_t out_len;
+} web_conn;
+
+static struct {
+    web_socket listener;
+    struct in_addr addr;           // Bound address, INADDR_ANY for every interface
+    int port;
+    web_rpc_fn rpc;
+    budc_thread thread;
+    bool running;
+    bool stop;                     // Guarded by lock
+    int calls;                     // Connections waiting for a control's answer, guarded by lock
+    unsigned long next_call;
+    budc_mutex lock;               // Guards the connections and the retained messages
+    web_conn* conns[WEB_MAX_CONNS];
+    struct { char key[64]; char message[WEB_MESSAGE_MAX]; } retained[WEB_RETAINED];
+    int retained_count;
+    char history[WEB_HISTORY][WEB_MESSAGE_MAX];
+    unsigned int history_head, history_count;
+    double last_push_ms;
+} web;
+
+static const char web_page[] =
+    "<!DOCTYPE html><html><head><meta charset=\"utf-8\"><title>BUDC</title><style>"
+    "body{font:14px sans-serif;margin:1em;background:#15181c;color:#ddd}"
+    "table{border-collapse:collapse;margin-bottom:1em}td,th{padding:4px 10px;border-bottom:1px solid #333;text-align:left}"
+    "input{width:6em;background:#222;color:#ddd;border:1px solid #444}button{background:#2d4f73;color:#fff;border:0;padding:3px 8px}"
+    ".ok{color:#6c6}.bad{color:#e66}.warn{color:#ec6}#log{height:14em;overflow:auto;font:12px monospace;background:#0d0f11;padding:4px}"
+    "canvas{background:#0d0f11;display:block;margin-bottom:1em}#conn{float:right}"
+    "</style></head><body><span id=\"conn\" class=\"warn\">connecting</span><h2>BUDC units</h2>"
+    "<table><thead><tr><th>Device</th><th>Node</th><th>Frequency</th><th>Power</th><th>Lock</th><th>Temp</th>"
+    "<th>Health</th><th>Alarms</th><th>Set GHz</th><th>Set power</th><th></th></tr></thead><tbody id=\"units\"></tbody></table>"
+    "<canvas id=\"plot\" width=\"900\" height=\"220\"></canvas><div id=\"log\"></div><script>"
+    "const units={},hist={},colors=['#5af','#fa5','#6c6','#e6e','#ee6','#6ee'];const $=id=>document.getElementById(id);"
+    "function esc(s){return String(s).replace(/[&<>\"]/g,c=>'&#'+c.charCodeAt(0)+';');}"
+    "function log(t,cls){const d=document.createElement('div');d.textContent=new Date().toLocaleTimeString()+'  '+t;"
+    "if(cls)d.className=cls;$('log').prepend(d);while($('log').childNodes.length>200)$('log').lastChild.remove();}"
+    "function row(s){let r=$('u-'+s.device);if(!r){r=document.createElement('tr');r.id='u-'+s.device;"
+    "r.innerHTML='<td></td><td></td><td></td><td></td><td></td><td></td><td></td><td></td>'+"
+    "'<td><input class=\"f\"></td><td><input class=\"p\"></td><td><button>Apply</button></td>';"
+    "r.querySelector('button').onclick=()=>apply(s.device,r);$('units').appendChild(r);}return r;}"
+    "function render(s){const r=row(s),c=r.cells;c[0].textContent=s.device;c[1].textContent=s.node;"
+    "c[2].textContent=s.freq_ghz==null?'?':s.freq_ghz.toFixed(6)+' GHz';c[3].textContent=s.power==null?'?':s.power;"
+    "c[4].innerHTML=s.locked==null?'?':s.locked?'<span class=ok>locked</span>':'<span class=bad>UNLOCKED</span>';"
+    "c[5].textContent=s.temp_c==null?'-':s.temp_c.toFixed(1)+' \\u00b0C';"
+    "c[6].innerHTML='<span class='+(s.health=='ok'?'ok':'bad')+'>'+esc(s.health)+'</span>';"
+    "c[7].innerHTML=s.alarms&&s.alarms.length?'<span class=bad>'+s.alarms.join(', ')+'</span>':'-';}"
+    "function apply(device,r){const p={device:device,wait:true},f=r.querySelector('.f').value,w=r.querySelector('.p').value;"
+    "if(f)p.ghz=parseFloat(f);if(w)p.power=parseInt(w);if(!f&&!w)return;"
+    "fetch('rpc',{method:'POST',headers:{'Content-Type':'application/json'},"
+    "body:JSON.stringify({jsonrpc:'2.0',id:1,method:'apply',params:p})}).then(x=>x.json()).then(j=>"
+    "log(device+': apply '+(j.error?'failed: '+j.error.message:'done'),j.error?'bad':'ok')).catch(e=>log(device+': '+e,'bad'));}"
+    "function plot(){const cv=$('plot'),g=cv.getContext('2d'),now=Date.now(),span=600000;g.clearRect(0,0,cv.width,cv.height);"
+    "let lo=1e9,hi=-1e9;for(const d in hist)for(const p of hist[d])if(p[1]!=null){lo=Math.min(lo,p[1]);hi=Math.max(hi,p[1]);}"
+    "if(lo>hi){lo=20;hi=40;}if(hi-lo<2){lo-=1;hi+=1;}const x=t=>(t-now+span)/span*cv.width,"
+    "y=v=>cv.height-10-(v-lo)/(hi-lo)*(cv.height-20);g.fillStyle='#888';g.fillText(hi.toFixed(1)+' \\u00b0C',4,12);"
+    "g.fillText(lo.toFixed(1)+' \\u00b0C',4,cv.height-4);g.fillText('last 10 min, red: unlocked',cv.width-150,12);let i=0;"
+    "for(const d in hist){const h=hist[d],col=colors[i++%colors.length];for(let k=0;k<h.length;k++){const e=k+1<h.length?h[k+1][0]:now;"
+    "if(h[k][2]===false){g.fillStyle='rgba(230,80,80,0.25)';g.fillRect(x(h[k][0]),0,x(e)-x(h[k][0]),cv.height);}}"
+    "g.strokeStyle=col;g.beginPath();let on=false;for(let k=0;k<h.length;k++){if(h[k][1]==null){on=false;continue;}"
+    "const e=k+1<h.length?h[k+1][0]:now;if(!on)g.moveTo(x(h[k][0]),y(h[k][1]));else g.lineTo(x(h[k][0]),y(h[k][1]));"
+    "g.lineTo(x(e),y(h[k][1]));on=true;}g.stroke();g.fillStyle=col;g.fillText(d,60+70*(i-1),cv.height-4);}}"
+    "const es=new EventSource('events');es.onopen=()=>{$('conn').textContent='live';$('conn').className='ok';};"
+    "es.onerror=()=>{$('conn').textContent='reconnecting';$('conn').className='warn';};"
+    "es.addEventListener('status',e=>{const s=JSON.parse(e.data),h=hist[s.device]||(hist[s.device]=[]);units[s.device]=s;render(s);"
+    "h.push([Date.now(),s.temp_c,s.locked]);while(h.length>2&&h[1][0]<Date.now()-600000)h.shift();});"
+    "es.addEventListener('event',e=>{const v=JSON.parse(e.data),t=v.type;let m=v.device+': '+t;"
+    "if(t=='lock')m+=v.locked?' acquired':' lost';else if(t=='health')m+=' '+v.state;"
+    "else if(t=='relock')m+=' '+v.stage+' after '+v.outage_ms+' ms';else if(t.startsWith('alarm'))m+=' rule '+v.rule+' at '+v.value;"
+    "log(m,t=='lock'&&v.locked||t=='alarm_cleared'||v.state=='ok'?'ok':'bad');});setInterval(plot,1000);"
+    "</script></body></html>";
+
+// --- SOCKETS ---
+static void set_nonblocking(web_socket s, bool on) {
+#ifdef _WIN32
+    u_long mode = on ? 1 : 0;
+    ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, on ? flags | O_NONBLOCK : flags & ~O_NONBLOCK);
+#endif
+}
+
+// Accepts "port" or "host:port"; a bare port listens on loopback only
+static int open_listener(const char* address) {
+    char host[128] = "127.0.0.1";
+    const char* colon = strrchr(address, ':');
+    const char* port = address;
+    if (colon) {
+        snprintf(host, sizeof(host), "%.*s", (int)(colon - address), address);
+        port = colon + 1;
+    }
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons((unsigned short)atoi(port));
+    if (atoi(port) <= 0 || atoi(port) > 65535 || inet_pton(AF_INET, host, &sa.sin_addr) != 1) {
+        fprintf(stderr, "Bad --web address '%s', expected port or host:port\n", address);
+        return -1;
+    }
+    web.listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (web.listener == WEB_INVALID) return -1;
+    int yes = 1;
+    setsockopt(web.listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&yes, sizeof(yes));
+    if (bind(web.listener, (struct sockaddr*)&sa, sizeof(sa)) != 0 || listen(web.listener, 8) != 0) {
+        fprintf(stderr, "Cannot listen on %s:%s\n", host, port);
+        web_close(web.listener);
+        web.listener = WEB_INVALID;
+        return -1;
+    }
+    set_nonblocking(web.listener, true);
+    web.addr = sa.sin_addr;
+    web.port = atoi(port);
+    return 0;
+}
+
+// --- CONNECTIONS ---
+// Lock held. False when the viewer is too far behind to take it.
+static bool queue_out(web_conn* c, const char* data, size_t len) {
+    if (c->out_len + len > sizeof(c->out)) return false;
+    memcpy(c->out + c->out_len, data, len);
+    c->out_len += len;
+    return true;
+}
+
+// Lock held. Sends what the socket takes now; -1 if the connection broke.
+static int flush_out(web_conn* c) {
+    while (c->out_len > 0) {
+        int n = (int)send(c->sock, c->out, (int)c->out_len, MSG_NOSIGNAL);
+        if (n <= 0) {
+#ifdef _WIN32
+            return n < 0 && WSAGetLastError() == WSAEWOULDBLOCK ? 0 : -1;
+#else
+            return n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+#endif
+        }
+        memmove(c->out, c->out + n, c->out_len - (size_t)n);
+        c->out_len -= (size_t)n;
+    }
+    return 0;
+}
+
+static void close_conn(int i) {
+    if (web.conns[i]->call) web.calls--;
+    web_close(web.conns[i]->sock);
+    free(web.conns[i]);
+    web.conns[i] = NULL;
+}
+
+static void respond(web_conn* c, const char* status, const char* type, const char* body, size_t len) {
+    char head[256];
+    int n = snprintf(head, sizeof(head),
+                     "HTTP/1.1 %s\r\nContent-Type: %s\r\nContent-Length: %lu\r\nCache-Control: no-cache\r\n"
+                     "Connection: close\r\n\r\n", status, type, (unsigned long)len);
+    queue_out(c, head, (size_t)n);
+    queue_out(c, body, len);
+    c->closing = true;
+}
+
+// Lock held. The connection waits for the answer unless the server gives
+// it straight away or cannot take the control.
+static void start_call(web_conn* c, char* body, size_t len) {
+    char reply[WEB_RPC_REPLY_MAX];
+    if (web.calls == WEB_MAX_CALLS) {
+        respond(c, "503 Service Unavailable", "text/plain", "busy\n", 5);
+        return;
+    }
+    body[len] = '\0';
+    // Requests are single lines to the dispatcher
+    for (char* p = body; *p; p++) if (*p == '\r' || *p == '\n') *p = ' ';
+    c->call = ++web.next_call;
+    reply[0] = '\0';
+    int taken = web.rpc(body, c->call, reply, sizeof(reply));
+    if (taken == 1) {
+        web.calls++;
+        return;
+    }
+    c->call = 0;
+    if (taken == 0) respond(c, "200 OK", "application/json", reply, strlen(reply));
+    else respond(c, "503 Service Unavailable", "text/plain", "busy\n", 5);
+}
+
+// Lock held. Replays what a new viewer missed, then it gets live messages.
+static void open_stream(web_conn* c) {
+    static const char head[] = "HTTP/1.1 200 OK\r\nContent-Type: text/event-stream\r\nCache-Control: no-cache\r\n"
+                               "Connection: keep-alive\r\n\r\nretry: 2000\n\n";
+    queue_out(c, head, sizeof(head) - 1);
+    for (int i = 0; i < web.retained_count; i++) {
+        queue_out(c, web.retained[i].message, strlen(web.retained[i].message));
+    }
+    for (unsigned int i = 0; i < web.history_count; i++) {
+        const char* m = web.history[(web.history_head + i) % WEB_HISTORY];
+        queue_out(c, m, strlen(m));
+    }
+    c->stream = true;
+}
+
+// Value of a header of the request head ending at end, NULL if absent
+static const char* find_header(const char* head, const char* end, const char* name) {
+    size_t len = strlen(name);
+    for (const char* h = strstr(head, "\r\n"); h && h < end; h = strstr(h + 2, "\r\n")) {
+        const char* p = h + 2;
+        size_t k = 0;
+        while (k < len && tolower((unsigned char)p[k]) == name[k]) k++;
+        if (k < len || p[k] != ':') continue;
+        for (p += k + 1; *p == ' '; p++) {}
+        return p;
+    }
+    return NULL;
+}
+
+// Host header value: this server's port, with localhost or an address it
+// listens on. A name that resolves here is refused, see the top of the file.
+static bool own_host(const char* value, size_t len) {
+    char host[64];
+    size_t colon = len;
+    while (colon > 0 && value[colon - 1] != ':') colon--;
+    int port = 80;  // Browsers leave out the default port
+    if (colon > 0) {
+        port = atoi(value + colon);
+        len = colon - 1;
+    }
+    if (port != web.port || len == 0 || len >= sizeof(host)) return false;
+    memcpy(host, value, len);
+    host[len] = '\0';
+    for (char* p = host; *p; p++) *p = (char)tolower((unsigned char)*p);
+    if (strcmp(host, "localhost") == 0) return true;
+    struct in_addr addr;
+    return inet_pton(AF_INET, host, &addr) == 1
+           && (web.addr.s_addr == htonl(INADDR_ANY) || addr.s_addr == web.addr.s_addr);
+}
+
+static bool own_origin(const char* value, size_t len) {
+    return len > 7 && strncmp(value, "http://", 7) == 0 && own_host(value + 7, len - 7);
+}
+
+static size_t header_len(const char* value) {
+    size_t len = value ? strcspn(value, "\r\n") : 0;
+    while (len > 0 && value[len - 1] == ' ') len--;
+    return len;
+}
+
+// Lock held. Acts on the request once it is complete.
+static void handle_http(int i) {
+    web_conn* c = web.conns[i];
+    c->in[c->in_len] = '\0';
+    char* end = strstr(c->in, "\r\n\r\n");
+    if (!end) {
+        if (c->in_len == sizeof(c->in) - 1) respond(c, "413 Payload Too Large", "text/plain", "too large\n", 10);
+        return;
+    }
+    char method[8] = "", path[128] = "";
+    sscanf(c->in, "%7s %127s", method, path);
+    size_t head_len = (size_t)(end + 4 - c->in);
+    const char* length = find_header(c->in, end, "content-length");
+    const char* type = find_header(c->in, end, "content-type");
+    size_t body_len = length ? (size_t)strtoul(length, NULL, 10) : 0;
+    bool json = type && strncmp(type, "application/json", 16) == 0;
+    const char* host = find_header(c->in, end, "host");
+    const char* origin = find_header(c->in, end, "origin");
+
+    if (!host || !own_host(host, header_len(host)) || (origin && !own_origin(origin, header_len(origin)))) {
+        respond(c, "403 Forbidden", "text/plain", "forbidden\n", 10);
+    } else if (strcmp(method, "GET") == 0 && (strcmp(path, "/") == 0 || strcmp(path, "/index.html") == 0)) {
+        respond(c, "200 OK", "text/html; charset=utf-8", web_page, sizeof(web_page) - 1);
+    } else if (strcmp(method, "GET") == 0 && strcmp(path, "/events") == 0) {
+        open_stream(c);
+    } else if (strcmp(method, "POST") == 0 && strcmp(path, "/rpc") == 0) {
+        if (!json) respond(c, "415 Unsupported Media Type", "text/plain", "expected application/json\n", 26);
+        else if (head_len + body_len >= sizeof(c->in)) respond(c, "413 Payload Too Large", "text/plain", "too large\n", 10);
+        else if (c->in_len >= head_len + body_len) start_call(c, c->in + head_len, body_len);
+    } else {
+        respond(c, "404 Not Found", "text/plain", "not found\n", 10);
+    }
+}
+
+static void accept_conns(void) {
+    for (;;) {
+        web_socket s = accept(web.listener, NULL, NULL);
+        if (s == WEB_INVALID) return;
+        int i = 0;
+        while (i < WEB_MAX_CONNS && web.conns[i]) i++;
+        web_conn* c = i < WEB_MAX_CONNS ? calloc(1, sizeof(*c)) : NULL;
+        if (!c) { web_close(s); continue; }
+        set_nonblocking(s, true);
+        c->sock = s;
+        web.conns[i] = c;
+    }
+}
+
+static void* web_main(void* arg) {
+    (void)arg;
+    budc_mutex_lock(&web.lock);
+    while (!web.stop) {
+        fd_set readable, writable;
+        web_socket top = web.listener;
+        FD_ZERO(&readable);
+        FD_ZERO(&writable);
+        FD_SET(web.listener, &readable);
+        for (int i = 0; i < WEB_MAX_CONNS; i++) {
+            web_conn* c = web.conns[i];
+            if (!c) continue;
+            FD_SET(c->sock, &readable);  // A viewer's socket turns readable when it goes away
+            if (c->out_len) FD_SET(c->sock, &writable);
+            if (c->sock > top) top = c->sock;
+        }
+        budc_mutex_unlock(&web.lock);
+        struct timeval tv = { 0, WEB_POLL_MS * 1000 };
+        int ready = select((int)top + 1, &readable, &writable, NULL, &tv);
+        budc_mutex_lock(&web.lock);
+        if (ready < 0) continue;
+
+        if (FD_ISSET(web.listener, &readable)) accept_conns();
+        for (int i = 0; i < WEB_MAX_CONNS; i++) {
+            web_conn* c = web.conns[i];
+            if (!c) continue;
+            bool broken = false;
+            if (FD_ISSET(c->sock, &readable)) {
+                char scratch[512];
+                char* into = c->stream ? scratch : c->in + c->in_len;
+                size_t room = c->stream ? sizeof(scratch) : sizeof(c->in) - 1 - c->in_len;
+                int n = room ? (int)recv(c->sock, into, (int)room, 0) : 0;
+                if (n <= 0 && room) broken = true;
+                else if (!c->stream) {
+                    c->in_len += (size_t)n;
+                    if (!c->closing && !c->call) handle_http(i);
+                }
+            }
+            if (!broken && FD_ISSET(c->sock, &writable)) broken = flush_out(c) != 0;
+            if (broken || (c->closing && c->out_len == 0)) close_conn(i);
+        }
+
+        // Keeps proxies from timing out quiet streams
+        if (budc_now_ms() - web.last_push_ms > WEB_KEEPALIVE_MS) {
+            web.last_push_ms = budc_now_ms();
+            for (int i = 0; i < WEB_MAX_CONNS; i++) {
+                if (web.conns[i] && web.conns[i]->stream) queue_out(web.conns[i], ":\n\n", 3);
+            }
+        }
+    }
+    for (int i = 0; i < WEB_MAX_CONNS; i++) if (web.conns[i]) close_conn(i);
+    budc_mutex_unlock(&web.lock);
+    return NULL;
+}
+
+// --- PUBLIC ---
+int web_start(const char* address, web_rpc_fn rpc) {
+#ifdef _WIN32
+    WSADATA wsa;
+    if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0) return -1;
+#endif
+    memset(&web, 0, sizeof(web));
+    web.rpc = rpc;
+    if (open_listener(address) != 0) return -1;
+    budc_mutex_init(&web.lock);
+    web.last_push_ms = budc_now_ms();
+    if (budc_thread_create(&web.thread, web_main, NULL) != 0) {
+        web_close(web.listener);
+        budc_mutex_destroy(&web.lock);
+        return -1;
+    }
+    web.running = true;
+    return 0;
+}
+
+void web_stop(void) {
+    if (!web.running) return;
+    budc_mutex_lock(&web.lock);
+    web.stop = true;
+    budc_mutex_unlock(&web.lock);
+    budc_thread_join(web.thread);
+    web_close(web.listener);
+    budc_mutex_destroy(&web.lock);
+    web.running = false;
+#ifdef _WIN32
+    WSACleanup();
+#endif
+}
+
+bool web_running(void) {
+    return web.running;
+}
+
+void web_rpc_done(unsigned long call, const char* reply) {
+    if (!web.running) return;
+    budc_mutex_lock(&web.lock);
+    for (int i = 0; i < WEB_MAX_CONNS; i++) {
+        web_conn* c = web.conns[i];
+        if (!c || c->call != call) continue;
+        c->call = 0;
+        web.calls--;
+        respond(c, "200 OK", "application/json", reply, strlen(reply));
+        if (flush_out(c) != 0 || c->out_len == 0) close_conn(i);
+        break;
+    }
+    budc_mutex_unlock(&web.lock);
+}
+
+void web_publish(const char* kind, const char* key, const char* json) {
+    char message[WEB_MESSAGE_MAX];
+    if (!web.running) return;
+    int n = snprintf(message, sizeof(message), "event: %s\ndata: %s\n\n", kind, json);
+    if (n < 0 || (size_t)n >= sizeof(message)) return;
+
+    budc_mutex_lock(&web.lock);
+    if (key) {
+        int i = 0;
+        while (i < web.retained_count && strcmp(web.retained[i].key, key) != 0) i++;
+        if (i < WEB_RETAINED) {
+            if (i == web.retained_count) {
+                web.retained_count++;
+                snprintf(web.retained[i].key, sizeof(web.retained[i].key), "%s", key);
+            }
+            memcpy(web.retained[i].message, message, (size_t)n + 1);
+        }
+    } else {
+        unsigned int slot = (web.history_head + web.history_count) % WEB_HISTORY;
+        memcpy(web.history[slot], message, (size_t)n + 1);
+        if (web.history_count < WEB_HISTORY) web.history_count++;
+        else web.history_head = (web.history_head + 1) % WEB_HISTORY;
+    }
+    // Sent straight away where the socket has room; the loop sends the rest
+    for (int i = 0; i < WEB_MAX_CONNS; i++) {
+        web_conn* c = web.conns[i];
+        if (!c || !c->stream) continue;
+        if (!queue_out(c, message, (size_t)n) || flush_out(c) != 0) close_conn(i);
+    }
+    web.last_push_ms = budc_now_ms();
+    budc_mutex_unlock(&web.lock);
+}
@@ -0,0 +1,46 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2024 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Web dashboard for budc_cli --web, see cli_web.c
+
+#ifndef CLI_WEB_H
+#define CLI_WEB_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Takes one JSON-RPC request line from a page. Returns 0 with the response
+// line in reply, 1 once the request is queued to be answered later through
+// web_rpc_done with the same call, or -1 when it cannot be taken now.
+typedef int (*web_rpc_fn)(const char* request, unsigned long call, char* reply, size_t len);
+
+// address is "port" (loopback only) or "host:port". Returns 0 once listening.
+int web_start(const char* address, web_rpc_fn rpc);
+void web_stop(void);
+// Pushes a JSON object to every viewer as an SSE event of the given kind.
+// With a key, the latest message per key is also replayed to new viewers;
+// without one, the last few are.
+void web_publish(const char* kind, const char* key, const char* json);
+bool web_running(void);
+// Sends the response line to a call web_rpc_fn queued. Dropped if the page
+// has gone away since.
+void web_rpc_done(unsigned long call, const char* reply);
+
+#endif // CLI_WEB_H
@@ -33,132 +33,123 @@
 #include <string.h>
 #include <float.h> 
 
-// Wrap C header for C++
-extern "C" {
-    #include "budc_scpi.h"
-}
+#include "gui_state.h"
 
-#ifdef _WIN32
-    #include <windows.h>
-#else
-    #include <unistd.h>
-#endif
+// --- FRAME STATS ---
+// Render-side cost of each frame. Allocations are counted through ImGui's
+// allocator hook, so they cover everything ImGui does while building a frame.
+#define FRAME_HISTORY 120
 
-// AppState remains the same
 typedef struct {
-    budc_device* dev;
-    serial_port_info* port_list;
-    int port_count;
-    int selected_port_idx;
-    bool is_connected;
-    char identity[256];
-    char serial_number[64];
-    char fw_version[64];
-    double current_freq_ghz;
-    bool is_locked;
-    float temperature_c;
-    int power_level;
-    bool temp_supported;
-    double target_freq_ghz;
-    int target_power_level;
-    char scpi_command[256];
-    char scpi_log[4096];
-    time_t last_update_time;
-    bool auto_refresh_enabled;
-} AppState;
-
-void safe_delay(int milliseconds) {
-    #ifdef _WIN32
-        Sleep(milliseconds);
-    #else
-        usleep(milliseconds * 1000);
-    #endif
+    float frame_ms[FRAME_HISTORY];  // Start-to-start time of recent frames
+    float io_ms[FRAME_HISTORY];     // Time each frame spent blocked on device I/O
+    int frame_head;
+    double build_ms;                // Last frame: input, state tick and UI build
+    unsigned int allocs;            // Allocations during the last frame
+    unsigned int allocs_current;
+    unsigned long long allocs_total;
+} FrameStats;
+
+static FrameStats frame_stats;
+
+static void* counting_alloc(size_t size, void* user_data) {
+    (void)user_data;
+    frame_stats.allocs_current++;
+    frame_stats.allocs_total++;
+    return malloc(size);
 }
 
-void refresh_port_list(AppState* state) {
-    // Free existing port list
-    if (state->port_list) {
-        free(state->port_list);
-        state->port_list = NULL;
-    }
-    
-    // Reset selection
-    state->selected_port_idx = -1;
-    
-    // Get new port list
-    state->port_count = budc_find_ports(&state->port_list);
-    
-    printf("Refreshed port list: found %d ports\n", state->port_count);
+static void counting_free(void* ptr, void* user_data) {
+    (void)user_data;
+    free(ptr);
 }
 
-void update_frequency_only(AppState* state) {
-    if (!state->is_connected) return;
-    if (budc_get_frequency_ghz(state->dev, &state->current_freq_ghz) == 0) {
-        state->target_freq_ghz = state->current_freq_ghz;
-    }
+static const char* port_name_at(void* user_data, int idx) {
+    return ((const AppState*)user_data)->port_list[idx].name;
 }
 
-void update_power_only(AppState* state) {
-    if (!state->is_connected) return;
-    if (budc_get_power_level(state->dev, &state->power_level) == 0) {
-        state->target_power_level = state->power_level;
-    }
+static bool show_diagnostics = false;
+
+static void show_frame_stats() {
+    float last_ms = frame_stats.frame_ms[(frame_stats.frame_head + FRAME_HISTORY - 1) % FRAME_HISTORY];
+    ImGui::TextDisabled("Frame %.1f ms, build %.2f ms, %u allocations", last_ms, frame_stats.build_ms, frame_stats.allocs);
+    ImGui::SameLine();
+    ImGui::Checkbox("Diagnostics (F12)", &show_diagnostics);
 }
 
-void update_device_status(AppState* state) {
-    if (!state->is_connected) return;
-    update_frequency_only(state);
-    safe_delay(50);
-    budc_get_lock_status(state->dev, &state->is_locked);
-    safe_delay(50);
-    if (budc_get_temperature_c(state->dev, &state->temperature_c) == 0) {
-        state->temp_supported = true;
-    } else {
-        state->temp_supported = false;
-        state->temperature_c = -999.0f;
+static void ring_stats(const float* ring, float* avg, float* max) {
+    float sum = 0.0f;
+    *max = 0.0f;
+    for (int i = 0; i < FRAME_HISTORY; i++) {
+        sum += ring[i];
+        if (ring[i] > *max) *max = ring[i];
     }
-    safe_delay(50);
-    update_power_only(state);
-    state->last_update_time = time(NULL);
+    *avg = sum / FRAME_HISTORY;
 }
 
-void update_all_values(AppState* state) {
-    if (!state->is_connected) return;
-    if (budc_get_identity(state->dev, state->identity, sizeof(state->identity)) == 0) {
-        // Parse the identity string: Company,Product,Serial,Firmware
-        char company[64] = "";
-        char product[64] = "";
-        
-        sscanf(state->identity, "%63[^,],%63[^,],%63[^,],%63s", 
-               company, product, state->serial_number, state->fw_version);
-               
-        // Store company and product for display
-        snprintf(state->identity, sizeof(state->identity), "%s %s", company, product);
-    } else {
-        strcpy(state->identity, "Error: Failed to read IDN");
-        state->serial_number[0] = '\0';
-        state->fw_version[0] = '\0';
+// --- DIAGNOSTICS OVERLAY ---
+// Splits "the GUI is laggy" into rendering, the UI thread waiting on the
+// port, the port itself, and the device.
+static void render_diagnostics(const AppState* state) {
+    const ImGuiIO& io = ImGui::GetIO();
+    float frame_avg, frame_max, io_avg, io_max;
+    ring_stats(frame_stats.frame_ms, &frame_avg, &frame_max);
+    ring_stats(frame_stats.io_ms, &io_avg, &io_max);
+    int last = (frame_stats.frame_head + FRAME_HISTORY - 1) % FRAME_HISTORY;
+
+    ImGui::SetNextWindowBgAlpha(0.9f);
+    ImGui::SetNextWindowPos(ImVec2(io.DisplaySize.x - 380, 30), ImGuiCond_FirstUseEver);
+    if (!ImGui::Begin("Diagnostics", &show_diagnostics, ImGuiWindowFlags_AlwaysAutoResize)) {
+        ImGui::End();
+        return;
     }
-    safe_delay(100);
-    update_device_status(state);
-}
+    ImGui::Text("Frame: %.1f ms avg, %.1f ms worst (%.0f FPS)", frame_avg, frame_max, io.Framerate);
+    ImGui::PlotLines("##frame", frame_stats.frame_ms, FRAME_HISTORY, frame_stats.frame_head, NULL, 0.0f, 50.0f, ImVec2(340, 50));
+    ImGui::Text("Build: %.2f ms, %u allocations", frame_stats.build_ms, frame_stats.allocs);
+    ImGui::Text("Blocked on I/O: %.1f ms last frame, %.1f ms worst", frame_stats.io_ms[last], io_max);
+    ImGui::PlotHistogram("##io", frame_stats.io_ms, FRAME_HISTORY, frame_stats.frame_head, NULL, 0.0f, 100.0f, ImVec2(340, 50));
 
-void init_app_state(AppState* state) {
-    memset(state, 0, sizeof(AppState));
-    state->selected_port_idx = -1;
-    state->port_list = NULL;
-    state->port_count = budc_find_ports(&state->port_list);
-    state->auto_refresh_enabled = false;
-}
+    if (state->is_connected) {
+        const budc_stats* st = &state->stats;
+        double p95 = budc_stats_latency_percentile(st, 95);
+        ImGui::Separator();
+        ImGui::Text("Retune queue: %d waiting, worker %s", state->retune_queued, state->retune_busy ? "busy" : "idle");
+        ImGui::Text("Port queue: %u waiting", st->io_waiters);
+        ImGui::Text("Latency: p50 %.1f, p95 %.1f, p99 %.1f, max %.1f ms",
+                    budc_stats_latency_percentile(st, 50), p95, budc_stats_latency_percentile(st, 99), st->latency_max_ms);
+        ImGui::Text("Link: %.0f%% busy, %.0f B/s out, %.0f B/s in", state->link_util * 100.0, state->tx_bytes_s, state->rx_bytes_s);
+        ImGui::Text("Exchanges: %lu, timeouts %lu, recoveries %lu", st->transactions, st->timeouts, st->recoveries);
 
-void cleanup_app_state(AppState* state) {
-    if (state->is_connected) budc_disconnect(state->dev);
-    if (state->port_list) free(state->port_list);
+        // Most specific cause first
+        ImGui::Separator();
+        if (io_max > 50.0f) ImGui::TextColored(ImVec4(1,0.6f,0,1), "Lag: UI thread waiting on device I/O");
+        else if (frame_stats.build_ms > 16.0) ImGui::TextColored(ImVec4(1,0.6f,0,1), "Lag: rendering");
+        else if (state->link_util > 0.8) ImGui::TextColored(ImVec4(1,0.6f,0,1), "Lag: serial link saturated");
+        else if (p95 > 100.0) ImGui::TextColored(ImVec4(1,0.6f,0,1), "Lag: device slow to reply");
+        else ImGui::TextColored(ImVec4(0,1,0,1), "No lag source detected");
+    }
+    if (state->first_status_ms > 0.0) {
+        ImGui::Text("Startup: first frame %.0f ms, first status %.0f ms", state->first_frame_ms, state->first_status_ms);
+    } else {
+        ImGui::Text("Startup: first frame %.0f ms", state->first_frame_ms);
+    }
+    ImGui::End();
 }
 
 void render_gui(AppState* state);
 
 int main(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--headless-bench") == 0 && i + 1 < argc) {
+            int frames = i + 2 < argc ? atoi(argv[i + 2]) : 0;
+            return run_headless_bench(argv[i + 1], frames > 0 ? frames : 600);
+        }
+    }
+
+    // Ports are scanned and the last device reopened while the window comes up
+    AppState state;
+    init_app_state(&state, true);
+
     glfwInit();
     const char* glsl_version = "#version 330";
     glfwWindowHint(GLFW_CONTEXT_VERSION_MAJOR, 3);
@@ -174,6 +165,7 @@ int main(int argc, char* argv[]) {
         return -1;
     }
 
+    ImGui::SetAllocatorFunctions(counting_alloc, counting_free);
     ImGui::CreateContext();
     ImGuiIO& io = ImGui::GetIO();
     io.ConfigFlags |= ImGuiConfigFlags_NavEnableKeyboard;
@@ -182,17 +174,28 @@ int main(int argc, char* argv[]) {
     ImGui_ImplGlfw_InitForOpenGL(window, true);
     ImGui_ImplOpenGL3_Init(glsl_version);
 
-    AppState state;
-    init_app_state(&state);
-
+    double last_frame_ms = budc_now_ms();
     while (!glfwWindowShouldClose(window)) {
+        double frame_start = budc_now_ms();
+        frame_stats.frame_ms[frame_stats.frame_head] = (float)(frame_start - last_frame_ms);
+        frame_stats.io_ms[frame_stats.frame_head] = (float)state.io_stall_ms;
+        frame_stats.frame_head = (frame_stats.frame_head + 1) % FRAME_HISTORY;
+        last_frame_ms = frame_start;
+        state.io_stall_ms = 0.0;
+        frame_stats.allocs = frame_stats.allocs_current;
+        frame_stats.allocs_current = 0;
+
         glfwPollEvents();
 
         ImGui_ImplOpenGL3_NewFrame();
         ImGui_ImplGlfw_NewFrame();
         ImGui::NewFrame();
+        app_tick(&state);
         render_gui(&state);
+        if (ImGui::IsKeyPressed(ImGuiKey_F12, false)) show_diagnostics = !show_diagnostics;
+        if (show_diagnostics) render_diagnostics(&state);
         ImGui::Render();
+        frame_stats.build_ms = budc_now_ms() - frame_start;
 
         int display_w, display_h;
         glfwGetFramebufferSize(window, &display_w, &display_h);
@@ -202,6 +205,7 @@ int main(int argc, char* argv[]) {
         ImGui_ImplOpenGL3_RenderDrawData(ImGui::GetDrawData());
         
         glfwSwapBuffers(window);
+        note_first_frame(&state);
     }
 
     cleanup_app_state(&state);
@@ -219,49 +223,55 @@ void render_gui(AppState* state) {
     ImGui::SetNextWindowSize(io.DisplaySize, ImGuiCond_Always);
     ImGui::Begin("BUDC Control Panel", NULL, ImGuiWindowFlags_NoResize | ImGuiWindowFlags_NoMove | ImGuiWindowFlags_NoCollapse);
 
+    bool connecting = state->connector != NULL;
     if (ImGui::CollapsingHeader("Connection", ImGuiTreeNodeFlags_DefaultOpen)) {
         if (state->is_connected) {
-            ImGui::Text("Connected to: %s", state->port_list[state->selected_port_idx].name);
+            ImGui::Text("Connected to: %s", state->port_name);
             ImGui::SameLine(0, 20);
             if (ImGui::Button("Disconnect")) {
-                budc_disconnect(state->dev);
-                state->is_connected = false;
-                state->dev = NULL;
+                disconnect_device(state);
             }
         } else {
             if (state->port_count > 0) {
-                const char** items = (const char**)malloc(state->port_count * sizeof(char*));
-                for(int i = 0; i < state->port_count; i++) items[i] = state->port_list[i].name;
-                ImGui::Combo("Serial Port", &state->selected_port_idx, items, state->port_count, 4);
-                free(items);
+                ImGui::Combo("Serial Port", &state->selected_port_idx, port_name_at, state, state->port_count, 4);
+            } else if (state->connect_phase == CONNECT_SCANNING) {
+                ImGui::Text("Scanning ports...");
             } else {
                 ImGui::Text("No serial ports found.");
             }
             ImGui::SameLine(0, 20);
+            ImGui::BeginDisabled(connecting);
             if (ImGui::Button("Connect")) {
                 if (state->selected_port_idx >= 0) {
-                    state->dev = budc_connect(state->port_list[state->selected_port_idx].name);
-                    if (state->dev) {
-                        state->is_connected = true;
-                        safe_delay(500);
-                        update_all_values(state);
-                    }
+                    begin_connect(state, state->port_list[state->selected_port_idx].name);
                 }
             }
             ImGui::SameLine(0, 10);
             if (ImGui::Button("Refresh Ports")) {
                 refresh_port_list(state);
             }
+            ImGui::EndDisabled();
+        }
+        if (state->connect_phase == CONNECT_FAILED) {
+            ImGui::TextColored(ImVec4(1,0,0,1), "%s", state->connect_message);
+        } else if (connecting && state->connect_message[0]) {
+            ImGui::TextDisabled("%s", state->connect_message);
         }
     }
     
-    if (!state->is_connected) {
+    if (!state->is_connected || !state->status_ready) {
+        show_frame_stats();
         ImGui::End();
         return;
     }
-    
-    if (state->auto_refresh_enabled && difftime(time(NULL), state->last_update_time) > 10.0) {
-        update_device_status(state);
+
+    // Ctrl+Up/Down steps the frequency and Ctrl+PageUp/PageDown the power;
+    // plain arrows stay with keyboard navigation
+    if (io.KeyCtrl && !io.WantTextInput) {
+        if (ImGui::IsKeyPressed(ImGuiKey_UpArrow)) step_freq(state, 1.0);
+        if (ImGui::IsKeyPressed(ImGuiKey_DownArrow)) step_freq(state, -1.0);
+        if (ImGui::IsKeyPressed(ImGuiKey_PageUp)) request_power(state, state->target_power_level + 1);
+        if (ImGui::IsKeyPressed(ImGuiKey_PageDown)) request_power(state, state->target_power_level - 1);
     }
     
     if (ImGui::CollapsingHeader("Device Information", ImGuiTreeNodeFlags_DefaultOpen)) {
@@ -269,12 +279,35 @@ void render_gui(AppState* state) {
         ImGui::Text("Serial Number: %s", state->serial_number);
         ImGui::Text("Firmware Version: %s", state->fw_version);
         ImGui::Separator();
-        ImGui::Text("Current LO Freq: %.4f GHz", state->current_freq_ghz);
+        // While a retune is pending the requested value is shown straight away
+        double shown_freq = state->freq_status == RETUNE_PENDING ? state->target_freq_ghz : state->current_freq_ghz;
+        ImGui::Text("Current LO Freq: %.4f GHz", shown_freq);
+        if (ImGui::IsItemHovered() && io.MouseWheel != 0.0f) {
+            step_freq(state, io.MouseWheel);
+        }
+        if (state->freq_status != RETUNE_IDLE) ImGui::SameLine();
+        switch (state->freq_status) {
+        case RETUNE_PENDING: ImGui::TextColored(ImVec4(1,1,0,1), "(pending)"); break;
+        case RETUNE_CONFIRMED: ImGui::TextColored(ImVec4(0,1,0,1), "(confirmed in %.0f ms)", state->retune_ms); break;
+        case RETUNE_FAILED: ImGui::TextColored(ImVec4(1,0,0,1), "(failed)"); break;
+        default: break;
+        }
         ImGui::Text("PLL Lock Status: "); ImGui::SameLine();
         ImGui::TextColored(state->is_locked ? ImVec4(0,1,0,1) : ImVec4(1,0,0,1), state->is_locked ? "LOCKED" : "UNLOCKED");
-        if (state->temp_supported) ImGui::Text("Temperature: %.1f C", state->temperature_c);
-        else ImGui::Text("Temperature: Not Supported");
-        ImGui::Text("Power Level: %d", state->power_level);
+        if (!state->temp_supported) ImGui::Text("Temperature: Not Supported");
+        else if (state->temperature_age_s < 0) ImGui::Text("Temperature: measuring...");
+        else ImGui::Text("Temperature: %.1f C (%.0f s ago)", state->temperature_c, state->temperature_age_s);
+        ImGui::Text("Power Level: %d", state->power_status == RETUNE_PENDING ? state->target_power_level : state->power_level);
+        if (ImGui::IsItemHovered() && io.MouseWheel != 0.0f) {
+            request_power(state, state->target_power_level + (io.MouseWheel > 0 ? 1 : -1));
+        }
+        if (state->power_status != RETUNE_IDLE) ImGui::SameLine();
+        switch (state->power_status) {
+        case RETUNE_PENDING: ImGui::TextColored(ImVec4(1,1,0,1), "(pending)"); break;
+        case RETUNE_CONFIRMED: ImGui::TextColored(ImVec4(0,1,0,1), "(confirmed)"); break;
+        case RETUNE_FAILED: ImGui::TextColored(ImVec4(1,0,0,1), "(failed)"); break;
+        default: break;
+        }
         ImGui::Separator();
         ImGui::Checkbox("Auto-refresh (10s)", &state->auto_refresh_enabled);
     }
@@ -282,26 +315,24 @@ void render_gui(AppState* state) {
     if (ImGui::CollapsingHeader("Controls", ImGuiTreeNodeFlags_DefaultOpen)) {
         ImGui::InputDouble("Target Freq (GHz)", &state->target_freq_ghz, 0.1, 1.0, "%.4f");
         ImGui::SameLine();
-        if (ImGui::Button("Set Freq")) {
-            if (budc_set_frequency_ghz(state->dev, state->target_freq_ghz) == 0) {
-                safe_delay(250); // Give device time to process
-                update_frequency_only(state);
-            }
-        }
+        if (ImGui::Button("Set Freq")) request_freq(state, state->target_freq_ghz);
+
+        ImGui::Combo("Step", &state->freq_step_idx, freq_step_labels, FREQ_STEP_COUNT);
+        ImGui::SameLine();
+        if (ImGui::Button("-")) step_freq(state, -1.0);
+        ImGui::SameLine();
+        if (ImGui::Button("+")) step_freq(state, 1.0);
+        ImGui::SameLine();
+        ImGui::TextDisabled("Ctrl+Up/Down or wheel over the readout to step");
         
         ImGui::InputInt("Target Power Level", &state->target_power_level, 1, 5);
         ImGui::SameLine();
-        if (ImGui::Button("Set Power")) {
-            if (budc_set_power_level(state->dev, state->target_power_level) == 0) {
-                safe_delay(250); // Give device time to process
-                update_power_only(state);
-            }
-        }
+        if (ImGui::Button("Set Power")) request_power(state, state->target_power_level);
         
         ImGui::Separator();
-        if (ImGui::Button("PRESET")) { budc_preset(state->dev); safe_delay(200); update_all_values(state); }
+        if (ImGui::Button("PRESET")) { preset_device(state); }
         ImGui::SameLine();
-        if (ImGui::Button("SAVE")) { budc_save_settings(state->dev); }
+        if (ImGui::Button("SAVE")) { save_device(state); }
         ImGui::SameLine();
         if (ImGui::Button("Refresh All")) { update_all_values(state); }
     }
@@ -310,17 +341,12 @@ void render_gui(AppState* state) {
         bool enter_pressed = ImGui::InputText("Command", state->scpi_command, sizeof(state->scpi_command), ImGuiInputTextFlags_EnterReturnsTrue);
         ImGui::SameLine();
         if (ImGui::Button("Send") || enter_pressed) {
-            char response[512] = {0};
-            char log_entry[1024];
-            budc_send_raw_command(state->dev, state->scpi_command, response, sizeof(response));
-            snprintf(log_entry, sizeof(log_entry), ">> %s\n<< %s\n\n", state->scpi_command, strlen(response) > 0 ? response : "(no response)");
-            strncat(state->scpi_log, log_entry, sizeof(state->scpi_log) - strlen(state->scpi_log) - 1);
-            state->scpi_command[0] = '\0';
-            safe_delay(100);
-            update_device_status(state); // Update everything after a manual command
+            send_scpi_command(state);
         }
         ImGui::InputTextMultiline("Log", state->scpi_log, sizeof(state->scpi_log), ImVec2(-FLT_MIN, 150), ImGuiInputTextFlags_ReadOnly);
         if (ImGui::GetScrollY() >= ImGui::GetScrollMaxY()) ImGui::SetScrollHereY(1.0f);
     }
+    ImGui::Separator();
+    show_frame_stats();
     ImGui::End();
 }
\ No newline at end of file
@@ -0,0 +1,722 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2025 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// State and device logic for budc_gui, see gui_state.h
+
+#include "gui_state.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+const char* const freq_step_labels[FREQ_STEP_COUNT] = { "1 MHz", "10 MHz", "100 MHz", "1 GHz" };
+const double freq_step_ghz[FREQ_STEP_COUNT] = { 0.001, 0.01, 0.1, 1.0 };
+
+#define DIAG_INTERVAL_MS 500          // How often app_tick refreshes the library counters
+
+// Charges the enclosing call's duration to io_stall_ms. Nested calls
+// (update_device_status inside update_all_values) count once.
+struct StallTimer {
+    AppState* state;
+    double start;
+    explicit StallTimer(AppState* s) : state(s), start(0.0) {
+        if (state->stall_depth++ == 0) start = budc_now_ms();
+    }
+    ~StallTimer() {
+        if (--state->stall_depth == 0) state->io_stall_ms += budc_now_ms() - start;
+    }
+};
+
+// A pending retune owns the target field until it is confirmed or fails
+static void update_frequency_only(AppState* state) {
+    if (!state->is_connected) return;
+    if (budc_get_frequency_ghz(state->dev, &state->current_freq_ghz) == 0 && state->freq_status != RETUNE_PENDING) {
+        state->target_freq_ghz = state->current_freq_ghz;
+    }
+}
+
+static void update_power_only(AppState* state) {
+    if (!state->is_connected) return;
+    if (budc_get_power_level(state->dev, &state->power_level) == 0 && state->power_status != RETUNE_PENDING) {
+        state->target_power_level = state->power_level;
+    }
+}
+
+// --- RETUNE WORKER ---
+// Set commands run on this thread so the UI never waits on the port. Only
+// the newest request is kept: stepping through ten frequencies faster than
+// the PLL locks sends the last one, and frequency and power requested
+// together go out in one exchange. The auto-refresh readback runs here too.
+#define RETUNE_LOCK_TIMEOUT_MS 3000
+#define RETUNE_LOCK_SLICE_MS 50     // Lock waits are sliced so a newer request cuts them short
+
+struct RetuneWorker {
+    budc_device* dev;
+    std::thread thread;
+    std::mutex lock;
+    std::condition_variable cond;
+    bool stop = false;
+    bool busy = false;             // Applying or confirming a request
+
+    // Requests, guarded by lock. The sequence numbers tell a result whether
+    // it is still the newest one for that setting.
+    bool want_freq = false, want_power = false, want_refresh = false;
+    double freq_ghz = 0.0;
+    int power = 0;
+    unsigned int freq_seq = 0, power_seq = 0;
+    double freq_request_ms = 0.0;
+
+    // Results, guarded by lock, picked up by poll_retune. A status only
+    // counts while its sequence number is still the newest request's.
+    bool have_result = false;
+    RetuneStatus freq_status = RETUNE_IDLE, power_status = RETUNE_IDLE;
+    unsigned int freq_result_seq = 0, power_result_seq = 0;
+    double read_freq_ghz = 0.0, retune_ms = 0.0;
+    int read_power = 0;
+    bool have_freq = false, have_power = false, locked = false, have_lock = false;
+    bool refreshed = false;        // The readback answers a refresh request
+
+    explicit RetuneWorker(budc_device* d) : dev(d) { thread = std::thread(&RetuneWorker::run, this); }
+
+    ~RetuneWorker() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stop = true;
+        }
+        cond.notify_one();
+        thread.join();
+    }
+
+    void request_freq(double ghz) {
+        std::lock_guard<std::mutex> guard(lock);
+        want_freq = true;
+        freq_ghz = ghz;
+        freq_seq++;
+        freq_request_ms = budc_now_ms();
+        cond.notify_one();
+    }
+
+    void request_power(int level) {
+        std::lock_guard<std::mutex> guard(lock);
+        want_power = true;
+        power = level;
+        power_seq++;
+        cond.notify_one();
+    }
+
+    void request_refresh() {
+        std::lock_guard<std::mutex> guard(lock);
+        want_refresh = true;
+        cond.notify_one();
+    }
+
+    bool freq_superseded(unsigned int seq) {
+        std::lock_guard<std::mutex> guard(lock);
+        return stop || freq_seq != seq;
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> guard(lock);
+        for (;;) {
+            cond.wait(guard, [this] { return stop || want_freq || want_power || want_refresh; });
+            if (stop) return;
+            bool do_freq = want_freq, do_power = want_power, do_refresh = want_refresh;
+            double ghz = freq_ghz, started = freq_request_ms;
+            int level = power;
+            unsigned int fseq = freq_seq, pseq = power_seq;
+            want_freq = want_power = want_refresh = false;
+            busy = true;
+            guard.unlock();
+
+            int rc = do_freq || do_power ? budc_apply_settings(dev, do_freq ? ghz * 1e9 : -1.0, do_power ? level : -1) : 0;
+            bool lock_ok = false;
+            if (rc == 0 && do_freq) {
+                double deadline = budc_now_ms() + RETUNE_LOCK_TIMEOUT_MS;
+                while (!freq_superseded(fseq) && budc_now_ms() < deadline) {
+                    if (budc_wait_for_lock(dev, RETUNE_LOCK_SLICE_MS) == 0) { lock_ok = true; break; }
+                }
+            }
+            // Superseded before it locked: go straight to the newer request
+            if (rc == 0 && do_freq && !do_power && !lock_ok && freq_superseded(fseq)) {
+                guard.lock();
+                busy = false;
+                want_refresh = want_refresh || do_refresh;
+                continue;
+            }
+            double now_freq = 0.0;
+            int now_power = 0;
+            bool is_locked = false;
+            bool got_freq = budc_get_frequency_ghz(dev, &now_freq) == 0;
+            bool got_power = budc_get_power_level(dev, &now_power) == 0;
+            bool got_lock = budc_get_lock_status(dev, &is_locked) == 0;
+
+            guard.lock();
+            busy = false;
+            have_result = true;
+            have_freq = got_freq; read_freq_ghz = now_freq;
+            have_power = got_power; read_power = now_power;
+            have_lock = got_lock; locked = is_locked;
+            refreshed = refreshed || do_refresh;
+            if (do_freq) {
+                bool match = got_freq && fabs(now_freq - ghz) < 1e-6;
+                freq_status = rc == 0 && match && lock_ok ? RETUNE_CONFIRMED : RETUNE_FAILED;
+                freq_result_seq = fseq;
+                retune_ms = budc_now_ms() - started;
+            }
+            if (do_power) {
+                power_status = rc == 0 && got_power && now_power == level ? RETUNE_CONFIRMED : RETUNE_FAILED;
+                power_result_seq = pseq;
+            }
+        }
+    }
+};
+
+// --- REQUESTS ---
+void request_freq(AppState* state, double ghz) {
+    if (!state->retune) return;
+    state->target_freq_ghz = ghz;
+    state->freq_status = RETUNE_PENDING;
+    state->retune->request_freq(ghz);
+}
+
+void request_power(AppState* state, int level) {
+    if (!state->retune) return;
+    if (level < 0) level = 0;
+    state->target_power_level = level;
+    state->power_status = RETUNE_PENDING;
+    state->retune->request_power(level);
+}
+
+void step_freq(AppState* state, double steps) {
+    request_freq(state, state->target_freq_ghz + steps * freq_step_ghz[state->freq_step_idx]);
+}
+
+// Called every frame: takes the worker's latest readback, never blocks on I/O
+static void poll_retune(AppState* state) {
+    RetuneWorker* w = state->retune;
+    if (!w) return;
+    std::lock_guard<std::mutex> guard(w->lock);
+    if (!w->have_result) return;
+    w->have_result = false;
+    if (w->have_freq) state->current_freq_ghz = w->read_freq_ghz;
+    if (w->have_power) state->power_level = w->read_power;
+    if (w->have_lock) state->is_locked = w->locked;
+    if (w->refreshed) {
+        w->refreshed = false;
+        // A pending retune owns the target field until it is confirmed or fails
+        if (w->have_freq && state->freq_status != RETUNE_PENDING) state->target_freq_ghz = state->current_freq_ghz;
+        if (w->have_power && state->power_status != RETUNE_PENDING) state->target_power_level = state->power_level;
+        state->last_update_time = time(NULL);
+    }
+    // A result for a request that has since been replaced leaves it pending
+    if (w->freq_result_seq == w->freq_seq && state->freq_status == RETUNE_PENDING) {
+        state->freq_status = w->freq_status;
+        state->retune_ms = w->retune_ms;
+    }
+    if (w->power_result_seq == w->power_seq && state->power_status == RETUNE_PENDING) {
+        state->power_status = w->power_status;
+    }
+}
+
+// --- READS ---
+// Temperature comes from the library's background sampler, so this never
+// touches the port and is cheap enough to call every frame
+static void update_temperature(AppState* state) {
+    double age_ms;
+    if (!state->is_connected) return;
+    state->temp_supported = budc_temperature_supported(state->dev);
+    if (budc_get_temperature_filtered(state->dev, &state->temperature_c, &age_ms) == 0) {
+        state->temperature_age_s = age_ms / 1000.0;
+    } else {
+        state->temperature_age_s = -1.0;
+    }
+}
+
+void update_device_status(AppState* state) {
+    if (!state->is_connected) return;
+    StallTimer stall(state);
+    update_frequency_only(state);
+    budc_get_lock_status(state->dev, &state->is_locked);
+    update_power_only(state);
+    state->last_update_time = time(NULL);
+}
+
+// Splits "Company,Product,Serial,Firmware" into the display fields
+static void set_identity(AppState* state, const char* idn) {
+    char company[64] = "";
+    char product[64] = "";
+    state->serial_number[0] = '\0';
+    state->fw_version[0] = '\0';
+    sscanf(idn, "%63[^,],%63[^,],%63[^,],%63s", company, product, state->serial_number, state->fw_version);
+    snprintf(state->identity, sizeof(state->identity), "%s %s", company, product);
+}
+
+void update_all_values(AppState* state) {
+    if (!state->is_connected) return;
+    StallTimer stall(state);
+    char idn[256];
+    if (budc_get_identity(state->dev, idn, sizeof(idn)) == 0) {
+        set_identity(state, idn);
+    } else {
+        strcpy(state->identity, "Error: Failed to read IDN");
+        state->serial_number[0] = '\0';
+        state->fw_version[0] = '\0';
+    }
+    update_device_status(state);
+}
+
+// --- PORT CACHE ---
+// serial -> port of every device connected so far, plus the last one, so the
+// next start can reopen it without probing every port. Plain text:
+//   last 244003
+//   244003 /dev/ttyACM0
+#define PORT_CACHE_MAX 16
+
+typedef struct {
+    char last[64];
+    int count;
+    char serial[PORT_CACHE_MAX][64];
+    char port[PORT_CACHE_MAX][128];
+} PortCache;
+
+static bool port_cache_path(char* path, size_t len) {
+    const char* dir;
+#ifdef _WIN32
+    dir = getenv("APPDATA");
+    if (!dir) return false;
+    snprintf(path, len, "%s\\budc_gui_ports.txt", dir);
+#else
+    dir = getenv("XDG_CONFIG_HOME");
+    if (dir && *dir) snprintf(path, len, "%s/budc_gui_ports.txt", dir);
+    else if ((dir = getenv("HOME")) != NULL) snprintf(path, len, "%s/.config/budc_gui_ports.txt", dir);
+    else return false;
+#endif
+    return true;
+}
+
+static void load_port_cache(PortCache* cache) {
+    char path[512], line[256], key[64], value[128];
+    memset(cache, 0, sizeof(*cache));
+    if (!port_cache_path(path, sizeof(path))) return;
+    FILE* f = fopen(path, "r");
+    if (!f) return;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "%63s %127s", key, value) != 2) continue;
+        if (strcmp(key, "last") == 0) snprintf(cache->last, sizeof(cache->last), "%.63s", value);
+        else if (cache->count < PORT_CACHE_MAX) {
+            snprintf(cache->serial[cache->count], sizeof(cache->serial[0]), "%s", key);
+            snprintf(cache->port[cache->count], sizeof(cache->port[0]), "%s", value);
+            cache->count++;
+        }
+    }
+    fclose(f);
+}
+
+static const char* cached_port(const PortCache* cache, const char* serial) {
+    for (int i = 0; i < cache->count; i++) {
+        if (strcmp(cache->serial[i], serial) == 0) return cache->port[i];
+    }
+    return NULL;
+}
+
+static void save_port_cache(const char* serial, const char* port) {
+    PortCache cache;
+    char path[512];
+    if (!serial[0] || !port_cache_path(path, sizeof(path))) return;
+    load_port_cache(&cache);
+    FILE* f = fopen(path, "w");
+    if (!f) return;
+    fprintf(f, "last %s\n%s %s\n", serial, serial, port);
+    // Another device that was on this port has moved or gone; drop it
+    for (int i = 0; i < cache.count; i++) {
+        if (strcmp(cache.serial[i], serial) != 0 && strcmp(cache.port[i], port) != 0) {
+            fprintf(f, "%s %s\n", cache.serial[i], cache.port[i]);
+        }
+    }
+    fclose(f);
+}
+
+// --- BACKGROUND CONNECT ---
+// One job per Connector: enumerate ports, then optionally open one (given, or
+// the last device from the cache) and read its identity and first status.
+// Each stage is published as soon as it is done so the window fills in
+// progressively; poll_connector hands the results to AppState.
+struct Connector {
+    std::thread thread;
+    std::mutex lock;
+
+    // Job, fixed before the thread starts
+    bool scan;                     // Enumerate ports first
+    bool auto_connect;             // Reopen the last device from the cache
+    char port[128];                // Port to open, empty for none or auto
+
+    // Results, guarded by lock
+    ConnectPhase phase = CONNECT_SCANNING;
+    char message[160] = "";
+    serial_port_info* ports = NULL;
+    int port_count = 0;
+    bool ports_ready = false;
+    budc_device* dev = NULL;
+    char dev_port[128] = "";
+    char idn[256] = "";
+    bool dev_ready = false;
+    double freq_ghz = 0.0;
+    int power = 0;
+    bool locked = false;
+    bool status_ready = false;
+    bool done = false;
+
+    Connector(bool do_scan, bool do_auto, const char* port_name) : scan(do_scan), auto_connect(do_auto) {
+        snprintf(port, sizeof(port), "%s", port_name ? port_name : "");
+        thread = std::thread(&Connector::run, this);
+    }
+
+    ~Connector() {
+        if (thread.joinable()) thread.join();
+        free(ports);
+    }
+
+    void set_phase(ConnectPhase p, const char* text) {
+        std::lock_guard<std::mutex> guard(lock);
+        phase = p;
+        snprintf(message, sizeof(message), "%s", text);
+    }
+
+    // Opens port_name and keeps it if it answers (and is want_serial, if given)
+    bool try_open(const char* port_name, const char* want_serial) {
+        char text[160], idn_buf[256], serial[64] = "";
+        snprintf(text, sizeof(text), "Opening %s...", port_name);
+        set_phase(CONNECT_OPENING, text);
+        budc_device* d = budc_connect(port_name);
+        if (!d) return false;
+        if (budc_get_identity(d, idn_buf, sizeof(idn_buf)) != 0) idn_buf[0] = '\0';
+        sscanf(idn_buf, "%*[^,],%*[^,],%63[^,]", serial);
+        if (want_serial && strcmp(serial, want_serial) != 0) {
+            budc_disconnect(d);
+            return false;
+        }
+        budc_monitor_start(d, NULL);
+        std::lock_guard<std::mutex> guard(lock);
+        dev = d;
+        snprintf(dev_port, sizeof(dev_port), "%s", port_name);
+        snprintf(idn, sizeof(idn), "%s", idn_buf);
+        dev_ready = true;
+        phase = CONNECT_READING;
+        snprintf(message, sizeof(message), "Reading status...");
+        return true;
+    }
+
+    // The cached port first, then the other ports that look like a unit: the
+    // device may have moved. Anything else is left for the user to pick.
+    bool reopen_last(const serial_port_info* list, int count) {
+        PortCache cache;
+        load_port_cache(&cache);
+        if (!cache.last[0]) return false;
+        const char* port_name = cached_port(&cache, cache.last);
+        if (port_name && try_open(port_name, cache.last)) return true;
+        for (int i = 0; i < count; i++) {
+            if (port_name && strcmp(list[i].name, port_name) == 0) continue;
+            if (!budc_port_may_be_budc(&list[i], cache.last)) continue;
+            if (try_open(list[i].name, cache.last)) return true;
+        }
+        return false;
+    }
+
+    void run() {
+        serial_port_info* list = NULL;
+        int count = 0;
+        if (scan) {
+            count = budc_find_ports(&list);
+            std::lock_guard<std::mutex> guard(lock);
+            ports = list;
+            port_count = count;
+            ports_ready = true;
+        }
+
+        bool opened = false;
+        if (port[0]) opened = try_open(port, NULL);
+        else if (auto_connect && count > 0) opened = reopen_last(list, count);
+
+        if (opened) {
+            double f = 0.0;
+            int p = 0;
+            bool l = false;
+            budc_get_frequency_ghz(dev, &f);
+            budc_get_lock_status(dev, &l);
+            budc_get_power_level(dev, &p);
+            std::lock_guard<std::mutex> guard(lock);
+            freq_ghz = f;
+            locked = l;
+            power = p;
+            status_ready = true;
+        }
+
+        std::lock_guard<std::mutex> guard(lock);
+        if (port[0] && !opened) {
+            phase = CONNECT_FAILED;
+            snprintf(message, sizeof(message), "Failed to connect to %s", port);
+        } else {
+            phase = CONNECT_IDLE;
+            message[0] = '\0';
+        }
+        done = true;
+    }
+};
+
+static void start_connector(AppState* state, bool scan, bool auto_connect, const char* port_name) {
+    if (state->connector) return;  // One job at a time; the buttons are disabled meanwhile
+    state->connector = new Connector(scan, auto_connect, port_name);
+    state->connect_phase = scan ? CONNECT_SCANNING : CONNECT_OPENING;
+    state->connect_message[0] = '\0';
+}
+
+// Moves whatever the job has finished into AppState; never waits on it
+static void poll_connector(AppState* state) {
+    Connector* c = state->connector;
+    if (!c) return;
+    bool finished;
+    {
+        std::lock_guard<std::mutex> guard(c->lock);
+        state->connect_phase = c->phase;
+        snprintf(state->connect_message, sizeof(state->connect_message), "%s", c->message);
+        if (c->ports_ready) {
+            free(state->port_list);
+            state->port_list = c->ports;
+            state->port_count = c->port_count;
+            state->selected_port_idx = -1;
+            c->ports = NULL;
+            c->ports_ready = false;
+        }
+        if (c->dev_ready) {
+            state->dev = c->dev;
+            state->is_connected = true;
+            state->status_ready = false;
+            snprintf(state->port_name, sizeof(state->port_name), "%s", c->dev_port);
+            set_identity(state, c->idn);
+            for (int i = 0; i < state->port_count; i++) {
+                if (strcmp(state->port_list[i].name, c->dev_port) == 0) state->selected_port_idx = i;
+            }
+            state->retune = new RetuneWorker(state->dev);
+            save_port_cache(state->serial_number, state->port_name);
+            c->dev_ready = false;
+        }
+        if (c->status_ready) {
+            state->current_freq_ghz = state->target_freq_ghz = c->freq_ghz;
+            state->is_locked = c->locked;
+            state->power_level = state->target_power_level = c->power;
+            state->last_update_time = time(NULL);
+            state->status_ready = true;
+            if (state->first_status_ms == 0.0) state->first_status_ms = budc_now_ms() - state->start_ms;
+            c->status_ready = false;
+        }
+        finished = c->done;
+    }
+    if (finished) {
+        delete c;  // Already returned, the join is immediate
+        state->connector = NULL;
+    }
+}
+
+// Waits for the job, then takes ownership of anything it opened, so a
+// handle opened just before the window closes is still disconnected
+static void finish_connector(AppState* state) {
+    if (!state->connector) return;
+    StallTimer stall(state);
+    state->connector->thread.join();  // A connect in flight runs to completion
+    poll_connector(state);            // Done by now: hands over the results and deletes the job
+}
+
+// --- CONNECTION ---
+void init_app_state(AppState* state, bool auto_connect) {
+    memset(state, 0, sizeof(AppState));
+    state->selected_port_idx = -1;
+    state->port_list = NULL;
+    state->auto_refresh_enabled = false;
+    state->start_ms = budc_now_ms();
+    start_connector(state, true, auto_connect, NULL);
+}
+
+void refresh_port_list(AppState* state) {
+    start_connector(state, true, false, NULL);
+}
+
+void begin_connect(AppState* state, const char* port_name) {
+    start_connector(state, false, false, port_name);
+}
+
+void disconnect_device(AppState* state) {
+    StallTimer stall(state);
+    finish_connector(state);  // It may be reading status on this handle
+    delete state->retune;  // Joins the worker before the handle goes away
+    state->retune = NULL;
+    budc_disconnect(state->dev);
+    state->is_connected = false;
+    state->dev = NULL;
+    state->freq_status = RETUNE_IDLE;
+    state->power_status = RETUNE_IDLE;
+    memset(&state->stats, 0, sizeof(state->stats));
+    state->diag_sample_ms = 0.0;
+    state->link_util = state->tx_bytes_s = state->rx_bytes_s = 0.0;
+    state->retune_queued = 0;
+    state->retune_busy = false;
+}
+
+void cleanup_app_state(AppState* state) {
+    finish_connector(state);
+    if (state->is_connected) disconnect_device(state);
+    if (state->port_list) free(state->port_list);
+}
+// --- DIAGNOSTICS ---
+// Counters only, no port traffic: safe to run every frame
+static void update_diagnostics(AppState* state) {
+    RetuneWorker* w = state->retune;
+    if (w) {
+        std::lock_guard<std::mutex> guard(w->lock);
+        state->retune_queued = (w->want_freq ? 1 : 0) + (w->want_power ? 1 : 0);
+        state->retune_busy = w->busy;
+    }
+
+    double now = budc_now_ms();
+    if (now - state->diag_sample_ms < DIAG_INTERVAL_MS) return;
+    budc_stats prev = state->stats;
+    double elapsed_s = (now - state->diag_sample_ms) / 1000.0;
+    bool first = state->diag_sample_ms == 0.0;
+    if (budc_get_stats(state->dev, &state->stats) != 0) return;
+    state->diag_sample_ms = now;
+    if (first) return;
+    state->link_util = (state->stats.io_busy_ms - prev.io_busy_ms) / (elapsed_s * 1000.0);
+    if (state->link_util > 1.0) state->link_util = 1.0;
+    state->tx_bytes_s = (state->stats.bytes_written - prev.bytes_written) / elapsed_s;
+    state->rx_bytes_s = (state->stats.bytes_read - prev.bytes_read) / elapsed_s;
+}
+
+// --- ACTIONS ---
+void app_tick(AppState* state) {
+    poll_connector(state);
+    if (!state->is_connected) return;
+    // The readback runs on the retune worker and lands through poll_retune
+    if (state->auto_refresh_enabled && state->retune && difftime(time(NULL), state->last_update_time) > 10.0) {
+        state->retune->request_refresh();
+        state->last_update_time = time(NULL);
+    }
+    update_temperature(state);
+    poll_retune(state);
+    update_diagnostics(state);
+}
+
+void note_first_frame(AppState* state) {
+    if (state->first_frame_ms != 0.0) return;
+    state->first_frame_ms = budc_now_ms() - state->start_ms;
+}
+
+void preset_device(AppState* state) {
+    StallTimer stall(state);
+    budc_preset(state->dev);
+    update_all_values(state);
+}
+
+void save_device(AppState* state) {
+    StallTimer stall(state);
+    budc_save_settings(state->dev);
+}
+
+void send_scpi_command(AppState* state) {
+    StallTimer stall(state);
+    char response[512] = {0};
+    char log_entry[1024];
+    budc_send_raw_command(state->dev, state->scpi_command, response, sizeof(response));
+    snprintf(log_entry, sizeof(log_entry), ">> %s\n<< %s\n\n", state->scpi_command, strlen(response) > 0 ? response : "(no response)");
+    strncat(state->scpi_log, log_entry, sizeof(state->scpi_log) - strlen(state->scpi_log) - 1);
+    state->scpi_command[0] = '\0';
+    update_device_status(state); // Update everything after a manual command
+}
+
+// --- HEADLESS BENCH ---
+#define BENCH_FRAME_MS 16          // Paced like a 60 Hz display
+#define BENCH_STEP_EVERY 6         // Frames between frequency steps: 10 steps/s
+
+static int compare_double(const void* a, const void* b) {
+    double x = *(const double*)a, y = *(const double*)b;
+    return x < y ? -1 : x > y;
+}
+
+int run_headless_bench(const char* port_name, int frames) {
+    AppState state;
+    memset(&state, 0, sizeof(state));
+    state.selected_port_idx = -1;
+    if (frames < 2 * BENCH_STEP_EVERY) frames = 2 * BENCH_STEP_EVERY;
+
+    // Same path as the window: the connect runs in the background while ticking
+    state.start_ms = budc_now_ms();
+    begin_connect(&state, port_name);
+    double first_tick_ms = 0.0;
+    while (state.connector) {
+        double frame_start = budc_now_ms();
+        app_tick(&state);
+        first_tick_ms = fmax(first_tick_ms, budc_now_ms() - frame_start);
+        budc_sleep_ms(BENCH_FRAME_MS);
+    }
+    if (!state.is_connected || !state.status_ready) {
+        fprintf(stderr, "Failed to connect to %s\n", port_name);
+        cleanup_app_state(&state);
+        return 1;
+    }
+    printf("First status: %.1f ms (slowest tick meanwhile %.3f ms)\n", state.first_status_ms, first_tick_ms);
+
+    // Step for the first half, then let the last retune settle
+    double* tick_ms = (double*)malloc(frames * sizeof(double));
+    if (!tick_ms) { disconnect_device(&state); return 1; }
+    double start_freq = state.current_freq_ghz;
+    int steps = 0, confirmed = 0, failed = 0;
+    RetuneStatus last = RETUNE_IDLE;
+    state.freq_step_idx = 1;
+    for (int i = 0; i < frames; i++) {
+        double frame_start = budc_now_ms();
+        if (i < frames / 2 && i % BENCH_STEP_EVERY == 0) { step_freq(&state, 1.0); steps++; }
+        app_tick(&state);
+        tick_ms[i] = budc_now_ms() - frame_start;
+        if (state.freq_status != last) {
+            if (state.freq_status == RETUNE_CONFIRMED) confirmed++;
+            if (state.freq_status == RETUNE_FAILED) failed++;
+            last = state.freq_status;
+        }
+        double left = BENCH_FRAME_MS - (budc_now_ms() - frame_start);
+        if (left > 0) budc_sleep_ms((unsigned int)left);
+    }
+
+    qsort(tick_ms, frames, sizeof(double), compare_double);
+    printf("Frames: %d, state tick p50 %.3f ms, p99 %.3f ms, max %.3f ms\n", frames,
+           tick_ms[frames / 2], tick_ms[frames * 99 / 100], tick_ms[frames - 1]);
+    printf("Steps: %d (%.4f -> %.4f GHz), confirmed %d, failed %d, last retune %.0f ms, final %s\n",
+           steps, start_freq, state.target_freq_ghz, confirmed, failed, state.retune_ms,
+           state.freq_status == RETUNE_CONFIRMED ? "confirmed" : state.freq_status == RETUNE_FAILED ? "failed" : "pending");
+    printf("Link: %.0f%% busy, %.0f B/s out, %.0f B/s in, latency p95 %.1f ms, port queue %u\n",
+           state.link_util * 100.0, state.tx_bytes_s, state.rx_bytes_s,
+           budc_stats_latency_percentile(&state.stats, 95), state.stats.io_waiters);
+    free(tick_ms);
+    int result = state.freq_status == RETUNE_CONFIRMED ? 0 : 1;
+    cleanup_app_state(&state);
+    return result;
+}
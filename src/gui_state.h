@@ -0,0 +1,140 @@
+/* BUDC Controller - A cross-platform controller for BUC/BUDC devices.
+ *
+ * Copyright (C) 2025 Penthertz
+ *
+ * This file is part of BUDC Controller.
+ *
+ * BUDC Controller is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// Headless half of budc_gui: the application state and everything that
+// talks to the device. Nothing here includes ImGui, so the same code runs
+// behind the window and in budc_gui --headless-bench. gui.cpp only draws
+// AppState and calls these functions in response to input.
+
+#ifndef GUI_STATE_H
+#define GUI_STATE_H
+
+#include <time.h>
+
+// Wrap C header for C++
+extern "C" {
+    #include "budc_scpi.h"
+}
+
+// How far a requested retune has got, shown next to the readout
+typedef enum {
+    RETUNE_IDLE = 0,
+    RETUNE_PENDING,    // Shown optimistically, not yet read back
+    RETUNE_CONFIRMED,  // Read back as requested (and locked, for frequency)
+    RETUNE_FAILED
+} RetuneStatus;
+
+// Background enumeration and connect, see Connector in gui_state.cpp
+typedef enum {
+    CONNECT_IDLE = 0,
+    CONNECT_SCANNING,      // Enumerating ports
+    CONNECT_OPENING,       // Opening a port and reading the identity
+    CONNECT_READING,       // Connected, initial status on its way
+    CONNECT_FAILED
+} ConnectPhase;
+
+struct RetuneWorker;
+struct Connector;
+
+typedef struct {
+    budc_device* dev;
+    serial_port_info* port_list;
+    int port_count;
+    int selected_port_idx;
+    bool is_connected;
+    char port_name[128];       // Port of the open connection
+    char identity[256];
+    char serial_number[64];
+    char fw_version[64];
+    double current_freq_ghz;
+    bool is_locked;
+    float temperature_c;
+    double temperature_age_s;  // -1 until the background sampler has a reading
+    int power_level;
+    bool temp_supported;
+    double target_freq_ghz;
+    int target_power_level;
+    char scpi_command[256];
+    char scpi_log[4096];
+    time_t last_update_time;
+    bool auto_refresh_enabled;
+    RetuneWorker* retune;      // Runs set commands off the UI thread while connected
+    Connector* connector;      // Enumeration or connect job in flight, NULL when none
+    ConnectPhase connect_phase;
+    char connect_message[160];
+    bool status_ready;         // Initial status has arrived since connecting
+    RetuneStatus freq_status;
+    RetuneStatus power_status;
+    double retune_ms;          // Request to confirmation of the last frequency change
+    int freq_step_idx;
+
+    // Diagnostics, refreshed by app_tick
+    double io_stall_ms;        // Time the UI thread spent blocked on the device; the frame loop resets it
+    int stall_depth;
+    budc_stats stats;          // Library counters as of diag_sample_ms
+    double diag_sample_ms;
+    double link_util;          // Share of wall time the port spent in exchanges, 0..1
+    double tx_bytes_s, rx_bytes_s;
+    int retune_queued;         // Requests waiting for the retune worker
+    bool retune_busy;          // Worker is applying or confirming one
+
+    // Startup timings from start_ms, 0 until reached
+    double start_ms;
+    double first_frame_ms;
+    double first_status_ms;
+} AppState;
+
+#define FREQ_STEP_COUNT 4
+extern const char* const freq_step_labels[FREQ_STEP_COUNT];
+extern const double freq_step_ghz[FREQ_STEP_COUNT];
+
+// init_app_state returns at once; enumeration and, with auto_connect, the
+// reconnect to the last device (found through the serial-to-port cache)
+// continue in the background and land through app_tick.
+void init_app_state(AppState* state, bool auto_connect);
+void cleanup_app_state(AppState* state);
+void refresh_port_list(AppState* state);             // Background
+void begin_connect(AppState* state, const char* port_name);  // Background
+void disconnect_device(AppState* state);
+
+// Blocking reads, for connect and the explicit refresh actions
+void update_device_status(AppState* state);
+void update_all_values(AppState* state);
+
+// Once per frame: cheap, never waits on the port. The auto-refresh is
+// handed to the retune worker.
+void app_tick(AppState* state);
+void note_first_frame(AppState* state);  // Call after the first frame is on screen
+
+// Non-blocking; the worker confirms or fails them later
+void request_freq(AppState* state, double ghz);
+void request_power(AppState* state, int level);
+void step_freq(AppState* state, double steps);  // By the selected step size
+
+// Blocking actions behind the buttons
+void preset_device(AppState* state);
+void save_device(AppState* state);
+void send_scpi_command(AppState* state);
+
+// Drives the state layer without a window: steps the frequency against a real
+// device (or simulator) and reports frame tick cost and retune times
+int run_headless_bench(const char* port_name, int frames);
+
+#endif // GUI_STATE_H